@@ -5,6 +5,8 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "lwip/sockets.h"
+#include "quic_mem.h"
+#include "quic_pipeline.h"
 #include <sys/select.h>
 #include <string.h>
 
@@ -15,7 +17,8 @@ ESP_EVENT_DEFINE_BASE(LIBEV_EVENTS);
 enum {
     LIBEV_IO_EVENT,
     LIBEV_TIMER_EVENT,
-    LIBEV_BREAK_EVENT
+    LIBEV_BREAK_EVENT,
+    LIBEV_ASYNC_EVENT
 };
 
 // Global default event loop
@@ -29,6 +32,8 @@ static void io_monitor_task(void *arg) {
     struct timeval tv;
     
     while (loop->running) {
+        quic_mem_log_stack_watermark("io_monitor");
+
         // Prepare FD sets
         FD_ZERO(&read_fds);
         FD_ZERO(&write_fds);
@@ -131,6 +136,8 @@ static void handle_io_event(void *handler_arg, esp_event_base_t base,
         // Call the libev callback
         data->watcher->cb(loop, data->watcher, data->revents);
     }
+
+    quic_mem_log_stack_watermark("ev_esp_loop");
 }
 
 // Timer event handler
@@ -143,6 +150,25 @@ static void handle_timer_event(void *handler_arg, esp_event_base_t base,
         // Call the libev callback
         data->watcher->cb(loop, data->watcher, data->revents);
     }
+
+    quic_mem_log_stack_watermark("ev_esp_loop");
+}
+
+// Async event handler
+static void handle_async_event(void *handler_arg, esp_event_base_t base,
+                               int32_t id, void *event_data) {
+    ev_loop *loop = (ev_loop *)handler_arg;
+    async_event_data *data = (async_event_data *)event_data;
+
+    if (data && data->watcher) {
+        // Sends from here on post a new wakeup
+        atomic_store(&data->watcher->sent, 0);
+        if (data->watcher->active && data->watcher->cb) {
+            data->watcher->cb(loop, data->watcher, EV_ASYNC);
+        }
+    }
+
+    quic_mem_log_stack_watermark("ev_esp_loop");
 }
 
 // Break event handler
@@ -167,9 +193,10 @@ static esp_err_t ev_loop_init(ev_loop *loop) {
     esp_event_loop_args_t loop_args = {
         .queue_size = 32,
         .task_name = "ev_esp_loop",
-        .task_priority = 5,
-        .task_stack_size = 32768,
-        .task_core_id = tskNO_AFFINITY
+        .task_priority = QUIC_IO_TASK_PRIORITY,
+        .task_stack_size = EV_LOOP_TASK_STACK_SIZE,
+        .task_core_id = quic_pipeline_stage_core(QUIC_STAGE_IO) < 0 ?
+                        tskNO_AFFINITY : quic_pipeline_stage_core(QUIC_STAGE_IO)
     };
     
     esp_err_t ret = esp_event_loop_create(&loop_args, &loop->esp_event_loop);
@@ -200,6 +227,16 @@ static esp_err_t ev_loop_init(ev_loop *loop) {
         return ret;
     }
     
+    ret = esp_event_handler_register_with(loop->esp_event_loop,
+                                         LIBEV_EVENTS, LIBEV_ASYNC_EVENT,
+                                         handle_async_event, loop);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register async event handler: %s", esp_err_to_name(ret));
+        esp_event_loop_delete(loop->esp_event_loop);
+        vSemaphoreDelete(loop->io_mutex);
+        return ret;
+    }
+
     ret = esp_event_handler_register_with(loop->esp_event_loop, 
                                          LIBEV_EVENTS, LIBEV_BREAK_EVENT,
                                          handle_break_event, loop);
@@ -253,7 +290,8 @@ void ev_io_start(ev_loop *loop, ev_io *watcher) {
             // First IO watcher - make sure IO monitor task is running
             if (!loop->running) {
                 loop->running = true;
-                xTaskCreate(io_monitor_task, "io_monitor", 32768, loop, 5, &loop->io_task_handle);
+                quic_task_create(io_monitor_task, "io_monitor", EV_IO_MONITOR_STACK_SIZE, loop,
+                                 QUIC_IO_TASK_PRIORITY, QUIC_IO_TASK_CORE, &loop->io_task_handle);
             }
         }
         
@@ -328,6 +366,43 @@ void ev_timer_stop(ev_loop *loop, ev_timer *watcher) {
     }
 }
 
+void ev_timer_destroy(ev_loop *loop, ev_timer *watcher) {
+    ev_timer_stop(loop, watcher);
+    if (watcher->esp_timer_handle) {
+        esp_timer_delete(watcher->esp_timer_handle);
+        watcher->esp_timer_handle = NULL;
+    }
+}
+
+void ev_async_init(ev_async *watcher, void (*cb)(ev_loop *loop, ev_async *w, int revents)) {
+    memset(watcher, 0, sizeof(ev_async));
+    watcher->cb = cb;
+}
+
+void ev_async_start(ev_loop *loop, ev_async *watcher) {
+    watcher->active = 1;
+}
+
+void ev_async_stop(ev_loop *loop, ev_async *watcher) {
+    watcher->active = 0;
+}
+
+void ev_async_send(ev_loop *loop, ev_async *watcher) {
+    if (!loop) loop = EV_DEFAULT;
+
+    if (atomic_exchange(&watcher->sent, 1) == 0) {
+        async_event_data data = {
+            .watcher = watcher
+        };
+        // Never block the sender; a full queue means the loop is busy and
+        // will see the next send
+        if (esp_event_post_to(loop->esp_event_loop, LIBEV_EVENTS, LIBEV_ASYNC_EVENT,
+                              &data, sizeof(data), 0) != ESP_OK) {
+            atomic_store(&watcher->sent, 0);
+        }
+    }
+}
+
 // Break the event loop
 void ev_break(ev_loop *loop, int how) {
     if (!loop) loop = EV_DEFAULT;
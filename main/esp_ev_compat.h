@@ -6,14 +6,29 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include <stdatomic.h>
 
 #define MAX_IO_WATCHERS 16
 #define MAX_TIMER_WATCHERS 16
 
+// Task stack sizes (bytes). Packet buffers come from the shared pool in
+// quic_mem.h, so neither task keeps datagrams on its stack. ev_esp_loop
+// runs the TLS handshake with certificate verification, the trust store
+// parsing and the NVS writes of recv_new_token_cb; io_monitor only
+// selects. Check them against the stacks bench result
+// (mqtt_quic_bench_stacks) after changing what runs on these tasks.
+#ifndef EV_IO_MONITOR_STACK_SIZE
+#define EV_IO_MONITOR_STACK_SIZE 4096
+#endif
+#ifndef EV_LOOP_TASK_STACK_SIZE
+#define EV_LOOP_TASK_STACK_SIZE  16384
+#endif
+
 // Basic types to match libev
 typedef struct ev_loop ev_loop;
 typedef struct ev_io ev_io;
 typedef struct ev_timer ev_timer;
+typedef struct ev_async ev_async;
 typedef float ev_tstamp;
 
 // Event data structures
@@ -27,10 +42,15 @@ typedef struct {
     int revents;
 } timer_event_data;
 
+typedef struct {
+    ev_async *watcher;
+} async_event_data;
+
 // Event types
 #define EV_READ  1
 #define EV_WRITE 2
 #define EV_TIMER 4
+#define EV_ASYNC 8
 
 // Default event loop instance
 extern ev_loop *EV_DEFAULT;
@@ -43,6 +63,16 @@ void ev_io_stop(ev_loop *loop, ev_io *watcher);
 void ev_timer_init(ev_timer *watcher, void (*cb)(ev_loop *loop, ev_timer *w, int revents), ev_tstamp after, ev_tstamp repeat);
 void ev_timer_again(ev_loop *loop, ev_timer *watcher);
 void ev_timer_stop(ev_loop *loop, ev_timer *watcher);
+// Not in libev, whose timers own nothing: stop the timer and free the
+// esp_timer behind it. ev_timer_init must run again before reuse.
+void ev_timer_destroy(ev_loop *loop, ev_timer *watcher);
+
+// Wake the loop from another task: cb runs in the loop task, once for any
+// number of ev_async_send calls made before it ran
+void ev_async_init(ev_async *watcher, void (*cb)(ev_loop *loop, ev_async *w, int revents));
+void ev_async_start(ev_loop *loop, ev_async *watcher);
+void ev_async_stop(ev_loop *loop, ev_async *watcher);
+void ev_async_send(ev_loop *loop, ev_async *watcher);
 
 void ev_run(ev_loop *loop, int flags);
 void ev_break(ev_loop *loop, int how);
@@ -88,5 +118,12 @@ struct ev_timer {
     ev_loop *loop;
 };
 
+struct ev_async {
+    void (*cb)(ev_loop *loop, ev_async *w, int revents);
+    int active;
+    atomic_int sent;  // A wakeup is posted and has not run yet
+    void *data;
+};
+
 
 #endif // ESP_EV_COMPAT_H
\ No newline at end of file
@@ -0,0 +1,1529 @@
+#include "mqtt_quic_bench.h"
+#include "mqtt_quic_stream_pub.h"
+#include "mqtt_quic_inflight.h"
+#include "mqtt_quic_router.h"
+#include "mqtt_quic_codec.h"
+#include "mqtt_quic_failover.h"
+#include "mqtt_quic_outbound.h"
+#include "core_mqtt_state.h"
+#include "ngtcp2_sample.h"
+#include "quic_netem.h"
+#include "quic_dns.h"
+#include "quic_path.h"
+#include "quic_token.h"
+#include "quic_trust.h"
+#include "quic_pipeline.h"
+#include "quic_mem.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "freertos/task.h"
+#include <openssl/ssl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "MQTT_QUIC_BENCH";
+
+// Time allowed for the broker to acknowledge a streamed payload
+#define BENCH_DRAIN_TIMEOUT_MS 60000
+
+// Inbound messages seen by mqtt_quic_bench_on_publish
+static volatile uint32_t inbound_count = 0;
+
+// Too large for the task stack
+static MQTTQUICInflight_t bench_inflight;
+static uint32_t latency_samples[MQTT_QUIC_BENCH_LATENCY_MAX];
+
+typedef struct {
+    size_t offset;
+} pattern_reader_t;
+
+// Deterministic payload so the receiving side can verify it if it wants to
+static int32_t pattern_reader(void *pUserCtx, uint8_t *pBuffer, size_t bufferSize) {
+    pattern_reader_t *reader = (pattern_reader_t *)pUserCtx;
+
+    for (size_t i = 0; i < bufferSize; i++) {
+        pBuffer[i] = (uint8_t)(reader->offset + i);
+    }
+    reader->offset += bufferSize;
+
+    return (int32_t)bufferSize;
+}
+
+void mqtt_quic_bench_report(const char *pScenario, const char *pFieldsFormat, ...) {
+    char fields[256];
+    va_list args;
+
+    va_start(args, pFieldsFormat);
+    vsnprintf(fields, sizeof(fields), pFieldsFormat, args);
+    va_end(args);
+
+    // Scenarios run on the MQTT task, and each ends here
+    quic_mem_log_stack_watermark("quic_mqtt_task");
+
+    ESP_LOGI(TAG, MQTT_QUIC_BENCH_RESULT_PREFIX "{\"scenario\":\"%s\",%s}", pScenario, fields);
+}
+
+// Wait until every queued stream byte is acknowledged
+static bool wait_stream_drained(uint32_t timeoutMs) {
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeoutMs * 1000;
+
+    while (quic_client_unacked_bytes() > 0) {
+        if (!quic_client_is_connected() || esp_timer_get_time() > deadline) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+
+    return true;
+}
+
+void mqtt_quic_bench_stream_publish(MQTTContext_t *pContext, const char *pTopic) {
+    static const size_t sizes[] = {
+        1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024
+    };
+
+    ESP_LOGI(TAG, "=== Streaming publish benchmark ===");
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        MQTTPublishInfo_t publishInfo;
+        pattern_reader_t reader = { 0 };
+        uint32_t heapBefore = esp_get_free_heap_size();
+
+        memset(&publishInfo, 0, sizeof(publishInfo));
+        publishInfo.qos = MQTTQoS0;
+        publishInfo.pTopicName = pTopic;
+        publishInfo.topicNameLength = strlen(pTopic);
+        publishInfo.payloadLength = sizes[i];
+
+        int64_t start = esp_timer_get_time();
+        MQTTStatus_t status = mqtt_quic_publish_stream(pContext, &publishInfo, 0,
+                                                       pattern_reader, &reader, 5000);
+        if (status != MQTTSuccess) {
+            ESP_LOGE(TAG, "Streaming publish of %zu bytes failed: %d", sizes[i], status);
+            return;
+        }
+
+        bool drained = wait_stream_drained(BENCH_DRAIN_TIMEOUT_MS);
+        int64_t elapsedUs = esp_timer_get_time() - start;
+        if (!drained) {
+            ESP_LOGE(TAG, "Stream not drained after %zu byte publish", sizes[i]);
+            return;
+        }
+
+        mqtt_quic_bench_report("stream_publish",
+                               "\"size\":%zu,\"time_ms\":%lld,\"throughput_kBps\":%.1f,"
+                               "\"heap_before\":%lu,\"heap_after\":%lu,\"heap_min\":%lu",
+                               sizes[i], (long long)(elapsedUs / 1000),
+                               elapsedUs > 0 ? (double)sizes[i] * 1000.0 / (double)elapsedUs : 0.0,
+                               heapBefore, esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+
+        // Keep coreMQTT's receive path serviced between runs
+        MQTT_ProcessLoop(pContext);
+    }
+}
+
+void mqtt_quic_bench_on_publish(const MQTTPublishInfo_t *pPublishInfo, void *pUserCtx) {
+    (void)pPublishInfo;
+    (void)pUserCtx;
+    inbound_count++;
+}
+
+void mqtt_quic_bench_inbound_qos0(MQTTContext_t *pContext,
+                                  NetworkContext_t *pNetworkContext,
+                                  const char *pTopic,
+                                  uint32_t count) {
+    MQTTSubscribeInfo_t subscribeInfo = {
+        .qos = MQTTQoS0,
+        .pTopicFilter = pTopic,
+        .topicFilterLength = strlen(pTopic)
+    };
+    MQTTPublishInfo_t publishInfo;
+    char payload[16];
+
+    ESP_LOGI(TAG, "=== Inbound QoS0 benchmark: %lu messages ===", (unsigned long)count);
+
+    if (MQTT_Subscribe(pContext, &subscribeInfo, 1, MQTT_GetPacketId(pContext)) != MQTTSuccess) {
+        ESP_LOGE(TAG, "Subscribe to %s failed", pTopic);
+        return;
+    }
+
+    // Let the SUBACK arrive before the burst
+    for (int i = 0; i < 10; i++) {
+        MQTT_ProcessLoop(pContext);
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+
+    memset(&publishInfo, 0, sizeof(publishInfo));
+    publishInfo.qos = MQTTQoS0;
+    publishInfo.pTopicName = pTopic;
+    publishInfo.topicNameLength = strlen(pTopic);
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = sizeof(payload);
+
+    for (uint32_t i = 0; i < count; i++) {
+        snprintf(payload, sizeof(payload), "%015lu", (unsigned long)i);
+        if (MQTT_Publish(pContext, &publishInfo, 0) != MQTTSuccess) {
+            ESP_LOGE(TAG, "Publish %lu failed", (unsigned long)i);
+            return;
+        }
+    }
+
+    uint32_t packetsBefore = pNetworkContext->rxPackets;
+    uint32_t locksBefore = pNetworkContext->rxLockCount;
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + (int64_t)BENCH_DRAIN_TIMEOUT_MS * 1000;
+
+    inbound_count = 0;
+    while (inbound_count < count && esp_timer_get_time() < deadline) {
+        if (MQTT_ProcessLoop(pContext) != MQTTSuccess) {
+            vTaskDelay(1);
+        }
+    }
+
+    int64_t elapsedUs = esp_timer_get_time() - start;
+    uint32_t packets = pNetworkContext->rxPackets - packetsBefore;
+    uint32_t locks = pNetworkContext->rxLockCount - locksBefore;
+
+    mqtt_quic_bench_report("inbound_qos0",
+                           "\"received\":%lu,\"msgs\":%lu,\"time_ms\":%lld,"
+                           "\"rate_msg_s\":%.1f,\"locks_per_packet\":%.2f",
+                           (unsigned long)inbound_count, (unsigned long)count,
+                           (long long)(elapsedUs / 1000),
+                           elapsedUs > 0 ? (double)inbound_count * 1e6 / (double)elapsedUs : 0.0,
+                           packets > 0 ? (double)locks / (double)packets : 0.0);
+}
+
+void mqtt_quic_bench_coalescing(MQTTContext_t *pContext, const char *pTopic,
+                                size_t coalesceBytes, uint32_t coalesceDelayMs) {
+    static const uint32_t messages = 200;
+    static const uint32_t intervalMs = 5;
+    MQTTPublishInfo_t publishInfo;
+    char payload[40];
+
+    ESP_LOGI(TAG, "=== Publish coalescing benchmark: %lu messages every %lu ms ===",
+             (unsigned long)messages, (unsigned long)intervalMs);
+
+    memset(&publishInfo, 0, sizeof(publishInfo));
+    publishInfo.qos = MQTTQoS0;
+    publishInfo.pTopicName = pTopic;
+    publishInfo.topicNameLength = strlen(pTopic);
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = sizeof(payload);
+
+    for (int run = 0; run < 2; run++) {
+        size_t bytes = run == 0 ? 0 : coalesceBytes;
+        quic_client_stats_t before, after;
+
+        quic_client_set_coalescing(bytes, coalesceDelayMs);
+        quic_client_get_stats(&before);
+
+        for (uint32_t i = 0; i < messages; i++) {
+            snprintf(payload, sizeof(payload), "{\"seq\":%06lu,\"t\":21.5,\"rh\":40.1}",
+                     (unsigned long)i);
+            if (MQTT_Publish(pContext, &publishInfo, 0) != MQTTSuccess) {
+                ESP_LOGE(TAG, "Publish %lu failed", (unsigned long)i);
+                return;
+            }
+            vTaskDelay(pdMS_TO_TICKS(intervalMs));
+        }
+
+        quic_client_flush_safe();
+        if (!wait_stream_drained(BENCH_DRAIN_TIMEOUT_MS)) {
+            ESP_LOGE(TAG, "Stream not drained after coalescing run");
+            return;
+        }
+        quic_client_get_stats(&after);
+
+        uint32_t datagrams = after.tx_datagrams - before.tx_datagrams;
+        uint64_t radioUs = after.radio_on_us - before.radio_on_us;
+
+        mqtt_quic_bench_report("coalescing",
+                               "\"bytes\":%zu,\"delay_ms\":%lu,\"msgs\":%lu,\"datagrams\":%lu,"
+                               "\"bursts\":%lu,\"pkts_per_msg\":%.2f,\"radio_on_us_per_msg\":%.0f",
+                               bytes, (unsigned long)coalesceDelayMs, (unsigned long)messages,
+                               (unsigned long)datagrams,
+                               (unsigned long)(after.tx_bursts - before.tx_bursts),
+                               (double)datagrams / (double)messages,
+                               (double)radioUs / (double)messages);
+
+        MQTT_ProcessLoop(pContext);
+    }
+}
+
+// Publish count QoS1 messages through coreMQTT's state engine
+static bool qos1_run_coremqtt(MQTTContext_t *pContext, MQTTPublishInfo_t *pPublishInfo,
+                              char *payload, size_t payloadSize,
+                              uint32_t count, int64_t deadline) {
+    for (uint32_t i = 0; i < count; ) {
+        snprintf(payload, payloadSize, "%031lu", (unsigned long)i);
+        MQTTStatus_t status = MQTT_Publish(pContext, pPublishInfo, MQTT_GetPacketId(pContext));
+        if (status == MQTTSuccess) {
+            i++;
+        } else if (status != MQTTNoMemory || esp_timer_get_time() > deadline) {
+            ESP_LOGE(TAG, "QoS1 publish %lu failed: %d", (unsigned long)i, status);
+            return false;
+        } else {
+            // State records exhausted, wait for PUBACKs
+            MQTT_ProcessLoop(pContext);
+        }
+    }
+
+    // Wait until no QoS1 publish is left awaiting its PUBACK
+    for (;;) {
+        MQTTStateCursor_t cursor = MQTT_STATE_CURSOR_INITIALIZER;
+        if (MQTT_PublishToResend(pContext, &cursor) == MQTT_PACKET_ID_INVALID) {
+            break;
+        }
+        if (esp_timer_get_time() > deadline) {
+            return false;
+        }
+        MQTT_ProcessLoop(pContext);
+    }
+
+    return true;
+}
+
+// Publish count QoS1 messages through the pipelined publisher
+static bool qos1_run_pipelined(MQTTContext_t *pContext, MQTTPublishInfo_t *pPublishInfo,
+                               char *payload, size_t payloadSize,
+                               uint32_t count, int64_t deadline) {
+    for (uint32_t i = 0; i < count; ) {
+        snprintf(payload, payloadSize, "%031lu", (unsigned long)i);
+        MQTTStatus_t status = mqtt_quic_publish_qos1_pipelined(pContext, &bench_inflight,
+                                                               pPublishInfo, NULL);
+        if (status == MQTTSuccess) {
+            i++;
+        } else if (status != MQTTNoMemory || esp_timer_get_time() > deadline) {
+            ESP_LOGE(TAG, "Pipelined publish %lu failed: %d", (unsigned long)i, status);
+            return false;
+        } else {
+            // Window or send buffer full; push out held data and read PUBACKs
+            quic_client_flush_safe();
+            MQTT_ProcessLoop(pContext);
+        }
+    }
+
+    quic_client_flush_safe();
+    while (bench_inflight.inFlight > 0) {
+        if (esp_timer_get_time() > deadline) {
+            return false;
+        }
+        MQTT_ProcessLoop(pContext);
+    }
+
+    return true;
+}
+
+void mqtt_quic_bench_qos1_pipeline(MQTTContext_t *pContext,
+                                   NetworkContext_t *pNetworkContext,
+                                   const char *pTopic,
+                                   uint32_t count) {
+    static const uint16_t windows[] = { 0, 16, 64, MQTT_QUIC_INFLIGHT_MAX };
+    MQTTPublishInfo_t publishInfo;
+    char payload[32];
+
+    ESP_LOGI(TAG, "=== QoS1 pipeline benchmark: %lu messages ===", (unsigned long)count);
+
+    memset(&publishInfo, 0, sizeof(publishInfo));
+    publishInfo.qos = MQTTQoS1;
+    publishInfo.pTopicName = pTopic;
+    publishInfo.topicNameLength = strlen(pTopic);
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = sizeof(payload);
+
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        int64_t start = esp_timer_get_time();
+        int64_t deadline = start + (int64_t)BENCH_DRAIN_TIMEOUT_MS * 1000;
+        bool done;
+
+        // Window 0 stands for coreMQTT's own state engine
+        if (windows[w] == 0) {
+            done = qos1_run_coremqtt(pContext, &publishInfo, payload, sizeof(payload),
+                                     count, deadline);
+        } else {
+            mqtt_quic_inflight_init(&bench_inflight, windows[w]);
+            pNetworkContext->pInflight = &bench_inflight;
+            done = qos1_run_pipelined(pContext, &publishInfo, payload, sizeof(payload),
+                                      count, deadline);
+            pNetworkContext->pInflight = NULL;
+        }
+
+        int64_t elapsedUs = esp_timer_get_time() - start;
+        if (!done) {
+            ESP_LOGE(TAG, "QoS1 run with window %u did not complete", windows[w]);
+            return;
+        }
+
+        double ackLatencyMs = (windows[w] != 0 && bench_inflight.acked > 0) ?
+            (double)bench_inflight.ackLatencySumMs / (double)bench_inflight.acked : 0.0;
+
+        mqtt_quic_bench_report("qos1_pipeline",
+                               "\"mode\":\"%s\",\"window\":%u,\"msgs\":%lu,\"time_ms\":%lld,"
+                               "\"rate_msg_s\":%.1f,\"ack_latency_ms\":%.1f,\"refused\":%lu,"
+                               "\"rtt_ms\":%lu",
+                               windows[w] == 0 ? "coremqtt" : "pipelined",
+                               windows[w] == 0 ? MQTT_STATE_ARRAY_MAX_COUNT : windows[w],
+                               (unsigned long)count, (long long)(elapsedUs / 1000),
+                               elapsedUs > 0 ? (double)count * 1e6 / (double)elapsedUs : 0.0,
+                               ackLatencyMs,
+                               (unsigned long)(windows[w] == 0 ? 0 : bench_inflight.refused),
+                               (unsigned long)quic_client_smoothed_rtt_ms());
+    }
+}
+
+void mqtt_quic_bench_handshake(uint32_t mqttConnectUs) {
+    quic_client_stats_t stats;
+
+    quic_client_get_stats(&stats);
+    mqtt_quic_bench_report("handshake",
+                           "\"dns_ms\":%.1f,\"keygen_ms\":%.1f,\"first_flight_ms\":%.1f,"
+                           "\"handshake_ms\":%.1f,\"mqtt_connect_ms\":%.1f,"
+                           "\"dns_source\":\"%s\",\"raced\":%s,\"ip_version\":%u,"
+                           "\"verify\":\"%s\",\"rpk\":%s,\"hs_tx_bytes\":%lu,\"hs_rx_bytes\":%lu,"
+                           "\"datagrams\":%lu,\"bytes\":%llu,\"rtt_ms\":%lu",
+                           stats.dns_us / 1000.0, stats.keygen_us / 1000.0,
+                           stats.first_flight_us / 1000.0, stats.handshake_us / 1000.0,
+                           mqttConnectUs / 1000.0,
+                           quic_dns_source_name((quic_dns_source_t)stats.dns_source),
+                           stats.raced ? "true" : "false", stats.ip_version,
+                           stats.verify == QUIC_TLS_VERIFY_CHAIN ? "chain" :
+                           stats.verify == QUIC_TLS_VERIFY_PINNED_KEY ? "pinned" : "none",
+                           stats.server_rpk ? "true" : "false",
+                           (unsigned long)stats.handshake_tx_bytes,
+                           (unsigned long)stats.handshake_rx_bytes,
+                           (unsigned long)stats.tx_datagrams,
+                           (unsigned long long)stats.tx_bytes,
+                           (unsigned long)quic_client_smoothed_rtt_ms());
+}
+
+void mqtt_quic_bench_keepalive(MQTTContext_t *pContext, uint32_t intervalMs, uint32_t windowMs) {
+    quic_client_stats_t initial;
+
+    ESP_LOGI(TAG, "=== Idle keepalive benchmark: %lu ms interval, %lu ms per run ===",
+             (unsigned long)intervalMs, (unsigned long)windowMs);
+    quic_client_get_stats(&initial);
+
+    for (int run = 0; run < 2; run++) {
+        bool mqttPings = run == 0;
+        quic_client_stats_t before, after;
+        uint32_t pings = 0;
+        int64_t start;
+        int64_t nextPing;
+
+        quic_client_set_keep_alive(mqttPings ? 0 : intervalMs);
+        // Let ACKs of earlier traffic go out first
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        MQTT_ProcessLoop(pContext);
+
+        quic_client_get_stats(&before);
+        start = esp_timer_get_time();
+        nextPing = start + (int64_t)intervalMs * 1000;
+        while (esp_timer_get_time() - start < (int64_t)windowMs * 1000) {
+            if (mqttPings && esp_timer_get_time() >= nextPing) {
+                if (MQTT_Ping(pContext) == MQTTSuccess) {
+                    pings++;
+                }
+                nextPing += (int64_t)intervalMs * 1000;
+            }
+            MQTT_ProcessLoop(pContext);
+            vTaskDelay(pdMS_TO_TICKS(100));
+        }
+        quic_client_get_stats(&after);
+
+        if (!quic_client_is_connected()) {
+            ESP_LOGE(TAG, "Connection lost during the keepalive run");
+            return;
+        }
+
+        uint32_t tx = after.tx_datagrams - before.tx_datagrams;
+        uint32_t rx = after.rx_datagrams - before.rx_datagrams;
+        double perHour = 3600000.0 / (double)windowMs;
+
+        mqtt_quic_bench_report("keepalive",
+                               "\"mode\":\"%s\",\"interval_ms\":%lu,\"window_ms\":%lu,"
+                               "\"mqtt_pings\":%lu,\"tx_datagrams\":%lu,\"rx_datagrams\":%lu,"
+                               "\"bursts\":%lu,\"pkts_per_hour\":%.0f,\"bursts_per_hour\":%.0f",
+                               mqttPings ? "mqtt" : "quic",
+                               (unsigned long)intervalMs, (unsigned long)windowMs,
+                               (unsigned long)pings, (unsigned long)tx, (unsigned long)rx,
+                               (unsigned long)(after.tx_bursts - before.tx_bursts),
+                               (double)(tx + rx) * perHour,
+                               (double)(after.tx_bursts - before.tx_bursts) * perHour);
+    }
+
+    quic_client_set_keep_alive(initial.keep_alive_ms);
+}
+
+void mqtt_quic_bench_lowpower(MQTTContext_t *pContext, const char *pEchoTopic,
+                              uint32_t slackMs, uint32_t windowMs) {
+    static const char sensorTopic[] = "esp32/quic/bench/sensor";
+    // Unrelated periods, so the two streams do not line up by themselves
+    const int64_t sensorPeriodUs = 1300 * 1000;
+    const int64_t echoPeriodUs = 3100 * 1000;
+    MQTTPublishInfo_t sensorInfo;
+    MQTTPublishInfo_t echoInfo;
+    quic_client_stats_t initial;
+    char payload[16];
+
+    ESP_LOGI(TAG, "=== Low-power TX benchmark: %lu ms slack, %lu ms per run ===",
+             (unsigned long)slackMs, (unsigned long)windowMs);
+    quic_client_get_stats(&initial);
+    if (initial.keep_alive_ms == 0) {
+        quic_client_set_keep_alive(10000);
+    }
+
+    memset(&sensorInfo, 0, sizeof(sensorInfo));
+    sensorInfo.qos = MQTTQoS0;
+    sensorInfo.pTopicName = sensorTopic;
+    sensorInfo.topicNameLength = sizeof(sensorTopic) - 1;
+    sensorInfo.pPayload = payload;
+    sensorInfo.payloadLength = sizeof(payload);
+    echoInfo = sensorInfo;
+    echoInfo.pTopicName = pEchoTopic;
+    echoInfo.topicNameLength = strlen(pEchoTopic);
+
+    for (int run = 0; run < 2; run++) {
+        uint32_t slack = run == 0 ? 0 : slackMs;
+        quic_client_stats_t before, after;
+        uint32_t msgs = 0;
+        int64_t start;
+        int64_t nextSensor;
+        int64_t nextEcho;
+
+        quic_client_set_tx_slack(slack);
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        MQTT_ProcessLoop(pContext);
+
+        quic_client_get_stats(&before);
+        start = esp_timer_get_time();
+        nextSensor = start;
+        nextEcho = start + echoPeriodUs / 2;
+        while (esp_timer_get_time() - start < (int64_t)windowMs * 1000) {
+            int64_t now = esp_timer_get_time();
+
+            if (now >= nextSensor) {
+                snprintf(payload, sizeof(payload), "%015lu", (unsigned long)msgs);
+                if (MQTT_Publish(pContext, &sensorInfo, 0) == MQTTSuccess) {
+                    msgs++;
+                }
+                nextSensor += sensorPeriodUs;
+            }
+            if (now >= nextEcho) {
+                snprintf(payload, sizeof(payload), "%015lu", (unsigned long)msgs);
+                if (MQTT_Publish(pContext, &echoInfo, 0) == MQTTSuccess) {
+                    msgs++;
+                }
+                nextEcho += echoPeriodUs;
+            }
+            MQTT_ProcessLoop(pContext);
+            vTaskDelay(pdMS_TO_TICKS(100));
+        }
+        quic_client_get_stats(&after);
+
+        if (!quic_client_is_connected()) {
+            ESP_LOGE(TAG, "Connection lost during the low-power run");
+            break;
+        }
+
+        uint32_t bursts = after.tx_bursts - before.tx_bursts;
+        uint32_t wakeups = after.timer_wakeups - before.timer_wakeups;
+        double perHour = 3600000.0 / (double)windowMs;
+
+        mqtt_quic_bench_report("lowpower",
+                               "\"slack_ms\":%lu,\"window_ms\":%lu,\"msgs\":%lu,"
+                               "\"tx_datagrams\":%lu,\"bursts\":%lu,\"timer_wakeups\":%lu,"
+                               "\"bursts_per_hour\":%.0f,\"wakeups_per_hour\":%.0f,"
+                               "\"bursts_per_day\":%.0f",
+                               (unsigned long)slack, (unsigned long)windowMs,
+                               (unsigned long)msgs,
+                               (unsigned long)(after.tx_datagrams - before.tx_datagrams),
+                               (unsigned long)bursts, (unsigned long)wakeups,
+                               bursts * perHour, wakeups * perHour, bursts * perHour * 24);
+    }
+
+    quic_client_set_tx_slack(initial.tx_slack_ms);
+    quic_client_set_keep_alive(initial.keep_alive_ms);
+}
+
+void mqtt_quic_bench_trust_store(void) {
+    quic_trust_stats_t stats;
+    WOLFSSL_CERT_MANAGER *cm;
+    const uint8_t *der;
+    size_t len;
+    size_t loaded = 0;
+    uint32_t heapBefore;
+    uint32_t heapLoaded;
+    int64_t start;
+    int64_t eagerUs;
+
+    quic_trust_get_stats(&stats);
+    if (stats.certs == 0) {
+        ESP_LOGW(TAG, "No trust store open, skipping");
+        return;
+    }
+
+    // What parsing the whole bundle up front would cost
+    heapBefore = esp_get_free_heap_size();
+    start = esp_timer_get_time();
+    cm = wolfSSL_CertManagerNew();
+    for (size_t i = 0; cm != NULL && quic_trust_get(i, &der, &len) == 0; i++) {
+        if (wolfSSL_CertManagerLoadCABuffer(cm, der, (long)len,
+                                            WOLFSSL_FILETYPE_ASN1) == WOLFSSL_SUCCESS) {
+            loaded++;
+        }
+    }
+    eagerUs = esp_timer_get_time() - start;
+    heapLoaded = esp_get_free_heap_size();
+    wolfSSL_CertManagerFree(cm);
+
+    mqtt_quic_bench_report("trust_store",
+                           "\"certs\":%u,\"image_bytes\":%u,\"open_ms\":%.2f,"
+                           "\"lookups\":%lu,\"parsed\":%lu,\"verify_ms\":%.1f,"
+                           "\"dates_waived\":%lu,\"eager_loaded\":%u,\"eager_ms\":%.1f,"
+                           "\"eager_heap\":%ld",
+                           (unsigned)stats.certs, (unsigned)stats.image_bytes,
+                           stats.open_us / 1000.0,
+                           (unsigned long)stats.lookups, (unsigned long)stats.parsed,
+                           stats.verify_us / 1000.0, (unsigned long)stats.dates_waived,
+                           (unsigned)loaded, eagerUs / 1000.0,
+                           (long)heapBefore - (long)heapLoaded);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const uint32_t *sorted, uint32_t n, uint32_t pct) {
+    return n == 0 ? 0 : sorted[(uint64_t)(n - 1) * pct / 100];
+}
+
+void mqtt_quic_bench_publish_latency(MQTTContext_t *pContext,
+                                     NetworkContext_t *pNetworkContext,
+                                     const char *pTopic,
+                                     uint32_t count) {
+    MQTTPublishInfo_t publishInfo;
+    char payload[32];
+    uint32_t n = 0;
+
+    if (count > MQTT_QUIC_BENCH_LATENCY_MAX) {
+        count = MQTT_QUIC_BENCH_LATENCY_MAX;
+    }
+
+    ESP_LOGI(TAG, "=== Publish latency benchmark: %lu messages ===", (unsigned long)count);
+
+    memset(&publishInfo, 0, sizeof(publishInfo));
+    publishInfo.qos = MQTTQoS1;
+    publishInfo.pTopicName = pTopic;
+    publishInfo.topicNameLength = strlen(pTopic);
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = sizeof(payload);
+
+    // One message in flight at a time: each sample is a PUBLISH to PUBACK round trip
+    mqtt_quic_inflight_init(&bench_inflight, 1);
+    pNetworkContext->pInflight = &bench_inflight;
+
+    for (; n < count; n++) {
+        int64_t start = esp_timer_get_time();
+        int64_t deadline = start + (int64_t)BENCH_DRAIN_TIMEOUT_MS * 1000;
+
+        snprintf(payload, sizeof(payload), "%031lu", (unsigned long)n);
+        if (mqtt_quic_publish_qos1_pipelined(pContext, &bench_inflight,
+                                             &publishInfo, NULL) != MQTTSuccess) {
+            ESP_LOGE(TAG, "Latency publish %lu failed", (unsigned long)n);
+            break;
+        }
+        // Do not let the sample wait for the coalescing deadline
+        quic_client_flush_safe();
+
+        while (bench_inflight.inFlight > 0 && esp_timer_get_time() < deadline) {
+            MQTT_ProcessLoop(pContext);
+        }
+        if (bench_inflight.inFlight > 0) {
+            ESP_LOGE(TAG, "No PUBACK for latency publish %lu", (unsigned long)n);
+            break;
+        }
+        latency_samples[n] = (uint32_t)(esp_timer_get_time() - start);
+    }
+
+    pNetworkContext->pInflight = NULL;
+
+    qsort(latency_samples, n, sizeof(latency_samples[0]), compare_u32);
+    mqtt_quic_bench_report("publish_latency",
+                           "\"msgs\":%lu,\"p50_ms\":%.2f,\"p90_ms\":%.2f,\"p99_ms\":%.2f,"
+                           "\"max_ms\":%.2f,\"rtt_ms\":%lu",
+                           (unsigned long)n,
+                           percentile(latency_samples, n, 50) / 1000.0,
+                           percentile(latency_samples, n, 90) / 1000.0,
+                           percentile(latency_samples, n, 99) / 1000.0,
+                           percentile(latency_samples, n, 100) / 1000.0,
+                           (unsigned long)quic_client_smoothed_rtt_ms());
+}
+
+void mqtt_quic_bench_fanout(MQTTContext_t *pContext,
+                            NetworkContext_t *pNetworkContext,
+                            uint32_t count) {
+    MQTTSubscribeInfo_t subscribeInfo = {
+        .qos = MQTTQoS0,
+        .pTopicFilter = MQTT_QUIC_BENCH_FANOUT_TOPIC "/+",
+        .topicFilterLength = strlen(MQTT_QUIC_BENCH_FANOUT_TOPIC "/+")
+    };
+    MQTTPublishInfo_t publishInfo;
+    char payload[16];
+
+    ESP_LOGI(TAG, "=== Inbound fan-out benchmark: %lu messages ===", (unsigned long)count);
+
+    if (MQTT_Subscribe(pContext, &subscribeInfo, 1, MQTT_GetPacketId(pContext)) != MQTTSuccess) {
+        ESP_LOGE(TAG, "Subscribe to %s failed", subscribeInfo.pTopicFilter);
+        return;
+    }
+
+    for (int i = 0; i < 10; i++) {
+        MQTT_ProcessLoop(pContext);
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+
+    memset(&publishInfo, 0, sizeof(publishInfo));
+    publishInfo.qos = MQTTQoS0;
+    publishInfo.pTopicName = MQTT_QUIC_BENCH_FANOUT_CONTROL;
+    publishInfo.topicNameLength = strlen(MQTT_QUIC_BENCH_FANOUT_CONTROL);
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = (size_t)snprintf(payload, sizeof(payload), "%lu",
+                                                 (unsigned long)count);
+
+    uint32_t packetsBefore = pNetworkContext->rxPackets;
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + (int64_t)BENCH_DRAIN_TIMEOUT_MS * 1000;
+
+    inbound_count = 0;
+    if (MQTT_Publish(pContext, &publishInfo, 0) != MQTTSuccess) {
+        ESP_LOGE(TAG, "Fan-out request failed");
+        return;
+    }
+    quic_client_flush_safe();
+
+    // A broker without the bench control topic sends nothing; the run then
+    // ends at the deadline with received=0
+    while (inbound_count < count && esp_timer_get_time() < deadline) {
+        if (MQTT_ProcessLoop(pContext) != MQTTSuccess) {
+            vTaskDelay(1);
+        }
+    }
+
+    int64_t elapsedUs = esp_timer_get_time() - start;
+
+    mqtt_quic_bench_report("fanout",
+                           "\"received\":%lu,\"msgs\":%lu,\"time_ms\":%lld,"
+                           "\"rate_msg_s\":%.1f,\"packets\":%lu",
+                           (unsigned long)inbound_count, (unsigned long)count,
+                           (long long)(elapsedUs / 1000),
+                           elapsedUs > 0 ? (double)inbound_count * 1e6 / (double)elapsedUs : 0.0,
+                           (unsigned long)(pNetworkContext->rxPackets - packetsBefore));
+}
+
+// Subscribe to the fan-out topics and prepare a request for count
+// messages of size bytes; payload must outlive publishInfo
+static bool fanout_prepare(MQTTContext_t *pContext, MQTTPublishInfo_t *publishInfo,
+                           char *payload, size_t payloadSize, uint32_t count, uint32_t size) {
+    MQTTSubscribeInfo_t subscribeInfo = {
+        .qos = MQTTQoS0,
+        .pTopicFilter = MQTT_QUIC_BENCH_FANOUT_TOPIC "/+",
+        .topicFilterLength = strlen(MQTT_QUIC_BENCH_FANOUT_TOPIC "/+")
+    };
+
+    if (MQTT_Subscribe(pContext, &subscribeInfo, 1, MQTT_GetPacketId(pContext)) != MQTTSuccess) {
+        ESP_LOGE(TAG, "Subscribe to %s failed", subscribeInfo.pTopicFilter);
+        return false;
+    }
+    for (int i = 0; i < 10; i++) {
+        MQTT_ProcessLoop(pContext);
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+
+    memset(publishInfo, 0, sizeof(*publishInfo));
+    publishInfo->qos = MQTTQoS0;
+    publishInfo->pTopicName = MQTT_QUIC_BENCH_FANOUT_CONTROL;
+    publishInfo->topicNameLength = strlen(MQTT_QUIC_BENCH_FANOUT_CONTROL);
+    publishInfo->pPayload = payload;
+    publishInfo->payloadLength = (size_t)snprintf(payload, payloadSize, "%lu %lu",
+                                                  (unsigned long)count, (unsigned long)size);
+    return true;
+}
+
+void mqtt_quic_bench_ack_frequency(MQTTContext_t *pContext, uint32_t ackTolerance,
+                                   uint32_t count, uint32_t size) {
+    MQTTPublishInfo_t publishInfo;
+    quic_client_stats_t initial;
+    char payload[24];
+
+    ESP_LOGI(TAG, "=== ACK frequency benchmark: %lu x %lu bytes, tolerance %lu ===",
+             (unsigned long)count, (unsigned long)size, (unsigned long)ackTolerance);
+
+    if (!fanout_prepare(pContext, &publishInfo, payload, sizeof(payload), count, size)) {
+        return;
+    }
+
+    quic_client_get_stats(&initial);
+
+    for (int run = 0; run < 2; run++) {
+        uint32_t tolerance = run == 0 ? initial.ack_tolerance : ackTolerance;
+        quic_client_stats_t before, after;
+        int64_t start;
+        int64_t deadline;
+
+        quic_client_set_ack_frequency(tolerance, 0);
+        quic_client_get_stats(&before);
+        start = esp_timer_get_time();
+        deadline = start + (int64_t)BENCH_DRAIN_TIMEOUT_MS * 1000;
+
+        inbound_count = 0;
+        if (MQTT_Publish(pContext, &publishInfo, 0) != MQTTSuccess) {
+            ESP_LOGE(TAG, "Fan-out request failed");
+            break;
+        }
+        quic_client_flush_safe();
+
+        while (inbound_count < count && esp_timer_get_time() < deadline) {
+            if (MQTT_ProcessLoop(pContext) != MQTTSuccess) {
+                vTaskDelay(1);
+            }
+        }
+
+        int64_t elapsedUs = esp_timer_get_time() - start;
+        quic_client_get_stats(&after);
+
+        uint64_t rxBytes = after.rx_bytes - before.rx_bytes;
+        uint32_t tx = after.tx_datagrams - before.tx_datagrams;
+        double mb = (double)rxBytes / (1024.0 * 1024.0);
+
+        mqtt_quic_bench_report("ack_frequency",
+                               "\"tolerance\":%lu,\"max_ack_delay_ms\":%lu,\"received\":%lu,"
+                               "\"msgs\":%lu,\"rx_bytes\":%llu,\"time_ms\":%lld,\"kbps\":%.1f,"
+                               "\"tx_datagrams\":%lu,\"acks\":%lu,\"acks_per_mb\":%.1f",
+                               (unsigned long)tolerance, (unsigned long)after.max_ack_delay_ms,
+                               (unsigned long)inbound_count, (unsigned long)count,
+                               (unsigned long long)rxBytes, (long long)(elapsedUs / 1000),
+                               elapsedUs > 0 ? (double)rxBytes * 8000.0 / (double)elapsedUs : 0.0,
+                               (unsigned long)tx,
+                               (unsigned long)(after.ack_datagrams - before.ack_datagrams),
+                               mb > 0 ? (double)(after.ack_datagrams - before.ack_datagrams) / mb : 0.0);
+    }
+
+    quic_client_set_ack_frequency(initial.ack_tolerance, initial.max_ack_delay_ms);
+}
+
+void mqtt_quic_bench_pipeline(MQTTContext_t *pContext, uint32_t count, uint32_t size) {
+    MQTTPublishInfo_t publishInfo;
+    quic_client_stats_t before, after;
+    int ioCore = quic_pipeline_stage_core(QUIC_STAGE_IO);
+    int appCore = quic_pipeline_stage_core(QUIC_STAGE_APP);
+    int64_t idleBefore[2];
+    uint64_t ioBefore;
+    uint64_t appBusy = 0;
+    char payload[24];
+
+    ESP_LOGI(TAG, "=== Pipeline benchmark: %lu x %lu bytes, I/O core %d, app core %d ===",
+             (unsigned long)count, (unsigned long)size, ioCore, appCore);
+
+    if (!fanout_prepare(pContext, &publishInfo, payload, sizeof(payload), count, size)) {
+        return;
+    }
+
+    quic_client_get_stats(&before);
+    ioBefore = quic_pipeline_busy_us(QUIC_STAGE_IO);
+    for (int core = 0; core < 2; core++) {
+        idleBefore[core] = quic_pipeline_idle_us(core);
+    }
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + (int64_t)BENCH_DRAIN_TIMEOUT_MS * 1000;
+
+    inbound_count = 0;
+    if (MQTT_Publish(pContext, &publishInfo, 0) != MQTTSuccess) {
+        ESP_LOGE(TAG, "Fan-out request failed");
+        return;
+    }
+    quic_client_flush_safe();
+
+    while (inbound_count < count && esp_timer_get_time() < deadline) {
+        int64_t busyStart = esp_timer_get_time();
+        MQTTStatus_t status = MQTT_ProcessLoop(pContext);
+
+        appBusy += (uint64_t)(esp_timer_get_time() - busyStart);
+        if (status != MQTTSuccess) {
+            vTaskDelay(1);
+        }
+    }
+
+    int64_t elapsedUs = esp_timer_get_time() - start;
+    double ioUtil = 0.0;
+    double appUtil = 0.0;
+    double idle[2];
+
+    quic_client_get_stats(&after);
+    quic_pipeline_busy_add(QUIC_STAGE_APP, (uint32_t)appBusy);
+    if (elapsedUs > 0) {
+        ioUtil = (double)(quic_pipeline_busy_us(QUIC_STAGE_IO) - ioBefore) * 100.0 / (double)elapsedUs;
+        appUtil = (double)appBusy * 100.0 / (double)elapsedUs;
+    }
+    // -1 without run-time stats; the counter is 32 bits wide
+    for (int core = 0; core < 2; core++) {
+        int64_t now = quic_pipeline_idle_us(core);
+        idle[core] = now < 0 || idleBefore[core] < 0 || elapsedUs <= 0 ? -1.0 :
+                     (double)(uint32_t)(now - idleBefore[core]) * 100.0 / (double)elapsedUs;
+    }
+
+    uint64_t rxBytes = after.rx_bytes - before.rx_bytes;
+
+    mqtt_quic_bench_report("pipeline",
+                           "\"pipelined\":%d,\"io_core\":%d,\"app_core\":%d,\"received\":%lu,"
+                           "\"msgs\":%lu,\"time_ms\":%lld,\"kbps\":%.1f,\"io_util\":%.1f,"
+                           "\"app_util\":%.1f,\"core0_idle\":%.1f,\"core1_idle\":%.1f",
+                           QUIC_PIPELINE_ENABLE, ioCore, appCore,
+                           (unsigned long)inbound_count, (unsigned long)count,
+                           (long long)(elapsedUs / 1000),
+                           elapsedUs > 0 ? (double)rxBytes * 8000.0 / (double)elapsedUs : 0.0,
+                           ioUtil, appUtil, idle[0], idle[1]);
+}
+
+// Largest bulk publish of the priority scenario
+#define BENCH_PRIORITY_BULK_MAX 4096
+// A small publish and a PINGREQ this often while bulk data is queued
+#define BENCH_PRIORITY_PERIOD_MS 100
+
+static uint8_t priority_bulk[BENCH_PRIORITY_BULK_MAX];
+
+void mqtt_quic_bench_priority(MQTTContext_t *pContext, uint32_t bulkSize, uint32_t windowMs) {
+    MQTTPublishInfo_t bulkInfo, smallInfo;
+    quic_client_stats_t initial;
+    char payload[16];
+
+    if (bulkSize > BENCH_PRIORITY_BULK_MAX) {
+        bulkSize = BENCH_PRIORITY_BULK_MAX;
+    }
+    ESP_LOGI(TAG, "=== Send priority benchmark: %lu byte bulk publishes, %lu ms per run ===",
+             (unsigned long)bulkSize, (unsigned long)windowMs);
+
+    memset(&bulkInfo, 0, sizeof(bulkInfo));
+    bulkInfo.qos = MQTTQoS0;
+    bulkInfo.pTopicName = "esp32/quic/bench/priority/bulk";
+    bulkInfo.topicNameLength = strlen(bulkInfo.pTopicName);
+    bulkInfo.pPayload = priority_bulk;
+    bulkInfo.payloadLength = bulkSize;
+    smallInfo = bulkInfo;
+    smallInfo.pTopicName = "esp32/quic/bench/priority/small";
+    smallInfo.topicNameLength = strlen(smallInfo.pTopicName);
+    smallInfo.pPayload = payload;
+
+    quic_client_get_stats(&initial);
+
+    for (int run = 0; run < 2; run++) {
+        bool fifo = run == 0;
+        quic_client_stats_t before, after;
+        uint32_t bulk = 0, small = 0, pings = 0;
+        uint64_t pingTotalUs = 0;
+        int64_t pingMaxUs = 0, pingSentUs = 0;
+        int64_t start, nextSmall;
+
+        quic_client_set_send_fifo(fifo);
+        wait_stream_drained(BENCH_DRAIN_TIMEOUT_MS);
+
+        quic_client_get_stats(&before);
+        start = esp_timer_get_time();
+        nextSmall = start;
+        while (esp_timer_get_time() - start < (int64_t)windowMs * 1000) {
+            // Keep the send buffer close to full of bulk data
+            if (quic_client_unacked_bytes() + bulkSize + 64 <= APP_SEND_BUFFER_SIZE &&
+                MQTT_Publish(pContext, &bulkInfo, 0) == MQTTSuccess) {
+                bulk++;
+            }
+
+            if (esp_timer_get_time() >= nextSmall) {
+                smallInfo.payloadLength = (size_t)snprintf(payload, sizeof(payload), "%lu",
+                                                           (unsigned long)small);
+                if (MQTT_Publish(pContext, &smallInfo, 0) == MQTTSuccess) {
+                    small++;
+                }
+                if (!pContext->waitingForPingResp && MQTT_Ping(pContext) == MQTTSuccess) {
+                    pingSentUs = esp_timer_get_time();
+                }
+                nextSmall += (int64_t)BENCH_PRIORITY_PERIOD_MS * 1000;
+            }
+
+            MQTT_ProcessLoop(pContext);
+            if (pingSentUs != 0 && !pContext->waitingForPingResp) {
+                int64_t us = esp_timer_get_time() - pingSentUs;
+
+                pings++;
+                pingTotalUs += (uint64_t)us;
+                if (us > pingMaxUs) {
+                    pingMaxUs = us;
+                }
+                pingSentUs = 0;
+            }
+            vTaskDelay(1);
+        }
+        quic_client_get_stats(&after);
+
+        if (!quic_client_is_connected()) {
+            ESP_LOGE(TAG, "Connection lost during the priority run");
+            break;
+        }
+
+        uint32_t delay[QUIC_SEND_CLASS_COUNT];
+        for (int cls = 0; cls < QUIC_SEND_CLASS_COUNT; cls++) {
+            uint32_t n = after.class_packets[cls] - before.class_packets[cls];
+            delay[cls] = n ? (uint32_t)((after.class_delay_us[cls] - before.class_delay_us[cls]) / n) : 0;
+        }
+
+        mqtt_quic_bench_report("priority",
+                               "\"mode\":\"%s\",\"bulk_msgs\":%lu,\"small_msgs\":%lu,\"pings\":%lu,"
+                               "\"ping_avg_ms\":%.1f,\"ping_max_ms\":%.1f,\"reordered\":%lu,"
+                               "\"control_delay_us\":%lu,\"interactive_delay_us\":%lu,"
+                               "\"bulk_delay_us\":%lu",
+                               fifo ? "fifo" : "priority", (unsigned long)bulk,
+                               (unsigned long)small, (unsigned long)pings,
+                               pings ? (double)pingTotalUs / pings / 1000.0 : 0.0,
+                               (double)pingMaxUs / 1000.0,
+                               (unsigned long)(after.reordered - before.reordered),
+                               (unsigned long)delay[QUIC_SEND_CONTROL],
+                               (unsigned long)delay[QUIC_SEND_INTERACTIVE],
+                               (unsigned long)delay[QUIC_SEND_BULK]);
+    }
+
+    quic_client_set_send_fifo(initial.send_fifo);
+}
+
+// Sensor topics per policy in the outbound scenario, and their sample period
+#define BENCH_OUTBOUND_TOPICS 4
+#define BENCH_OUTBOUND_PERIOD_MS 20
+
+void mqtt_quic_bench_outbound(MQTTContext_t *pContext, uint32_t ttlMs, uint32_t windowMs) {
+    MQTTQUICOutboundStats_t before, after;
+    MQTTPublishInfo_t bulkInfo, sampleInfo;
+    char topic[48];
+    char payload[32];
+    uint32_t samples = 0, bulk = 0;
+    int64_t start, nextSample, deadline;
+
+    ESP_LOGI(TAG, "=== Outbound policy benchmark: %lu ms TTL, %lu ms ===",
+             (unsigned long)ttlMs, (unsigned long)windowMs);
+
+    if (mqtt_quic_outbound_set_policy("esp32/quic/bench/outbound/latest/+", true, 0) != 0 ||
+        mqtt_quic_outbound_set_policy("esp32/quic/bench/outbound/deadline/+", false, ttlMs) != 0) {
+        return;
+    }
+
+    // Bulk traffic on a topic without a policy keeps the link busy
+    memset(&bulkInfo, 0, sizeof(bulkInfo));
+    bulkInfo.qos = MQTTQoS0;
+    bulkInfo.pTopicName = "esp32/quic/bench/outbound/bulk";
+    bulkInfo.topicNameLength = strlen(bulkInfo.pTopicName);
+    bulkInfo.pPayload = priority_bulk;
+    bulkInfo.payloadLength = BENCH_PRIORITY_BULK_MAX / 2;
+    sampleInfo = bulkInfo;
+    sampleInfo.pTopicName = topic;
+    sampleInfo.pPayload = payload;
+
+    wait_stream_drained(BENCH_DRAIN_TIMEOUT_MS);
+    mqtt_quic_outbound_get_stats(&before);
+    start = esp_timer_get_time();
+    nextSample = start;
+    while (esp_timer_get_time() - start < (int64_t)windowMs * 1000) {
+        if (quic_client_unacked_bytes() + bulkInfo.payloadLength + 64 <= APP_SEND_BUFFER_SIZE &&
+            MQTT_Publish(pContext, &bulkInfo, 0) == MQTTSuccess) {
+            bulk++;
+        }
+
+        if (esp_timer_get_time() >= nextSample) {
+            for (int i = 0; i < 2 * BENCH_OUTBOUND_TOPICS; i++) {
+                sampleInfo.topicNameLength = (uint16_t)snprintf(topic, sizeof(topic),
+                    "esp32/quic/bench/outbound/%s/%d",
+                    i < BENCH_OUTBOUND_TOPICS ? "latest" : "deadline", i % BENCH_OUTBOUND_TOPICS);
+                sampleInfo.payloadLength = (size_t)snprintf(payload, sizeof(payload), "%lu %lld",
+                    (unsigned long)samples, (long long)(esp_timer_get_time() / 1000));
+                if (mqtt_quic_outbound_publish(pContext, &sampleInfo) == MQTTSuccess) {
+                    samples++;
+                }
+            }
+            nextSample += (int64_t)BENCH_OUTBOUND_PERIOD_MS * 1000;
+        }
+
+        mqtt_quic_outbound_flush(pContext);
+        MQTT_ProcessLoop(pContext);
+        vTaskDelay(1);
+    }
+
+    // Let the held samples go out or expire
+    deadline = esp_timer_get_time() + (int64_t)BENCH_DRAIN_TIMEOUT_MS * 1000;
+    do {
+        mqtt_quic_outbound_flush(pContext);
+        MQTT_ProcessLoop(pContext);
+        vTaskDelay(1);
+        mqtt_quic_outbound_get_stats(&after);
+    } while (after.pending > 0 && quic_client_is_connected() && esp_timer_get_time() < deadline);
+
+    mqtt_quic_bench_report("outbound",
+                           "\"samples\":%lu,\"sent\":%lu,\"conflated\":%lu,\"dropped\":%lu,"
+                           "\"overflows\":%lu,\"pending\":%lu,\"bulk_msgs\":%lu,\"ttl_ms\":%lu",
+                           (unsigned long)samples, (unsigned long)(after.sent - before.sent),
+                           (unsigned long)(after.conflated - before.conflated),
+                           (unsigned long)(after.dropped - before.dropped),
+                           (unsigned long)(after.overflows - before.overflows),
+                           (unsigned long)after.pending, (unsigned long)bulk,
+                           (unsigned long)ttlMs);
+}
+
+// Longest wait for a standby's handshake in the failover, path cache and
+// token scenarios
+#define BENCH_STANDBY_WAIT_MS 15000
+
+// Reconnect to the broker MQTT is on through mqtt_quic_failover, and wait
+// for count fan-out messages of size bytes; returns false if it could not
+// reconnect
+static bool path_cache_run(MQTTContext_t *pContext, NetworkContext_t *pNetworkContext,
+                           const MQTTConnectInfo_t *pConnectInfo,
+                           uint32_t count, uint32_t size, bool warm, bool reloaded) {
+    MQTTSubscribeInfo_t subscribeInfo = {
+        .qos = MQTTQoS0,
+        .pTopicFilter = MQTT_QUIC_BENCH_FANOUT_TOPIC "/+",
+        .topicFilterLength = strlen(MQTT_QUIC_BENCH_FANOUT_TOPIC "/+")
+    };
+    MQTTPublishInfo_t publishInfo;
+    quic_client_stats_t stats;
+    char payload[24];
+    int64_t start, readyUs, connectedUs, deadline;
+
+    start = esp_timer_get_time();
+    deadline = start + (int64_t)BENCH_STANDBY_WAIT_MS * 1000;
+    if (mqtt_quic_failover_standby() != 0) {
+        return false;
+    }
+    while (quic_client_standby_state() == QUIC_STANDBY_CONNECTING && esp_timer_get_time() < deadline) {
+        MQTT_ProcessLoop(pContext);
+        vTaskDelay(1);
+    }
+    readyUs = esp_timer_get_time();
+    if (quic_client_standby_state() != QUIC_STANDBY_READY) {
+        quic_client_standby_stop();
+        return false;
+    }
+
+    if (mqtt_quic_failover_switch(pContext, pNetworkContext, pConnectInfo, 5000, NULL) != MQTTSuccess) {
+        ESP_LOGE(TAG, "CONNECT after reconnecting failed");
+        return false;
+    }
+    connectedUs = esp_timer_get_time();
+    // The switch opens the next standby at once; its handshake would share
+    // the link with the transfer measured here
+    quic_client_standby_stop();
+
+    // SUBSCRIBE and the request share the stream, the server sees them in order
+    memset(&publishInfo, 0, sizeof(publishInfo));
+    publishInfo.qos = MQTTQoS0;
+    publishInfo.pTopicName = MQTT_QUIC_BENCH_FANOUT_CONTROL;
+    publishInfo.topicNameLength = strlen(MQTT_QUIC_BENCH_FANOUT_CONTROL);
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = (size_t)snprintf(payload, sizeof(payload), "%lu %lu",
+                                                 (unsigned long)count, (unsigned long)size);
+    inbound_count = 0;
+    if (MQTT_Subscribe(pContext, &subscribeInfo, 1, MQTT_GetPacketId(pContext)) != MQTTSuccess ||
+        MQTT_Publish(pContext, &publishInfo, 0) != MQTTSuccess) {
+        ESP_LOGE(TAG, "Fan-out request failed");
+        return false;
+    }
+    quic_client_flush_safe();
+
+    deadline = esp_timer_get_time() + (int64_t)BENCH_DRAIN_TIMEOUT_MS * 1000;
+    while (inbound_count < count && esp_timer_get_time() < deadline) {
+        if (MQTT_ProcessLoop(pContext) != MQTTSuccess) {
+            vTaskDelay(1);
+        }
+    }
+
+    int64_t elapsedUs = esp_timer_get_time() - start;
+
+    quic_client_get_stats(&stats);
+    mqtt_quic_bench_report("path_cache",
+                           "\"warm\":%d,\"reloaded\":%d,\"seeded\":%d,\"initial_rtt_ms\":%lu,"
+                           "\"cwnd_hint\":%lu,\"received\":%lu,\"msgs\":%lu,\"kb\":%lu,"
+                           "\"handshake_ms\":%lld,\"connect_ms\":%lld,\"time_ms\":%lld,\"rtt_ms\":%lu",
+                           warm, reloaded, stats.path_seeded, (unsigned long)stats.initial_rtt_ms,
+                           (unsigned long)stats.path_cwnd_hint,
+                           (unsigned long)inbound_count, (unsigned long)count,
+                           (unsigned long)((uint64_t)count * size / 1024),
+                           (long long)((readyUs - start) / 1000),
+                           (long long)((connectedUs - start) / 1000),
+                           (long long)(elapsedUs / 1000),
+                           (unsigned long)quic_client_smoothed_rtt_ms());
+    return true;
+}
+
+void mqtt_quic_bench_path_cache(MQTTContext_t *pContext,
+                                NetworkContext_t *pNetworkContext,
+                                const MQTTConnectInfo_t *pConnectInfo,
+                                const ServerInfo_t *pBrokers,
+                                size_t brokerCount,
+                                uint32_t kb) {
+    // Both entries are the current broker, so the standby and every
+    // failover go back to it
+    static ServerInfo_t pathBrokers[2];
+    bool ok = true;
+
+    ESP_LOGI(TAG, "=== Path cache benchmark: first %lu KB after reconnecting to %s:%u ===",
+             (unsigned long)kb, pBrokers[0].pHostName, pBrokers[0].port);
+
+    pathBrokers[0] = pBrokers[0];
+    pathBrokers[1] = pBrokers[0];
+    quic_client_standby_stop();
+    mqtt_quic_failover_init(pathBrokers, 2);
+
+    // Cold: nothing saved. Warm: what the connection replaced by the
+    // previous run saved as it closed. Reloaded: the same read back from
+    // flash, as after a restart
+    quic_path_flush();
+    for (int run = 0; run < 3 && ok; run++) {
+        if (run == 2) {
+            quic_path_reload();
+        }
+        ok = path_cache_run(pContext, pNetworkContext, pConnectInfo, kb, 1024, run > 0, run == 2);
+    }
+    if (!ok) {
+        ESP_LOGE(TAG, "Reconnecting to %s failed, skipping the path cache benchmark",
+                 pBrokers[0].pHostName);
+    }
+
+    quic_client_standby_stop();
+    mqtt_quic_failover_init(pBrokers, brokerCount);
+}
+
+void mqtt_quic_bench_token(MQTTContext_t *pContext, const ServerInfo_t *pServer) {
+    quic_client_stats_t stats;
+    char port[8];
+
+    ESP_LOGI(TAG, "=== Token benchmark: handshakes with %s:%u, which sends Retry ===",
+             pServer->pHostName, pServer->port);
+
+    snprintf(port, sizeof(port), "%u", pServer->port);
+    // Cold: no token. Warm: the one the previous connection got in
+    // NEW_TOKEN. Reloaded: the same read back from flash, as after a restart
+    quic_token_flush();
+    for (int run = 0; run < 3; run++) {
+        int64_t deadline = esp_timer_get_time() + (int64_t)BENCH_STANDBY_WAIT_MS * 1000;
+
+        if (run == 2) {
+            quic_token_reload();
+        }
+        if (quic_client_standby_start(pServer->pHostName, port) != 0) {
+            ESP_LOGE(TAG, "Cannot connect to %s, skipping the token benchmark", pServer->pHostName);
+            return;
+        }
+        while (quic_client_standby_state() == QUIC_STANDBY_CONNECTING &&
+               esp_timer_get_time() < deadline) {
+            MQTT_ProcessLoop(pContext);
+            vTaskDelay(1);
+        }
+        // NEW_TOKEN comes with HANDSHAKE_DONE or shortly after
+        for (int i = 0; i < 5; i++) {
+            MQTT_ProcessLoop(pContext);
+            vTaskDelay(pdMS_TO_TICKS(50));
+        }
+
+        quic_client_get_stats(&stats);
+        mqtt_quic_bench_report("token",
+                               "\"warm\":%d,\"reloaded\":%d,\"ready\":%d,\"token_used\":%d,"
+                               "\"retries\":%lu,\"handshake_ms\":%.1f,\"rtt_ms\":%lu",
+                               run > 0, run == 2, stats.standby_state == QUIC_STANDBY_READY,
+                               stats.standby_token_used, (unsigned long)stats.standby_retries,
+                               stats.standby_handshake_us / 1000.0,
+                               (unsigned long)quic_client_smoothed_rtt_ms());
+        quic_client_standby_stop();
+    }
+}
+
+void mqtt_quic_bench_failover(MQTTContext_t *pContext,
+                              NetworkContext_t *pNetworkContext,
+                              const MQTTConnectInfo_t *pConnectInfo,
+                              uint32_t count, uint32_t periodMs) {
+    MQTTQUICFailoverStats_t failoverStats;
+    MQTTPublishInfo_t publishInfo;
+    quic_client_stats_t before, now, after;
+    int64_t lastRxUs, detectUs = 0, resumeUs = 0;
+    uint32_t lastRx, sent = 0;
+    char payload[16];
+
+    ESP_LOGI(TAG, "=== Failover benchmark: %lu messages every %lu ms ===",
+             (unsigned long)count, (unsigned long)periodMs);
+
+    int64_t deadline = esp_timer_get_time() + (int64_t)BENCH_STANDBY_WAIT_MS * 1000;
+    while (quic_client_standby_state() != QUIC_STANDBY_READY && esp_timer_get_time() < deadline) {
+        mqtt_quic_failover_standby();
+        MQTT_ProcessLoop(pContext);
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    if (quic_client_standby_state() != QUIC_STANDBY_READY) {
+        ESP_LOGE(TAG, "No warm standby, skipping the failover benchmark");
+        return;
+    }
+
+    memset(&publishInfo, 0, sizeof(publishInfo));
+    publishInfo.qos = MQTTQoS0;
+    publishInfo.pTopicName = MQTT_QUIC_BENCH_FAILOVER_CONTROL;
+    publishInfo.topicNameLength = strlen(MQTT_QUIC_BENCH_FAILOVER_CONTROL);
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = (size_t)snprintf(payload, sizeof(payload), "%lu",
+                                                 (unsigned long)(count / 2));
+    if (MQTT_Publish(pContext, &publishInfo, 0) != MQTTSuccess) {
+        ESP_LOGE(TAG, "Failover request failed");
+        return;
+    }
+    quic_client_flush_safe();
+
+    publishInfo.pTopicName = MQTT_QUIC_BENCH_FAILOVER_TOPIC;
+    publishInfo.topicNameLength = strlen(MQTT_QUIC_BENCH_FAILOVER_TOPIC);
+
+    quic_client_get_stats(&before);
+    lastRx = before.rx_datagrams;
+    lastRxUs = esp_timer_get_time();
+    // Half the messages, then at most the idle timeout to notice the loss
+    deadline = lastRxUs + ((int64_t)count * periodMs + before.idle_timeout_ms) * 1000;
+
+    while (sent < count && esp_timer_get_time() < deadline) {
+        quic_client_get_stats(&now);
+        if (detectUs == 0 && now.rx_datagrams != lastRx) {
+            lastRx = now.rx_datagrams;
+            lastRxUs = esp_timer_get_time();
+        }
+
+        if (!quic_client_is_connected()) {
+            if (detectUs != 0) {
+                ESP_LOGE(TAG, "Connection lost again after failing over");
+                break;
+            }
+            detectUs = esp_timer_get_time();
+            if (mqtt_quic_failover_switch(pContext, pNetworkContext, pConnectInfo,
+                                          5000, NULL) != MQTTSuccess) {
+                ESP_LOGE(TAG, "Failover failed");
+                break;
+            }
+            continue;
+        }
+
+        publishInfo.payloadLength = (size_t)snprintf(payload, sizeof(payload), "%lu",
+                                                     (unsigned long)sent);
+        if (MQTT_Publish(pContext, &publishInfo, 0) == MQTTSuccess) {
+            quic_client_flush_safe();
+            sent++;
+            if (detectUs != 0 && resumeUs == 0) {
+                resumeUs = esp_timer_get_time();
+            }
+        }
+        MQTT_ProcessLoop(pContext);
+        vTaskDelay(pdMS_TO_TICKS(periodMs));
+    }
+
+    quic_client_get_stats(&after);
+    mqtt_quic_failover_get_stats(&failoverStats);
+
+    mqtt_quic_bench_report("failover",
+                           "\"msgs\":%lu,\"sent\":%lu,\"failovers\":%lu,\"detect_ms\":%lld,"
+                           "\"switch_ms\":%lu,\"outage_ms\":%lld,\"rtt_ms\":%lu,"
+                           "\"standby_tx_bytes\":%llu,\"standby_rx_bytes\":%llu,"
+                           "\"standby_keepalive_ms\":%lu",
+                           (unsigned long)count, (unsigned long)sent,
+                           (unsigned long)(after.failovers - before.failovers),
+                           detectUs ? (long long)((detectUs - lastRxUs) / 1000) : -1LL,
+                           (unsigned long)failoverStats.lastSwitchMs,
+                           resumeUs ? (long long)((resumeUs - lastRxUs) / 1000) : -1LL,
+                           (unsigned long)quic_client_smoothed_rtt_ms(),
+                           (unsigned long long)before.standby_tx_bytes,
+                           (unsigned long long)before.standby_rx_bytes,
+                           (unsigned long)before.standby_keep_alive_ms);
+}
+
+static void router_bench_handler(const MQTTPublishInfo_t *pPublishInfo, void *pUserCtx) {
+    (void)pPublishInfo;
+    (*(uint32_t *)pUserCtx)++;
+}
+
+void mqtt_quic_bench_router(uint32_t filterCount, uint32_t iterations) {
+    // Filter strings must stay valid for the linear scan
+    static char filters[2 * 128][24];
+    static const char *suffixes[] = { "temp", "cmd/reboot", "cmd/ota/start", "status" };
+    uint32_t routed = 0, linear = 0;
+    char topic[32];
+
+    if (filterCount > 128) {
+        filterCount = 128;
+    }
+
+    ESP_LOGI(TAG, "=== Router benchmark: %lu filters ===", (unsigned long)(2 * filterCount));
+
+    for (uint32_t i = 0; i < filterCount; i++) {
+        snprintf(filters[2 * i], sizeof(filters[0]), "gw/dev%03lu/+", (unsigned long)i);
+        snprintf(filters[2 * i + 1], sizeof(filters[0]), "gw/dev%03lu/cmd/#", (unsigned long)i);
+        for (int k = 0; k < 2; k++) {
+            const char *f = filters[2 * i + k];
+            if (mqtt_quic_router_add(f, strlen(f), router_bench_handler, &routed) != 0) {
+                ESP_LOGE(TAG, "Registering %s failed", f);
+                filterCount = i;
+                goto cleanup;
+            }
+        }
+    }
+
+    MQTTPublishInfo_t publishInfo;
+    memset(&publishInfo, 0, sizeof(publishInfo));
+    publishInfo.pTopicName = topic;
+
+    int64_t start = esp_timer_get_time();
+    for (uint32_t n = 0; n < iterations; n++) {
+        snprintf(topic, sizeof(topic), "gw/dev%03lu/%s",
+                 (unsigned long)(n % filterCount), suffixes[n % 4]);
+        publishInfo.topicNameLength = strlen(topic);
+        mqtt_quic_router_dispatch(&publishInfo);
+    }
+    int64_t routerUs = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (uint32_t n = 0; n < iterations; n++) {
+        snprintf(topic, sizeof(topic), "gw/dev%03lu/%s",
+                 (unsigned long)(n % filterCount), suffixes[n % 4]);
+        for (uint32_t f = 0; f < 2 * filterCount; f++) {
+            bool isMatch = false;
+            MQTT_MatchTopic(topic, strlen(topic), filters[f], strlen(filters[f]), &isMatch);
+            linear += isMatch;
+        }
+    }
+    int64_t linearUs = esp_timer_get_time() - start;
+
+    mqtt_quic_bench_report("router",
+                           "\"filters\":%lu,\"msgs\":%lu,\"trie_us_per_msg\":%.2f,"
+                           "\"linear_us_per_msg\":%.2f,\"trie_matches\":%lu,"
+                           "\"linear_matches\":%lu",
+                           (unsigned long)(2 * filterCount), (unsigned long)iterations,
+                           iterations ? (double)routerUs / iterations : 0.0,
+                           iterations ? (double)linearUs / iterations : 0.0,
+                           (unsigned long)routed, (unsigned long)linear);
+
+cleanup:
+    for (uint32_t i = 0; i < filterCount; i++) {
+        for (int k = 0; k < 2; k++) {
+            const char *f = filters[2 * i + k];
+            mqtt_quic_router_remove(f, strlen(f), router_bench_handler, &routed);
+        }
+    }
+}
+
+// Shaped like the demo telemetry, with values that vary between readings
+static size_t codec_bench_json(char *pBuffer, size_t size, size_t target) {
+    size_t n = 0;
+    uint32_t i = 0;
+
+    n += snprintf(pBuffer, size, "[");
+    while (n < target) {
+        int w = snprintf(pBuffer + n, size - n,
+                         "%s{\"device\":\"esp32-c3\",\"ts\":%lu,\"temp\":%lu.%lu,"
+                         "\"hum\":%lu,\"rssi\":-%lu,\"uptime\":%lu}",
+                         i ? "," : "", (unsigned long)(1700000000 + 10 * i),
+                         (unsigned long)(20 + i % 7), (unsigned long)(i * 3 % 10),
+                         (unsigned long)(40 + i % 13), (unsigned long)(55 + i % 11),
+                         (unsigned long)(3600 + 10 * i));
+        if (w < 0 || (size_t)w >= size - n - 1) {
+            break;
+        }
+        n += (size_t)w;
+        i++;
+    }
+    n += snprintf(pBuffer + n, size - n, "]");
+    return n;
+}
+
+void mqtt_quic_bench_codec(uint32_t iterations) {
+    // Too large for the task stack
+    static char json[MQTT_QUIC_CODEC_MAX_PAYLOAD];
+    static uint8_t encoded[MQTT_QUIC_CODEC_HEADER_SIZE + MQTT_QUIC_CODEC_MAX_PAYLOAD];
+    static uint8_t decoded[MQTT_QUIC_CODEC_MAX_PAYLOAD];
+    static const size_t targets[] = { 1, 1024, 3900 };
+
+    ESP_LOGI(TAG, "=== Codec benchmark: %lu iterations ===", (unsigned long)iterations);
+
+    for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+        size_t length = codec_bench_json(json, sizeof(json), targets[t]);
+        size_t encodedLength = 0;
+        int32_t decodedLength = 0;
+
+        int64_t start = esp_timer_get_time();
+        for (uint32_t n = 0; n < iterations; n++) {
+            encodedLength = mqtt_quic_codec_encode((const uint8_t *)json, length,
+                                                   encoded, sizeof(encoded));
+        }
+        int64_t encodeUs = esp_timer_get_time() - start;
+
+        start = esp_timer_get_time();
+        for (uint32_t n = 0; n < iterations; n++) {
+            decodedLength = mqtt_quic_codec_decode(encoded, encodedLength,
+                                                   decoded, sizeof(decoded));
+        }
+        int64_t decodeUs = esp_timer_get_time() - start;
+
+        if (encodedLength == 0 || decodedLength != (int32_t)length ||
+            memcmp(json, decoded, length) != 0) {
+            ESP_LOGE(TAG, "Codec round trip failed for %zu bytes", length);
+            continue;
+        }
+
+        double kb = (double)length * iterations / 1024.0;
+        mqtt_quic_bench_report("codec",
+                               "\"payload\":%zu,\"encoded\":%zu,\"saved_pct\":%.1f,"
+                               "\"encode_us_per_kb\":%.1f,\"decode_us_per_kb\":%.1f",
+                               length, encodedLength, 100.0 * ((double)length - encodedLength) / length,
+                               kb > 0 ? encodeUs / kb : 0.0, kb > 0 ? decodeUs / kb : 0.0);
+    }
+}
+
+void mqtt_quic_bench_netem(void) {
+    static const char *const dirs[] = { "tx", "rx" };
+    quic_netem_stats_t stats;
+
+    if (!QUIC_NETEM_ENABLE || !quic_netem_active()) {
+        return;
+    }
+
+    for (int d = QUIC_NETEM_TX; d <= QUIC_NETEM_RX; d++) {
+        quic_netem_get_stats((quic_netem_dir_t)d, &stats);
+        uint32_t queued = stats.datagrams - stats.dropped;
+        mqtt_quic_bench_report("netem",
+                               "\"dir\":\"%s\",\"datagrams\":%lu,\"dropped\":%lu,"
+                               "\"duplicated\":%lu,\"reordered\":%lu,\"overflow\":%lu,"
+                               "\"mean_delay_ms\":%.1f",
+                               dirs[d], (unsigned long)stats.datagrams,
+                               (unsigned long)stats.dropped, (unsigned long)stats.duplicated,
+                               (unsigned long)stats.reordered, (unsigned long)stats.overflow,
+                               queued > 0 ? stats.delay_us / 1000.0 / queued : 0.0);
+    }
+}
+
+void mqtt_quic_bench_stacks(void) {
+    quic_mem_stack_mark_t marks[QUIC_MEM_STACK_TASKS];
+    quic_client_stats_t stats;
+    char fields[160];
+    size_t n, len = 0;
+
+    n = quic_mem_stack_marks(marks, QUIC_MEM_STACK_TASKS);
+    for (size_t i = 0; i < n && len < sizeof(fields); i++) {
+        len += (size_t)snprintf(&fields[len], sizeof(fields) - len, "%s\"%s\":%lu",
+                                i > 0 ? "," : "", marks[i].task_name,
+                                (unsigned long)marks[i].free_bytes);
+    }
+    if (len >= sizeof(fields)) {
+        len = sizeof(fields) - 1;
+    }
+    fields[len] = '\0';
+
+    quic_client_get_stats(&stats);
+    mqtt_quic_bench_report("stacks", "\"free\":{%s},\"rx_dropped\":%lu",
+                           fields, (unsigned long)stats.rx_dropped);
+}
@@ -0,0 +1,376 @@
+#ifndef MQTT_QUIC_BENCH_H
+#define MQTT_QUIC_BENCH_H
+
+#include "core_mqtt.h"
+#include "mqtt_quic_transport.h"
+
+/**
+ * @brief Set to 1 to run the benchmarks from the demo task once MQTT is up.
+ */
+#ifndef QUIC_DEMO_RUN_BENCH
+#define QUIC_DEMO_RUN_BENCH 0
+#endif
+
+/**
+ * @brief Every result is logged as one line holding this prefix and a JSON
+ * object with a "scenario" key; pytest_quic_bench.py collects them.
+ */
+#define MQTT_QUIC_BENCH_RESULT_PREFIX "BENCH_RESULT "
+
+/**
+ * @brief Topics of the fan-out scenario. A publish of a decimal count to
+ * the control topic makes tools/mqtt_quic_server.py send that many QoS0
+ * messages to MQTT_QUIC_BENCH_FANOUT_TOPIC/<n>, of 16 bytes or of the
+ * size given after a space ("<count> <size>").
+ */
+#define MQTT_QUIC_BENCH_FANOUT_CONTROL "esp32/quic/bench/fanout/ctl"
+#define MQTT_QUIC_BENCH_FANOUT_TOPIC "esp32/quic/bench/fanout/data"
+
+/**
+ * @brief Topics of the failover scenario. A publish of a decimal count to
+ * the control topic makes tools/mqtt_quic_server.py go silent, like a
+ * crashed broker, after that many more publishes to the data topic.
+ */
+#define MQTT_QUIC_BENCH_FAILOVER_CONTROL "esp32/quic/bench/failover/ctl"
+#define MQTT_QUIC_BENCH_FAILOVER_TOPIC "esp32/quic/bench/failover/data"
+
+/**
+ * @brief Maximum number of samples of the latency scenario.
+ */
+#define MQTT_QUIC_BENCH_LATENCY_MAX 1000
+
+/**
+ * @brief Log one benchmark result line.
+ * @param pScenario Scenario name
+ * @param pFieldsFormat printf format of the remaining JSON members, without
+ *                      the enclosing braces
+ */
+void mqtt_quic_bench_report(const char *pScenario, const char *pFieldsFormat, ...);
+
+/**
+ * @brief Report connection setup phases and the datagrams and bytes sent.
+ *
+ * Logs DNS and key share generation time, and the time to the first
+ * flight and to the end of the handshake (see quic_client_stats_t),
+ * where the broker address came from and which IP version won, how
+ * the broker was authenticated, and the bytes each way up to handshake
+ * completion, which is where a raw public key saves over a certificate.
+ * Call right after MQTT_Connect, so the counts cover QUIC and MQTT setup.
+ *
+ * @param mqttConnectUs Time MQTT_Connect took to get the CONNACK
+ */
+void mqtt_quic_bench_handshake(uint32_t mqttConnectUs);
+
+/**
+ * @brief Count packets on an idle connection, with MQTT and with QUIC
+ * keepalive.
+ *
+ * First run: QUIC keep-alive off, a PINGREQ every intervalMs, as coreMQTT
+ * sends with a keepalive interval set. Second run: no MQTT traffic,
+ * ngtcp2 PINGs after intervalMs of silence. Each run lasts windowMs and
+ * logs the datagrams each way and transmit bursts, scaled to one idle
+ * hour. The keep-alive in effect before is restored afterwards.
+ *
+ * @param pContext Connected MQTT context, idle apart from this
+ * @param intervalMs Keepalive interval of both runs
+ * @param windowMs Length of each run
+ */
+void mqtt_quic_bench_keepalive(MQTTContext_t *pContext, uint32_t intervalMs, uint32_t windowMs);
+
+/**
+ * @brief Count radio and timer wakeups of a sparse workload with and
+ * without low-power TX windows.
+ *
+ * Publishes QoS0 messages at two unrelated periods, one of them to a
+ * topic the broker echoes back so delayed ACKs are due too, with QUIC
+ * keep-alive on. Runs once with tx_slack_ms 0 and once with slackMs, each
+ * for windowMs, and logs transmit bursts and timer wakeups scaled to an
+ * hour and a day. The previous slack is restored afterwards.
+ *
+ * @param pContext Connected MQTT context
+ * @param pEchoTopic Subscribed topic the broker sends publishes back on
+ * @param slackMs TX slack of the low-power run
+ * @param windowMs Length of each run
+ */
+void mqtt_quic_bench_lowpower(MQTTContext_t *pContext, const char *pEchoTopic,
+                              uint32_t slackMs, uint32_t windowMs);
+
+/**
+ * @brief Compare the flash-mapped trust store with loading it into heap.
+ *
+ * Logs the time quic_trust_open took, the issuer lookups and parses made
+ * while verifying the broker, and, for comparison, the time and heap it
+ * takes to load every certificate of the image into a wolfSSL certificate
+ * manager, as wolfSSL_CTX_load_verify_buffer would. Call after connecting
+ * with quic_client_config_t.ca_store set.
+ */
+void mqtt_quic_bench_trust_store(void);
+
+/**
+ * @brief Measure QoS1 PUBLISH to PUBACK latency one message at a time.
+ *
+ * Logs p50, p90, p99 and maximum over count samples (at most
+ * MQTT_QUIC_BENCH_LATENCY_MAX). Each publish is flushed at once, so
+ * coalescing does not add to the samples.
+ *
+ * @param pContext Connected MQTT context
+ * @param pNetworkContext Network context used by pContext
+ * @param pTopic Topic to publish to
+ * @param count Number of messages
+ */
+void mqtt_quic_bench_publish_latency(MQTTContext_t *pContext,
+                                     NetworkContext_t *pNetworkContext,
+                                     const char *pTopic,
+                                     uint32_t count);
+
+/**
+ * @brief Measure the receive rate of a burst fanned out by the server.
+ *
+ * Needs tools/mqtt_quic_server.py, see MQTT_QUIC_BENCH_FANOUT_CONTROL;
+ * other brokers send nothing and the run reports received=0.
+ *
+ * @param pContext Connected MQTT context
+ * @param pNetworkContext Network context used by pContext
+ * @param count Number of messages requested
+ */
+void mqtt_quic_bench_fanout(MQTTContext_t *pContext,
+                            NetworkContext_t *pNetworkContext,
+                            uint32_t count);
+
+/**
+ * @brief Count ACKs per MB of a bulk download with the ACK tolerance in
+ * effect and with ackTolerance.
+ *
+ * The server fans out count messages of size bytes for each run, see
+ * MQTT_QUIC_BENCH_FANOUT_CONTROL. Logs throughput and the datagrams sent
+ * per MB received; during the download those carry ACKs and flow control
+ * credit only. The previous ACK frequency is restored afterwards.
+ *
+ * @param pContext Connected MQTT context
+ * @param ackTolerance Tolerance of the second run
+ * @param count Messages per run
+ * @param size Payload bytes per message, at most what the MQTT buffer holds
+ */
+void mqtt_quic_bench_ack_frequency(MQTTContext_t *pContext, uint32_t ackTolerance,
+                                   uint32_t count, uint32_t size);
+
+/**
+ * @brief Download a fanned-out burst and log throughput with the time the
+ * I/O and the application stage were busy, per core they are pinned to.
+ *
+ * Build once with and once without -DQUIC_PIPELINE=1 to compare; the
+ * result carries "pipelined". Idle time per core is reported as well when
+ * CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS is set.
+ *
+ * @param pContext Connected MQTT context
+ * @param count Messages requested, see MQTT_QUIC_BENCH_FANOUT_CONTROL
+ * @param size Payload bytes per message
+ */
+void mqtt_quic_bench_pipeline(MQTTContext_t *pContext, uint32_t count, uint32_t size);
+
+/**
+ * @brief Log how long control packets and small publishes wait behind bulk
+ * publishes, in arrival order and with send classes.
+ *
+ * Keeps the QUIC send buffer nearly full of QoS0 publishes of bulkSize
+ * bytes while sending a small publish and a PINGREQ every 100 ms. Each run
+ * reports the PINGREQ to PINGRESP time seen by MQTT and the average time
+ * per send class from queueing a packet to its first byte going to
+ * ngtcp2. The previous mode is restored afterwards.
+ *
+ * @param pContext Connected MQTT context
+ * @param bulkSize Payload bytes per bulk publish, at most 4096
+ * @param windowMs Duration of each run
+ */
+void mqtt_quic_bench_priority(MQTTContext_t *pContext, uint32_t bulkSize, uint32_t windowMs);
+
+/**
+ * @brief Count the samples the outbound policies conflate and drop while
+ * bulk publishes keep the link busy.
+ *
+ * Publishes a sample every 20 ms on four topics with a latest-only policy
+ * and four with a deadline of ttlMs, through mqtt_quic_outbound_publish,
+ * while the QUIC send buffer is kept nearly full. Reports samples made,
+ * sent, replaced and expired once the held ones are gone.
+ *
+ * @param pContext Connected MQTT context
+ * @param ttlMs Deadline of the deadline topics
+ * @param windowMs Duration of the run
+ */
+void mqtt_quic_bench_outbound(MQTTContext_t *pContext, uint32_t ttlMs, uint32_t windowMs);
+
+/**
+ * @brief Reconnect to the broker twice, without and then with saved path
+ * state (quic_path.h), and log the time to the first kb KB each time.
+ *
+ * Runs cold, warm, and warm with the path cache read back from flash
+ * (quic_path_reload). Each run fails over to the broker MQTT is
+ * connected to with mqtt_quic_failover_standby and
+ * mqtt_quic_failover_switch, subscribes, and asks for kb fan-out
+ * messages of 1 KB. Reports the handshake, the CONNACK and the last
+ * message, all measured from the start of the reconnect, and the initial
+ * RTT the connection was seeded with. Clears the path cache first. The
+ * session stays on the new connection, and
+ * failover is set up again with pBrokers afterwards, without a standby.
+ *
+ * @param pContext Connected MQTT context
+ * @param pNetworkContext Its transport context
+ * @param pConnectInfo CONNECT sent after reconnecting
+ * @param pBrokers Brokers as given to mqtt_quic_failover_init, the one
+ *        MQTT is connected to first
+ * @param brokerCount Entries in pBrokers
+ * @param kb Fan-out messages of 1 KB to wait for
+ */
+void mqtt_quic_bench_path_cache(MQTTContext_t *pContext,
+                                NetworkContext_t *pNetworkContext,
+                                const MQTTConnectInfo_t *pConnectInfo,
+                                const ServerInfo_t *pBrokers,
+                                size_t brokerCount,
+                                uint32_t kb);
+
+/**
+ * @brief Connect three times to a server that demands address
+ * validation, first without and then with the token it sent in
+ * NEW_TOKEN, and log the handshake time and Retry count of each.
+ *
+ * The third connection reads the token back from flash first
+ * (quic_token_reload), as after a restart. All are opened as standbys
+ * and closed again, the MQTT session is not touched. Clears the token
+ * cache first.
+ *
+ * @param pContext Connected MQTT context, kept serviced meanwhile
+ * @param pServer Server that sends Retry to clients without a token
+ */
+void mqtt_quic_bench_token(MQTTContext_t *pContext, const ServerInfo_t *pServer);
+
+/**
+ * @brief Kill the broker halfway through a stream of publishes and log how
+ * long the session was without one.
+ *
+ * Needs a ready warm standby (mqtt_quic_failover_standby). Publishes QoS0
+ * messages every periodMs; the server stops answering after half of them.
+ * Reports the time from the last datagram of the old broker until the
+ * loss was detected, the switch itself (CONNECT to CONNACK on the
+ * standby), the whole outage until the next publish went out, and what
+ * keeping the standby warm cost until then. The session stays on the
+ * standby's broker afterwards.
+ *
+ * @param pContext Connected MQTT context
+ * @param pNetworkContext Its transport context
+ * @param pConnectInfo CONNECT sent to the standby's broker
+ * @param count Messages to publish
+ * @param periodMs Time between them
+ */
+void mqtt_quic_bench_failover(MQTTContext_t *pContext,
+                              NetworkContext_t *pNetworkContext,
+                              const MQTTConnectInfo_t *pConnectInfo,
+                              uint32_t count, uint32_t periodMs);
+
+/**
+ * @brief Stream QoS0 publishes of 1KB to 1MB and log throughput per size.
+ *
+ * Throughput is measured until the broker has acknowledged every stream
+ * byte, and free heap is logged around each run to show that memory use
+ * does not grow with the payload size.
+ *
+ * @param pContext Connected MQTT context
+ * @param pTopic Topic to publish to
+ */
+void mqtt_quic_bench_stream_publish(MQTTContext_t *pContext, const char *pTopic);
+
+/**
+ * @brief Measure the inbound rate of small QoS0 messages.
+ *
+ * Subscribes to pTopic, publishes count 16-byte QoS0 messages to it and
+ * runs MQTT_ProcessLoop until the broker has echoed them all back. Logs
+ * messages per second and QUIC lock acquisitions per received packet.
+ *
+ * @param pContext Connected MQTT context
+ * @param pNetworkContext Network context used by pContext
+ * @param pTopic Topic to loop messages through
+ * @param count Number of messages
+ */
+void mqtt_quic_bench_inbound_qos0(MQTTContext_t *pContext,
+                                  NetworkContext_t *pNetworkContext,
+                                  const char *pTopic,
+                                  uint32_t count);
+
+/**
+ * @brief Compare small QoS0 publishes with and without publish coalescing.
+ *
+ * Publishes a burst of 40-byte sensor readings a few milliseconds apart,
+ * once with coalescing off and once with the given settings, and logs
+ * datagrams per message and estimated radio-on time per message for each.
+ * Coalescing is left at the given settings afterwards.
+ *
+ * @param pContext Connected MQTT context
+ * @param pTopic Topic to publish to
+ * @param coalesceBytes Byte threshold for the coalescing run
+ * @param coalesceDelayMs Flush deadline for the coalescing run
+ */
+void mqtt_quic_bench_coalescing(MQTTContext_t *pContext, const char *pTopic,
+                                size_t coalesceBytes, uint32_t coalesceDelayMs);
+
+/**
+ * @brief Measure sustained QoS1 publish rate against the in-flight window.
+ *
+ * Publishes count 32-byte QoS1 messages through coreMQTT (limited to
+ * MQTT_STATE_ARRAY_MAX_COUNT in flight) and then through the pipelined
+ * publisher with windows of 16, 64 and MQTT_QUIC_INFLIGHT_MAX, and logs
+ * msgs/s, mean PUBACK latency and the QUIC smoothed RTT for each run.
+ * Run it over a delayed link to see the window/RTT trade-off.
+ *
+ * @param pContext Connected MQTT context
+ * @param pNetworkContext Network context used by pContext
+ * @param pTopic Topic to publish to
+ * @param count Number of messages per run
+ */
+void mqtt_quic_bench_qos1_pipeline(MQTTContext_t *pContext,
+                                   NetworkContext_t *pNetworkContext,
+                                   const char *pTopic,
+                                   uint32_t count);
+
+/**
+ * @brief Compare trie dispatch with linear MQTT_MatchTopic matching.
+ *
+ * Registers filterCount gateway-style filters ("gw/devNNN/+" and
+ * "gw/devNNN/cmd/#"), dispatches topics against them and logs the mean
+ * time per message for the router and for a linear scan. The filters are
+ * removed afterwards. Needs no connection.
+ *
+ * @param filterCount Number of devices, at most 128; two filters are
+ *                    registered per device
+ * @param iterations Number of topics dispatched
+ */
+void mqtt_quic_bench_router(uint32_t filterCount, uint32_t iterations);
+
+/**
+ * @brief Measure codec CPU cost against bytes saved on telemetry JSON.
+ *
+ * Encodes and decodes a single reading, a 1KB batch and a 4KB batch of
+ * readings iterations times each and logs encoded size, percentage saved
+ * and microseconds per KB for both directions. Needs no connection.
+ *
+ * @param iterations Encode/decode rounds per payload
+ */
+void mqtt_quic_bench_codec(uint32_t iterations);
+
+/**
+ * @brief Report what the impairment layer did in each direction, if it is
+ * built in and configured; see quic_netem.h.
+ */
+void mqtt_quic_bench_netem(void);
+
+/**
+ * @brief Report the lowest stack high-water mark of each task seen so far
+ * (quic_mem_stack_marks), and datagrams dropped while the packet pool
+ * was empty. Run it last, after the scenarios have worked the stacks.
+ */
+void mqtt_quic_bench_stacks(void);
+
+/**
+ * @brief Count an inbound PUBLISH; register as a route for the bench topics.
+ */
+void mqtt_quic_bench_on_publish(const MQTTPublishInfo_t *pPublishInfo, void *pUserCtx);
+
+#endif /* MQTT_QUIC_BENCH_H */
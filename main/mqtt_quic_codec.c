@@ -0,0 +1,265 @@
+#include "mqtt_quic_codec.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "MQTT_QUIC_CODEC";
+
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH (LZSS_MIN_MATCH + 15)
+
+static const char *codec_filters[MQTT_QUIC_CODEC_MAX_FILTERS];
+static size_t codec_filter_count = 0;
+
+// Last position + 1 of each 3-byte hash, 0 if none
+static uint16_t match_head[MQTT_QUIC_CODEC_HASH_SIZE];
+
+static uint8_t encode_buffer[MQTT_QUIC_CODEC_HEADER_SIZE + MQTT_QUIC_CODEC_MAX_PAYLOAD];
+static uint8_t decode_buffer[MQTT_QUIC_CODEC_MAX_PAYLOAD];
+
+static MQTTQUICCodecStats_t codec_stats;
+
+int mqtt_quic_codec_enable(const char *pFilter) {
+    if (pFilter == NULL || codec_filter_count >= MQTT_QUIC_CODEC_MAX_FILTERS) {
+        ESP_LOGE(TAG, "Cannot enable compression for %s", pFilter ? pFilter : "(null)");
+        return -1;
+    }
+
+    codec_filters[codec_filter_count++] = pFilter;
+    return 0;
+}
+
+bool mqtt_quic_codec_topic_enabled(const char *pTopic, uint16_t topicLength) {
+    for (size_t i = 0; i < codec_filter_count; i++) {
+        bool isMatch = false;
+        if (MQTT_MatchTopic(pTopic, topicLength, codec_filters[i],
+                            (uint16_t)strlen(codec_filters[i]), &isMatch) == MQTTSuccess &&
+            isMatch) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t hash3(const uint8_t *p) {
+    uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return ((v * 2654435761U) >> 16) & (MQTT_QUIC_CODEC_HASH_SIZE - 1);
+}
+
+/**
+ * @brief LZSS: a flag byte precedes every 8 items, bit set for a literal
+ * byte, clear for a 2-byte match (12-bit offset - 1, 4-bit length - 3).
+ * @return Compressed length, 0 if it would not fit in outSize
+ */
+static size_t lzss_compress(const uint8_t *in, size_t inLen, uint8_t *out, size_t outSize) {
+    size_t ip = 0, op = 0, flagPos = 0;
+    int flagBit = 8;
+
+    memset(match_head, 0, sizeof(match_head));
+
+    while (ip < inLen) {
+        size_t bestLen = 0, bestOff = 0;
+
+        if (flagBit == 8) {
+            if (op >= outSize) {
+                return 0;
+            }
+            flagPos = op++;
+            out[flagPos] = 0;
+            flagBit = 0;
+        }
+
+        if (ip + LZSS_MIN_MATCH <= inLen) {
+            uint32_t h = hash3(in + ip);
+            size_t cand = match_head[h];
+            match_head[h] = (uint16_t)(ip + 1);
+
+            if (cand != 0 && ip - (cand - 1) <= MQTT_QUIC_CODEC_MAX_PAYLOAD) {
+                size_t max = inLen - ip < LZSS_MAX_MATCH ? inLen - ip : LZSS_MAX_MATCH;
+                size_t len = 0;
+
+                cand--;
+                while (len < max && in[cand + len] == in[ip + len]) {
+                    len++;
+                }
+                if (len >= LZSS_MIN_MATCH) {
+                    bestLen = len;
+                    bestOff = ip - cand;
+                }
+            }
+        }
+
+        if (bestLen > 0) {
+            if (op + 2 > outSize) {
+                return 0;
+            }
+            uint16_t code = (uint16_t)(((bestOff - 1) << 4) | (bestLen - LZSS_MIN_MATCH));
+            out[op++] = (uint8_t)(code >> 8);
+            out[op++] = (uint8_t)code;
+
+            // Keep the match finder current across the copied bytes
+            for (size_t k = 1; k < bestLen && ip + k + LZSS_MIN_MATCH <= inLen; k++) {
+                match_head[hash3(in + ip + k)] = (uint16_t)(ip + k + 1);
+            }
+            ip += bestLen;
+        } else {
+            if (op >= outSize) {
+                return 0;
+            }
+            out[flagPos] |= (uint8_t)(1U << flagBit);
+            out[op++] = in[ip++];
+        }
+        flagBit++;
+    }
+
+    return op;
+}
+
+static int lzss_decompress(const uint8_t *in, size_t inLen, uint8_t *out, size_t outLen) {
+    size_t ip = 0, op = 0;
+
+    while (op < outLen) {
+        if (ip >= inLen) {
+            return -1;
+        }
+
+        uint8_t flags = in[ip++];
+        for (int bit = 0; bit < 8 && op < outLen; bit++) {
+            if (flags & (1U << bit)) {
+                if (ip >= inLen) {
+                    return -1;
+                }
+                out[op++] = in[ip++];
+                continue;
+            }
+
+            if (ip + 2 > inLen) {
+                return -1;
+            }
+            uint16_t code = (uint16_t)((in[ip] << 8) | in[ip + 1]);
+            size_t off = (size_t)(code >> 4) + 1;
+            size_t len = (size_t)(code & 0x0F) + LZSS_MIN_MATCH;
+            ip += 2;
+
+            if (off > op || len > outLen - op) {
+                return -1;
+            }
+            // Byte by byte: the source may overlap the destination
+            for (size_t k = 0; k < len; k++, op++) {
+                out[op] = out[op - off];
+            }
+        }
+    }
+
+    return ip == inLen ? 0 : -1;
+}
+
+size_t mqtt_quic_codec_encode(const uint8_t *pPayload, size_t length,
+                              uint8_t *pOut, size_t outSize) {
+    size_t n;
+
+    if (length > MQTT_QUIC_CODEC_MAX_PAYLOAD ||
+        outSize < MQTT_QUIC_CODEC_HEADER_SIZE + length) {
+        return 0;
+    }
+
+    pOut[0] = MQTT_QUIC_CODEC_MAGIC;
+    pOut[2] = (uint8_t)(length >> 8);
+    pOut[3] = (uint8_t)length;
+
+    // Only keep the compressed form if it is strictly smaller
+    n = length > 0 ? lzss_compress(pPayload, length, pOut + MQTT_QUIC_CODEC_HEADER_SIZE,
+                                   length - 1) : 0;
+    if (n > 0) {
+        pOut[1] = MQTT_QUIC_CODEC_LZSS;
+    } else {
+        pOut[1] = MQTT_QUIC_CODEC_STORED;
+        memcpy(pOut + MQTT_QUIC_CODEC_HEADER_SIZE, pPayload, length);
+        n = length;
+        codec_stats.stored++;
+    }
+
+    codec_stats.encoded++;
+    codec_stats.bytesIn += length;
+    codec_stats.bytesOut += MQTT_QUIC_CODEC_HEADER_SIZE + n;
+
+    return MQTT_QUIC_CODEC_HEADER_SIZE + n;
+}
+
+int32_t mqtt_quic_codec_decode(const uint8_t *pPayload, size_t length,
+                               uint8_t *pOut, size_t outSize) {
+    size_t origLen;
+    int rv = -1;
+
+    if (length >= MQTT_QUIC_CODEC_HEADER_SIZE && pPayload[0] == MQTT_QUIC_CODEC_MAGIC) {
+        const uint8_t *data = pPayload + MQTT_QUIC_CODEC_HEADER_SIZE;
+        size_t dataLen = length - MQTT_QUIC_CODEC_HEADER_SIZE;
+
+        origLen = ((size_t)pPayload[2] << 8) | pPayload[3];
+        if (origLen <= outSize) {
+            if (pPayload[1] == MQTT_QUIC_CODEC_STORED && dataLen == origLen) {
+                memcpy(pOut, data, origLen);
+                rv = 0;
+            } else if (pPayload[1] == MQTT_QUIC_CODEC_LZSS) {
+                rv = lzss_decompress(data, dataLen, pOut, origLen);
+            }
+        }
+    }
+
+    if (rv != 0) {
+        codec_stats.decodeErrors++;
+        return -1;
+    }
+
+    codec_stats.decoded++;
+    return (int32_t)origLen;
+}
+
+MQTTStatus_t mqtt_quic_codec_publish(MQTTContext_t *pContext,
+                                     const MQTTPublishInfo_t *pPublishInfo,
+                                     uint16_t packetId) {
+    MQTTPublishInfo_t encoded;
+    size_t n;
+
+    if (pPublishInfo == NULL ||
+        !mqtt_quic_codec_topic_enabled(pPublishInfo->pTopicName, pPublishInfo->topicNameLength)) {
+        return MQTT_Publish(pContext, pPublishInfo, packetId);
+    }
+
+    n = mqtt_quic_codec_encode(pPublishInfo->pPayload, pPublishInfo->payloadLength,
+                               encode_buffer, sizeof(encode_buffer));
+    if (n == 0) {
+        ESP_LOGE(TAG, "Payload of %zu bytes too large to encode", pPublishInfo->payloadLength);
+        return MQTTBadParameter;
+    }
+
+    encoded = *pPublishInfo;
+    encoded.pPayload = encode_buffer;
+    encoded.payloadLength = n;
+
+    ESP_LOGD(TAG, "Encoded %zu -> %zu bytes on %.*s", pPublishInfo->payloadLength, n,
+             pPublishInfo->topicNameLength, pPublishInfo->pTopicName);
+
+    return MQTT_Publish(pContext, &encoded, packetId);
+}
+
+int mqtt_quic_codec_receive(MQTTPublishInfo_t *pPublishInfo) {
+    if (!mqtt_quic_codec_topic_enabled(pPublishInfo->pTopicName, pPublishInfo->topicNameLength)) {
+        return 0;
+    }
+
+    int32_t n = mqtt_quic_codec_decode(pPublishInfo->pPayload, pPublishInfo->payloadLength,
+                                       decode_buffer, sizeof(decode_buffer));
+    if (n < 0) {
+        ESP_LOGW(TAG, "Malformed encoded payload on %.*s",
+                 pPublishInfo->topicNameLength, pPublishInfo->pTopicName);
+        return -1;
+    }
+
+    pPublishInfo->pPayload = decode_buffer;
+    pPublishInfo->payloadLength = (size_t)n;
+    return 0;
+}
+
+void mqtt_quic_codec_get_stats(MQTTQUICCodecStats_t *pStats) {
+    *pStats = codec_stats;
+}
@@ -0,0 +1,103 @@
+#ifndef MQTT_QUIC_CODEC_H
+#define MQTT_QUIC_CODEC_H
+
+#include "core_mqtt.h"
+
+/**
+ * @brief Largest payload the codec handles; also the LZSS window, so a
+ * match may reference any earlier byte of the payload.
+ */
+#define MQTT_QUIC_CODEC_MAX_PAYLOAD 4096
+
+/**
+ * @brief Entries in the compressor's match finder (uint16_t each).
+ */
+#define MQTT_QUIC_CODEC_HASH_SIZE 1024
+
+/**
+ * @brief Maximum number of topic filters with compression enabled.
+ */
+#define MQTT_QUIC_CODEC_MAX_FILTERS 8
+
+/**
+ * @brief Payload header on topics with compression enabled:
+ * MQTT_QUIC_CODEC_MAGIC, method, original length (big endian, 16 bits).
+ */
+#define MQTT_QUIC_CODEC_MAGIC 0x1F
+#define MQTT_QUIC_CODEC_HEADER_SIZE 4
+#define MQTT_QUIC_CODEC_STORED 0   // Payload did not compress, sent as is
+#define MQTT_QUIC_CODEC_LZSS 1
+
+typedef struct MQTTQUICCodecStats
+{
+    uint32_t encoded;       // Payloads encoded
+    uint32_t stored;        // ... of which sent uncompressed
+    uint32_t decoded;
+    uint32_t decodeErrors;
+    uint64_t bytesIn;       // Payload bytes before encoding
+    uint64_t bytesOut;      // Payload bytes after encoding, headers included
+} MQTTQUICCodecStats_t;
+
+/**
+ * @brief Enable compression for topics matching a filter.
+ *
+ * Both ends must enable the same filters: every payload on a matching
+ * topic carries the codec header, and payloads on other topics are left
+ * untouched.
+ *
+ * @param pFilter Topic filter, must stay valid
+ * @return 0 on success, -1 if the filter table is full
+ */
+int mqtt_quic_codec_enable(const char *pFilter);
+
+/**
+ * @brief Whether payloads on a topic go through the codec.
+ */
+bool mqtt_quic_codec_topic_enabled(const char *pTopic, uint16_t topicLength);
+
+/**
+ * @brief Encode a payload into a caller buffer.
+ *
+ * Uses LZSS with 12-bit offsets and 3..18 byte matches; falls back to
+ * MQTT_QUIC_CODEC_STORED when that does not make the payload smaller.
+ * The match finder is a static table, so encoding allocates nothing and
+ * must not run from two tasks at once.
+ *
+ * @param pOut Output buffer of at least MQTT_QUIC_CODEC_HEADER_SIZE + length bytes
+ * @return Encoded length, or 0 if the payload exceeds MQTT_QUIC_CODEC_MAX_PAYLOAD
+ */
+size_t mqtt_quic_codec_encode(const uint8_t *pPayload, size_t length,
+                              uint8_t *pOut, size_t outSize);
+
+/**
+ * @brief Decode an encoded payload into a caller buffer.
+ * @return Decoded length, or -1 if the payload is malformed or too large
+ */
+int32_t mqtt_quic_codec_decode(const uint8_t *pPayload, size_t length,
+                               uint8_t *pOut, size_t outSize);
+
+/**
+ * @brief MQTT_Publish with the payload encoded if the topic is enabled.
+ *
+ * Encodes into a static buffer: call from the MQTT task only.
+ *
+ * @return Status of MQTT_Publish, or MQTTBadParameter if the payload is
+ *         larger than MQTT_QUIC_CODEC_MAX_PAYLOAD on an enabled topic
+ */
+MQTTStatus_t mqtt_quic_codec_publish(MQTTContext_t *pContext,
+                                     const MQTTPublishInfo_t *pPublishInfo,
+                                     uint16_t packetId);
+
+/**
+ * @brief Decode an inbound publish in place if its topic is enabled.
+ *
+ * On success pPublishInfo->pPayload points to a static buffer valid until
+ * the next call. Call from the MQTT event callback.
+ *
+ * @return 0 if the payload is ready for the application, -1 if it is malformed
+ */
+int mqtt_quic_codec_receive(MQTTPublishInfo_t *pPublishInfo);
+
+void mqtt_quic_codec_get_stats(MQTTQUICCodecStats_t *pStats);
+
+#endif /* MQTT_QUIC_CODEC_H */
@@ -0,0 +1,148 @@
+#include "mqtt_quic_failover.h"
+#include "ngtcp2_sample.h"
+#include "esp_log.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "MQTT_QUIC_FAILOVER";
+
+// Used from the MQTT task only, no lock
+static struct {
+    const ServerInfo_t *brokers;
+    size_t count;
+    size_t active;         // Broker MQTT is connected to
+    size_t standby;        // Broker the standby goes, or would go, to
+    uint32_t retryAtMs;    // No new standby before this
+    char port[8];
+    MQTTQUICFailoverStats_t stats;
+} failover;
+
+// The broker after i, skipping the active one
+static size_t next_broker(size_t i) {
+    i = (i + 1) % failover.count;
+    if (i == failover.active) {
+        i = (i + 1) % failover.count;
+    }
+    return i;
+}
+
+void mqtt_quic_failover_init(const ServerInfo_t *pBrokers, size_t brokerCount) {
+    memset(&failover, 0, sizeof(failover));
+    failover.brokers = pBrokers;
+    failover.count = brokerCount;
+    failover.retryAtMs = mqtt_get_time_ms();
+    if (brokerCount > 1) {
+        failover.standby = next_broker(0);
+    }
+}
+
+int mqtt_quic_failover_standby(void) {
+    const ServerInfo_t *broker;
+    uint32_t now;
+
+    if (failover.count < 2) {
+        return -1;
+    }
+
+    switch (quic_client_standby_state()) {
+    case QUIC_STANDBY_CONNECTING:
+    case QUIC_STANDBY_READY:
+        return 0;
+    case QUIC_STANDBY_FAILED:
+        // Handshake failed or the broker went silent, try the next one later
+        failover.stats.standbyFailures++;
+        quic_client_standby_stop();
+        failover.standby = next_broker(failover.standby);
+        failover.retryAtMs = mqtt_get_time_ms() + MQTT_QUIC_FAILOVER_RETRY_MS;
+        break;
+    case QUIC_STANDBY_NONE:
+        break;
+    }
+
+    now = mqtt_get_time_ms();
+    if ((int32_t)(now - failover.retryAtMs) < 0) {
+        return -1;
+    }
+
+    broker = &failover.brokers[failover.standby];
+    snprintf(failover.port, sizeof(failover.port), "%u", broker->port);
+    if (quic_client_standby_start(broker->pHostName, failover.port) != 0) {
+        failover.standby = next_broker(failover.standby);
+        failover.retryAtMs = now + MQTT_QUIC_FAILOVER_RETRY_MS;
+        return -1;
+    }
+
+    failover.stats.standbyStarts++;
+    return 0;
+}
+
+MQTTStatus_t mqtt_quic_failover_switch(MQTTContext_t *pContext,
+                                       NetworkContext_t *pNetworkContext,
+                                       const MQTTConnectInfo_t *pConnectInfo,
+                                       uint32_t timeoutMs,
+                                       bool *pSessionPresent) {
+    TransportInterface_t transport;
+    MQTTGetCurrentTimeFunc_t getTime;
+    MQTTEventCallback_t appCallback;
+    MQTTFixedBuffer_t networkBuffer;
+    bool sessionPresent = false;
+    MQTTStatus_t status;
+    uint32_t start;
+
+    if (failover.count < 2 || quic_client_failover() != 0) {
+        return MQTTBadParameter;
+    }
+    start = mqtt_get_time_ms();
+
+    failover.active = failover.standby;
+    failover.standby = next_broker(failover.active);
+    mqtt_quic_transport_switch(pNetworkContext, &failover.brokers[failover.active]);
+
+    // Packet IDs and QoS state belonged to the old session
+    transport = pContext->transportInterface;
+    getTime = pContext->getTime;
+    appCallback = pContext->appCallback;
+    networkBuffer = pContext->networkBuffer;
+    status = MQTT_Init(pContext, &transport, getTime, appCallback, &networkBuffer);
+    if (status == MQTTSuccess) {
+        status = MQTT_Connect(pContext, pConnectInfo, NULL, timeoutMs, &sessionPresent);
+    }
+    if (pSessionPresent != NULL) {
+        *pSessionPresent = sessionPresent;
+    }
+
+    failover.stats.failovers++;
+    failover.stats.lastSwitchMs = mqtt_get_time_ms() - start;
+    if (status != MQTTSuccess) {
+        ESP_LOGE(TAG, "CONNECT to %s failed, error %d",
+                 failover.brokers[failover.active].pHostName, status);
+        return status;
+    }
+    ESP_LOGI(TAG, "Session moved to %s:%u in %lu ms (session present: %d)",
+             failover.brokers[failover.active].pHostName,
+             failover.brokers[failover.active].port,
+             (unsigned long)failover.stats.lastSwitchMs, sessionPresent);
+
+    // The new session has none of the old one's unacknowledged publishes
+    uint32_t lost = 0;
+    int32_t resent = mqtt_quic_transport_resend_qos1(pNetworkContext, pContext,
+                                                     timeoutMs, &lost);
+    failover.stats.lostPublishes += lost;
+    if (resent < 0) {
+        return MQTTSendFailed;
+    }
+    failover.stats.resentPublishes += (uint32_t)resent;
+    if (resent > 0 || lost > 0) {
+        ESP_LOGI(TAG, "Resent %ld unacknowledged QoS1 publishes, %lu lost",
+                 (long)resent, (unsigned long)lost);
+    }
+
+    // Cover the new broker right away
+    failover.retryAtMs = mqtt_get_time_ms();
+    mqtt_quic_failover_standby();
+    return MQTTSuccess;
+}
+
+void mqtt_quic_failover_get_stats(MQTTQUICFailoverStats_t *pStats) {
+    *pStats = failover.stats;
+}
@@ -0,0 +1,69 @@
+#ifndef MQTT_QUIC_FAILOVER_H
+#define MQTT_QUIC_FAILOVER_H
+
+#include "core_mqtt.h"
+#include "mqtt_quic_transport.h"
+
+/**
+ * @brief Wait before opening another standby after one failed.
+ */
+#define MQTT_QUIC_FAILOVER_RETRY_MS 30000
+
+typedef struct MQTTQUICFailoverStats
+{
+    uint32_t failovers;         // Sessions moved to the standby
+    uint32_t standbyStarts;     // Standby connections opened
+    uint32_t standbyFailures;   // Standbys that failed or went silent
+    uint32_t lastSwitchMs;      // Last failover, QUIC switch to CONNACK
+    uint32_t resentPublishes;   // Unacknowledged QoS1 publishes sent again
+    uint32_t lostPublishes;     // Too large to keep, see MQTT_QUIC_RESEND_MAX_PACKET
+} MQTTQUICFailoverStats_t;
+
+/**
+ * @brief Set the brokers to use, the one currently connected first.
+ *
+ * A warm standby goes to the next broker in the list; after a failover
+ * the standby's broker becomes the current one and the list is walked on
+ * from there. The array must stay valid while failover is in use.
+ */
+void mqtt_quic_failover_init(const ServerInfo_t *pBrokers, size_t brokerCount);
+
+/**
+ * @brief Keep a warm standby to another broker.
+ *
+ * Opens one if there is none and replaces one that failed, waiting
+ * MQTT_QUIC_FAILOVER_RETRY_MS between attempts. Cheap when the standby is
+ * fine; call it periodically from the MQTT task. Opening one resolves the
+ * broker, which blocks for up to QUIC_DNS_TIMEOUT_MS without a cached
+ * answer (quic_dns_resolve).
+ *
+ * @return 0 if a standby is connecting or ready, -1 otherwise
+ */
+int mqtt_quic_failover_standby(void);
+
+/**
+ * @brief Move the MQTT session to the standby after losing the broker.
+ *
+ * The standby's handshake is done, so the switch costs the CONNECT and
+ * CONNACK round trip. coreMQTT is reinitialised with its transport,
+ * callbacks and buffer. QoS1 publishes coreMQTT had not seen a PUBACK for
+ * are then sent again from the transport's copies, see
+ * mqtt_quic_transport_resend_qos1. Subscriptions only survive if the
+ * brokers share sessions (a cluster) and cleanSession is false; subscribe
+ * again otherwise. A new standby is opened afterwards.
+ *
+ * Must be called from the task that runs MQTT_ProcessLoop.
+ *
+ * @param pSessionPresent Set from the CONNACK, may be NULL
+ * @return MQTTSuccess, MQTTBadParameter without a ready standby, the
+ *         MQTT_Connect error, or MQTTSendFailed if resending failed
+ */
+MQTTStatus_t mqtt_quic_failover_switch(MQTTContext_t *pContext,
+                                       NetworkContext_t *pNetworkContext,
+                                       const MQTTConnectInfo_t *pConnectInfo,
+                                       uint32_t timeoutMs,
+                                       bool *pSessionPresent);
+
+void mqtt_quic_failover_get_stats(MQTTQUICFailoverStats_t *pStats);
+
+#endif /* MQTT_QUIC_FAILOVER_H */
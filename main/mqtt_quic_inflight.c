@@ -0,0 +1,159 @@
+#include "mqtt_quic_inflight.h"
+#include "mqtt_quic_transport.h"
+#include "ngtcp2_sample.h"
+#include "quic_mem.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "MQTT_QUIC_INFLIGHT";
+
+void mqtt_quic_inflight_init(MQTTQUICInflight_t *pInflight, uint16_t window) {
+    memset(pInflight, 0, sizeof(*pInflight));
+    pInflight->window = window > MQTT_QUIC_INFLIGHT_MAX ? MQTT_QUIC_INFLIGHT_MAX : window;
+}
+
+static MQTTQUICInflightSlot_t *inflight_slot(MQTTQUICInflight_t *pInflight, uint16_t packetId) {
+    return &pInflight->slots[packetId % MQTT_QUIC_INFLIGHT_MAX];
+}
+
+MQTTStatus_t mqtt_quic_publish_qos1_pipelined(MQTTContext_t *pContext,
+                                              MQTTQUICInflight_t *pInflight,
+                                              const MQTTPublishInfo_t *pPublishInfo,
+                                              uint16_t *pPacketId)
+{
+    size_t remainingLength = 0, packetSize = 0, headerSize = 0;
+    MQTTPublishInfo_t publishInfo;
+    MQTTFixedBuffer_t headerBuffer;
+    MQTTStatus_t status;
+    quic_pkt_buf_t *pb;
+
+    if (pContext == NULL || pInflight == NULL || pPublishInfo == NULL) {
+        ESP_LOGE(TAG, "Invalid parameters: pContext=%p, pInflight=%p, pPublishInfo=%p",
+                 pContext, pInflight, pPublishInfo);
+        return MQTTBadParameter;
+    }
+
+    // IDs come from coreMQTT's counter, so they are not used by its own
+    // publishes. The slot is still taken only if the ID
+    // MQTT_QUIC_INFLIGHT_MAX back is unacknowledged; wait for it rather
+    // than skip IDs.
+    MQTTQUICInflightSlot_t *slot = inflight_slot(pInflight, pContext->nextPacketId);
+    if (pInflight->inFlight >= pInflight->window || slot->packetId != 0) {
+        pInflight->refused++;
+        return MQTTNoMemory;
+    }
+
+    publishInfo = *pPublishInfo;
+    publishInfo.qos = MQTTQoS1;
+
+    status = MQTT_GetPublishPacketSize(&publishInfo, &remainingLength, &packetSize);
+    if (status != MQTTSuccess) {
+        ESP_LOGE(TAG, "MQTT_GetPublishPacketSize failed: %s", MQTT_Status_strerror(status));
+        return status;
+    }
+
+    // A larger one would be queued in pieces; use the stream API for it
+    if (packetSize > APP_SEND_BUFFER_SIZE) {
+        ESP_LOGE(TAG, "PUBLISH of %zu bytes exceeds the %u byte send buffer",
+                 packetSize, (unsigned)APP_SEND_BUFFER_SIZE);
+        return MQTTBadParameter;
+    }
+
+    pb = quic_pkt_buf_alloc();
+    if (pb == NULL) {
+        return MQTTNoMemory;
+    }
+
+    uint16_t packetId = MQTT_GetPacketId(pContext);
+
+    headerBuffer.pBuffer = pb->data;
+    headerBuffer.size = sizeof(pb->data);
+
+    status = MQTT_SerializePublishHeader(&publishInfo, packetId, remainingLength,
+                                         &headerBuffer, &headerSize);
+    if (status != MQTTSuccess) {
+        ESP_LOGE(TAG, "MQTT_SerializePublishHeader failed: %s", MQTT_Status_strerror(status));
+        goto end;
+    }
+
+    ngtcp2_vec datav[2] = {
+        { .base = pb->data, .len = headerSize },
+        { .base = (uint8_t *)publishInfo.pPayload, .len = publishInfo.payloadLength }
+    };
+
+    quic_send_class_t cls = headerSize + publishInfo.payloadLength > MQTT_QUIC_BULK_PUBLISH_BYTES ?
+                            QUIC_SEND_BULK : QUIC_SEND_INTERACTIVE;
+    int result = quic_client_writev_safe(datav, publishInfo.payloadLength > 0 ? 2 : 1,
+                                         QUIC_WRITE_FLAG_COALESCE | QUIC_WRITE_FLAG_CLASS(cls) |
+                                         QUIC_WRITE_FLAG_ORDER(mqtt_quic_topic_order(publishInfo.pTopicName,
+                                                                                     publishInfo.topicNameLength)));
+    if (result < 0) {
+        status = MQTTSendFailed;
+        goto end;
+    }
+
+    if ((size_t)result != headerSize + publishInfo.payloadLength) {
+        // Nothing is queued unless the whole packet fits, see
+        // quic_client_writev_safe
+        if (result != 0) {
+            ESP_LOGE(TAG, "PUBLISH of %zu bytes split on the stream", packetSize);
+            quic_client_abort_write();
+            status = MQTTSendFailed;
+        } else {
+            status = MQTTNoMemory;
+        }
+        goto end;
+    }
+
+    slot->packetId = packetId;
+    slot->sentMs = mqtt_get_time_ms();
+    pInflight->inFlight++;
+    pInflight->published++;
+    pContext->lastPacketTxTime = slot->sentMs;
+
+    if (pPacketId != NULL) {
+        *pPacketId = packetId;
+    }
+
+end:
+    quic_pkt_buf_unref(pb);
+    return status;
+}
+
+bool mqtt_quic_inflight_ack(MQTTQUICInflight_t *pInflight, uint16_t packetId) {
+    MQTTQUICInflightSlot_t *slot = inflight_slot(pInflight, packetId);
+
+    // Anything else is coreMQTT's
+    if (packetId == 0 || slot->packetId != packetId) {
+        return false;
+    }
+
+    pInflight->ackLatencySumMs += (uint32_t)(mqtt_get_time_ms() - slot->sentMs);
+    slot->packetId = 0;
+    pInflight->inFlight--;
+    pInflight->acked++;
+
+    return true;
+}
+
+void mqtt_quic_inflight_fail(MQTTQUICInflight_t *pInflight) {
+    if (pInflight->inFlight == 0) {
+        return;
+    }
+
+    ESP_LOGW(TAG, "%u pipelined publishes lost their session", pInflight->inFlight);
+    for (size_t i = 0; i < MQTT_QUIC_INFLIGHT_MAX && pInflight->inFlight > 0; i++) {
+        MQTTQUICInflightSlot_t *slot = &pInflight->slots[i];
+        uint16_t packetId = slot->packetId;
+
+        if (packetId == 0) {
+            continue;
+        }
+        slot->packetId = 0;
+        pInflight->inFlight--;
+        pInflight->lost++;
+        if (pInflight->lostCallback != NULL) {
+            pInflight->lostCallback(packetId, pInflight->pLostCallbackCtx);
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef MQTT_QUIC_INFLIGHT_H
+#define MQTT_QUIC_INFLIGHT_H
+
+#include <stdbool.h>
+#include "core_mqtt.h"
+
+/**
+ * @brief Capacity of the in-flight table; a power of two.
+ *
+ * The usable window is configured per table up to this size.
+ */
+#define MQTT_QUIC_INFLIGHT_MAX 256
+
+/**
+ * @brief Called for each publish still in flight when its session ended.
+ * @param packetId ID returned by mqtt_quic_publish_qos1_pipelined
+ * @param pCtx MQTTQUICInflight_t.pLostCallbackCtx
+ */
+typedef void (*MQTTQUICInflightLostCallback_t)(uint16_t packetId, void *pCtx);
+
+typedef struct MQTTQUICInflightSlot
+{
+    uint16_t packetId;  // 0 when free
+    uint32_t sentMs;
+} MQTTQUICInflightSlot_t;
+
+/**
+ * @brief QoS1 in-flight window indexed by packet ID.
+ *
+ * Publishing and PUBACK matching are O(1) regardless of the window size,
+ * unlike coreMQTT's state records, which are scanned linearly and capped
+ * at MQTT_STATE_ARRAY_MAX_COUNT. Not thread safe: use it from the task
+ * that runs MQTT_ProcessLoop.
+ */
+typedef struct MQTTQUICInflight
+{
+    uint16_t window;     // Maximum number of unacknowledged publishes
+    uint16_t inFlight;   // Currently unacknowledged
+    uint32_t published;  // Publishes queued on the stream
+    uint32_t acked;      // PUBACKs matched
+    uint32_t refused;    // Publishes refused because the window was full
+    uint32_t lost;       // Publishes failed by mqtt_quic_inflight_fail
+    // Told about each lost publish so it can be sent again; set after
+    // mqtt_quic_inflight_init, may be NULL
+    MQTTQUICInflightLostCallback_t lostCallback;
+    void *pLostCallbackCtx;
+    uint64_t ackLatencySumMs;
+    MQTTQUICInflightSlot_t slots[MQTT_QUIC_INFLIGHT_MAX];
+} MQTTQUICInflight_t;
+
+/**
+ * @brief Reset the table and set its window.
+ * @param pInflight Table to initialize
+ * @param window Maximum in-flight publishes, clamped to MQTT_QUIC_INFLIGHT_MAX
+ */
+void mqtt_quic_inflight_init(MQTTQUICInflight_t *pInflight, uint16_t window);
+
+/**
+ * @brief Publish a QoS1 message outside coreMQTT's state engine.
+ *
+ * The PUBLISH is serialized and queued on the QUIC stream (coalescable)
+ * and its packet ID recorded in pInflight. The PUBACK is consumed by the
+ * transport before it reaches coreMQTT, see NetworkContext_t.pInflight.
+ * pPublishInfo->qos is ignored and QoS1 is used.
+ *
+ * The packet ID comes from MQTT_GetPacketId, so it does not collide with
+ * coreMQTT's own publishes. The packet must fit APP_SEND_BUFFER_SIZE;
+ * larger payloads belong on mqtt_quic_publish_stream.
+ *
+ * Must be called from the task that runs MQTT_ProcessLoop.
+ *
+ * @param pContext Connected MQTT context
+ * @param pInflight Table registered in the transport's network context
+ * @param pPublishInfo Topic and payload
+ * @param pPacketId Receives the packet ID used, may be NULL
+ * @return MQTTSuccess; MQTTNoMemory when the window or the QUIC send
+ *         buffer is full (retry after MQTT_ProcessLoop); MQTTBadParameter
+ *         for a packet larger than the send buffer, or MQTTSendFailed
+ */
+MQTTStatus_t mqtt_quic_publish_qos1_pipelined(MQTTContext_t *pContext,
+                                              MQTTQUICInflight_t *pInflight,
+                                              const MQTTPublishInfo_t *pPublishInfo,
+                                              uint16_t *pPacketId);
+
+/**
+ * @brief Match a PUBACK against the table.
+ * @return true if the packet ID was in flight and is now released
+ */
+bool mqtt_quic_inflight_ack(MQTTQUICInflight_t *pInflight, uint16_t packetId);
+
+/**
+ * @brief Fail every publish in flight: their PUBACKs will not come.
+ *
+ * The table keeps no payloads to replay, so each one is counted as lost
+ * and reported to lostCallback. The transport calls this when a CONNACK
+ * starts a new session, after a reconnect or a failover.
+ */
+void mqtt_quic_inflight_fail(MQTTQUICInflight_t *pInflight);
+
+#endif /* MQTT_QUIC_INFLIGHT_H */
@@ -0,0 +1,634 @@
+#include "mqtt_quic_offline.h"
+#include "core_mqtt_state.h"
+#include "ngtcp2_sample.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#else
+#include <stdio.h>
+#endif
+
+static const char *TAG = "MQTT_QUIC_OFFLINE";
+
+#define RECORD_MAGIC 0x5171
+#define RECORD_BLANK 0xFFFF
+#define RECORD_ALIGN(n) (((n) + 3U) & ~(size_t)3U)
+
+// While coreMQTT's state records are full a publish is retried this often,
+// this many times, before the replay stops until the next call
+#define REPLAY_RETRY_MS 10
+#define REPLAY_RETRIES 50
+
+/**
+ * @brief On-flash record header, followed by the topic and the payload
+ * and padded to 4 bytes.
+ */
+typedef struct {
+    uint16_t magic;
+    uint8_t qos;
+    uint8_t retain;
+    uint16_t topicLength;
+    uint16_t payloadLength;
+    uint32_t seq;
+    uint32_t crc;  // CRC-32 of the header (with crc = 0), topic and payload
+} offline_record_t;
+
+static struct {
+    SemaphoreHandle_t lock;
+#ifdef ESP_PLATFORM
+    const esp_partition_t *partition;
+#else
+    FILE *file;
+#endif
+    size_t sectorCount;
+    size_t headSector;   // Sector the batch is written to
+    size_t headOffset;   // End of the records already in flash
+    size_t tailSector;   // Next record to replay
+    size_t tailOffset;
+    uint32_t nextSeq;
+    uint8_t batch[MQTT_QUIC_OFFLINE_BATCH_SIZE];
+    size_t batchLen;
+    int64_t batchStartUs;
+    MQTTQUICOfflineStats_t stats;
+} queue;
+
+// Replay runs on the MQTT task only, keep the record off its stack
+static uint8_t replay_record[MQTT_QUIC_OFFLINE_BATCH_SIZE];
+
+#ifdef ESP_PLATFORM
+
+static int storage_open(size_t *size) {
+    queue.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                               MQTT_QUIC_OFFLINE_PARTITION_SUBTYPE,
+                                               MQTT_QUIC_OFFLINE_PARTITION);
+    if (queue.partition == NULL) {
+        ESP_LOGE(TAG, "Partition %s not found", MQTT_QUIC_OFFLINE_PARTITION);
+        return -1;
+    }
+
+    *size = queue.partition->size;
+    return 0;
+}
+
+static int storage_read(size_t offset, void *dst, size_t len) {
+    return esp_partition_read(queue.partition, offset, dst, len) == ESP_OK ? 0 : -1;
+}
+
+static int storage_write(size_t offset, const void *src, size_t len) {
+    return esp_partition_write(queue.partition, offset, src, len) == ESP_OK ? 0 : -1;
+}
+
+static int storage_erase_sector(size_t sector) {
+    return esp_partition_erase_range(queue.partition,
+                                     sector * MQTT_QUIC_OFFLINE_SECTOR_SIZE,
+                                     MQTT_QUIC_OFFLINE_SECTOR_SIZE) == ESP_OK ? 0 : -1;
+}
+
+#else
+
+static int storage_erase_sector(size_t sector);
+
+static int storage_open(size_t *size) {
+    queue.file = fopen(MQTT_QUIC_OFFLINE_HOST_FILE, "r+b");
+    if (queue.file == NULL) {
+        queue.file = fopen(MQTT_QUIC_OFFLINE_HOST_FILE, "w+b");
+        if (queue.file == NULL) {
+            ESP_LOGE(TAG, "Cannot create %s", MQTT_QUIC_OFFLINE_HOST_FILE);
+            return -1;
+        }
+        // A new file starts out erased, like fresh flash
+        for (size_t s = 0; s < MQTT_QUIC_OFFLINE_HOST_SIZE / MQTT_QUIC_OFFLINE_SECTOR_SIZE; s++) {
+            if (storage_erase_sector(s) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    *size = MQTT_QUIC_OFFLINE_HOST_SIZE;
+    return 0;
+}
+
+static int storage_read(size_t offset, void *dst, size_t len) {
+    if (fseek(queue.file, (long)offset, SEEK_SET) != 0 ||
+        fread(dst, 1, len, queue.file) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+static int storage_write(size_t offset, const void *src, size_t len) {
+    if (fseek(queue.file, (long)offset, SEEK_SET) != 0 ||
+        fwrite(src, 1, len, queue.file) != len ||
+        fflush(queue.file) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int storage_erase_sector(size_t sector) {
+    uint8_t blank[256];
+
+    memset(blank, 0xFF, sizeof(blank));
+    for (size_t off = 0; off < MQTT_QUIC_OFFLINE_SECTOR_SIZE; off += sizeof(blank)) {
+        if (storage_write(sector * MQTT_QUIC_OFFLINE_SECTOR_SIZE + off, blank, sizeof(blank)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#endif /* ESP_PLATFORM */
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320U & (0U - (crc & 1U)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t record_crc(const offline_record_t *hdr, const uint8_t *data) {
+    offline_record_t h = *hdr;
+
+    h.crc = 0;
+    return crc32_update(crc32_update(0, (const uint8_t *)&h, sizeof(h)),
+                        data, (size_t)hdr->topicLength + hdr->payloadLength);
+}
+
+static size_t record_size(const offline_record_t *hdr) {
+    return RECORD_ALIGN(sizeof(*hdr) + hdr->topicLength + hdr->payloadLength);
+}
+
+static size_t sector_address(size_t sector, size_t offset) {
+    return sector * MQTT_QUIC_OFFLINE_SECTOR_SIZE + offset;
+}
+
+static size_t next_sector(size_t sector) {
+    return (sector + 1) % queue.sectorCount;
+}
+
+// Wrap-safe sequence comparison
+static bool seq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+/**
+ * @brief Read the record header at a sector offset
+ * @return 1 for a record, 0 at the end of the sector's records, -1 if corrupt
+ */
+static int read_record_header(size_t sector, size_t offset, offline_record_t *hdr) {
+    if (offset + sizeof(*hdr) > MQTT_QUIC_OFFLINE_SECTOR_SIZE) {
+        return 0;
+    }
+    if (storage_read(sector_address(sector, offset), hdr, sizeof(*hdr)) != 0) {
+        return -1;
+    }
+    if (hdr->magic == RECORD_BLANK) {
+        return 0;
+    }
+    if (hdr->magic != RECORD_MAGIC ||
+        offset + record_size(hdr) > MQTT_QUIC_OFFLINE_SECTOR_SIZE) {
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Walk the record headers of a sector from an offset
+ * @param end Receives the offset after the last record
+ * @param lastSeq Receives the sequence number of the last record, if any
+ * @return Number of records, negative (-1 - count) if the walk stopped at a
+ *         corrupt header, e.g. one torn by power loss
+ */
+static int sector_scan(size_t sector, size_t start, size_t *end, uint32_t *lastSeq) {
+    offline_record_t hdr;
+    size_t offset = start;
+    int count = 0;
+    int rv;
+
+    while ((rv = read_record_header(sector, offset, &hdr)) == 1) {
+        *lastSeq = hdr.seq;
+        offset += record_size(&hdr);
+        count++;
+    }
+
+    *end = offset;
+    return rv < 0 ? -1 - count : count;
+}
+
+static bool sector_is_blank(size_t sector) {
+    uint32_t words[16];
+
+    for (size_t off = 0; off < MQTT_QUIC_OFFLINE_SECTOR_SIZE; off += sizeof(words)) {
+        if (storage_read(sector_address(sector, off), words, sizeof(words)) != 0) {
+            return false;
+        }
+        for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+            if (words[i] != 0xFFFFFFFFU) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static int erase_sector(size_t sector) {
+    if (storage_erase_sector(sector) != 0) {
+        ESP_LOGE(TAG, "Erasing sector %zu failed", sector);
+        return -1;
+    }
+    queue.stats.sectorErases++;
+    return 0;
+}
+
+// Write the RAM batch behind the records already in the head sector
+static int flush_batch(void) {
+    if (queue.batchLen == 0) {
+        return 0;
+    }
+
+    if (storage_write(sector_address(queue.headSector, queue.headOffset),
+                      queue.batch, queue.batchLen) != 0) {
+        ESP_LOGE(TAG, "Writing %zu bytes to sector %zu failed", queue.batchLen, queue.headSector);
+        return -1;
+    }
+
+    queue.headOffset += queue.batchLen;
+    queue.batchLen = 0;
+    queue.stats.flashWrites++;
+    return 0;
+}
+
+// Move the head to the next sector, dropping the oldest one when full
+static int advance_head(void) {
+    size_t next = next_sector(queue.headSector);
+
+    if (next == queue.tailSector) {
+        size_t end;
+        uint32_t seq;
+        int n = sector_scan(queue.tailSector, queue.tailOffset, &end, &seq);
+        uint32_t dropped = (uint32_t)(n < 0 ? -1 - n : n);
+
+        ESP_LOGW(TAG, "Queue full, dropping %lu oldest records", (unsigned long)dropped);
+        queue.stats.dropped += dropped;
+        queue.stats.pending -= dropped;
+        queue.tailSector = next_sector(queue.tailSector);
+        queue.tailOffset = 0;
+    }
+
+    // Sectors are normally erased once replayed, so this only erases
+    // after a drop or a torn write
+    if (!sector_is_blank(next) && erase_sector(next) != 0) {
+        return -1;
+    }
+
+    queue.headSector = next;
+    queue.headOffset = 0;
+    return 0;
+}
+
+int mqtt_quic_offline_init(void) {
+    size_t size;
+    bool found = false;
+    uint32_t minSeq = 0, maxSeq = 0;
+
+    if (queue.lock == NULL) {
+        queue.lock = xSemaphoreCreateMutex();
+        if (queue.lock == NULL) {
+            ESP_LOGE(TAG, "Failed to create queue mutex");
+            return -1;
+        }
+    }
+
+    xSemaphoreTake(queue.lock, portMAX_DELAY);
+
+    if (storage_open(&size) != 0) {
+        xSemaphoreGive(queue.lock);
+        return -1;
+    }
+
+    queue.sectorCount = size / MQTT_QUIC_OFFLINE_SECTOR_SIZE;
+    queue.batchLen = 0;
+    memset(&queue.stats, 0, sizeof(queue.stats));
+
+    if (queue.sectorCount < 2) {
+        ESP_LOGE(TAG, "Partition too small: %zu bytes", size);
+        xSemaphoreGive(queue.lock);
+        return -1;
+    }
+
+    // The oldest and newest sectors are those whose first record has the
+    // lowest and highest sequence number
+    for (size_t s = 0; s < queue.sectorCount; s++) {
+        offline_record_t hdr;
+        if (read_record_header(s, 0, &hdr) != 1) {
+            continue;
+        }
+        if (!found || seq_before(hdr.seq, minSeq)) {
+            minSeq = hdr.seq;
+            queue.tailSector = s;
+        }
+        if (!found || seq_before(maxSeq, hdr.seq)) {
+            maxSeq = hdr.seq;
+            queue.headSector = s;
+        }
+        found = true;
+    }
+
+    int rv = 0;
+    if (!found) {
+        queue.headSector = queue.tailSector = 0;
+        queue.headOffset = queue.tailOffset = 0;
+        queue.nextSeq = 1;
+        if (!sector_is_blank(0)) {
+            rv = erase_sector(0);
+        }
+    } else {
+        size_t s = queue.tailSector, end = 0;
+        uint32_t lastSeq = maxSeq;
+        int n;
+
+        queue.tailOffset = 0;
+        for (;;) {
+            n = sector_scan(s, 0, &end, &lastSeq);
+            queue.stats.pending += (uint32_t)(n < 0 ? -1 - n : n);
+            if (s == queue.headSector) {
+                break;
+            }
+            s = next_sector(s);
+        }
+
+        queue.headOffset = end;
+        queue.nextSeq = lastSeq + 1;
+        // Never write behind a torn record, start the next sector instead.
+        // Replay stops at the torn header and erases the old head then.
+        if (n < 0) {
+            rv = advance_head();
+        }
+    }
+
+    ESP_LOGI(TAG, "Offline queue: %zu sectors, %lu records pending (sectors %zu..%zu)",
+             queue.sectorCount, (unsigned long)queue.stats.pending,
+             queue.tailSector, queue.headSector);
+
+    xSemaphoreGive(queue.lock);
+    return rv;
+}
+
+int mqtt_quic_offline_enqueue(const MQTTPublishInfo_t *pPublishInfo) {
+    offline_record_t hdr;
+    size_t size;
+    int rv = 0;
+
+    if (pPublishInfo == NULL || queue.lock == NULL) {
+        return -1;
+    }
+
+    size = RECORD_ALIGN(sizeof(hdr) + pPublishInfo->topicNameLength + pPublishInfo->payloadLength);
+    if (size > MQTT_QUIC_OFFLINE_BATCH_SIZE) {
+        ESP_LOGE(TAG, "Publish of %zu bytes too large to queue", size);
+        return -1;
+    }
+
+    xSemaphoreTake(queue.lock, portMAX_DELAY);
+
+    if (queue.headOffset + queue.batchLen + size > MQTT_QUIC_OFFLINE_SECTOR_SIZE) {
+        if (flush_batch() != 0 || advance_head() != 0) {
+            rv = -1;
+            goto end;
+        }
+    } else if (queue.batchLen + size > sizeof(queue.batch)) {
+        if (flush_batch() != 0) {
+            rv = -1;
+            goto end;
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RECORD_MAGIC;
+    hdr.qos = (uint8_t)pPublishInfo->qos;
+    hdr.retain = pPublishInfo->retain ? 1 : 0;
+    hdr.topicLength = pPublishInfo->topicNameLength;
+    hdr.payloadLength = (uint16_t)pPublishInfo->payloadLength;
+    hdr.seq = queue.nextSeq;
+
+    uint8_t *record = queue.batch + queue.batchLen;
+    uint8_t *data = record + sizeof(hdr);
+    memcpy(data, pPublishInfo->pTopicName, hdr.topicLength);
+    memcpy(data + hdr.topicLength, pPublishInfo->pPayload, hdr.payloadLength);
+    memset(data + hdr.topicLength + hdr.payloadLength, 0xFF,
+           size - sizeof(hdr) - hdr.topicLength - hdr.payloadLength);
+    hdr.crc = record_crc(&hdr, data);
+    memcpy(record, &hdr, sizeof(hdr));
+
+    if (queue.batchLen == 0) {
+        queue.batchStartUs = esp_timer_get_time();
+    }
+    queue.batchLen += size;
+    queue.nextSeq++;
+    queue.stats.pending++;
+    queue.stats.enqueued++;
+
+    if (esp_timer_get_time() - queue.batchStartUs >= (int64_t)MQTT_QUIC_OFFLINE_SYNC_MS * 1000) {
+        rv = flush_batch();
+    }
+
+end:
+    xSemaphoreGive(queue.lock);
+    return rv;
+}
+
+int mqtt_quic_offline_sync(void) {
+    int rv;
+
+    if (queue.lock == NULL) {
+        return -1;
+    }
+
+    xSemaphoreTake(queue.lock, portMAX_DELAY);
+    rv = flush_batch();
+    xSemaphoreGive(queue.lock);
+
+    return rv;
+}
+
+// Wait until everything published so far is acknowledged
+static int wait_delivered(MQTTContext_t *pContext, int64_t deadline) {
+    quic_client_flush_safe();
+
+    for (;;) {
+        MQTTStateCursor_t cursor = MQTT_STATE_CURSOR_INITIALIZER;
+
+        if (quic_client_unacked_bytes() == 0 &&
+            MQTT_PublishToResend(pContext, &cursor) == MQTT_PACKET_ID_INVALID) {
+            return 0;
+        }
+        if (!quic_client_is_connected() || esp_timer_get_time() > deadline) {
+            return -1;
+        }
+        MQTT_ProcessLoop(pContext);
+        vTaskDelay(1);
+    }
+}
+
+static MQTTStatus_t replay_publish(MQTTContext_t *pContext, const MQTTPublishInfo_t *pPublishInfo,
+                                   int64_t deadline) {
+    for (int attempt = 0; ; attempt++) {
+        uint16_t packetId = pPublishInfo->qos == MQTTQoS0 ? 0 : MQTT_GetPacketId(pContext);
+        MQTTStatus_t status = MQTT_Publish(pContext, pPublishInfo, packetId);
+
+        if (status != MQTTNoMemory || attempt == REPLAY_RETRIES ||
+            esp_timer_get_time() > deadline) {
+            return status;
+        }
+        // coreMQTT's QoS1 state records are full, wait for PUBACKs
+        status = MQTT_ProcessLoop(pContext);
+        if (status != MQTTSuccess && status != MQTTNeedMoreBytes) {
+            return status;
+        }
+        vTaskDelay(pdMS_TO_TICKS(REPLAY_RETRY_MS));
+    }
+}
+
+int32_t mqtt_quic_offline_replay(MQTTContext_t *pContext,
+                                 uint32_t maxRecords,
+                                 uint32_t timeoutMs) {
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeoutMs * 1000;
+    int32_t replayed = 0;
+
+    if (pContext == NULL || mqtt_quic_offline_sync() != 0) {
+        return -1;
+    }
+
+    while ((uint32_t)replayed < maxRecords && esp_timer_get_time() <= deadline) {
+        offline_record_t hdr;
+        size_t sector, offset;
+        int rv;
+
+        xSemaphoreTake(queue.lock, portMAX_DELAY);
+        sector = queue.tailSector;
+        offset = queue.tailOffset;
+
+        if (sector == queue.headSector && offset >= queue.headOffset) {
+            xSemaphoreGive(queue.lock);
+            break;
+        }
+
+        rv = read_record_header(sector, offset, &hdr);
+        if (rv != 1) {
+            xSemaphoreGive(queue.lock);
+
+            // End of an older sector: erase it once its publishes are in
+            if (wait_delivered(pContext, deadline) != 0) {
+                return replayed;
+            }
+
+            xSemaphoreTake(queue.lock, portMAX_DELAY);
+            bool atHead = sector == queue.headSector;
+            if (queue.tailSector == sector) {
+                if (rv < 0) {
+                    ESP_LOGW(TAG, "Corrupt record in sector %zu at %zu, skipping the rest",
+                             sector, offset);
+                }
+                erase_sector(sector);
+                if (atHead) {
+                    // Nothing follows the head, start it over empty
+                    queue.headOffset = 0;
+                    queue.tailOffset = 0;
+                } else {
+                    queue.tailSector = next_sector(sector);
+                    queue.tailOffset = 0;
+                }
+            }
+            xSemaphoreGive(queue.lock);
+            if (atHead) {
+                break;
+            }
+            continue;
+        }
+
+        size_t size = record_size(&hdr);
+        bool valid = storage_read(sector_address(sector, offset), replay_record, size) == 0 &&
+                     record_crc(&hdr, replay_record + sizeof(hdr)) == hdr.crc;
+        xSemaphoreGive(queue.lock);
+
+        if (valid) {
+            MQTTPublishInfo_t publishInfo;
+
+            memset(&publishInfo, 0, sizeof(publishInfo));
+            publishInfo.qos = (MQTTQoS_t)hdr.qos;
+            publishInfo.retain = hdr.retain != 0;
+            publishInfo.pTopicName = (const char *)replay_record + sizeof(hdr);
+            publishInfo.topicNameLength = hdr.topicLength;
+            publishInfo.pPayload = replay_record + sizeof(hdr) + hdr.topicLength;
+            publishInfo.payloadLength = hdr.payloadLength;
+
+            MQTTStatus_t status = replay_publish(pContext, &publishInfo, deadline);
+            if (status == MQTTNoMemory) {
+                // The record stays first in the queue for the next call
+                ESP_LOGW(TAG, "No PUBACKs coming in, pausing the replay at record %lu",
+                         (unsigned long)hdr.seq);
+                return replayed;
+            }
+            if (status != MQTTSuccess) {
+                ESP_LOGE(TAG, "Replaying record %lu failed: %s",
+                         (unsigned long)hdr.seq, MQTT_Status_strerror(status));
+                return replayed > 0 ? replayed : -1;
+            }
+            replayed++;
+        } else {
+            ESP_LOGW(TAG, "Dropping record %lu with bad CRC", (unsigned long)hdr.seq);
+        }
+
+        xSemaphoreTake(queue.lock, portMAX_DELAY);
+        // Unless an enqueue dropped this sector in the meantime
+        if (queue.tailSector == sector && queue.tailOffset == offset) {
+            queue.tailOffset += size;
+            queue.stats.pending--;
+            if (valid) {
+                queue.stats.replayed++;
+            }
+        }
+        xSemaphoreGive(queue.lock);
+    }
+
+    if (replayed == 0 || wait_delivered(pContext, deadline) != 0) {
+        return replayed;
+    }
+
+    // Drained: erase the head sector too, so the replayed records are not
+    // sent again after a reboot
+    xSemaphoreTake(queue.lock, portMAX_DELAY);
+    if (queue.tailSector == queue.headSector && queue.tailOffset == queue.headOffset &&
+        queue.batchLen == 0 && queue.headOffset > 0) {
+        if (erase_sector(queue.headSector) == 0) {
+            queue.headOffset = 0;
+            queue.tailOffset = 0;
+        }
+    }
+    xSemaphoreGive(queue.lock);
+
+    ESP_LOGI(TAG, "Replayed %ld records, %lu pending", (long)replayed,
+             (unsigned long)queue.stats.pending);
+
+    return replayed;
+}
+
+void mqtt_quic_offline_get_stats(MQTTQUICOfflineStats_t *pStats) {
+    if (queue.lock != NULL) {
+        xSemaphoreTake(queue.lock, portMAX_DELAY);
+    }
+    *pStats = queue.stats;
+    if (queue.lock != NULL) {
+        xSemaphoreGive(queue.lock);
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef MQTT_QUIC_OFFLINE_H
+#define MQTT_QUIC_OFFLINE_H
+
+#include "core_mqtt.h"
+
+/**
+ * @brief Data partition holding the queue (see partitions.csv).
+ */
+#define MQTT_QUIC_OFFLINE_PARTITION "mqttq"
+#define MQTT_QUIC_OFFLINE_PARTITION_SUBTYPE 0x40
+
+/**
+ * @brief Backing file and its size when built without ESP_PLATFORM.
+ */
+#define MQTT_QUIC_OFFLINE_HOST_FILE "mqtt_quic_offline.bin"
+#define MQTT_QUIC_OFFLINE_HOST_SIZE (192 * 1024)
+
+/**
+ * @brief Flash erase unit. Records never span sectors and a sector is
+ * erased only once all of its records are replayed or dropped.
+ */
+#define MQTT_QUIC_OFFLINE_SECTOR_SIZE 4096
+
+/**
+ * @brief RAM batch written to flash in one go; also the largest record
+ * (16-byte header, topic and payload).
+ */
+#define MQTT_QUIC_OFFLINE_BATCH_SIZE 1024
+
+/**
+ * @brief Longest time a record waits in the RAM batch before an enqueue
+ * writes the batch out. Records still in RAM are lost on power loss.
+ */
+#define MQTT_QUIC_OFFLINE_SYNC_MS 5000
+
+typedef struct MQTTQUICOfflineStats
+{
+    uint32_t pending;       // Records waiting to be replayed
+    uint32_t enqueued;
+    uint32_t replayed;
+    uint32_t dropped;       // Oldest records discarded while the queue was full
+    uint32_t flashWrites;   // Batches written to flash
+    uint32_t sectorErases;
+} MQTTQUICOfflineStats_t;
+
+/**
+ * @brief Open the queue and recover its state from flash.
+ *
+ * The queue is a circular log of sectors. Records carry a sequence number
+ * and a CRC; the oldest and newest sectors are found from the first record
+ * of each, so no separate index is written.
+ *
+ * @return 0 on success, -1 if the partition is missing or unreadable
+ */
+int mqtt_quic_offline_init(void);
+
+/**
+ * @brief Append a publish to the queue. Safe to call from any task.
+ *
+ * The record goes to a RAM batch that is written to flash when it fills,
+ * when the next record does not fit the current sector, after
+ * MQTT_QUIC_OFFLINE_SYNC_MS or on mqtt_quic_offline_sync. When the queue
+ * is full the oldest sector is dropped.
+ *
+ * @return 0 on success, -1 on error or if the record is too large
+ */
+int mqtt_quic_offline_enqueue(const MQTTPublishInfo_t *pPublishInfo);
+
+/**
+ * @brief Write the RAM batch to flash.
+ * @return 0 on success, -1 on error
+ */
+int mqtt_quic_offline_sync(void);
+
+/**
+ * @brief Publish queued records, oldest first.
+ *
+ * Records are published back to back with MQTT_Publish so that the
+ * transport coalesces them into full QUIC packets. A sector is erased
+ * once its publishes are acknowledged by QUIC and, for QoS1, by PUBACK.
+ * Delivery is at least once: records of a partly replayed sector are
+ * sent again after a reboot.
+ * While coreMQTT has no free state record for a QoS1 publish the call
+ * waits for PUBACKs a bounded time, then returns; the next call resumes
+ * at the same record.
+ *
+ * Must be called from the task that runs MQTT_ProcessLoop.
+ *
+ * @param pContext Connected MQTT context
+ * @param maxRecords Maximum number of records to publish in this call
+ * @param timeoutMs Maximum time spent in this call
+ * @return Number of records published, or -1 on error
+ */
+int32_t mqtt_quic_offline_replay(MQTTContext_t *pContext,
+                                 uint32_t maxRecords,
+                                 uint32_t timeoutMs);
+
+void mqtt_quic_offline_get_stats(MQTTQUICOfflineStats_t *pStats);
+
+#endif /* MQTT_QUIC_OFFLINE_H */
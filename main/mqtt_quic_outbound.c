@@ -0,0 +1,179 @@
+#include "mqtt_quic_outbound.h"
+#include "mqtt_quic_transport.h"
+#include "ngtcp2_sample.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "MQTT_QUIC_OUTBOUND";
+
+typedef struct {
+    const char *filter;
+    bool latestOnly;
+    uint32_t ttlMs;
+} outbound_policy_t;
+
+typedef struct {
+    char topic[MQTT_QUIC_OUTBOUND_MAX_TOPIC];
+    uint8_t payload[MQTT_QUIC_OUTBOUND_MAX_PAYLOAD];
+    uint16_t topicLength;
+    uint16_t payloadLength;
+    MQTTQoS_t qos;
+    bool retain;
+    const outbound_policy_t *policy;
+    uint32_t deadlineMs;
+} outbound_entry_t;
+
+// Used from the MQTT task only, no lock
+static outbound_policy_t outbound_policies[MQTT_QUIC_OUTBOUND_MAX_POLICIES];
+static size_t outbound_policy_count = 0;
+
+// Held publishes, oldest first
+static outbound_entry_t outbound_queue[MQTT_QUIC_OUTBOUND_MAX_PENDING];
+static size_t outbound_queue_len = 0;
+
+static MQTTQUICOutboundStats_t outbound_stats;
+
+int mqtt_quic_outbound_set_policy(const char *pFilter, bool latestOnly, uint32_t ttlMs) {
+    if (pFilter == NULL || outbound_policy_count >= MQTT_QUIC_OUTBOUND_MAX_POLICIES) {
+        ESP_LOGE(TAG, "Cannot set an outbound policy for %s", pFilter ? pFilter : "(null)");
+        return -1;
+    }
+
+    outbound_policies[outbound_policy_count].filter = pFilter;
+    outbound_policies[outbound_policy_count].latestOnly = latestOnly;
+    outbound_policies[outbound_policy_count].ttlMs = ttlMs;
+    outbound_policy_count++;
+    return 0;
+}
+
+static const outbound_policy_t *find_policy(const char *pTopic, uint16_t topicLength) {
+    for (size_t i = 0; i < outbound_policy_count; i++) {
+        bool isMatch = false;
+        if (MQTT_MatchTopic(pTopic, topicLength, outbound_policies[i].filter,
+                            (uint16_t)strlen(outbound_policies[i].filter), &isMatch) == MQTTSuccess &&
+            isMatch) {
+            return &outbound_policies[i];
+        }
+    }
+    return NULL;
+}
+
+static void remove_entry(size_t i) {
+    outbound_queue_len--;
+    memmove(&outbound_queue[i], &outbound_queue[i + 1],
+            (outbound_queue_len - i) * sizeof(outbound_queue[0]));
+}
+
+MQTTStatus_t mqtt_quic_outbound_publish(MQTTContext_t *pContext,
+                                        const MQTTPublishInfo_t *pPublishInfo) {
+    const outbound_policy_t *policy;
+    outbound_entry_t *entry = NULL;
+
+    policy = find_policy(pPublishInfo->pTopicName, pPublishInfo->topicNameLength);
+    if (policy == NULL) {
+        return MQTT_Publish(pContext, pPublishInfo,
+                            pPublishInfo->qos == MQTTQoS0 ? 0 : MQTT_GetPacketId(pContext));
+    }
+
+    if (pPublishInfo->topicNameLength > MQTT_QUIC_OUTBOUND_MAX_TOPIC ||
+        pPublishInfo->payloadLength > MQTT_QUIC_OUTBOUND_MAX_PAYLOAD) {
+        ESP_LOGE(TAG, "Publish on %.*s too large to hold",
+                 pPublishInfo->topicNameLength, pPublishInfo->pTopicName);
+        return MQTTBadParameter;
+    }
+
+    if (policy->latestOnly) {
+        for (size_t i = 0; i < outbound_queue_len; i++) {
+            if (outbound_queue[i].topicLength == pPublishInfo->topicNameLength &&
+                memcmp(outbound_queue[i].topic, pPublishInfo->pTopicName,
+                       pPublishInfo->topicNameLength) == 0) {
+                entry = &outbound_queue[i];
+                outbound_stats.conflated++;
+                break;
+            }
+        }
+    }
+
+    if (entry == NULL) {
+        if (outbound_queue_len == MQTT_QUIC_OUTBOUND_MAX_PENDING) {
+            remove_entry(0);
+            outbound_stats.overflows++;
+        }
+        entry = &outbound_queue[outbound_queue_len++];
+        memcpy(entry->topic, pPublishInfo->pTopicName, pPublishInfo->topicNameLength);
+        entry->topicLength = pPublishInfo->topicNameLength;
+        entry->policy = policy;
+    }
+
+    memcpy(entry->payload, pPublishInfo->pPayload, pPublishInfo->payloadLength);
+    entry->payloadLength = (uint16_t)pPublishInfo->payloadLength;
+    entry->qos = pPublishInfo->qos;
+    entry->retain = pPublishInfo->retain;
+    entry->deadlineMs = mqtt_get_time_ms() + policy->ttlMs;
+
+    // It is held now, whatever the flush does: a failed MQTT_Publish,
+    // of this one or an older one, leaves it held for the next flush.
+    // Reporting it would make the caller queue the publish a second time.
+    if (mqtt_quic_outbound_flush(pContext) < 0) {
+        ESP_LOGW(TAG, "Publish on %.*s held until sending works again",
+                 pPublishInfo->topicNameLength, pPublishInfo->pTopicName);
+    }
+    return MQTTSuccess;
+}
+
+int32_t mqtt_quic_outbound_flush(MQTTContext_t *pContext) {
+    MQTTPublishInfo_t publishInfo;
+    quic_send_credit_t credit;
+    size_t remainingLength, packetSize;
+    uint32_t now = mqtt_get_time_ms();
+    int32_t sent = 0;
+    bool blocked = false;
+    size_t i = 0;
+
+    while (i < outbound_queue_len) {
+        outbound_entry_t *entry = &outbound_queue[i];
+
+        if (entry->policy->ttlMs > 0 && (int32_t)(now - entry->deadlineMs) > 0) {
+            remove_entry(i);
+            outbound_stats.dropped++;
+            continue;
+        }
+        if (blocked) {
+            // Newer ones do not overtake it, only expire
+            i++;
+            continue;
+        }
+
+        memset(&publishInfo, 0, sizeof(publishInfo));
+        publishInfo.qos = entry->qos;
+        publishInfo.retain = entry->retain;
+        publishInfo.pTopicName = entry->topic;
+        publishInfo.topicNameLength = entry->topicLength;
+        publishInfo.pPayload = entry->payload;
+        publishInfo.payloadLength = entry->payloadLength;
+
+        // Anything that would wait in the QUIC send buffer waits here instead
+        if (MQTT_GetPublishPacketSize(&publishInfo, &remainingLength, &packetSize) != MQTTSuccess ||
+            quic_client_get_send_credit(&credit) != 0 || credit.send_now < packetSize) {
+            blocked = true;
+            i++;
+            continue;
+        }
+
+        if (MQTT_Publish(pContext, &publishInfo,
+                         entry->qos == MQTTQoS0 ? 0 : MQTT_GetPacketId(pContext)) != MQTTSuccess) {
+            ESP_LOGE(TAG, "Failed to publish on %.*s", entry->topicLength, entry->topic);
+            return -1;
+        }
+        remove_entry(i);
+        outbound_stats.sent++;
+        sent++;
+    }
+
+    return sent;
+}
+
+void mqtt_quic_outbound_get_stats(MQTTQUICOutboundStats_t *pStats) {
+    *pStats = outbound_stats;
+    pStats->pending = (uint32_t)outbound_queue_len;
+}
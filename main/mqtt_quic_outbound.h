@@ -0,0 +1,79 @@
+#ifndef MQTT_QUIC_OUTBOUND_H
+#define MQTT_QUIC_OUTBOUND_H
+
+#include "core_mqtt.h"
+
+/**
+ * @brief Maximum number of topic filters with an outbound policy.
+ */
+#define MQTT_QUIC_OUTBOUND_MAX_POLICIES 8
+
+/**
+ * @brief Publishes held until the connection can send them. When all are
+ * taken the oldest is discarded for a new one.
+ */
+#define MQTT_QUIC_OUTBOUND_MAX_PENDING 8
+
+/**
+ * @brief Largest topic and payload of a held publish.
+ */
+#define MQTT_QUIC_OUTBOUND_MAX_TOPIC 64
+#define MQTT_QUIC_OUTBOUND_MAX_PAYLOAD 256
+
+typedef struct MQTTQUICOutboundStats
+{
+    uint32_t pending;       // Publishes held now
+    uint32_t sent;          // Held publishes handed to MQTT_Publish
+    uint32_t conflated;     // Replaced by a newer one on the same topic
+    uint32_t dropped;       // Not sent before their deadline
+    uint32_t overflows;     // Discarded to make room for a newer one
+} MQTTQUICOutboundStats_t;
+
+/**
+ * @brief Hold publishes on topics matching a filter until the connection
+ * can send them at once, see mqtt_quic_outbound_publish.
+ *
+ * With latestOnly a newer publish on the same topic replaces the held one,
+ * keeping its place in the queue. With ttlMs a publish still held that
+ * long after mqtt_quic_outbound_publish is discarded. Both may be set. A
+ * topic takes the policy of the first filter it matches.
+ *
+ * @param pFilter Topic filter, must stay valid
+ * @param ttlMs Deadline of each publish, 0 for none
+ * @return 0 on success, -1 if the policy table is full
+ */
+int mqtt_quic_outbound_set_policy(const char *pFilter, bool latestOnly, uint32_t ttlMs);
+
+/**
+ * @brief Publish through the outbound policies.
+ *
+ * Topics without a policy go straight to MQTT_Publish. Others are copied
+ * and queued, then mqtt_quic_outbound_flush runs. The packet ID of a held
+ * QoS1 publish is taken when it is sent.
+ *
+ * Must be called from the task that runs MQTT_ProcessLoop.
+ *
+ * @return MQTTSuccess once sent or held, MQTTBadParameter if the topic or
+ *         payload is too large to hold, or the MQTT_Publish status for a
+ *         topic without a policy. A held publish counts as accepted even
+ *         when sending held ones fails; it stays held for the next flush.
+ */
+MQTTStatus_t mqtt_quic_outbound_publish(MQTTContext_t *pContext,
+                                        const MQTTPublishInfo_t *pPublishInfo);
+
+/**
+ * @brief Send held publishes, oldest first, while the connection can take
+ * them without queueing, and discard those past their deadline.
+ *
+ * A publish is only handed to QUIC when quic_client_get_send_credit says
+ * it leaves at once, so publishes wait here, where they can still be
+ * replaced, rather than in the QUIC send buffer. Call it periodically, or
+ * when the send credit callback fires, from the MQTT task.
+ *
+ * @return Number of publishes sent, or -1 if MQTT_Publish failed
+ */
+int32_t mqtt_quic_outbound_flush(MQTTContext_t *pContext);
+
+void mqtt_quic_outbound_get_stats(MQTTQUICOutboundStats_t *pStats);
+
+#endif /* MQTT_QUIC_OUTBOUND_H */
@@ -0,0 +1,258 @@
+#include "mqtt_quic_router.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "MQTT_QUIC_ROUTER";
+
+// Index 0 means "none" for both pools: node 0 is the root, which is
+// never a child, and route 0 is left unused.
+typedef struct {
+    uint16_t next;        // Next node in the same edge bucket
+    uint16_t parent;
+    uint16_t plusChild;   // Child for the '+' level
+    uint16_t routes;      // Routes of filters ending at this level
+    uint16_t hashRoutes;  // Routes of filters ending in "<this level>/#"
+    uint16_t label;       // Level name, offset into label_pool
+    uint8_t labelLength;
+} router_node_t;
+
+typedef struct {
+    MQTTQUICRouteHandler_t handler;
+    void *pUserCtx;
+    uint16_t next;
+} router_route_t;
+
+static router_node_t nodes[MQTT_QUIC_ROUTER_MAX_NODES];
+static router_route_t routes[MQTT_QUIC_ROUTER_MAX_ROUTES + 1];
+static char label_pool[MQTT_QUIC_ROUTER_LABEL_POOL];
+static uint16_t edge_buckets[MQTT_QUIC_ROUTER_EDGE_BUCKETS];
+static uint16_t node_count = 1;
+static uint16_t route_free = 0;
+static uint16_t route_count = 1;
+static size_t label_used = 0;
+
+static uint16_t edge_bucket(uint16_t parent, const char *label, size_t len) {
+    uint32_t h = 2166136261U ^ parent;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)label[i]) * 16777619U;
+    }
+    return (uint16_t)(h & (MQTT_QUIC_ROUTER_EDGE_BUCKETS - 1));
+}
+
+static uint16_t find_child(uint16_t parent, const char *label, size_t len) {
+    for (uint16_t n = edge_buckets[edge_bucket(parent, label, len)]; n != 0; n = nodes[n].next) {
+        if (nodes[n].parent == parent && nodes[n].labelLength == len &&
+            memcmp(&label_pool[nodes[n].label], label, len) == 0) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+static uint16_t new_node(uint16_t parent, const char *label, size_t len) {
+    if (node_count >= MQTT_QUIC_ROUTER_MAX_NODES || len > UINT8_MAX ||
+        label_used + len > sizeof(label_pool)) {
+        ESP_LOGE(TAG, "Router pool exhausted: %u nodes, %zu label bytes",
+                 node_count, label_used);
+        return 0;
+    }
+
+    uint16_t n = node_count++;
+    memset(&nodes[n], 0, sizeof(nodes[n]));
+    nodes[n].parent = parent;
+    nodes[n].label = (uint16_t)label_used;
+    nodes[n].labelLength = (uint8_t)len;
+    memcpy(&label_pool[label_used], label, len);
+    label_used += len;
+    return n;
+}
+
+static uint16_t add_child(uint16_t parent, const char *label, size_t len) {
+    uint16_t n = find_child(parent, label, len);
+
+    if (n == 0 && (n = new_node(parent, label, len)) != 0) {
+        uint16_t b = edge_bucket(parent, label, len);
+        nodes[n].next = edge_buckets[b];
+        edge_buckets[b] = n;
+    }
+    return n;
+}
+
+// '+' and '#' must fill a whole level and '#' must be the last one
+static bool filter_valid(const char *pFilter, uint16_t filterLength) {
+    if (pFilter == NULL || filterLength == 0) {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < filterLength; i++) {
+        bool levelStart = i == 0 || pFilter[i - 1] == '/';
+        bool levelEnd = i + 1 == filterLength || pFilter[i + 1] == '/';
+
+        if ((pFilter[i] == '+' || pFilter[i] == '#') && !(levelStart && levelEnd)) {
+            return false;
+        }
+        if (pFilter[i] == '#' && i + 1 != filterLength) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Walk the filter levels to the route list it ends in
+ * @param create Allocate missing levels
+ * @return Route list head to update, or NULL
+ */
+static uint16_t *filter_routes(const char *pFilter, uint16_t filterLength, bool create) {
+    const char *level = pFilter;
+    const char *end = pFilter + filterLength;
+    uint16_t node = 0;
+
+    for (;;) {
+        const char *sep = memchr(level, '/', (size_t)(end - level));
+        size_t len = (size_t)((sep ? sep : end) - level);
+
+        if (len == 1 && level[0] == '#') {
+            return &nodes[node].hashRoutes;
+        }
+
+        uint16_t child;
+        if (len == 1 && level[0] == '+') {
+            child = nodes[node].plusChild;
+            if (child == 0 && create && (child = new_node(node, level, len)) != 0) {
+                nodes[node].plusChild = child;
+            }
+        } else {
+            child = create ? add_child(node, level, len) : find_child(node, level, len);
+        }
+
+        if (child == 0) {
+            return NULL;
+        }
+        node = child;
+
+        if (sep == NULL) {
+            return &nodes[node].routes;
+        }
+        level = sep + 1;
+    }
+}
+
+int mqtt_quic_router_add(const char *pFilter,
+                         uint16_t filterLength,
+                         MQTTQUICRouteHandler_t handler,
+                         void *pUserCtx) {
+    if (handler == NULL || !filter_valid(pFilter, filterLength)) {
+        ESP_LOGE(TAG, "Invalid route for filter %.*s", filterLength, pFilter ? pFilter : "");
+        return -1;
+    }
+
+    uint16_t r = route_free;
+    if (r != 0) {
+        route_free = routes[r].next;
+    } else if (route_count <= MQTT_QUIC_ROUTER_MAX_ROUTES) {
+        r = route_count++;
+    } else {
+        ESP_LOGE(TAG, "Router pool exhausted: %d routes", MQTT_QUIC_ROUTER_MAX_ROUTES);
+        return -1;
+    }
+
+    uint16_t *head = filter_routes(pFilter, filterLength, true);
+    if (head == NULL) {
+        routes[r].next = route_free;
+        route_free = r;
+        return -1;
+    }
+
+    routes[r].handler = handler;
+    routes[r].pUserCtx = pUserCtx;
+    routes[r].next = *head;
+    *head = r;
+
+    ESP_LOGD(TAG, "Route added for %.*s", filterLength, pFilter);
+    return 0;
+}
+
+int mqtt_quic_router_remove(const char *pFilter,
+                            uint16_t filterLength,
+                            MQTTQUICRouteHandler_t handler,
+                            void *pUserCtx) {
+    if (!filter_valid(pFilter, filterLength)) {
+        return -1;
+    }
+
+    uint16_t *link = filter_routes(pFilter, filterLength, false);
+    for (; link != NULL && *link != 0; link = &routes[*link].next) {
+        uint16_t r = *link;
+        if (routes[r].handler == handler && routes[r].pUserCtx == pUserCtx) {
+            *link = routes[r].next;
+            routes[r].next = route_free;
+            route_free = r;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static size_t call_routes(uint16_t r, const MQTTPublishInfo_t *pPublishInfo) {
+    size_t n = 0;
+
+    for (; r != 0; r = routes[r].next) {
+        routes[r].handler(pPublishInfo, routes[r].pUserCtx);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief Match the topic levels from `level` on below `node`
+ * @param level Start of the next topic level, NULL after the last one
+ * @param sysTopic Topic starts with '$', wildcards must not match the level
+ */
+static size_t match(uint16_t node, const char *level, const char *end, bool sysTopic,
+                    const MQTTPublishInfo_t *pPublishInfo) {
+    size_t n = 0;
+
+    // "<level>/#" matches this level itself and everything below it
+    if (!sysTopic) {
+        n += call_routes(nodes[node].hashRoutes, pPublishInfo);
+    }
+
+    if (level == NULL) {
+        return n + call_routes(nodes[node].routes, pPublishInfo);
+    }
+
+    const char *sep = memchr(level, '/', (size_t)(end - level));
+    const char *next = sep ? sep + 1 : NULL;
+    size_t len = (size_t)((sep ? sep : end) - level);
+
+    uint16_t child = find_child(node, level, len);
+    if (child != 0) {
+        n += match(child, next, end, false, pPublishInfo);
+    }
+    if (nodes[node].plusChild != 0 && !sysTopic) {
+        n += match(nodes[node].plusChild, next, end, false, pPublishInfo);
+    }
+    return n;
+}
+
+size_t mqtt_quic_router_dispatch(const MQTTPublishInfo_t *pPublishInfo) {
+    if (pPublishInfo == NULL || pPublishInfo->pTopicName == NULL ||
+        pPublishInfo->topicNameLength == 0) {
+        return 0;
+    }
+
+    const char *topic = pPublishInfo->pTopicName;
+    return match(0, topic, topic + pPublishInfo->topicNameLength, topic[0] == '$',
+                 pPublishInfo);
+}
+
+void mqtt_quic_router_reset(void) {
+    memset(&nodes[0], 0, sizeof(nodes[0]));
+    memset(edge_buckets, 0, sizeof(edge_buckets));
+    node_count = 1;
+    route_free = 0;
+    route_count = 1;
+    label_used = 0;
+}
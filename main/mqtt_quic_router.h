@@ -0,0 +1,68 @@
+#ifndef MQTT_QUIC_ROUTER_H
+#define MQTT_QUIC_ROUTER_H
+
+#include "core_mqtt.h"
+
+/**
+ * @brief Pool sizes. All router memory is static; registration fails
+ * once a pool is exhausted.
+ */
+#define MQTT_QUIC_ROUTER_MAX_NODES 384       // Distinct filter levels
+#define MQTT_QUIC_ROUTER_MAX_ROUTES 256      // Registered (filter, handler) pairs
+#define MQTT_QUIC_ROUTER_LABEL_POOL 3072     // Bytes for level names
+#define MQTT_QUIC_ROUTER_EDGE_BUCKETS 256    // Child lookup hash table, power of two
+
+/**
+ * @brief Handler for inbound PUBLISH packets matching a registered filter.
+ * @param pPublishInfo Deserialized publish, valid for the duration of the call
+ * @param pUserCtx Context given at registration
+ */
+typedef void (*MQTTQUICRouteHandler_t)(const MQTTPublishInfo_t *pPublishInfo,
+                                       void *pUserCtx);
+
+/**
+ * @brief Register a handler for a topic filter.
+ *
+ * Filters are stored as a trie of topic levels. A child level is found
+ * through a hash table keyed by (parent, name), so dispatch costs one
+ * lookup per topic level plus the '+' and '#' branches on the way,
+ * independent of the number of filters. A filter may have several
+ * handlers and a topic matching several filters reaches all of them.
+ *
+ * Not thread safe: register before connecting or from the MQTT task.
+ *
+ * @return 0 on success, -1 if the filter is invalid or a pool is full
+ */
+int mqtt_quic_router_add(const char *pFilter,
+                         uint16_t filterLength,
+                         MQTTQUICRouteHandler_t handler,
+                         void *pUserCtx);
+
+/**
+ * @brief Remove a handler registered with the same filter and context.
+ *
+ * The route slot is reused; trie levels stay allocated.
+ *
+ * @return 0 on success, -1 if no such route exists
+ */
+int mqtt_quic_router_remove(const char *pFilter,
+                            uint16_t filterLength,
+                            MQTTQUICRouteHandler_t handler,
+                            void *pUserCtx);
+
+/**
+ * @brief Call every handler whose filter matches the publish topic.
+ *
+ * Follows MQTT rules: "a/#" also matches "a", and filters starting with
+ * a wildcard do not match topics starting with '$'.
+ *
+ * @return Number of handlers called
+ */
+size_t mqtt_quic_router_dispatch(const MQTTPublishInfo_t *pPublishInfo);
+
+/**
+ * @brief Drop all routes and trie levels.
+ */
+void mqtt_quic_router_reset(void);
+
+#endif /* MQTT_QUIC_ROUTER_H */
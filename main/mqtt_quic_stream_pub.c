@@ -0,0 +1,188 @@
+#include "mqtt_quic_stream_pub.h"
+#include "mqtt_quic_transport.h"
+#include "core_mqtt_state.h"
+#include "ngtcp2_sample.h"
+#include "quic_mem.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+static const char *TAG = "MQTT_QUIC_STREAM";
+
+// The header and every payload chunk go through here. A publish may take
+// minutes, too long to hold a buffer of the shared pool, which the RX path
+// needs. Used from the MQTT task only, no lock.
+static uint8_t chunk[QUIC_PKT_BUF_SIZE];
+
+/**
+ * @brief Queue bytes on the QUIC stream, waiting while the send buffer is full
+ *
+ * The PUBLISH is one bulk packet to the send scheduler, ordered behind
+ * earlier publishes to its topic by order; more says whether further
+ * bytes of it follow this call.
+ *
+ * @return 0 on success, -1 on error or timeout
+ */
+static int queue_on_stream(const uint8_t *data, size_t len, bool more, uint16_t order,
+                           uint32_t timeoutMs) {
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeoutMs * 1000;
+
+    while (len > 0) {
+        ngtcp2_vec vec = {
+            .base = (uint8_t *)data,
+            .len = len
+        };
+
+        // Bulk payload fills packets on its own, never hold it back
+        int result = quic_client_writev_safe(&vec, 1, (more ? QUIC_WRITE_FLAG_MORE : 0) |
+                                             QUIC_WRITE_FLAG_CLASS(QUIC_SEND_BULK) |
+                                             QUIC_WRITE_FLAG_ORDER(order));
+        if (result < 0) {
+            return -1;
+        }
+
+        if (result == 0) {
+            if (!quic_client_is_connected() || esp_timer_get_time() > deadline) {
+                ESP_LOGE(TAG, "Timed out waiting for QUIC stream buffer space");
+                return -1;
+            }
+            // Wait for the peer to acknowledge data
+            vTaskDelay(1);
+            continue;
+        }
+
+        data += result;
+        len -= (size_t)result;
+        deadline = esp_timer_get_time() + (int64_t)timeoutMs * 1000;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Drop the state record of a publish that never made it out
+ *
+ * coreMQTT has no call for that, so the record is walked through its
+ * acknowledgements to the end, where coreMQTT frees it.
+ */
+static void release_state(MQTTContext_t *pContext, uint16_t packetId, MQTTQoS_t qos) {
+    MQTTPublishState_t state = MQTTStateNull;
+    MQTTStatus_t status;
+
+    status = MQTT_UpdateStatePublish(pContext, packetId, MQTT_SEND, qos, &state);
+    if (status == MQTTSuccess && qos == MQTTQoS1) {
+        status = MQTT_UpdateStateAck(pContext, packetId, MQTTPuback, MQTT_RECEIVE, &state);
+    } else if (status == MQTTSuccess) {
+        status = MQTT_UpdateStateAck(pContext, packetId, MQTTPubrec, MQTT_RECEIVE, &state);
+        if (status == MQTTSuccess) {
+            status = MQTT_UpdateStateAck(pContext, packetId, MQTTPubrel, MQTT_SEND, &state);
+        }
+        if (status == MQTTSuccess) {
+            status = MQTT_UpdateStateAck(pContext, packetId, MQTTPubcomp, MQTT_RECEIVE, &state);
+        }
+    }
+
+    if (status != MQTTSuccess) {
+        ESP_LOGE(TAG, "Could not release the state of packet ID %u: %s",
+                 packetId, MQTT_Status_strerror(status));
+    }
+}
+
+MQTTStatus_t mqtt_quic_publish_stream(MQTTContext_t *pContext,
+                                      const MQTTPublishInfo_t *pPublishInfo,
+                                      uint16_t packetId,
+                                      MQTTQUICPayloadReader_t reader,
+                                      void *pReaderCtx,
+                                      uint32_t timeoutMs)
+{
+    size_t remainingLength = 0, packetSize = 0, headerSize = 0;
+    MQTTPublishState_t publishState = MQTTStateNull;
+    MQTTFixedBuffer_t headerBuffer;
+    MQTTStatus_t status;
+    uint16_t order;
+
+    if (pContext == NULL || pPublishInfo == NULL || reader == NULL) {
+        ESP_LOGE(TAG, "Invalid parameters: pContext=%p, pPublishInfo=%p, reader=%p",
+                 pContext, pPublishInfo, reader);
+        return MQTTBadParameter;
+    }
+
+    if (pPublishInfo->qos != MQTTQoS0 && packetId == 0) {
+        ESP_LOGE(TAG, "Packet ID must be non-zero for QoS > 0");
+        return MQTTBadParameter;
+    }
+
+    status = MQTT_GetPublishPacketSize(pPublishInfo, &remainingLength, &packetSize);
+    if (status != MQTTSuccess) {
+        ESP_LOGE(TAG, "MQTT_GetPublishPacketSize failed: %s", MQTT_Status_strerror(status));
+        return status;
+    }
+
+    headerBuffer.pBuffer = chunk;
+    headerBuffer.size = sizeof(chunk);
+
+    status = MQTT_SerializePublishHeader(pPublishInfo, packetId, remainingLength,
+                                         &headerBuffer, &headerSize);
+    if (status != MQTTSuccess) {
+        ESP_LOGE(TAG, "MQTT_SerializePublishHeader failed: %s", MQTT_Status_strerror(status));
+        return status;
+    }
+
+    if (pPublishInfo->qos != MQTTQoS0) {
+        status = MQTT_ReserveState(pContext, packetId, pPublishInfo->qos);
+        if (status != MQTTSuccess) {
+            ESP_LOGE(TAG, "MQTT_ReserveState failed: %s", MQTT_Status_strerror(status));
+            return status;
+        }
+    }
+
+    ESP_LOGI(TAG, "Streaming PUBLISH: topic %.*s, %zu payload bytes",
+             pPublishInfo->topicNameLength, pPublishInfo->pTopicName,
+             pPublishInfo->payloadLength);
+
+    order = mqtt_quic_topic_order(pPublishInfo->pTopicName, pPublishInfo->topicNameLength);
+    if (queue_on_stream(chunk, headerSize, pPublishInfo->payloadLength > 0, order,
+                        timeoutMs) != 0) {
+        status = MQTTSendFailed;
+        goto fail;
+    }
+
+    size_t remaining = pPublishInfo->payloadLength;
+    while (remaining > 0) {
+        size_t want = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+        int32_t n = reader(pReaderCtx, chunk, want);
+
+        if (n <= 0 || (size_t)n > want) {
+            ESP_LOGE(TAG, "Payload reader failed with %ld, %zu bytes short",
+                     (long)n, remaining);
+            status = MQTTSendFailed;
+            goto fail;
+        }
+
+        if (queue_on_stream(chunk, (size_t)n, (size_t)n < remaining, order, timeoutMs) != 0) {
+            status = MQTTSendFailed;
+            goto fail;
+        }
+
+        remaining -= (size_t)n;
+    }
+
+    pContext->lastPacketTxTime = pContext->getTime();
+
+    if (pPublishInfo->qos != MQTTQoS0) {
+        status = MQTT_UpdateStatePublish(pContext, packetId, MQTT_SEND,
+                                         pPublishInfo->qos, &publishState);
+        if (status != MQTTSuccess) {
+            ESP_LOGE(TAG, "MQTT_UpdateStatePublish failed: %s", MQTT_Status_strerror(status));
+        }
+    }
+    return status;
+
+fail:
+    // Whatever part of the PUBLISH is queued must not stay on the stream
+    quic_client_abort_write();
+    if (pPublishInfo->qos != MQTTQoS0) {
+        release_state(pContext, packetId, pPublishInfo->qos);
+    }
+    return status;
+}
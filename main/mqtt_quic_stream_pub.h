@@ -0,0 +1,52 @@
+#ifndef MQTT_QUIC_STREAM_PUB_H
+#define MQTT_QUIC_STREAM_PUB_H
+
+#include "core_mqtt.h"
+
+/**
+ * @brief Reader callback that supplies the next chunk of a streamed payload.
+ * @param pUserCtx Context passed to mqtt_quic_publish_stream
+ * @param pBuffer Buffer to fill
+ * @param bufferSize Number of bytes wanted, never more than what is left
+ * @return Number of bytes written to pBuffer (> 0), or a negative value on error
+ */
+typedef int32_t (*MQTTQUICPayloadReader_t)(void *pUserCtx,
+                                           uint8_t *pBuffer,
+                                           size_t bufferSize);
+
+/**
+ * @brief Publish a payload of arbitrary size without buffering it.
+ *
+ * The PUBLISH header is serialized on its own and the payload is pulled
+ * from the reader one packet buffer at a time and queued on the QUIC
+ * stream. The call blocks while the stream send buffer is full, i.e.
+ * while QUIC flow control or congestion control holds data back, so
+ * memory use does not depend on the payload size. Neither the MQTT
+ * network buffer nor MQTT_MAX_BUFFER_SIZE limit the payload.
+ *
+ * Must be called from the task that runs MQTT_ProcessLoop. For QoS > 0
+ * the packet ID is registered with coreMQTT's state engine, so the
+ * PUBACK is handled by MQTT_ProcessLoop as for MQTT_Publish.
+ *
+ * If the reader fails or the buffer stays full past timeoutMs, the part
+ * of the PUBLISH already queued is taken back with
+ * quic_client_abort_write; once some of it was sent the connection is
+ * closed instead. The packet ID is released either way.
+ *
+ * @param pContext Initialized and connected MQTT context
+ * @param pPublishInfo Publish info; payloadLength is the total payload
+ *                     size and pPayload is ignored
+ * @param packetId Packet ID for QoS > 0, ignored for QoS 0
+ * @param reader Callback supplying the payload
+ * @param pReaderCtx Context passed to reader
+ * @param timeoutMs Maximum time to wait for stream buffer space per chunk
+ * @return MQTTSuccess, MQTTBadParameter, MQTTSendFailed or a coreMQTT state error
+ */
+MQTTStatus_t mqtt_quic_publish_stream(MQTTContext_t *pContext,
+                                      const MQTTPublishInfo_t *pPublishInfo,
+                                      uint16_t packetId,
+                                      MQTTQUICPayloadReader_t reader,
+                                      void *pReaderCtx,
+                                      uint32_t timeoutMs);
+
+#endif /* MQTT_QUIC_STREAM_PUB_H */
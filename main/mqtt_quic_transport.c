@@ -1,6 +1,9 @@
 #include "mqtt_quic_transport.h"
 #include "esp_log.h"
 #include "ngtcp2_sample.h"
+#include "quic_pipeline.h"
+#include "core_mqtt_state.h"
+#include "freertos/task.h"
 #include <string.h>
 
 static const char *TAG = "MQTT_QUIC";
@@ -8,10 +11,19 @@ static const char *TAG = "MQTT_QUIC";
 // Global transport interface
 TransportInterface_t xTransportInterface = {0};
 
+// Copies of coreMQTT's unacknowledged QoS1 publishes, for
+// mqtt_quic_transport_resend_qos1. Used from the MQTT task only, no lock.
+typedef struct {
+    uint16_t packetId;  // 0 when free
+    uint16_t len;       // 0 if the packet was too large to keep
+    uint16_t idOffset;  // Where the packet ID sits in data
+    uint8_t data[MQTT_QUIC_RESEND_MAX_PACKET];
+} resend_entry_t;
+static resend_entry_t resend_store[MQTT_QUIC_RESEND_MAX];
+static bool resend_active;  // mqtt_quic_transport_resend_qos1 is writing
+
 // Forward declarations for ngtcp2 client functions
-extern struct client g_client;
 extern int quic_client_write_safe(const uint8_t *data, size_t datalen);
-extern int quic_client_read_safe(uint8_t *buffer, size_t buffer_size, size_t *bytes_read);
 extern bool quic_client_is_connected(void);
 
 // Time function required by MQTT
@@ -20,148 +32,342 @@ uint32_t mqtt_get_time_ms(void) {
 }
 
 /**
- * @brief Decode MQTT variable byte integer (remaining length)
- * @param data Pointer to the data buffer
- * @param data_len Length of the data buffer
- * @param remaining_length Pointer to store the decoded remaining length
- * @param bytes_used Pointer to store the number of bytes used for encoding
- * @return 0 on success, -1 on failure
+ * @brief Log the start of an outgoing MQTT packet
+ * @param data First vector of the packet
+ * @param len Length of the first vector
+ * @param total Length of the whole packet
  */
-static int decode_mqtt_remaining_length(const uint8_t *data, size_t data_len, 
-                                      uint32_t *remaining_length, size_t *bytes_used) {
-    if (data_len < 2) {
-        return -1; // Not enough data to decode
+static void log_outgoing_packet(const uint8_t *data, size_t len, size_t total) {
+    char hex_str[257];
+    size_t hex_len = (len > 128) ? 128 : len;
+
+    for (size_t i = 0; i < hex_len; i++) {
+        snprintf(&hex_str[i*2], 3, "%02x", data[i]);
     }
-    
-    *remaining_length = 0;
-    *bytes_used = 0;
-    uint32_t multiplier = 1;
-    
-    for (size_t i = 1; i < data_len && i < 5; i++) { // Skip first byte (packet type)
-        uint8_t byte = data[i];
-        *remaining_length += (byte & 0x7F) * multiplier;
-        (*bytes_used)++;
-        
-        if ((byte & 0x80) == 0) {
-            // Most significant bit is 0, this is the last byte
+    hex_str[hex_len*2] = '\0';
+
+    ESP_LOGI(TAG, "MQTT packet type 0x%02x, %zu bytes", data[0], total);
+    ESP_LOGD(TAG, "Header hex (%zu bytes): %s%s", len, hex_str, (len > 128) ? "..." : "");
+}
+
+/**
+ * @brief Whether an outgoing packet may wait for publish coalescing
+ *
+ * PUBLISH and the QoS acknowledgements are gathered; CONNECT, SUBSCRIBE,
+ * PINGREQ, DISCONNECT and the like go out at once and take any held
+ * packets with them.
+ */
+static bool mqtt_packet_coalescable(uint8_t first_byte) {
+    uint8_t type = (first_byte >> 4) & 0x0F;
+
+    return type >= 3 && type <= 7;  // PUBLISH .. PUBCOMP
+}
+
+/**
+ * @brief Send class of an outgoing packet of total bytes
+ *
+ * Acknowledgements, PINGREQ and (UN)SUBSCRIBE go ahead of publishes, small
+ * publishes ahead of large ones. DISCONNECT queues behind everything so
+ * that it does not cut off publishes sent before it.
+ */
+static quic_send_class_t mqtt_packet_class(uint8_t first_byte, size_t total) {
+    switch ((first_byte >> 4) & 0x0F) {
+    case 3:   // PUBLISH
+        return total > MQTT_QUIC_BULK_PUBLISH_BYTES ? QUIC_SEND_BULK : QUIC_SEND_INTERACTIVE;
+    case 14:  // DISCONNECT
+        return QUIC_SEND_BULK;
+    default:
+        return QUIC_SEND_CONTROL;
+    }
+}
+
+// FNV-1a over the topic name, folded to 16 bits
+#define TOPIC_ORDER_SEED 2166136261U
+#define TOPIC_ORDER_STEP(hash, byte) (((hash) ^ (uint8_t)(byte)) * 16777619U)
+
+static uint16_t topic_order_fold(uint32_t hash) {
+    hash = (hash >> 16) ^ (hash & 0xFFFF);
+    return hash != 0 ? (uint16_t)hash : 1;
+}
+
+uint16_t mqtt_quic_topic_order(const char *pTopicName, size_t topicNameLength) {
+    uint32_t hash = TOPIC_ORDER_SEED;
+
+    for (size_t i = 0; i < topicNameLength; i++) {
+        hash = TOPIC_ORDER_STEP(hash, pTopicName[i]);
+    }
+    return topic_order_fold(hash);
+}
+
+// Byte pos of the data in datav, -1 past its end
+static int packet_byte(const ngtcp2_vec *datav, size_t datavcnt, size_t pos) {
+    for (size_t i = 0; i < datavcnt; i++) {
+        if (pos < datav[i].len) {
+            return datav[i].base[pos];
+        }
+        pos -= datav[i].len;
+    }
+    return -1;
+}
+
+/**
+ * @brief Length of the fixed header of the outgoing packet in datav
+ * @param pRemaining Receives its remaining length
+ * @return Header length, 0 if it is not all there or malformed
+ */
+static size_t packet_header_length(const ngtcp2_vec *datav, size_t datavcnt,
+                                   size_t *pRemaining) {
+    size_t remaining = 0, multiplier = 1;
+
+    // At most 4 length bytes follow the packet type
+    for (size_t pos = 1; pos < 5; pos++) {
+        int b = packet_byte(datav, datavcnt, pos);
+        if (b < 0) {
             return 0;
         }
-        
-        multiplier *= 128;
-        if (multiplier > 128 * 128 * 128) {
-            return -1; // Malformed remaining length
+        remaining += (size_t)(b & 0x7F) * multiplier;
+        if ((b & 0x80) == 0) {
+            *pRemaining = remaining;
+            return pos + 1;
         }
+        multiplier *= 128;
     }
-    
-    return -1; // Incomplete or malformed
+    return 0;
 }
 
 /**
- * @brief Determine if we have enough data to know the complete MQTT packet length
- * @param context Network context containing the send buffer
- * @return true if packet length is determined, false otherwise
+ * @brief Ordering key of an outgoing PUBLISH from its topic name, which
+ * coreMQTT spreads over several vectors
+ * @return mqtt_quic_topic_order of the topic, 0 if it is not all there
  */
-static bool determine_mqtt_packet_length(NetworkContext_t *context) {
-    if (context->packet_length_determined) {
-        return true;
+static uint16_t mqtt_publish_order(const ngtcp2_vec *datav, size_t datavcnt) {
+    uint32_t hash = TOPIC_ORDER_SEED;
+    size_t remaining, len;
+    size_t pos = packet_header_length(datav, datavcnt, &remaining);
+    int b, hi, lo;
+
+    hi = packet_byte(datav, datavcnt, pos);
+    lo = packet_byte(datav, datavcnt, pos + 1);
+    if (pos == 0 || hi < 0 || lo < 0) {
+        return 0;
     }
-    
-    if (context->send_buffer_len < 2) {
-        return false; // Need at least 2 bytes (packet type + 1 byte of remaining length)
+
+    len = ((size_t)hi << 8) | (size_t)lo;
+    pos += 2;
+    for (size_t i = 0; i < len; i++) {
+        if ((b = packet_byte(datav, datavcnt, pos + i)) < 0) {
+            return 0;
+        }
+        hash = TOPIC_ORDER_STEP(hash, b);
     }
-    
-    uint32_t remaining_length;
-    size_t bytes_used;
-    
-    if (decode_mqtt_remaining_length(context->send_buffer, context->send_buffer_len,
-                                   &remaining_length, &bytes_used) == 0) {
-        // Successfully decoded remaining length
-        context->expected_packet_length = 1 + bytes_used + remaining_length; // 1 byte for packet type + bytes_used + remaining_length
-        context->packet_length_determined = true;
-        
-        // Check if this is a CONNECT packet
-        if (context->send_buffer[0] == 0x10) {
-            context->is_mqtt_connect_packet = true;
+    return topic_order_fold(hash);
+}
+
+static resend_entry_t *resend_find(uint16_t packetId) {
+    for (size_t i = 0; i < MQTT_QUIC_RESEND_MAX; i++) {
+        if (resend_store[i].packetId == packetId) {
+            return &resend_store[i];
         }
-        
-        ESP_LOGI(TAG, "Determined MQTT packet length: %lu bytes (remaining_length=%lu, bytes_used=%zu)",
-                 context->expected_packet_length, remaining_length, bytes_used);
-        return true;
     }
-    
-    return false;
+    return NULL;
 }
 
 /**
- * @brief Send the complete MQTT packet over QUIC
- * @param context Network context containing the complete packet
- * @return 0 on success, -1 on failure
+ * @brief Keep a copy of an outgoing QoS1 PUBLISH until its PUBACK
+ *
+ * A re-send under the same packet ID replaces the copy. When coreMQTT has
+ * more publishes outstanding than the store holds the slot of packet ID
+ * modulo the store size is reused.
  */
-static int send_complete_mqtt_packet(NetworkContext_t *context) {
-    ESP_LOGI(TAG, "=== SENDING COMPLETE MQTT PACKET ===");
-    ESP_LOGI(TAG, "Packet length: %zu bytes", context->send_buffer_len);
-    ESP_LOGI(TAG, "Is CONNECT packet: %s", context->is_mqtt_connect_packet ? "YES" : "NO");
-    
-    // Validate packet before sending
-    if (context->send_buffer_len == 0 || context->send_buffer_len > sizeof(context->send_buffer)) {
-        ESP_LOGE(TAG, "Invalid packet length: %zu", context->send_buffer_len);
+static resend_entry_t *resend_keep(const ngtcp2_vec *datav, size_t datavcnt,
+                                   size_t headerLength, size_t packetLength, size_t total) {
+    size_t pos;
+    int hi, lo, idHi, idLo;
+    uint16_t packetId;
+    resend_entry_t *entry;
+
+    // The topic length, the topic, then the packet ID
+    hi = packet_byte(datav, datavcnt, headerLength);
+    lo = packet_byte(datav, datavcnt, headerLength + 1);
+    if (hi < 0 || lo < 0) {
+        return NULL;
+    }
+    pos = headerLength + 2 + (((size_t)hi << 8) | (size_t)lo);
+    idHi = packet_byte(datav, datavcnt, pos);
+    idLo = packet_byte(datav, datavcnt, pos + 1);
+    if (idHi < 0 || idLo < 0) {
+        return NULL;
+    }
+    packetId = (uint16_t)((idHi << 8) | idLo);
+
+    entry = resend_find(packetId);
+    if (entry == NULL) {
+        entry = resend_find(0);
+    }
+    if (entry == NULL) {
+        entry = &resend_store[packetId % MQTT_QUIC_RESEND_MAX];
+    }
+
+    entry->packetId = packetId;
+    entry->idOffset = (uint16_t)pos;
+    entry->len = 0;
+    // Known then, but lost if the session moves
+    if (packetLength > MQTT_QUIC_RESEND_MAX_PACKET || total < packetLength) {
+        return entry;
+    }
+    // A write may carry more than this packet; keep exactly its bytes
+    for (size_t i = 0, off = 0; i < datavcnt && off < packetLength; i++) {
+        size_t n = datav[i].len < packetLength - off ? datav[i].len : packetLength - off;
+
+        memcpy(entry->data + off, datav[i].base, n);
+        off += n;
+    }
+    entry->len = (uint16_t)packetLength;
+    return entry;
+}
+
+/**
+ * @brief Give up on the packet coreMQTT stopped handing over part way
+ *
+ * coreMQTT drops a packet after MQTT_SEND_TIMEOUT_MS without progress and
+ * moves on to the next one. The open packet is closed on the QUIC side so
+ * that other writers are not held off and the next packet is not taken
+ * for its rest. Returns -1 if the connection had to be closed for it.
+ */
+static int tx_abandon(NetworkContext_t *pNetworkContext) {
+    int rv = 0;
+
+    if (pNetworkContext->txPacketLeft > 0 &&
+        pNetworkContext->txPacketLeft < pNetworkContext->txPacketLength) {
+        ESP_LOGW(TAG, "Abandoning an MQTT packet with %zu of %zu bytes unsent",
+                 pNetworkContext->txPacketLeft, pNetworkContext->txPacketLength);
+        rv = quic_client_abort_write();
+    }
+    pNetworkContext->txFlags = 0;
+    pNetworkContext->txPacketLeft = 0;
+    pNetworkContext->txPacketLength = 0;
+    return rv;
+}
+
+int32_t mqtt_quic_transport_writev(NetworkContext_t *pNetworkContext,
+                                TransportOutVector_t *pIoVec,
+                                size_t ioVecCount)
+{
+    ngtcp2_vec datav[MQTT_QUIC_MAX_IOVEC];
+    size_t datavcnt = 0;
+    size_t total = 0;
+    size_t offered = 0;
+
+    if (pNetworkContext == NULL || pIoVec == NULL || ioVecCount == 0) {
+        ESP_LOGE(TAG, "Invalid parameters: pNetworkContext=%p, pIoVec=%p, ioVecCount=%zu",
+                 pNetworkContext, pIoVec, ioVecCount);
         return -1;
     }
-    
-    // Log the complete packet in hex
-    char hex_str[257];
-    size_t hex_len = (context->send_buffer_len > 128) ? 128 : context->send_buffer_len;
-    
-    for (size_t i = 0; i < hex_len; i++) {
-        snprintf(&hex_str[i*2], 3, "%02x", context->send_buffer[i]);
+
+    // coreMQTT hands over one packet per call; anything beyond
+    // MQTT_QUIC_MAX_IOVEC is reported as a partial write and re-sent by coreMQTT
+    size_t i;
+    for (i = 0; i < ioVecCount; i++) {
+        offered += pIoVec[i].iov_len;
     }
-    hex_str[hex_len*2] = '\0';
-    
-    ESP_LOGI(TAG, "Complete MQTT packet hex (%zu bytes): %s%s", 
-             context->send_buffer_len, hex_str, (context->send_buffer_len > 128) ? "..." : "");
-    
+    for (i = 0; i < ioVecCount && datavcnt < MQTT_QUIC_MAX_IOVEC; i++) {
+        if (pIoVec[i].iov_len == 0) {
+            continue;
+        }
+        datav[datavcnt].base = (uint8_t *)pIoVec[i].iov_base;
+        datav[datavcnt].len = pIoVec[i].iov_len;
+        total += pIoVec[i].iov_len;
+        datavcnt++;
+    }
+
+    if (datavcnt == 0) {
+        return 0;
+    }
+
     // Check if QUIC client is still connected
-    extern bool quic_client_is_connected(void);
     if (!quic_client_is_connected()) {
         ESP_LOGE(TAG, "QUIC client is not connected, cannot send data");
         return -1;
     }
-    
-    // Add a small delay before sending to ensure QUIC is ready
-    vTaskDelay(pdMS_TO_TICKS(10));
-    
-    int result = quic_client_write_safe(context->send_buffer, 
-                                       context->send_buffer_len);
-    
-    if (result != 0) {
-        ESP_LOGE(TAG, "Failed to send complete MQTT packet over QUIC, error %d", result);
+
+    // coreMQTT re-sends exactly what a partial write left over; anything
+    // else starts at a packet boundary, the previous packet was given up
+    bool continuation = pNetworkContext->txPacketLeft > 0 &&
+                        pNetworkContext->txPacketLeft < pNetworkContext->txPacketLength &&
+                        offered == pNetworkContext->txPacketLeft;
+    if (!continuation && tx_abandon(pNetworkContext) != 0) {
         return -1;
     }
-    
-    ESP_LOGI(TAG, "Successfully sent complete MQTT packet (%zu bytes) over QUIC", context->send_buffer_len);
-    return 0;
-}
 
-/**
- * @brief Reset the send buffer for a new packet
- * @param context Network context to reset
- */
-static void reset_send_buffer(NetworkContext_t *context) {
-    context->send_buffer_len = 0;
-    context->expected_packet_length = 0;
-    context->packet_length_determined = false;
-    context->is_mqtt_connect_packet = false;
+    resend_entry_t *kept = NULL;
+    uint32_t flags;
+    if (continuation) {
+        // datav[0] is payload then and the packet keeps the flags it was
+        // queued with
+        flags = pNetworkContext->txFlags;
+    } else {
+        size_t remaining = 0;
+        size_t headerLength = packet_header_length(datav, datavcnt, &remaining);
+        size_t packetLength = headerLength > 0 ? headerLength + remaining : total;
+
+        log_outgoing_packet(datav[0].base, datav[0].len, packetLength);
+
+        flags = mqtt_packet_coalescable(datav[0].base[0]) ?
+                QUIC_WRITE_FLAG_COALESCE : QUIC_WRITE_FLAG_NONE;
+        flags |= QUIC_WRITE_FLAG_CLASS(mqtt_packet_class(datav[0].base[0], packetLength));
+        if (((datav[0].base[0] >> 4) & 0x0F) == 3) {
+            // A large publish must not be overtaken by a later one to its topic
+            flags |= QUIC_WRITE_FLAG_ORDER(mqtt_publish_order(datav, datavcnt));
+            if (((datav[0].base[0] >> 1) & 0x03) == MQTTQoS1 && headerLength > 0 &&
+                !resend_active) {
+                kept = resend_keep(datav, datavcnt, headerLength, packetLength, total);
+            }
+        }
+        pNetworkContext->txFlags = flags;
+        pNetworkContext->txPacketLeft = packetLength;
+        pNetworkContext->txPacketLength = packetLength;
+    }
+
+    if (total < pNetworkContext->txPacketLeft) {
+        // The rest of the packet follows once coreMQTT re-sends it
+        flags |= QUIC_WRITE_FLAG_MORE;
+    }
+
+    int result = quic_client_writev_safe(datav, datavcnt, flags);
+    if (result < 0) {
+        ESP_LOGE(TAG, "Failed to send MQTT packet over QUIC, error %d", result);
+        pNetworkContext->txFlags = 0;
+        pNetworkContext->txPacketLeft = 0;
+        pNetworkContext->txPacketLength = 0;
+        if (kept != NULL) {
+            // Not sent, and coreMQTT reports the failure
+            kept->packetId = 0;
+        }
+        return -1;
+    }
+
+    pNetworkContext->txPacketLeft -= (size_t)result < pNetworkContext->txPacketLeft ?
+                                     (size_t)result : pNetworkContext->txPacketLeft;
+
+    if (result == 0) {
+        ESP_LOGD(TAG, "QUIC send buffer full, coreMQTT will retry");
+    }
+
+    return (int32_t)result;
 }
 
 int32_t mqtt_quic_transport_send(NetworkContext_t *pNetworkContext,
                               const void *pBuffer,
                               size_t bytesToSend)
 {
-    ESP_LOGI(TAG, "=== TRANSPORT SEND CALLED ===");
-    ESP_LOGI(TAG, "Function: %s", __func__);
-    ESP_LOGI(TAG, "Parameters: pNetworkContext=%p, pBuffer=%p, bytesToSend=%zu", pNetworkContext, pBuffer, bytesToSend);
-    
-    if (pNetworkContext == NULL || pBuffer == NULL) {
+    // With writev registered, coreMQTT only uses send for whole packets
+    // (PINGREQ, PUBACK, ...), so no reassembly is needed
+    TransportOutVector_t iov = {
+        .iov_base = pBuffer,
+        .iov_len = bytesToSend
+    };
+
+    if (pBuffer == NULL) {
         ESP_LOGE(TAG, "Invalid parameters: pNetworkContext=%p, pBuffer=%p", pNetworkContext, pBuffer);
         return -1;
     }
@@ -171,83 +377,133 @@ int32_t mqtt_quic_transport_send(NetworkContext_t *pNetworkContext,
         return 0;
     }
 
-    ESP_LOGI(TAG, "Received fragment of %zu bytes", bytesToSend);
-    
-    // Log the fragment in hex for debugging
-    const uint8_t *data = (const uint8_t *)pBuffer;
-    char hex_str[257];
-    size_t hex_len = (bytesToSend > 128) ? 128 : bytesToSend;
-    
-    for (size_t i = 0; i < hex_len; i++) {
-        snprintf(&hex_str[i*2], 3, "%02x", data[i]);
+    return mqtt_quic_transport_writev(pNetworkContext, &iov, 1);
+}
+
+int32_t mqtt_quic_transport_flush(NetworkContext_t *pNetworkContext)
+{
+    (void)pNetworkContext;
+
+    if (!quic_client_is_connected()) {
+        ESP_LOGE(TAG, "QUIC client is not connected, cannot flush");
+        return -1;
     }
-    hex_str[hex_len*2] = '\0';
-    
-    ESP_LOGI(TAG, "Fragment hex (%zu bytes): %s%s", bytesToSend, hex_str, (bytesToSend > 128) ? "..." : "");
-    
-    // Check if this is the start of a new packet
-    if (pNetworkContext->send_buffer_len == 0) {
-        ESP_LOGI(TAG, "Starting new MQTT packet");
-        
-        // Check if this looks like a valid MQTT packet start
-        if (data[0] == 0x10) {
-            ESP_LOGI(TAG, "*** This looks like the start of an MQTT CONNECT packet! ***");
-        } else {
-            ESP_LOGI(TAG, "MQTT packet type: 0x%02x", data[0]);
+
+    return quic_client_flush_safe() == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Frame length callback for MQTT: decode the remaining length
+ * @param data Start of an MQTT packet in the stream buffer
+ * @param datalen Number of buffered bytes
+ * @return Total packet length, 0 if more bytes are needed, -1 if malformed
+ */
+static ssize_t mqtt_frame_length(const uint8_t *data, size_t datalen) {
+    size_t remaining_length = 0;
+    size_t multiplier = 1;
+
+    // Skip first byte (packet type), at most 4 length bytes follow
+    for (size_t i = 1; i < datalen && i < 5; i++) {
+        remaining_length += (data[i] & 0x7F) * multiplier;
+        if ((data[i] & 0x80) == 0) {
+            return (ssize_t)(1 + i + remaining_length);
         }
+        multiplier *= 128;
     }
-    
-    // Check if we have enough space in the send buffer
-    if (pNetworkContext->send_buffer_len + bytesToSend > sizeof(pNetworkContext->send_buffer)) {
-        ESP_LOGE(TAG, "Send buffer overflow! Current: %zu, Adding: %zu, Max: %zu",
-                 pNetworkContext->send_buffer_len, bytesToSend, sizeof(pNetworkContext->send_buffer));
-        return -1;
+
+    return datalen >= 5 ? -1 : 0;
+}
+
+static const char *mqtt_packet_name(uint8_t first_byte) {
+    switch ((first_byte >> 4) & 0x0F) {
+        case 1: return "CONNECT";
+        case 2: return "CONNACK";
+        case 3: return "PUBLISH";
+        case 4: return "PUBACK";
+        case 5: return "PUBREC";
+        case 6: return "PUBREL";
+        case 7: return "PUBCOMP";
+        case 8: return "SUBSCRIBE";
+        case 9: return "SUBACK";
+        case 10: return "UNSUBSCRIBE";
+        case 11: return "UNSUBACK";
+        case 12: return "PINGREQ";
+        case 13: return "PINGRESP";
+        case 14: return "DISCONNECT";
+        default: return "UNKNOWN";
     }
-    
-    // Add this fragment to the send buffer
-    memcpy(pNetworkContext->send_buffer + pNetworkContext->send_buffer_len, data, bytesToSend);
-    pNetworkContext->send_buffer_len += bytesToSend;
-    
-    ESP_LOGD(TAG, "Added fragment to buffer. Total buffered: %zu bytes", pNetworkContext->send_buffer_len);
-    
-    // Try to determine the packet length if we haven't already
-    if (!pNetworkContext->packet_length_determined) {
-        if (determine_mqtt_packet_length(pNetworkContext)) {
-            ESP_LOGD(TAG, "Determined packet length: %lu bytes", pNetworkContext->expected_packet_length);
-        } else {
-            ESP_LOGD(TAG, "Still determining packet length, need more data");
-        }
+}
+
+/**
+ * @brief Release the current packet view and fetch the next complete packet
+ * @param context Network context holding the view
+ * @return 0 if a packet is available, -2 if none is buffered yet, -1 on error
+ */
+static int fetch_next_packet(NetworkContext_t *context) {
+    const uint8_t *packet;
+    size_t packet_len;
+    int result;
+
+    // Check if QUIC client is still connected
+    if (!quic_client_is_connected()) {
+        ESP_LOGW(TAG, "QUIC client is not connected, cannot receive data");
+        return -2;
     }
-    
-    // Check if we have the complete packet
-    if (pNetworkContext->packet_length_determined && 
-        pNetworkContext->send_buffer_len >= pNetworkContext->expected_packet_length) {
-        
-        ESP_LOGD(TAG, "*** COMPLETE MQTT PACKET READY TO SEND ***");
-        ESP_LOGD(TAG, "Expected: %lu bytes, Buffered: %zu bytes",
-                 pNetworkContext->expected_packet_length, pNetworkContext->send_buffer_len);
-        
-        // Send the complete packet
-        int result = send_complete_mqtt_packet(pNetworkContext);
-        
-        // Reset buffer for next packet
-        reset_send_buffer(pNetworkContext);
-        
-        if (result != 0) {
-            ESP_LOGE(TAG, "Failed to send complete MQTT packet");
+
+    do {
+        result = quic_client_recv_frame_safe(context->rxPacketLen, mqtt_frame_length,
+                                             &packet, &packet_len);
+#if !QUIC_PIPELINE_ENABLE
+        context->rxLockCount++;
+#endif
+
+        if (result == -1) {
+            ESP_LOGE(TAG, "Failed to receive data over QUIC");
+            if (!quic_client_is_connected()) {
+                // The view was released and the connection closed, see
+                // quic_client_recv_frame_safe; it must not be released again
+                context->pRxPacket = NULL;
+                context->rxPacketLen = 0;
+                context->rxPacketOffset = 0;
+            }
+            // Otherwise the lock was busy and nothing was released; the
+            // next call passes the same length again
             return -1;
         }
-        
-        ESP_LOGI(TAG, "Successfully sent complete MQTT packet");
-    } else {
-        ESP_LOGI(TAG, "Packet not complete yet, continuing to buffer");
-        if (pNetworkContext->packet_length_determined) {
-            ESP_LOGD(TAG, "Need %lu more bytes",
-                     pNetworkContext->expected_packet_length - pNetworkContext->send_buffer_len);
+
+        context->pRxPacket = packet;
+        context->rxPacketLen = packet_len;
+        context->rxPacketOffset = 0;
+
+        if (result != 0) {
+            return result;
         }
-    }
-    
-    return (int32_t)bytesToSend;
+
+        context->rxPackets++;
+
+        if (packet_len == 4 && (packet[0] & 0xF0) == 0x40) {
+            resend_entry_t *entry = resend_find((uint16_t)((packet[2] << 8) | packet[3]));
+            if (entry != NULL && entry->packetId != 0) {
+                entry->packetId = 0;
+            }
+        }
+
+        if (context->pInflight != NULL && (packet[0] & 0xF0) == 0x20) {
+            // A new session: PUBACKs for publishes sent before it never come
+            mqtt_quic_inflight_fail(context->pInflight);
+        }
+
+        // PUBACKs for the pipelined publisher never reach coreMQTT, which
+        // has no state record for them
+    } while (context->pInflight != NULL && packet_len == 4 &&
+             (packet[0] & 0xF0) == 0x40 &&
+             mqtt_quic_inflight_ack(context->pInflight,
+                                    (uint16_t)((packet[2] << 8) | packet[3])));
+
+    ESP_LOGD(TAG, "*** MQTT Packet Type: %s (0x%02x), %zu bytes ***",
+             mqtt_packet_name(packet[0]), packet[0], packet_len);
+
+    return 0;
 }
 
 int32_t mqtt_quic_transport_recv(NetworkContext_t *pNetworkContext,
@@ -260,74 +516,67 @@ int32_t mqtt_quic_transport_recv(NetworkContext_t *pNetworkContext,
     }
     
     ESP_LOGD(TAG, "Attempting to receive up to %zu bytes", bytesToRecv);
-    
-    size_t bytesReceived = 0;
-    
-    // Check if QUIC client is still connected
-    extern bool quic_client_is_connected(void);
-    if (!quic_client_is_connected()) {
-        ESP_LOGW(TAG, "QUIC client is not connected, cannot receive data");
-        return 0; // Return 0 to indicate no data available, not an error
-    }
-    
-    int result = quic_client_read_safe((uint8_t *)pBuffer,
-                                      bytesToRecv,
-                                      &bytesReceived);
-    
-    if (result != 0) {
-        if (result == -2) {  // No data available
+
+    // coreMQTT reads a packet in several pieces (type, length, body); only
+    // the first piece of each packet touches the QUIC client and its lock
+    if (pNetworkContext->rxPacketOffset == pNetworkContext->rxPacketLen) {
+        int result = fetch_next_packet(pNetworkContext);
+        if (result == -2) {
             ESP_LOGD(TAG, "No data available from QUIC");
             return 0;
         }
-        ESP_LOGE(TAG, "Failed to receive data over QUIC, error %d", result);
-        return -1;
-    }
-    
-    if (bytesReceived > 0) {
-        ESP_LOGI(TAG, "=== RECEIVED %zu BYTES FROM QUIC ===", bytesReceived);
-        
-        // Log the received data in hex
-        const uint8_t *data = (const uint8_t *)pBuffer;
-        char hex_str[257];
-        size_t hex_len = (bytesReceived > 128) ? 128 : bytesReceived;
-        
-        for (size_t i = 0; i < hex_len; i++) {
-            snprintf(&hex_str[i*2], 3, "%02x", data[i]);
-        }
-        hex_str[hex_len*2] = '\0';
-        
-        ESP_LOGI(TAG, "Received packet hex (%zu bytes): %s%s", 
-                 bytesReceived, hex_str, (bytesReceived > 128) ? "..." : "");
-        
-        // Try to identify the MQTT packet type
-        if (bytesReceived > 0) {
-            uint8_t packet_type = (data[0] >> 4) & 0x0F;
-            const char* packet_name = "UNKNOWN";
-            
-            switch (packet_type) {
-                case 1: packet_name = "CONNECT"; break;
-                case 2: packet_name = "CONNACK"; break;
-                case 3: packet_name = "PUBLISH"; break;
-                case 4: packet_name = "PUBACK"; break;
-                case 5: packet_name = "PUBREC"; break;
-                case 6: packet_name = "PUBREL"; break;
-                case 7: packet_name = "PUBCOMP"; break;
-                case 8: packet_name = "SUBSCRIBE"; break;
-                case 9: packet_name = "SUBACK"; break;
-                case 10: packet_name = "UNSUBSCRIBE"; break;
-                case 11: packet_name = "UNSUBACK"; break;
-                case 12: packet_name = "PINGREQ"; break;
-                case 13: packet_name = "PINGRESP"; break;
-                case 14: packet_name = "DISCONNECT"; break;
-            }
-            
-            ESP_LOGI(TAG, "*** MQTT Packet Type: %s (0x%02x) ***", packet_name, packet_type);
+        if (result != 0) {
+            return -1;
         }
     }
-    
+
+    size_t available = pNetworkContext->rxPacketLen - pNetworkContext->rxPacketOffset;
+    size_t bytesReceived = (available < bytesToRecv) ? available : bytesToRecv;
+
+    memcpy(pBuffer, pNetworkContext->pRxPacket + pNetworkContext->rxPacketOffset, bytesReceived);
+    pNetworkContext->rxPacketOffset += bytesReceived;
+
     return (int32_t)bytesReceived;
 }
 
+MQTTStatus_t mqtt_quic_transport_next_packet(NetworkContext_t *pNetworkContext,
+                                          MQTTPacketInfo_t *pPacketInfo)
+{
+    if (pNetworkContext == NULL || pPacketInfo == NULL) {
+        ESP_LOGE(TAG, "Invalid parameters: pNetworkContext=%p, pPacketInfo=%p", pNetworkContext, pPacketInfo);
+        return MQTTBadParameter;
+    }
+
+    if (pNetworkContext->rxPacketOffset != pNetworkContext->rxPacketLen) {
+        // coreMQTT is in the middle of reading the current packet
+        return MQTTIllegalState;
+    }
+
+    int result = fetch_next_packet(pNetworkContext);
+    if (result == -2) {
+        return MQTTNoDataAvailable;
+    }
+    if (result != 0) {
+        return MQTTRecvFailed;
+    }
+
+    const uint8_t *packet = pNetworkContext->pRxPacket;
+    size_t headerLength = 2;
+    while (packet[headerLength - 1] & 0x80) {
+        headerLength++;
+    }
+
+    pPacketInfo->type = packet[0];
+    pPacketInfo->headerLength = headerLength;
+    pPacketInfo->remainingLength = pNetworkContext->rxPacketLen - headerLength;
+    pPacketInfo->pRemainingData = (uint8_t *)packet + headerLength;
+
+    // Handed over whole, released on the next fetch
+    pNetworkContext->rxPacketOffset = pNetworkContext->rxPacketLen;
+
+    return MQTTSuccess;
+}
+
 BaseType_t mqtt_quic_transport_init(NetworkContext_t *pNetworkContext,
                                   const ServerInfo_t *pServerInfo,
                                   const MQTTQUICConfig_t *pMqttQuicConfig)
@@ -340,9 +589,113 @@ BaseType_t mqtt_quic_transport_init(NetworkContext_t *pNetworkContext,
     
     pNetworkContext->pServerInfo = pServerInfo;
     pNetworkContext->pMqttQuicConfig = pMqttQuicConfig;
-    
-    // Initialize the send buffer
-    reset_send_buffer(pNetworkContext);
+    pNetworkContext->pRxPacket = NULL;
+    pNetworkContext->rxPacketLen = 0;
+    pNetworkContext->rxPacketOffset = 0;
+    pNetworkContext->rxPackets = 0;
+    pNetworkContext->rxLockCount = 0;
+    pNetworkContext->txFlags = 0;
+    pNetworkContext->txPacketLeft = 0;
+    pNetworkContext->txPacketLength = 0;
+    pNetworkContext->pInflight = NULL;
+    // Nothing is outstanding on a new connection
+    memset(resend_store, 0, sizeof(resend_store));
     
     return pdPASS;
 }
+
+void mqtt_quic_transport_switch(NetworkContext_t *pNetworkContext,
+                                const ServerInfo_t *pServerInfo)
+{
+    ESP_LOGI(TAG, "Transport now on %s:%u", pServerInfo->pHostName, pServerInfo->port);
+
+    pNetworkContext->pServerInfo = pServerInfo;
+    // The view pointed into data of the old connection, which is gone;
+    // nothing of it may be released on the new one
+    pNetworkContext->pRxPacket = NULL;
+    pNetworkContext->rxPacketLen = 0;
+    pNetworkContext->rxPacketOffset = 0;
+    pNetworkContext->txFlags = 0;
+    pNetworkContext->txPacketLeft = 0;
+    pNetworkContext->txPacketLength = 0;
+}
+
+// Queue a whole packet, waiting while the send buffer is full
+static int resend_write(NetworkContext_t *pNetworkContext, const uint8_t *data, size_t len,
+                        uint32_t timeoutMs) {
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeoutMs * 1000;
+
+    while (len > 0) {
+        TransportOutVector_t iov = {
+            .iov_base = data,
+            .iov_len = len
+        };
+        int32_t n = mqtt_quic_transport_writev(pNetworkContext, &iov, 1);
+
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0 && esp_timer_get_time() > deadline) {
+            // Left open it would hold off every other writer
+            (void)tx_abandon(pNetworkContext);
+            return -1;
+        }
+        if (n == 0) {
+            vTaskDelay(1);
+            continue;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int32_t mqtt_quic_transport_resend_qos1(NetworkContext_t *pNetworkContext,
+                                        MQTTContext_t *pContext,
+                                        uint32_t timeoutMs,
+                                        uint32_t *pLost) {
+    MQTTPublishState_t state = MQTTStateNull;
+    int32_t resent = 0;
+    uint32_t lost = 0;
+
+    resend_active = true;
+    for (size_t i = 0; i < MQTT_QUIC_RESEND_MAX; i++) {
+        resend_entry_t *entry = &resend_store[i];
+        uint16_t packetId;
+
+        if (entry->packetId == 0) {
+            continue;
+        }
+        if (entry->len == 0) {
+            entry->packetId = 0;
+            lost++;
+            continue;
+        }
+
+        // A new session: new packet ID, registered with coreMQTT so that
+        // MQTT_ProcessLoop takes the PUBACK
+        packetId = MQTT_GetPacketId(pContext);
+        if (MQTT_ReserveState(pContext, packetId, MQTTQoS1) != MQTTSuccess) {
+            entry->packetId = 0;
+            lost++;
+            continue;
+        }
+        entry->packetId = packetId;
+        entry->data[entry->idOffset] = (uint8_t)(packetId >> 8);
+        entry->data[entry->idOffset + 1] = (uint8_t)packetId;
+
+        if (resend_write(pNetworkContext, entry->data, entry->len, timeoutMs) != 0) {
+            ESP_LOGE(TAG, "Resending QoS1 publish failed");
+            resent = -1;
+            break;
+        }
+        (void)MQTT_UpdateStatePublish(pContext, packetId, MQTT_SEND, MQTTQoS1, &state);
+        resent++;
+    }
+    resend_active = false;
+
+    if (pLost != NULL) {
+        *pLost = lost;
+    }
+    return resent;
+}
@@ -4,6 +4,30 @@
 #include "core_mqtt.h"
 #include "freertos/FreeRTOS.h"
 #include "esp_timer.h"
+#include "mqtt_quic_inflight.h"
+
+/**
+ * @brief Maximum number of coreMQTT vectors passed to QUIC in one writev call.
+ */
+#define MQTT_QUIC_MAX_IOVEC 16
+
+/**
+ * @brief PUBLISH packets larger than this are sent as QUIC_SEND_BULK,
+ * behind smaller ones and control packets.
+ */
+#ifndef MQTT_QUIC_BULK_PUBLISH_BYTES
+#define MQTT_QUIC_BULK_PUBLISH_BYTES 1024
+#endif
+
+/**
+ * @brief coreMQTT's unacknowledged QoS1 publishes kept for
+ * mqtt_quic_transport_resend_qos1, and the largest packet kept. Larger
+ * ones are known by packet ID only and lost when the session moves.
+ */
+#define MQTT_QUIC_RESEND_MAX MQTT_STATE_ARRAY_MAX_COUNT
+#ifndef MQTT_QUIC_RESEND_MAX_PACKET
+#define MQTT_QUIC_RESEND_MAX_PACKET 320
+#endif
 
 /**
  * @brief Information about the server to connect to.
@@ -31,19 +55,37 @@ typedef struct NetworkContext
 {
     const ServerInfo_t *pServerInfo;
     const MQTTQUICConfig_t *pMqttQuicConfig;
-    
-    // Buffer for accumulating MQTT packet fragments
-    uint8_t send_buffer[512];  // Buffer for outgoing MQTT packets
-    size_t send_buffer_len;    // Current length of data in send buffer
-    uint32_t expected_packet_length;  // Expected total length of current MQTT packet
-    bool packet_length_determined;    // Whether we've determined the packet length
-    bool is_mqtt_connect_packet;      // Whether this is a CONNECT packet
+
+    // View of the current inbound MQTT packet inside the QUIC receive buffer
+    const uint8_t *pRxPacket;
+    size_t rxPacketLen;       // Length of the whole packet
+    size_t rxPacketOffset;    // Bytes already handed to coreMQTT
+    uint32_t rxPackets;       // Complete packets framed
+    uint32_t rxLockCount;     // QUIC lock acquisitions on the receive path, none when pipelined
+
+    // Outbound packet coreMQTT is part way through handing over
+    uint32_t txFlags;         // QUIC_WRITE_FLAG_* it was started with
+    size_t txPacketLeft;      // Bytes of it still to come, 0 between packets
+    size_t txPacketLength;    // Its whole length, tells a re-send from a new packet
+
+    // In-flight table of the pipelined QoS1 publisher, NULL if unused; its
+    // PUBACKs are consumed here instead of being passed to coreMQTT
+    MQTTQUICInflight_t *pInflight;
 } NetworkContext_t;
 
 BaseType_t mqtt_quic_transport_init(NetworkContext_t *pNetworkContext,
                                   const ServerInfo_t *pServerInfo,
                                   const MQTTQUICConfig_t *pMqttQuicConfig);
 
+/**
+ * @brief Point the context at the broker quic_client_failover moved to.
+ *
+ * Drops the view of the packet being read, which belonged to the old
+ * connection. The counters and pInflight are kept.
+ */
+void mqtt_quic_transport_switch(NetworkContext_t *pNetworkContext,
+                                const ServerInfo_t *pServerInfo);
+
 int32_t mqtt_quic_transport_recv(NetworkContext_t *pNetworkContext,
                               void *pBuffer,
                               size_t bytesToRecv);
@@ -52,6 +94,69 @@ int32_t mqtt_quic_transport_send(NetworkContext_t *pNetworkContext,
                               const void *pBuffer,
                               size_t bytesToSend);
 
+/**
+ * @brief Get the next complete inbound MQTT packet without copying it.
+ *
+ * pPacketInfo->pRemainingData points into the QUIC receive buffer and stays
+ * valid until the next call to this function or to mqtt_quic_transport_recv.
+ * Use MQTT_DeserializePublish and friends on it directly.
+ *
+ * @return MQTTSuccess, MQTTNoDataAvailable, MQTTIllegalState if coreMQTT has
+ *         a packet half read, or MQTTRecvFailed
+ */
+MQTTStatus_t mqtt_quic_transport_next_packet(NetworkContext_t *pNetworkContext,
+                                          MQTTPacketInfo_t *pPacketInfo);
+
+int32_t mqtt_quic_transport_writev(NetworkContext_t *pNetworkContext,
+                                TransportOutVector_t *pIoVec,
+                                size_t ioVecCount);
+
+/**
+ * @brief Send PUBLISH/PUBACK packets held for coalescing right away.
+ *
+ * With coalescing enabled (quic_client_config_t.coalesce_bytes), call this
+ * after MQTT_Publish for a message that must not wait for the flush
+ * deadline. Other packet types are never held.
+ *
+ * @return 0 on success, -1 on error
+ */
+int32_t mqtt_quic_transport_flush(NetworkContext_t *pNetworkContext);
+
+/**
+ * @brief Send coreMQTT's unacknowledged QoS1 publishes again on a new
+ * session, e.g. after mqtt_quic_failover_switch.
+ *
+ * The transport keeps a copy of each QoS1 PUBLISH coreMQTT writes until
+ * its PUBACK comes in; MQTT_Init forgets them, the copies do not. Each is
+ * sent under a new packet ID registered with coreMQTT, so
+ * MQTT_ProcessLoop handles its PUBACK. Delivery is at least once: the
+ * old broker may have passed one on already. Publishes written outside
+ * coreMQTT (stream, pipelined) are not kept.
+ *
+ * Call after CONNACK, from the task that runs MQTT_ProcessLoop.
+ *
+ * @param timeoutMs Longest wait for send buffer space per packet
+ * @param pLost Set to the number of publishes too large to keep, may be NULL
+ * @return Number of publishes resent, or -1 if writing failed
+ */
+int32_t mqtt_quic_transport_resend_qos1(NetworkContext_t *pNetworkContext,
+                                        MQTTContext_t *pContext,
+                                        uint32_t timeoutMs,
+                                        uint32_t *pLost);
+
+/**
+ * @brief Send scheduler ordering key of a PUBLISH topic.
+ *
+ * MQTT delivers publishes to one topic in order, so a large publish must
+ * not be overtaken by a later small one to the same topic. Writers of
+ * PUBLISH packets outside coreMQTT pass it as QUIC_WRITE_FLAG_ORDER; the
+ * transport does so for coreMQTT's. Different topics may share a key,
+ * which only keeps them in order too.
+ *
+ * @return Key, never 0
+ */
+uint16_t mqtt_quic_topic_order(const char *pTopicName, size_t topicNameLength);
+
 // TransportInterface declaration
 extern TransportInterface_t xTransportInterface;
 
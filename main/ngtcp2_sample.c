@@ -34,6 +34,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include <ngtcp2/ngtcp2.h>
@@ -43,12 +44,21 @@
 #include <openssl/ssl.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
+#include <wolfssl/wolfcrypt/sha256.h>
+#include <wolfssl/wolfcrypt/asn_public.h>
 
 //#include <ev.h>
 #include "esp_ev_compat.h"
 #include "ngtcp2_sample.h"
 #include <esp_task_wdt.h>
 #include "mqtt_quic_transport.h"  // This includes esp_timer.h
+#include "quic_mem.h"
+#include "quic_netem.h"
+#include "quic_dns.h"
+#include "quic_path.h"
+#include "quic_token.h"
+#include "quic_trust.h"
+#include "quic_pipeline.h"
 
 #include "esp_log.h"
 static const char *TAG = "QUIC";
@@ -75,7 +85,6 @@ static const char *TAG = "QUIC";
 #define REMOTE_HOST "127.0.0.1"
 #define REMOTE_PORT "14567"
 #define ALPN "\x4mqtt"
-struct client g_client;  // Make the client struct global
 
 // Global configuration for dynamic hostname/port
 static quic_client_config_t g_config = {
@@ -93,52 +102,49 @@ static volatile uint64_t g_quic_n_local_streams = 0;
 SemaphoreHandle_t quic_mutex = NULL;
 static bool quic_processing = false;  // Flag to prevent reentrancy
 
-#define APP_BUFFER_SIZE 4096
+#if QUIC_PIPELINE_ENABLE
+// Received stream data goes from the I/O task to the MQTT task through a
+// lock-free ring. The peer never has more than APP_RECV_WINDOW unread
+// bytes outstanding, so the ring holds exactly that. A frame crossing the
+// end of the ring is copied to app_recv_frame for a contiguous view.
+static uint8_t app_recv_buffer[APP_RECV_WINDOW];
+static uint8_t app_recv_frame[APP_RECV_WINDOW];
+static quic_spsc_ring_t app_recv_ring;
+// Ring bytes whose flow control credit went back to the peer; only the
+// I/O task moves it, see client_return_credit
+static atomic_size_t app_recv_credited;
+// The MQTT task wakes the I/O task with this once enough is consumed
+static ev_async app_recv_credit_async;
+#else
+// The receive buffer is twice the stream flow control window: the peer can
+// never have more than APP_RECV_WINDOW unread bytes outstanding, so
+// compacting once read_pos passes the window always leaves room and keeps
+// packet views handed to the MQTT task stable in between.
+#define APP_BUFFER_SIZE (2 * APP_RECV_WINDOW)
 static uint8_t app_recv_buffer[APP_BUFFER_SIZE];
 static size_t app_recv_buffer_len = 0;
 static size_t app_recv_buffer_read_pos = 0;
+#endif
 
-static uint64_t timestamp(void) {
-  return esp_timer_get_time() * 1000;
-}
-
-static int create_sock(struct sockaddr *addr, socklen_t *paddrlen,
-                       const char *host, const char *port) {
-  struct addrinfo hints = {0};
-  struct addrinfo *res, *rp;
-  int rv;
-  int fd = -1;
-
-  hints.ai_flags = AF_UNSPEC;
-  hints.ai_socktype = SOCK_DGRAM;
-
-  rv = getaddrinfo(host, port, &hints, &res);
-  if (rv != 0) {
-    // Replace gai_strerror with displaying the error code directly
-    ESP_LOGE(TAG, "getaddrinfo failed with error code: %d", rv);
-    return -1;
-  }
-
-  for (rp = res; rp; rp = rp->ai_next) {
-    fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    if (fd == -1) {
-      continue;
-    }
-
-    break;
-  }
-
-  if (fd == -1) {
-    goto end;
-  }
+// Outgoing stream data is kept here until the peer acknowledges it, since
+// ngtcp2 references (and may retransmit) the bytes without copying them.
+static uint8_t app_send_buffer[APP_SEND_BUFFER_SIZE];
 
-  *paddrlen = rp->ai_addrlen;
-  memcpy(addr, rp->ai_addr, rp->ai_addrlen);
+// Whom to tell when send buffer space comes back, see
+// quic_client_set_send_credit_cb
+static struct {
+  quic_send_credit_cb cb;
+  void *user_data;
+  size_t min_free;
+  bool armed;  // A write was refused or left less than min_free
+} send_credit;
 
-end:
-  freeaddrinfo(res);
+static quic_client_stats_t g_stats;
+// The standby's own counters, reported as quic_client_stats_t.standby_*
+static quic_client_stats_t g_standby_stats;
 
-  return fd;
+static uint64_t timestamp(void) {
+  return esp_timer_get_time() * 1000;
 }
 
 static int connect_sock(struct sockaddr *local_addr, socklen_t *plocal_addrlen,
@@ -163,28 +169,117 @@ static int connect_sock(struct sockaddr *local_addr, socklen_t *plocal_addrlen,
   return 0;
 }
 
+// UDP socket connected to remote, -1 if that address cannot be used
+static int create_sock(const quic_dns_addr_t *remote,
+                       struct sockaddr_storage *local_addr,
+                       socklen_t *plocal_addrlen) {
+  int fd;
+
+  fd = socket(remote->addr.ss_family, SOCK_DGRAM, 0);
+  if (fd == -1) {
+    ESP_LOGW(TAG, "socket: %s", strerror(errno));
+    return -1;
+  }
+
+  *plocal_addrlen = sizeof(*local_addr);
+  if (connect_sock((struct sockaddr *)local_addr, plocal_addrlen, fd,
+                   (const struct sockaddr *)&remote->addr,
+                   remote->addrlen) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
 struct client {
   ngtcp2_crypto_conn_ref conn_ref;
   int fd;
   struct sockaddr_storage local_addr;
   socklen_t local_addrlen;
+  struct sockaddr_storage remote_addr;  // Where fd sends to
+  socklen_t remote_addrlen;
   SSL_CTX *ssl_ctx;
   SSL *ssl;
   ngtcp2_conn *conn;
 
   struct {
     int64_t stream_id;
-    const uint8_t *data;
-    size_t datalen;
-    size_t nwrite;
+    // Stream offsets; bytes in [acked, queued) live in app_send_buffer
+    uint64_t acked;   // acknowledged by the peer, may be overwritten
+    uint64_t nwrite;  // handed to ngtcp2
+    uint64_t flushed; // released for sending, the rest is held for coalescing
+    uint64_t queued;  // appended by the application
+    ngtcp2_tstamp hold_expiry;  // when held data must go, UINT64_MAX if none
   } stream;
 
+  // The MQTT packets in [head, stream.queued), in send order. Bytes below
+  // stream.nwrite belong to ngtcp2; those above may still be reordered,
+  // see client_sched_insert.
+  struct {
+    uint64_t head;  // stream offset of pkts[0]
+    struct {
+      uint32_t len;
+      uint8_t cls;           // quic_send_class_t
+      uint16_t order;        // QUIC_WRITE_FLAG_ORDER key, 0 for none
+      bool started;          // first byte handed to ngtcp2
+      ngtcp2_tstamp queued;
+    } pkts[QUIC_SEND_MAX_PENDING];
+    size_t npkts;
+    bool open;           // The next write continues the last packet
+    TaskHandle_t owner;  // Task writing the open packet
+    uint64_t open_off;   // Stream offset the open packet starts at
+  } sched;
+
+  const char *hostname;         // Broker this connection goes to
+  quic_client_stats_t *stats;   // g_stats, or g_standby_stats
+  ngtcp2_tstamp started;        // Connection setup began
+  bool standby;                 // Warm standby, not used by MQTT yet
+  bool handshake_done;
+  bool closed;                  // client_close ran
+  uint64_t max_local_streams;
+
   ngtcp2_ccerr last_error;
+  bool key_pinned;  // The server's key matched server_key_sha256
+  int trust_depth;  // Lowest chain depth verified with ca_store, 0 for none
+  // The idle timeout expired or the peer stopped answering, it is gone
+  bool idle_closed;
+  // When a packet left with nothing heard from the peer since and data in
+  // flight, 0 once it answers. See client_peer_gone
+  ngtcp2_tstamp unanswered;
+
+  // Received datagrams no packet of ours acknowledged yet, see
+  // client_ack_deferrable
+  struct {
+    uint32_t pkts;
+    ngtcp2_tstamp first;  // when the first of them came in
+    size_t credit;        // flow control credit returned since
+  } ack;
+
+  // Happy eyeballs: a second socket, to the other address family, while
+  // no answer came in on either path yet. See client_race_send.
+  struct {
+    int fd;  // -1 when not racing
+    struct sockaddr_storage remote_addr;
+    socklen_t remote_addrlen;
+    // Datagrams go to fd too from here on: QUIC_RACE_DELAY_MS after the
+    // first one, UINT64_MAX before it and 0 once started
+    ngtcp2_tstamp start;
+    quic_pkt_buf_t *flight[QUIC_RACE_FLIGHT_MAX];  // Sent before start
+    size_t nflight;
+    ev_io rev;
+  } race;
 
   ev_io rev;
   ev_timer timer;
 };
 
+// Two connection slots: the one MQTT runs on and a warm standby to
+// another broker, see quic_client_standby_start
+static struct client g_conns[2];
+static struct client *g_client = &g_conns[0];
+static struct client *g_standby;  // NULL without a standby
+
 static int numeric_host_family(const char *hostname, int family) {
   uint8_t dst[sizeof(struct in6_addr)];
   return inet_pton(family, hostname, dst) == 1;
@@ -195,27 +290,300 @@ static int numeric_host(const char *hostname) {
          numeric_host_family(hostname, AF_INET6);
 }
 
-static int client_ssl_init(struct client *c) {
-  c->ssl_ctx = SSL_CTX_new(TLS_client_method());
-  if (!c->ssl_ctx) {
+// Key exchange groups, cheapest first: the ESP32-C3 has no ECC
+// accelerator and X25519 is several times faster than P-256 in software.
+// The key share sent in the first flight is for the first group.
+static int tls_groups[] = {
+#ifdef HAVE_CURVE25519
+  WOLFSSL_ECC_X25519,
+#endif
+  WOLFSSL_ECC_SECP256R1,
+};
+
+// TLS state kept across connections: the configured context and an SSL
+// object with its key share already generated, see
+// quic_client_prepare_handshake. tls_lock guards both pointers.
+static SSL_CTX *g_ssl_ctx;
+static SSL *g_ssl_spare;
+static portMUX_TYPE tls_lock = portMUX_INITIALIZER_UNLOCKED;
+// CA certificates already in g_ssl_ctx; only the QUIC task loads them
+static const char *g_ssl_ca_loaded;
+
+static SSL_CTX *client_ssl_ctx(void) {
+  SSL_CTX *ctx;
+
+  taskENTER_CRITICAL(&tls_lock);
+  ctx = g_ssl_ctx;
+  taskEXIT_CRITICAL(&tls_lock);
+  if (ctx) {
+    return ctx;
+  }
+
+  ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx) {
     ESP_LOGE(TAG, "SSL_CTX_new: %s", ERR_error_string(ERR_get_error(), NULL));
-    return -1;
+    return NULL;
   }
 
-  if (ngtcp2_crypto_wolfssl_configure_client_context(c->ssl_ctx) != 0) {
+  if (ngtcp2_crypto_wolfssl_configure_client_context(ctx) != 0) {
     ESP_LOGE(TAG, "ngtcp2_crypto_wolfssl_configure_client_context failed");
-    return -1;
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+
+  wolfSSL_CTX_set_groups(ctx, tls_groups, (int)(sizeof(tls_groups) / sizeof(tls_groups[0])));
+  wolfSSL_CTX_set_verify(ctx, WOLFSSL_VERIFY_NONE, NULL);
+
+  // Another task may have been quicker
+  taskENTER_CRITICAL(&tls_lock);
+  if (!g_ssl_ctx) {
+    g_ssl_ctx = ctx;
+    ctx = NULL;
+  }
+  taskEXIT_CRITICAL(&tls_lock);
+  if (ctx) {
+    SSL_CTX_free(ctx);
   }
 
-  wolfSSL_CTX_UseSNI(c->ssl_ctx, WOLFSSL_SNI_HOST_NAME, g_config.hostname, strlen(g_config.hostname) + 1);
-  wolfSSL_CTX_set_verify(c->ssl_ctx, WOLFSSL_VERIFY_NONE, NULL);
+  return g_ssl_ctx;
+}
 
-  c->ssl = SSL_new(c->ssl_ctx);
-  if (!c->ssl) {
+static SSL *client_ssl_new(SSL_CTX *ctx) {
+  SSL *ssl = SSL_new(ctx);
+  if (!ssl) {
     ESP_LOGE(TAG, "SSL_new: %s", ERR_error_string(ERR_get_error(), NULL));
+    return NULL;
+  }
+
+  // Generates the key pair right away rather than in the first flight
+  if (wolfSSL_UseKeyShare(ssl, (unsigned short)tls_groups[0]) != WOLFSSL_SUCCESS) {
+    ESP_LOGW(TAG, "Key share not generated ahead, the handshake will do it");
+  }
+
+  return ssl;
+}
+
+int quic_client_prepare_handshake(void) {
+  SSL_CTX *ctx = client_ssl_ctx();
+  SSL *ssl;
+  bool prepared;
+  int64_t start;
+
+  if (!ctx) {
+    return -1;
+  }
+
+  taskENTER_CRITICAL(&tls_lock);
+  prepared = g_ssl_spare != NULL;
+  taskEXIT_CRITICAL(&tls_lock);
+  if (prepared) {
+    return 0;
+  }
+
+  start = esp_timer_get_time();
+  ssl = client_ssl_new(ctx);
+  if (!ssl) {
+    return -1;
+  }
+
+  taskENTER_CRITICAL(&tls_lock);
+  if (!g_ssl_spare) {
+    g_ssl_spare = ssl;
+    ssl = NULL;
+  }
+  taskEXIT_CRITICAL(&tls_lock);
+  if (ssl) {
+    SSL_free(ssl);
+  }
+
+  ESP_LOGI(TAG, "Key share prepared in %lld us", (long long)(esp_timer_get_time() - start));
+  return 0;
+}
+
+// Whether the server's SubjectPublicKeyInfo hashes to the pin. A raw
+// public key is the SubjectPublicKeyInfo, a certificate contains it.
+static bool client_key_matches(SSL *ssl, const WOLFSSL_BUFFER_INFO *cert) {
+  uint8_t spki[640];
+  word32 spkilen = sizeof(spki);
+  uint8_t hash[WC_SHA256_DIGEST_SIZE];
+  const uint8_t *key = cert->buffer;
+  word32 keylen = cert->length;
+  int type = WOLFSSL_CERT_TYPE_X509;
+
+#ifdef HAVE_RPK
+  wolfSSL_get_negotiated_server_cert_type(ssl, &type);
+#endif
+  if (type != WOLFSSL_CERT_TYPE_RPK) {
+    if (wc_GetSubjectPubKeyInfoDerFromCert(cert->buffer, cert->length,
+                                           spki, &spkilen) != 0) {
+      return false;
+    }
+    key = spki;
+    keylen = spkilen;
+  }
+
+  if (wc_Sha256Hash(key, keylen, hash) != 0) {
+    return false;
+  }
+  return memcmp(hash, g_config.server_key_sha256, sizeof(hash)) == 0;
+}
+
+// The host name check for a certificate at error_depth whose failure is
+// overridden; wolfSSL leaves it out after any other error
+static bool client_host_verify(struct client *c, WOLFSSL_X509_STORE_CTX *store) {
+  if (store->error_depth == 0 && !numeric_host(c->hostname) &&
+      wolfSSL_X509_check_host(store->current_cert, c->hostname,
+                              strlen(c->hostname), 0, NULL) != WOLFSSL_SUCCESS) {
+    ESP_LOGE(TAG, "Server certificate is not for %s", c->hostname);
+    return false;
+  }
+  return true;
+}
+
+// wolfSSL only knows the CAs of ca_pem, so a chain anchored in ca_store
+// fails with its issuer missing. Look the issuer up there instead; other
+// failures stand. Returns 1 if the certificate at error_depth verified.
+static int client_trust_verify(struct client *c, WOLFSSL_X509_STORE_CTX *store) {
+  int depth = store->error_depth;
+  const WOLFSSL_BUFFER_INFO *cert;
+  int rv;
+
+  if ((store->error != ASN_NO_SIGNER_E &&
+       store->error != X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT &&
+       store->error != X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY) ||
+      depth < 0 || depth >= store->totalCerts) {
+    return 0;
+  }
+  if (depth > 0 && wolfSSL_X509_get_isCA(store->current_cert) != 1) {
+    return 0;
+  }
+
+  cert = &store->certs[depth];
+  if (c->trust_depth == depth + 1) {
+    // wolfSSL does not know the intermediate accepted from ca_store, so
+    // the certificate it signed comes back without issuer as well
+    const WOLFSSL_BUFFER_INFO *issuer = &store->certs[depth + 1];
+    rv = quic_trust_verify_signed_by(cert->buffer, cert->length,
+                                     issuer->buffer, issuer->length);
+  } else {
+    rv = quic_trust_verify(cert->buffer, cert->length);
+  }
+  if (rv != 0) {
+    return 0;
+  }
+
+  // wolfSSL skips the host name check after a failed signature check
+  if (!client_host_verify(c, store)) {
+    return 0;
+  }
+
+  c->trust_depth = depth;
+  return 1;
+}
+
+static int client_verify_cb(int preverify, WOLFSSL_X509_STORE_CTX *store) {
+  SSL *ssl = wolfSSL_X509_STORE_CTX_get_ex_data(
+    store, wolfSSL_get_ex_data_X509_STORE_CTX_idx());
+  ngtcp2_crypto_conn_ref *conn_ref = ssl ? SSL_get_app_data(ssl) : NULL;
+  struct client *c = conn_ref ? conn_ref->user_data : NULL;
+
+  if (!preverify && c && g_config.verify == QUIC_TLS_VERIFY_CHAIN) {
+    if (quic_trust_waive_date_error(store->error)) {
+      // Only the dates failed, see QUIC_TRUST_REQUIRE_CLOCK
+      preverify = client_host_verify(c, store);
+    } else if (g_config.ca_store) {
+      preverify = client_trust_verify(c, store);
+    }
+  }
+
+  if (!g_config.server_key_sha256) {
+    return preverify;
+  }
+
+  // The pin is about the server's own key, at depth 0. The CAs above it
+  // do not matter when only the key is checked.
+  if (store->error_depth > 0) {
+    return g_config.verify == QUIC_TLS_VERIFY_PINNED_KEY ? 1 : preverify;
+  }
+  if (!preverify && g_config.verify == QUIC_TLS_VERIFY_CHAIN) {
+    return 0;
+  }
+  if (!c || store->totalCerts < 1 ||
+      !client_key_matches(ssl, &store->certs[0])) {
+    ESP_LOGE(TAG, "Server key does not match the pinned key");
+    return 0;
+  }
+
+  c->key_pinned = true;
+  return 1;
+}
+
+static int client_ssl_verify_init(struct client *c) {
+  if (g_config.verify == QUIC_TLS_VERIFY_NONE) {
+    // The context default
+    return 0;
+  }
+
+  if (g_config.verify == QUIC_TLS_VERIFY_PINNED_KEY && !g_config.server_key_sha256) {
+    ESP_LOGE(TAG, "QUIC_TLS_VERIFY_PINNED_KEY needs server_key_sha256");
+    return -1;
+  }
+
+  if (g_config.verify == QUIC_TLS_VERIFY_CHAIN) {
+    if (g_config.ca_pem && g_config.ca_pem != g_ssl_ca_loaded) {
+      if (wolfSSL_CTX_load_verify_buffer(c->ssl_ctx,
+                                         (const unsigned char *)g_config.ca_pem,
+                                         (long)strlen(g_config.ca_pem),
+                                         WOLFSSL_FILETYPE_PEM) != WOLFSSL_SUCCESS) {
+        ESP_LOGE(TAG, "Cannot load the CA certificates");
+        return -1;
+      }
+      g_ssl_ca_loaded = g_config.ca_pem;
+    }
+    if (g_config.ca_store && quic_trust_open(g_config.ca_store) != 0) {
+      return -1;
+    }
+    if (!numeric_host(c->hostname)) {
+      wolfSSL_check_domain_name(c->ssl, c->hostname);
+    }
+  }
+
+#ifdef HAVE_RPK
+  if (g_config.verify == QUIC_TLS_VERIFY_PINNED_KEY) {
+    // A raw public key if the server has one, else its certificate
+    static const char cert_types[] = { WOLFSSL_CERT_TYPE_RPK, WOLFSSL_CERT_TYPE_X509 };
+    wolfSSL_set_server_cert_type(c->ssl, cert_types, (int)sizeof(cert_types));
+  }
+#endif
+
+  wolfSSL_set_verify(c->ssl, WOLFSSL_VERIFY_PEER, client_verify_cb);
+  return 0;
+}
+
+static int client_ssl_init(struct client *c) {
+  uint64_t start;
+
+  c->ssl_ctx = client_ssl_ctx();
+  if (!c->ssl_ctx) {
     return -1;
   }
 
+  taskENTER_CRITICAL(&tls_lock);
+  c->ssl = g_ssl_spare;
+  g_ssl_spare = NULL;
+  taskEXIT_CRITICAL(&tls_lock);
+
+  if (c->ssl) {
+    ESP_LOGI(TAG, "Using pre-generated key share");
+  } else {
+    start = timestamp();
+    c->ssl = client_ssl_new(c->ssl_ctx);
+    if (!c->ssl) {
+      return -1;
+    }
+    c->stats->keygen_us = (uint32_t)((timestamp() - start) / 1000);
+  }
+
   SSL_set_app_data(c->ssl, &c->conn_ref);
   SSL_set_connect_state(c->ssl);
   
@@ -231,11 +599,11 @@ static int client_ssl_init(struct client *c) {
     ESP_LOGE(TAG, "Invalid ALPN length: %zu", alpn_len);
   }
   
-  if (!numeric_host(g_config.hostname)) {
-    SSL_set_tlsext_host_name(c->ssl, g_config.hostname);
+  if (!numeric_host(c->hostname)) {
+    SSL_set_tlsext_host_name(c->ssl, c->hostname);
   }
 
-  return 0;
+  return client_ssl_verify_init(c);
 }
 
 static void rand_cb(uint8_t *dest, size_t destlen,
@@ -250,6 +618,33 @@ static void rand_cb(uint8_t *dest, size_t destlen,
   }
 }
 
+static uint16_t client_remote_port(const struct client *c) {
+  if (c->remote_addr.ss_family == AF_INET6) {
+    return ntohs(((const struct sockaddr_in6 *)&c->remote_addr)->sin6_port);
+  }
+  return ntohs(((const struct sockaddr_in *)&c->remote_addr)->sin_port);
+}
+
+static int recv_retry_cb(ngtcp2_conn *conn, const ngtcp2_pkt_hd *hd,
+                         void *user_data) {
+  struct client *c = user_data;
+
+  c->stats->retries++;
+  ESP_LOGI(TAG, "%s asked for address validation (Retry)", c->hostname);
+  return ngtcp2_crypto_recv_retry_cb(conn, hd, user_data);
+}
+
+// Saves the Retry round trip on the next connection to this server
+static int recv_new_token_cb(ngtcp2_conn *conn, const uint8_t *token,
+                             size_t tokenlen, void *user_data) {
+  struct client *c = user_data;
+  (void)conn;
+
+  c->stats->new_tokens++;
+  quic_token_save(c->hostname, client_remote_port(c), token, tokenlen);
+  return 0;
+}
+
 static int get_new_connection_id_cb(ngtcp2_conn *conn, ngtcp2_cid *cid,
                                     uint8_t *token, size_t cidlen,
                                     void *user_data) {
@@ -269,11 +664,69 @@ static int get_new_connection_id_cb(ngtcp2_conn *conn, ngtcp2_cid *cid,
   return 0;
 }
 
+// Apply keep_alive_ms, capped at half the idle timeout in effect so a
+// PING and its ACK fit in before either side gives up. The peer's
+// max_idle_timeout is known once the handshake has completed. A standby
+// carries no traffic of its own, so by default it pings as rarely as it
+// can without going idle.
+static void client_set_keep_alive(struct client *c) {
+  const ngtcp2_transport_params *remote = ngtcp2_conn_get_remote_transport_params(c->conn);
+  ngtcp2_duration idle = (ngtcp2_duration)g_config.idle_timeout_ms * NGTCP2_MILLISECONDS;
+  ngtcp2_duration timeout = (ngtcp2_duration)(c->standby ? g_config.standby_keep_alive_ms
+                                                         : g_config.keep_alive_ms) * NGTCP2_MILLISECONDS;
+
+  if (remote && remote->max_idle_timeout && (!idle || remote->max_idle_timeout < idle)) {
+    idle = remote->max_idle_timeout;
+  }
+  if (c->standby && !timeout) {
+    timeout = idle / 2;
+  }
+  if (timeout && idle && timeout > idle / 2) {
+    timeout = idle / 2;
+  }
+
+  ngtcp2_conn_set_keep_alive_timeout(c->conn, timeout ? timeout : UINT64_MAX);
+  c->stats->keep_alive_ms = (uint32_t)(timeout / NGTCP2_MILLISECONDS);
+  c->stats->idle_timeout_ms = (uint32_t)(idle / NGTCP2_MILLISECONDS);
+}
+
 static int handshake_completed_cb(ngtcp2_conn *conn, void *user_data) {
+    struct client *c = user_data;
+    int cert_type = WOLFSSL_CERT_TYPE_X509;
     (void)conn;
-    (void)user_data;
-    ESP_LOGI(TAG, "QUIC handshake completed callback triggered!");
-    g_quic_handshake_completed = true;
+
+    // Fail closed should the TLS stack ever skip the verify callback
+    if (g_config.verify != QUIC_TLS_VERIFY_NONE && g_config.server_key_sha256 &&
+        !c->key_pinned) {
+        ESP_LOGE(TAG, "Server key was not checked against the pin");
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+#ifdef HAVE_RPK
+    wolfSSL_get_negotiated_server_cert_type(c->ssl, &cert_type);
+#endif
+    c->stats->verify = (uint8_t)g_config.verify;
+    c->stats->server_rpk = cert_type == WOLFSSL_CERT_TYPE_RPK;
+    c->stats->handshake_tx_bytes = (uint32_t)c->stats->tx_bytes;
+    c->stats->handshake_rx_bytes = (uint32_t)c->stats->rx_bytes;
+
+    c->stats->handshake_us = (uint32_t)((timestamp() - c->started) / 1000);
+    c->stats->ip_version = c->remote_addr.ss_family == AF_INET6 ? 6 : 4;
+    c->handshake_done = true;
+    if (c->standby) {
+        ESP_LOGI(TAG, "Standby to %s ready (%lu ms, IPv%u)", c->hostname,
+                 (unsigned long)(c->stats->handshake_us / 1000), c->stats->ip_version);
+    } else {
+        ESP_LOGI(TAG, "QUIC handshake completed callback triggered! (%lu ms, IPv%u)",
+                 (unsigned long)(c->stats->handshake_us / 1000), c->stats->ip_version);
+        g_quic_handshake_completed = true;
+    }
+    client_set_keep_alive(c);
+    if (c->stats->keep_alive_ms) {
+        ESP_LOGI(TAG, "Keep-alive every %lu ms, idle timeout %lu ms",
+                 (unsigned long)c->stats->keep_alive_ms, (unsigned long)c->stats->idle_timeout_ms);
+    }
+    // Try this address first next time
+    quic_dns_connected(c->hostname, (struct sockaddr *)&c->remote_addr);
     return 0;
 }
 
@@ -283,14 +736,33 @@ static int recv_stream_data(ngtcp2_conn *conn, uint32_t flags,
                            const uint8_t *data, size_t datalen,
                            void *user_data, void *stream_user_data);
 
+static int acked_stream_data_offset(ngtcp2_conn *conn, int64_t stream_id,
+                                    uint64_t offset, uint64_t datalen,
+                                    void *user_data, void *stream_user_data) {
+  struct client *c = user_data;
+  (void)conn;
+  (void)stream_user_data;
+
+  // ngtcp2 reports acknowledged data in order, so the range can be released
+  if (stream_id == c->stream.stream_id) {
+    c->stream.acked = offset + datalen;
+  }
+
+  return 0;
+}
+
 static int extend_max_local_streams_bidi(ngtcp2_conn *conn,
                                          uint64_t max_streams,
                                          void *user_data) {
+  struct client *c = user_data;
   (void)conn;
-  (void)user_data; 
   ESP_LOGI(TAG, "Extending max local streams bidi to %" PRIu64 "\n", max_streams);
-  g_quic_connected = true;
-  g_quic_n_local_streams = max_streams;
+  c->max_local_streams = max_streams;
+  // A standby's streams only count once quic_client_failover promotes it
+  if (!c->standby) {
+    g_quic_connected = true;
+    g_quic_n_local_streams = max_streams;
+  }
   return 0;
 }
 
@@ -329,8 +801,9 @@ static int client_quic_init(struct client *c,
     .encrypt = ngtcp2_crypto_encrypt_cb,
     .decrypt = ngtcp2_crypto_decrypt_cb,
     .hp_mask = ngtcp2_crypto_hp_mask_cb,
-    .recv_retry = ngtcp2_crypto_recv_retry_cb,
+    .recv_retry = recv_retry_cb,
     .recv_stream_data = recv_stream_data,  // Add this callback!
+    .acked_stream_data_offset = acked_stream_data_offset,
     .handshake_completed = handshake_completed_cb,  // Add handshake completion callback
     .extend_max_local_streams_bidi = extend_max_local_streams_bidi,
     .rand = rand_cb,
@@ -340,10 +813,14 @@ static int client_quic_init(struct client *c,
     .delete_crypto_cipher_ctx = ngtcp2_crypto_delete_crypto_cipher_ctx_cb,
     .get_path_challenge_data = ngtcp2_crypto_get_path_challenge_data_cb,
     .version_negotiation = ngtcp2_crypto_version_negotiation_cb,
+    .recv_new_token = recv_new_token_cb,
   };
   ngtcp2_cid dcid, scid;
   ngtcp2_settings settings;
   ngtcp2_transport_params params;
+  quic_path_state_t path_state;
+  uint8_t token[QUIC_TOKEN_MAX_LEN];
+  size_t tokenlen;
   int rv;
 
   dcid.datalen = NGTCP2_MIN_INITIAL_DCIDLEN;
@@ -362,12 +839,35 @@ static int client_quic_init(struct client *c,
   settings.initial_ts = timestamp();
   ESP_LOGI(TAG, "===>  INITIAL TS: %llu", (unsigned long long)settings.initial_ts);
   settings.log_printf = log_printf;
+  // Probe as soon as the last connection to this broker says is worth it
+  if (quic_path_lookup(remote_addr, &path_state) == 0) {
+    settings.initial_rtt = (ngtcp2_duration)quic_path_initial_rtt_ms(&path_state) * NGTCP2_MILLISECONDS;
+    c->stats->path_seeded = true;
+    c->stats->path_cwnd_hint = path_state.cwnd;
+  }
+  c->stats->initial_rtt_ms = (uint32_t)(settings.initial_rtt / NGTCP2_MILLISECONDS);
+  // ngtcp2 copies the token
+  if (quic_token_take(c->hostname, client_remote_port(c), token, &tokenlen) == 0) {
+    settings.token = token;
+    settings.tokenlen = tokenlen;
+    c->stats->token_used = true;
+  }
 
   ngtcp2_transport_params_default(&params);
 
   params.initial_max_streams_uni = 3;
-  params.initial_max_stream_data_bidi_local = 128 * 1024;
+  // Credit is returned as the application consumes data, see
+  // client_consume_application_data
+  params.initial_max_stream_data_bidi_local = APP_RECV_WINDOW;
   params.initial_max_data = 1024 * 1024;
+  // Datagrams must fit into a single pool buffer
+  params.max_udp_payload_size = QUIC_PKT_BUF_SIZE;
+  params.max_idle_timeout = (ngtcp2_duration)g_config.idle_timeout_ms * NGTCP2_MILLISECONDS;
+  // The ceiling for quic_client_set_ack_frequency. ack_thresh stays at
+  // ngtcp2's default, the tolerance is applied in client_write
+  if (g_config.max_ack_delay_ms > 0) {
+    params.max_ack_delay = (ngtcp2_duration)g_config.max_ack_delay_ms * NGTCP2_MILLISECONDS;
+  }
 
   rv =
     ngtcp2_conn_client_new(&c->conn, &dcid, &scid, &path, NGTCP2_PROTO_VER_V1,
@@ -378,31 +878,110 @@ static int client_quic_init(struct client *c,
   }
 
   ngtcp2_conn_set_tls_native_handle(c->conn, c->ssl);
+  client_set_keep_alive(c);
+  c->stats->max_ack_delay_ms = (uint32_t)(
+    ngtcp2_conn_get_local_transport_params(c->conn)->max_ack_delay / NGTCP2_MILLISECONDS);
+
+  return 0;
+}
+
+static int client_read_pkt(struct client *c, const ngtcp2_path *path,
+                           const uint8_t *data, size_t datalen) {
+  ngtcp2_pkt_info pi = {0};
+  int rv;
+
+  rv = ngtcp2_conn_read_pkt(c->conn, path, &pi, data, datalen, timestamp());
+  if (rv != 0) {
+    ESP_LOGE(TAG, "ngtcp2_conn_read_pkt: %s", ngtcp2_strerror(rv));
+    if (!c->last_error.error_code) {
+      if (rv == NGTCP2_ERR_CRYPTO) {
+        ngtcp2_ccerr_set_tls_alert(
+          &c->last_error, ngtcp2_conn_get_tls_alert(c->conn), NULL, 0);
+      } else {
+        ngtcp2_ccerr_set_liberr(&c->last_error, rv, NULL, 0);
+      }
+    }
+    return -1;
+  }
+  c->unanswered = 0;
 
   return 0;
 }
 
+#if QUIC_NETEM_ENABLE
+static int client_sendmsg(struct client *c, const uint8_t *data, size_t datalen);
+
+/*
+ * Hand over datagrams whose impairment delay has passed: outgoing ones to
+ * the socket, incoming ones to ngtcp2. Delayed incoming datagrams all
+ * came in on the connection's current path. Only the active connection is
+ * impaired; a standby's datagrams never enter the queues.
+ */
+static void client_netem_release_tx(struct client *c) {
+  uint64_t now = (uint64_t)esp_timer_get_time();
+  quic_pkt_buf_t *pb;
+
+  while ((pb = quic_netem_poll(QUIC_NETEM_TX, now)) != NULL) {
+    // A failed send is just one more lost datagram
+    client_sendmsg(c, pb->data, pb->len);
+    quic_pkt_buf_unref(pb);
+  }
+}
+
+static int client_netem_release(struct client *c) {
+  uint64_t now = (uint64_t)esp_timer_get_time();
+  quic_pkt_buf_t *pb;
+  int rv = 0;
+
+  client_netem_release_tx(c);
+
+  while (rv == 0 && (pb = quic_netem_poll(QUIC_NETEM_RX, now)) != NULL) {
+    rv = client_read_pkt(c, ngtcp2_conn_get_path(c->conn), pb->data, pb->len);
+    quic_pkt_buf_unref(pb);
+  }
+
+  return rv;
+}
+#endif
+
+static void client_race_check(struct client *c);
+
+// Discard the datagrams queued on the socket while no packet buffer is
+// free. Left there, they keep select reporting the socket readable and
+// the I/O tasks spin; dropped, they are lost packets the peer resends.
+static void client_drain(struct client *c) {
+  uint8_t byte;
+
+  // A short read discards the rest of a datagram
+  while (recv(c->fd, &byte, 1, MSG_DONTWAIT) >= 0) {
+    c->stats->rx_dropped++;
+  }
+}
+
 static int client_read(struct client *c) {
-  // @NOTE: adjust the buffer size as needed
-  uint8_t buf[16384];
-  struct sockaddr_storage addr;
-  struct iovec iov = {
-    .iov_base = buf,
-    .iov_len = sizeof(buf),
-  };
+  quic_pkt_buf_t *pb;
+  struct iovec iov;
   struct msghdr msg = {0};
   ssize_t nread;
-  ngtcp2_path path;
-  ngtcp2_pkt_info pi = {0};
-  int rv;
+  int rv = 0;
+
+  if (c->race.fd != -1) {
+    client_race_check(c);
+  }
+
+  pb = quic_pkt_buf_alloc();
+  if (!pb) {
+    client_drain(c);
+    return 0;
+  }
+
+  iov.iov_base = pb->data;
+  iov.iov_len = sizeof(pb->data);
 
-  msg.msg_name = &addr;
   msg.msg_iov = &iov;
   msg.msg_iovlen = 1;
 
   for (;;) {
-    msg.msg_namelen = sizeof(addr);
-
     nread = recvmsg(c->fd, &msg, MSG_DONTWAIT);
 
     if (nread == -1) {
@@ -413,32 +992,48 @@ static int client_read(struct client *c) {
       break;
     }
 
-    path.local.addrlen = c->local_addrlen;
-    path.local.addr = (struct sockaddr *)&c->local_addr;
-    path.remote.addrlen = msg.msg_namelen;
-    path.remote.addr = msg.msg_name;
+    c->stats->rx_datagrams++;
+    c->stats->rx_bytes += (uint64_t)nread;
+
+    if (msg.msg_flags & MSG_TRUNC) {
+      ESP_LOGW(TAG, "Dropping truncated datagram");
+      continue;
+    }
 
-    rv = ngtcp2_conn_read_pkt(c->conn, &path, &pi, buf, (size_t)nread,
-                              timestamp());
+#if QUIC_NETEM_ENABLE
+    if (c == g_client && quic_netem_active()) {
+      quic_netem_submit(QUIC_NETEM_RX, pb->data, (size_t)nread,
+                        (uint64_t)esp_timer_get_time());
+      continue;
+    }
+#endif
+
+    // The socket is connected, so everything comes in on the connection's
+    // path. ngtcp2 cannot move a client to another address before the
+    // handshake, so after the second address wins a race the path still
+    // names the first one; only the socket decides where datagrams go.
+    rv = client_read_pkt(c, ngtcp2_conn_get_path(c->conn), pb->data,
+                         (size_t)nread);
     if (rv != 0) {
-      ESP_LOGE(TAG, "ngtcp2_conn_read_pkt: %s", ngtcp2_strerror(rv));
-      if (!c->last_error.error_code) {
-        if (rv == NGTCP2_ERR_CRYPTO) {
-          ngtcp2_ccerr_set_tls_alert(
-            &c->last_error, ngtcp2_conn_get_tls_alert(c->conn), NULL, 0);
-        } else {
-          ngtcp2_ccerr_set_liberr(&c->last_error, rv, NULL, 0);
-        }
-      }
-      return -1;
+      break;
+    }
+    if (c->ack.pkts++ == 0) {
+      c->ack.first = timestamp();
     }
   }
 
-  return 0;
+  quic_pkt_buf_unref(pb);
+
+#if QUIC_NETEM_ENABLE
+  if (rv == 0 && c == g_client) {
+    rv = client_netem_release(c);
+  }
+#endif
+
+  return rv;
 }
 
-static int client_send_packet(struct client *c, const uint8_t *data,
-                              size_t datalen) {
+static int sock_send(int fd, const uint8_t *data, size_t datalen) {
   struct iovec iov = {
     .iov_base = (uint8_t *)data,
     .iov_len = datalen,
@@ -450,7 +1045,7 @@ static int client_send_packet(struct client *c, const uint8_t *data,
   msg.msg_iovlen = 1;
 
   do {
-    nwrite = sendmsg(c->fd, &msg, 0);
+    nwrite = sendmsg(fd, &msg, 0);
   } while (nwrite == -1 && errno == EINTR);
 
   if (nwrite == -1) {
@@ -461,55 +1056,397 @@ static int client_send_packet(struct client *c, const uint8_t *data,
   return 0;
 }
 
-static size_t client_get_message(struct client *c, int64_t *pstream_id,
-                                 int *pfin, ngtcp2_vec *datav,
-                                 size_t datavcnt) {
-  if (datavcnt == 0) {
-    return 0;
-  }
+static void read_cb(struct ev_loop *loop, ev_io *w, int revents);
 
-  if (c->stream.stream_id != -1 && c->stream.nwrite < c->stream.datalen) {
-    *pstream_id = c->stream.stream_id;
-    *pfin = 1;
-    datav->base = (uint8_t *)c->stream.data + c->stream.nwrite;
-    datav->len = c->stream.datalen - c->stream.nwrite;
-    return 1;
+static void client_race_init(struct client *c, const quic_dns_addr_t *remote) {
+  struct sockaddr_storage local_addr;
+  socklen_t local_addrlen;
+
+  c->race.fd = create_sock(remote, &local_addr, &local_addrlen);
+  if (c->race.fd == -1) {
+    return;
   }
 
-  *pstream_id = -1;
-  *pfin = 0;
-  datav->base = NULL;
-  datav->len = 0;
+  memcpy(&c->race.remote_addr, &remote->addr, remote->addrlen);
+  c->race.remote_addrlen = remote->addrlen;
+  // Set when the first datagram goes out
+  c->race.start = UINT64_MAX;
+  c->stats->raced = true;
 
-  return 0;
+  ev_io_init(&c->race.rev, read_cb, c->race.fd, EV_READ);
+  c->race.rev.data = c;
+  ev_io_start(EV_DEFAULT, &c->race.rev);
 }
 
-static int client_write_streams(struct client *c) {
+// Keep the winning socket as c->fd and close the other one
+static void client_race_end(struct client *c, bool second_won) {
+  ev_io_stop(EV_DEFAULT, &c->race.rev);
+
+  if (second_won) {
+    ev_io_stop(EV_DEFAULT, &c->rev);
+    close(c->fd);
+    c->fd = c->race.fd;
+    memcpy(&c->remote_addr, &c->race.remote_addr, c->race.remote_addrlen);
+    c->remote_addrlen = c->race.remote_addrlen;
+
+    ev_io_init(&c->rev, read_cb, c->fd, EV_READ);
+    c->rev.data = c;
+    ev_io_start(EV_DEFAULT, &c->rev);
+  } else {
+    close(c->race.fd);
+  }
+  c->race.fd = -1;
+
+  for (size_t i = 0; i < c->race.nflight; i++) {
+    quic_pkt_buf_unref(c->race.flight[i]);
+  }
+  c->race.nflight = 0;
+
+  ESP_LOGI(TAG, "%s address won, continuing over IPv%d",
+           second_won ? "Second" : "First",
+           c->remote_addr.ss_family == AF_INET6 ? 6 : 4);
+}
+
+// Replay what was sent before race.start on the second socket, once
+static void client_race_start(struct client *c) {
+  for (size_t i = 0; i < c->race.nflight; i++) {
+    // A failure shows again with the next datagram
+    sock_send(c->race.fd, c->race.flight[i]->data, c->race.flight[i]->len);
+    quic_pkt_buf_unref(c->race.flight[i]);
+  }
+  c->race.nflight = 0;
+  c->race.start = 0;
+}
+
+/*
+ * The first socket with a datagram waiting wins. Peeking leaves the
+ * datagram for client_read.
+ */
+static void client_race_check(struct client *c) {
+  uint8_t b;
+
+  if (recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) >= 0) {
+    client_race_end(c, false);
+  } else if (recv(c->race.fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) >= 0) {
+    client_race_end(c, true);
+  }
+}
+
+/*
+ * While racing, datagrams go to the first address, and from race.start
+ * on to the second one as well. Until then they are kept, so that the
+ * second path starts with the whole first flight.
+ */
+static int client_race_send(struct client *c, const uint8_t *data,
+                            size_t datalen) {
+  quic_pkt_buf_t *pb;
+
+  if (c->race.start == UINT64_MAX) {
+    c->race.start = timestamp() + QUIC_RACE_DELAY_MS * NGTCP2_MILLISECONDS;
+  }
+
+  if (sock_send(c->fd, data, datalen) != 0) {
+    // E.g. an IPv6 address without an IPv6 route: no need to wait
+    ESP_LOGW(TAG, "First address failed, switching to the second");
+    client_race_start(c);
+    client_race_end(c, true);
+    return sock_send(c->fd, data, datalen);
+  }
+
+  if (timestamp() >= c->race.start) {
+    client_race_start(c);
+    if (sock_send(c->race.fd, data, datalen) != 0) {
+      client_race_end(c, false);
+    }
+  } else if (c->race.nflight < QUIC_RACE_FLIGHT_MAX &&
+             (pb = quic_pkt_buf_alloc()) != NULL) {
+    memcpy(pb->data, data, datalen);
+    pb->len = datalen;
+    c->race.flight[c->race.nflight++] = pb;
+  }
+
+  return 0;
+}
+
+static int client_sendmsg(struct client *c, const uint8_t *data,
+                          size_t datalen) {
+  if (c->race.fd != -1) {
+    return client_race_send(c, data, datalen);
+  }
+  return sock_send(c->fd, data, datalen);
+}
+
+static int client_send_packet(struct client *c, const uint8_t *data,
+                              size_t datalen) {
+  int rv;
+
+#if QUIC_NETEM_ENABLE
+  if (c == g_client && quic_netem_active()) {
+    // The impairment layer stands in for the network from here on
+    quic_netem_submit(QUIC_NETEM_TX, data, datalen, (uint64_t)esp_timer_get_time());
+    client_netem_release_tx(c);
+    rv = 0;
+  } else {
+    rv = client_sendmsg(c, data, datalen);
+  }
+#else
+  rv = client_sendmsg(c, data, datalen);
+#endif
+  if (rv != 0) {
+    return -1;
+  }
+
+  if (c->stats->tx_datagrams == 0) {
+    c->stats->first_flight_us = (uint32_t)((timestamp() - c->started) / 1000);
+  }
+  c->stats->tx_datagrams++;
+  c->stats->tx_bytes += (uint64_t)datalen;
+  // ngtcp2 puts a pending ACK into every packet
+  if (c->ack.pkts > 0) {
+    c->stats->ack_datagrams++;
+  }
+  c->ack.pkts = 0;
+  c->ack.credit = 0;
+
+  if (g_config.failover_timeout_ms && !c->unanswered) {
+    ngtcp2_conn_info info;
+
+    ngtcp2_conn_get_conn_info(c->conn, &info);
+    if (info.bytes_in_flight > 0) {
+      c->unanswered = timestamp();
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Release stream data held for coalescing once enough of it has
+ * accumulated or the oldest held write has waited long enough. In
+ * low-power mode held data also waits without a byte threshold.
+ */
+static void client_release_held_data(struct client *c, ngtcp2_tstamp ts) {
+  if (c->stream.flushed == c->stream.queued) {
+    return;
+  }
+
+  if ((g_config.coalesce_bytes == 0 && g_config.tx_slack_ms == 0) ||
+      (g_config.coalesce_bytes > 0 &&
+       c->stream.queued - c->stream.flushed >= g_config.coalesce_bytes) ||
+      ts >= c->stream.hold_expiry) {
+    c->stream.flushed = c->stream.queued;
+    c->stream.hold_expiry = UINT64_MAX;
+  }
+}
+
+static size_t client_get_message(struct client *c, int64_t *pstream_id,
+                                 int *pfin, ngtcp2_vec *datav,
+                                 size_t datavcnt) {
+  if (datavcnt == 0) {
+    return 0;
+  }
+
+  if (c->stream.stream_id != -1 && c->stream.nwrite < c->stream.flushed) {
+    size_t pos = (size_t)(c->stream.nwrite % APP_SEND_BUFFER_SIZE);
+    size_t len = (size_t)(c->stream.flushed - c->stream.nwrite);
+
+    *pstream_id = c->stream.stream_id;
+    *pfin = 0;
+    datav[0].base = app_send_buffer + pos;
+    datav[0].len = len;
+
+    if (pos + len <= APP_SEND_BUFFER_SIZE) {
+      return 1;
+    }
+
+    // Pending data wraps around the end of the ring
+    datav[0].len = APP_SEND_BUFFER_SIZE - pos;
+    if (datavcnt < 2) {
+      return 1;
+    }
+
+    datav[1].base = app_send_buffer;
+    datav[1].len = len - datav[0].len;
+    return 2;
+  }
+
+  *pstream_id = -1;
+  *pfin = 0;
+  datav->base = NULL;
+  datav->len = 0;
+
+  return 0;
+}
+
+/*
+ * Move the stream data [off, end) up by len bytes in app_send_buffer,
+ * from the back so that no byte is overwritten before it was moved.
+ */
+static void client_sched_shift(uint64_t off, uint64_t end, size_t len) {
+  while (end > off) {
+    // Both runs end within the buffer, at a position in [1, SIZE]
+    size_t src = (size_t)((end - 1) % APP_SEND_BUFFER_SIZE) + 1;
+    size_t dst = (size_t)((end - 1 + len) % APP_SEND_BUFFER_SIZE) + 1;
+    size_t n = src < dst ? src : dst;
+
+    if (n > end - off) {
+      n = (size_t)(end - off);
+    }
+    memmove(app_send_buffer + dst - n, app_send_buffer + src - n, n);
+    end -= n;
+  }
+}
+
+/*
+ * Make room for a packet of len bytes and class cls and return the stream
+ * offset to copy it to. It goes after the queued packets of its class and
+ * higher ones, ahead of lower ones ngtcp2 has not seen yet; a packet
+ * already started or one with the same ordering key is never overtaken.
+ * Continuations of an open packet and everything in FIFO mode go to the
+ * tail. Once the list is full new data joins the last packet, in arrival
+ * order.
+ */
+static uint64_t client_sched_insert(struct client *c, size_t len,
+                                    quic_send_class_t cls, uint16_t order,
+                                    bool more) {
+  uint64_t off = c->stream.queued;
+  size_t i = c->sched.npkts;
+
+  if (c->sched.open || i == QUIC_SEND_MAX_PENDING) {
+    if (!c->sched.open) {
+      c->sched.open_off = off;
+    }
+    c->sched.pkts[i - 1].len += (uint32_t)len;
+    c->sched.open = more;
+    return off;
+  }
+
+  if (!g_config.send_fifo && !more) {
+    // An open packet stays at the tail, its continuations go there too
+    while (i > 0 && c->sched.pkts[i - 1].cls > cls &&
+           (order == 0 || c->sched.pkts[i - 1].order != order) &&
+           off - c->sched.pkts[i - 1].len >= c->stream.nwrite) {
+      i--;
+      off -= c->sched.pkts[i].len;
+    }
+  }
+
+  if (i < c->sched.npkts) {
+    client_sched_shift(off, c->stream.queued, len);
+    memmove(&c->sched.pkts[i + 1], &c->sched.pkts[i],
+            (c->sched.npkts - i) * sizeof(c->sched.pkts[0]));
+    if (off < c->stream.flushed) {
+      c->stream.flushed += len;
+    }
+    c->stats->reordered++;
+  }
+  c->sched.pkts[i].len = (uint32_t)len;
+  c->sched.pkts[i].cls = (uint8_t)cls;
+  c->sched.pkts[i].order = order;
+  c->sched.pkts[i].started = false;
+  c->sched.pkts[i].queued = timestamp();
+  c->sched.npkts++;
+  c->sched.open = more;
+  c->sched.open_off = off;
+  return off;
+}
+
+/*
+ * Take the open packet back off the stream, which works as long as
+ * ngtcp2 has none of it. It is at the tail, see client_sched_insert.
+ * Returns 0 if it was dropped, -1 if part of it may be sent already.
+ */
+static int client_sched_drop_open(struct client *c) {
+  uint64_t len = c->stream.queued - c->sched.open_off;
+
+  if (c->sched.open_off < c->stream.nwrite || c->sched.npkts == 0) {
+    return -1;
+  }
+
+  // A full list merged it into the last packet, possibly with others
+  c->sched.pkts[c->sched.npkts - 1].len -= (uint32_t)len;
+  if (c->sched.pkts[c->sched.npkts - 1].len == 0) {
+    c->sched.npkts--;
+  }
+  c->stream.queued = c->sched.open_off;
+  if (c->stream.flushed > c->stream.queued) {
+    c->stream.flushed = c->stream.queued;
+  }
+  c->sched.open = false;
+  return 0;
+}
+
+/*
+ * Account the packets ngtcp2 took the first byte of and forget the ones
+ * it took completely.
+ */
+static void client_sched_advance(struct client *c, ngtcp2_tstamp ts) {
+  uint64_t off = c->sched.head;
+  size_t i, done = 0;
+
+  for (i = 0; i < c->sched.npkts && off < c->stream.nwrite; i++) {
+    if (!c->sched.pkts[i].started) {
+      uint8_t cls = c->sched.pkts[i].cls;
+      uint32_t delay = ts > c->sched.pkts[i].queued ?
+          (uint32_t)((ts - c->sched.pkts[i].queued) / NGTCP2_MICROSECONDS) : 0;
+
+      c->sched.pkts[i].started = true;
+      c->stats->class_packets[cls]++;
+      c->stats->class_delay_us[cls] += delay;
+      if (delay > c->stats->class_delay_max_us[cls]) {
+        c->stats->class_delay_max_us[cls] = delay;
+      }
+    }
+    off += c->sched.pkts[i].len;
+    if (off <= c->stream.nwrite &&
+        !(c->sched.open && i == c->sched.npkts - 1)) {
+      done = i + 1;
+      c->sched.head = off;
+    }
+  }
+
+  if (done > 0) {
+    c->sched.npkts -= done;
+    memmove(&c->sched.pkts[0], &c->sched.pkts[done],
+            c->sched.npkts * sizeof(c->sched.pkts[0]));
+  }
+}
+
+static int client_write_streams(struct client *c) {
   ngtcp2_tstamp ts = timestamp();
   ngtcp2_pkt_info pi;
   ngtcp2_ssize nwrite;
-  uint8_t buf[1452];
+  quic_pkt_buf_t *pb;
   ngtcp2_path_storage ps;
-  ngtcp2_vec datav;
+  ngtcp2_vec datav[2];
   size_t datavcnt;
   int64_t stream_id;
   ngtcp2_ssize wdatalen;
   uint32_t flags;
   int fin;
+  int rv = 0;
+  uint32_t sent = c->stats->tx_datagrams;
+
+  pb = quic_pkt_buf_alloc();
+  if (!pb) {
+    // Retry on the next timer tick
+    return 0;
+  }
 
   ngtcp2_path_storage_zero(&ps);
+  client_release_held_data(c, ts);
 
   for (;;) {
-    datavcnt = client_get_message(c, &stream_id, &fin, &datav, 1);
+    datavcnt = client_get_message(c, &stream_id, &fin, datav, 2);
 
     flags = NGTCP2_WRITE_STREAM_FLAG_MORE;
     if (fin) {
       flags |= NGTCP2_WRITE_STREAM_FLAG_FIN;
     }
 
-    nwrite = ngtcp2_conn_writev_stream(c->conn, &ps.path, &pi, buf, sizeof(buf),
-                                       &wdatalen, flags, stream_id, &datav,
-                                       datavcnt, ts);
+    nwrite = ngtcp2_conn_writev_stream(c->conn, &ps.path, &pi, pb->data,
+                                       sizeof(pb->data), &wdatalen, flags,
+                                       stream_id, datav, datavcnt, ts);
     if (nwrite < 0) {
       switch (nwrite) {
       case NGTCP2_ERR_WRITE_MORE:
@@ -518,36 +1455,194 @@ static int client_write_streams(struct client *c) {
       default:
         ESP_LOGE(TAG, "ngtcp2_conn_writev_stream: %s", ngtcp2_strerror((int)nwrite));
         ngtcp2_ccerr_set_liberr(&c->last_error, (int)nwrite, NULL, 0);
-        return -1;
+        rv = -1;
+        goto end;
       }
     }
 
     if (nwrite == 0) {
-      return 0;
+      goto end;
     }
 
     if (wdatalen > 0) {
       c->stream.nwrite += (size_t)wdatalen;
     }
 
-    if (client_send_packet(c, buf, (size_t)nwrite) != 0) {
+    if (client_send_packet(c, pb->data, (size_t)nwrite) != 0) {
       break;
     }
   }
 
-  return 0;
+end:
+  quic_pkt_buf_unref(pb);
+  client_sched_advance(c, ts);
+
+  if (c->stats->tx_datagrams != sent) {
+    c->stats->tx_bursts++;
+  }
+
+  return rv;
+}
+
+// Round up to the low-power TX window grid
+static ngtcp2_tstamp client_lp_align(ngtcp2_tstamp ts) {
+  ngtcp2_duration slack = (ngtcp2_duration)g_config.tx_slack_ms * NGTCP2_MILLISECONDS;
+
+  if (slack == 0 || ts == UINT64_MAX) {
+    return ts;
+  }
+  return (ts + slack - 1) / slack * slack;
+}
+
+// Whether everything pending may wait for a TX window: no data in flight,
+// so no loss timer is running, and no stream data released for sending
+static bool client_lp_deferrable(struct client *c) {
+  ngtcp2_conn_info info;
+
+  if (g_config.tx_slack_ms == 0 || !c->handshake_done || c->race.fd != -1) {
+    return false;
+  }
+  if (c->stream.nwrite < c->stream.flushed ||
+      (g_config.coalesce_bytes > 0 &&
+       c->stream.queued - c->stream.flushed >= g_config.coalesce_bytes)) {
+    return false;
+  }
+
+  ngtcp2_conn_get_conn_info(c->conn, &info);
+  return info.bytes_in_flight == 0;
+}
+
+// How long received datagrams may wait for an ACK, at most what was
+// advertised to the peer as max_ack_delay
+static ngtcp2_tstamp client_ack_delay(struct client *c) {
+  ngtcp2_duration advertised = ngtcp2_conn_get_local_transport_params(c->conn)->max_ack_delay;
+  ngtcp2_duration delay = (ngtcp2_duration)g_config.max_ack_delay_ms * NGTCP2_MILLISECONDS;
+
+  return delay == 0 || delay > advertised ? advertised : delay;
+}
+
+// Whether a write may wait for more datagrams to acknowledge: fewer than
+// ack_tolerance came in, the first of them is not overdue, and neither
+// ngtcp2's timers nor stream data or flow control credit need to go out.
+// ngtcp2 then sends nothing but the ACK, so skipping the write saves a
+// packet. Without a write ngtcp2 acknowledges at its own deadline.
+static bool client_ack_deferrable(struct client *c, ngtcp2_tstamp now) {
+  if (g_config.ack_tolerance == 0 || c->ack.pkts == 0 ||
+      c->ack.pkts >= g_config.ack_tolerance ||
+      !c->handshake_done || c->race.fd != -1) {
+    return false;
+  }
+  if (now >= c->ack.first + client_ack_delay(c) ||
+      now >= ngtcp2_conn_get_expiry(c->conn)) {
+    return false;
+  }
+  // Like ngtcp2, return credit once half the window was consumed
+  return c->stream.nwrite == c->stream.flushed && now < c->stream.hold_expiry &&
+         c->ack.credit < APP_RECV_WINDOW / 2;
 }
 
 static int client_handle_expiry(struct client *c);
+#if QUIC_PIPELINE_ENABLE
+static int client_return_credit(struct client *c);
+#endif
+static quic_standby_state_t client_standby_state(void);
+
+/*
+ * Whether the peer has not answered for failover_timeout_ms while data
+ * was in flight. Far quicker than the idle timeout, so only worth acting
+ * on when there is somewhere to go: a ready standby for the active
+ * connection. A silent standby is simply dropped and replaced.
+ */
+static bool client_peer_gone(struct client *c, ngtcp2_tstamp now) {
+  ngtcp2_conn_info info;
+
+  if (!g_config.failover_timeout_ms || !c->unanswered ||
+      now < c->unanswered + (ngtcp2_tstamp)g_config.failover_timeout_ms * NGTCP2_MILLISECONDS) {
+    return false;
+  }
+  if (!c->standby && client_standby_state() != QUIC_STANDBY_READY) {
+    return false;
+  }
+  ngtcp2_conn_get_conn_info(c->conn, &info);
+  return info.bytes_in_flight > 0;
+}
+
 static int client_write(struct client *c) {
   ngtcp2_tstamp expiry, now;
   ev_tstamp t;
 
+  if (c->race.fd != -1 && c->race.start != 0 && timestamp() >= c->race.start) {
+    client_race_start(c);
+  }
+
+#if QUIC_PIPELINE_ENABLE
+  // Credit the MQTT task released meanwhile rides along
+  if (client_return_credit(c) != 0) {
+    return -1;
+  }
+#endif
+
+  if (client_ack_deferrable(c, timestamp())) {
+    goto arm;
+  }
+
+  if (client_lp_deferrable(c)) {
+    expiry = ngtcp2_conn_get_expiry(c->conn);
+    if (c->stream.hold_expiry < expiry) {
+      expiry = c->stream.hold_expiry;
+    }
+    now = timestamp();
+    if (now < client_lp_align(expiry)) {
+      // Nothing pending is due before the next window
+      goto arm;
+    }
+    // The radio wakes up anyway, take held data along
+    if (c->stream.flushed != c->stream.queued) {
+      c->stream.hold_expiry = now;
+    }
+  }
+
   if (client_write_streams(c) != 0) {
     return -1;
   }
 
+arm:
   expiry = ngtcp2_conn_get_expiry(c->conn);
+  if (c->stream.hold_expiry < expiry) {
+    // Wake up to send data held for coalescing
+    expiry = c->stream.hold_expiry;
+  }
+  if (c->race.fd != -1 && c->race.start != 0 && c->race.start < expiry) {
+    // Wake up to start sending to the second address
+    expiry = c->race.start;
+  }
+  if (g_config.ack_tolerance > 0 && c->ack.pkts > 0) {
+    // Wake up when the ACK is overdue, unless that was missed already and
+    // ngtcp2 holds it back
+    ngtcp2_tstamp ack_expiry = c->ack.first + client_ack_delay(c);
+    if (ack_expiry < expiry && ack_expiry > timestamp()) {
+      expiry = ack_expiry;
+    }
+  }
+  if (client_lp_deferrable(c)) {
+    // Wake up on the TX window instead
+    expiry = client_lp_align(expiry);
+  }
+  if (g_config.failover_timeout_ms && c->unanswered) {
+    // Wake up to check whether the peer is gone
+    ngtcp2_tstamp gone = c->unanswered +
+                         (ngtcp2_tstamp)g_config.failover_timeout_ms * NGTCP2_MILLISECONDS;
+    if (gone < expiry && gone > timestamp()) {
+      expiry = gone;
+    }
+  }
+#if QUIC_NETEM_ENABLE
+  if (c == g_client && quic_netem_next_release_us() != UINT64_MAX &&
+      quic_netem_next_release_us() * 1000 < expiry) {
+    // Wake up to release datagrams held by the impairment layer
+    expiry = quic_netem_next_release_us() * 1000;
+  }
+#endif
   now = timestamp();
 
   // @FIXME: timer has some issues here
@@ -567,7 +1662,21 @@ static int client_write(struct client *c) {
 }
 
 static int client_handle_expiry(struct client *c) {
-  int rv = ngtcp2_conn_handle_expiry(c->conn, timestamp());
+  ngtcp2_tstamp now = timestamp();
+  int rv;
+
+  if (client_peer_gone(c, now)) {
+    ESP_LOGW(TAG, "%s stopped answering, connection lost", c->hostname);
+    c->idle_closed = true;
+    return -1;
+  }
+
+  rv = ngtcp2_conn_handle_expiry(c->conn, now);
+  if (rv == NGTCP2_ERR_IDLE_CLOSE) {
+    ESP_LOGW(TAG, "Nothing received within the idle timeout, connection lost");
+    c->idle_closed = true;
+    return -1;
+  }
   if (rv != 0) {
     ESP_LOGE(TAG, "ngtcp2_conn_handle_expiry: %s", ngtcp2_strerror(rv));
     return -1;
@@ -580,38 +1689,150 @@ static void client_close(struct client *c) {
   ngtcp2_ssize nwrite;
   ngtcp2_pkt_info pi;
   ngtcp2_path_storage ps;
-  uint8_t buf[1280];
+  quic_pkt_buf_t *pb;
 
   if (ngtcp2_conn_in_closing_period(c->conn) ||
-      ngtcp2_conn_in_draining_period(c->conn)) {
+      ngtcp2_conn_in_draining_period(c->conn) || c->idle_closed) {
+    // Closed silently after an idle timeout (RFC 9000 section 10.1)
+    goto fin;
+  }
+
+  pb = quic_pkt_buf_alloc();
+  if (!pb) {
     goto fin;
   }
 
   ngtcp2_path_storage_zero(&ps);
 
   nwrite = ngtcp2_conn_write_connection_close(
-    c->conn, &ps.path, &pi, buf, sizeof(buf), &c->last_error, timestamp());
+    c->conn, &ps.path, &pi, pb->data, sizeof(pb->data), &c->last_error,
+    timestamp());
   if (nwrite < 0) {
     ESP_LOGE(TAG, "ngtcp2_conn_write_connection_close: %s", ngtcp2_strerror((int)nwrite));
-    goto fin;
+  } else {
+    client_send_packet(c, pb->data, (size_t)nwrite);
   }
 
-  client_send_packet(c, buf, (size_t)nwrite);
+  quic_pkt_buf_unref(pb);
 
 fin:
-  ev_break(EV_DEFAULT, EVBREAK_ALL);
+  c->closed = true;
+  ev_io_stop(EV_DEFAULT, &c->rev);
+  ev_timer_stop(EV_DEFAULT, &c->timer);
+  if (c == g_client) {
+    // MQTT sends and receives fail from now on, which is how coreMQTT
+    // learns about the lost connection
+    g_quic_connected = false;
+  }
+  // The loop keeps running while the other connection is still up
+  if (!g_client->conn || g_client->closed) {
+    if (!g_standby || g_standby->closed) {
+      ev_break(EV_DEFAULT, EVBREAK_ALL);
+    }
+  }
+}
+
+static void client_send_credit(struct client *c, quic_send_credit_t *credit) {
+  const ngtcp2_transport_params *params;
+  ngtcp2_conn_info info;
+  uint64_t window;
+
+  memset(credit, 0, sizeof(*credit));
+  if (!c->conn || c->closed) {
+    return;
+  }
+
+  credit->unacked = (size_t)(c->stream.queued - c->stream.acked);
+  credit->queued = (size_t)(c->stream.queued - c->stream.nwrite);
+  credit->buffer_free = APP_SEND_BUFFER_SIZE - credit->unacked;
+
+  // The windows count what was handed to ngtcp2 only
+  credit->conn_window = ngtcp2_conn_get_max_data_left(c->conn);
+  if (c->stream.stream_id != -1) {
+    credit->stream_window = ngtcp2_conn_get_max_stream_data_left(c->conn, c->stream.stream_id);
+  } else {
+    // The first write opens the stream with the peer's initial limit
+    params = ngtcp2_conn_get_remote_transport_params(c->conn);
+    credit->stream_window = params ? params->initial_max_stream_data_bidi_remote : 0;
+  }
+  ngtcp2_conn_get_conn_info(c->conn, &info);
+  credit->cwnd_left = info.cwnd > info.bytes_in_flight ? info.cwnd - info.bytes_in_flight : 0;
+
+  window = credit->stream_window;
+  if (credit->conn_window < window) {
+    window = credit->conn_window;
+  }
+  if (credit->cwnd_left < window) {
+    window = credit->cwnd_left;
+  }
+  window = window > credit->queued ? window - credit->queued : 0;
+  credit->send_now = window < credit->buffer_free ? window : credit->buffer_free;
+}
+
+/*
+ * The send credit callback if it is due now, with the credit to pass it.
+ * The caller runs it after releasing quic_mutex.
+ */
+static quic_send_credit_cb client_send_credit_due(struct client *c,
+                                                  quic_send_credit_t *credit,
+                                                  void **user_data) {
+  if (c != g_client || !send_credit.armed || !send_credit.cb) {
+    return NULL;
+  }
+
+  client_send_credit(c, credit);
+  if (credit->buffer_free == 0 || credit->buffer_free < send_credit.min_free) {
+    return NULL;
+  }
+
+  send_credit.armed = false;
+  *user_data = send_credit.user_data;
+  return send_credit.cb;
 }
 
 static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
   struct client *c = w->data;
+  int64_t start = esp_timer_get_time();
+  quic_send_credit_cb credit_cb = NULL;
+  quic_send_credit_t credit;
+  void *credit_user_data = NULL;
+  int rv;
   (void)loop;
   (void)revents;
 
-  if (client_read(c) != 0) {
+  // The MQTT task writes to the same connection, serialize with it
+  if (quic_mutex == NULL || xSemaphoreTake(quic_mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+  if (c->closed || !c->conn) {
+    xSemaphoreGive(quic_mutex);
+    return;
+  }
+
+  rv = client_read(c);
+  if (rv != 0) {
+    client_close(c);
+  } else if (c->stream.nwrite < c->stream.queued &&
+             client_write(c) != 0) {
+    // ACKs may have opened the congestion window for queued stream data
     client_close(c);
+    rv = -1;
+  }
+  if (rv == 0) {
+    credit_cb = client_send_credit_due(c, &credit, &credit_user_data);
+  }
+
+  xSemaphoreGive(quic_mutex);
+  quic_pipeline_busy_add(QUIC_STAGE_IO, (uint32_t)(esp_timer_get_time() - start));
+
+  if (rv != 0) {
     return;
   }
 
+  if (credit_cb) {
+    credit_cb(&credit, credit_user_data);
+  }
+
   // Brief delay to avoid collision and allow other tasks to run
   vTaskDelay(pdMS_TO_TICKS(2));
 
@@ -624,17 +1845,34 @@ static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
 
 static void timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
   struct client *c = w->data;
+  int64_t start = esp_timer_get_time();
   (void)loop;
   (void)revents;
 
-  if (client_handle_expiry(c) != 0) {
+  if (quic_mutex == NULL || xSemaphoreTake(quic_mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+  if (c->closed || !c->conn) {
+    xSemaphoreGive(quic_mutex);
+    return;
+  }
+
+  c->stats->timer_wakeups++;
+
+#if QUIC_NETEM_ENABLE
+  if (c == g_client && client_netem_release(c) != 0) {
     client_close(c);
+    xSemaphoreGive(quic_mutex);
     return;
   }
+#endif
 
-  if (client_write(c) != 0) {
+  if (client_handle_expiry(c) != 0 || client_write(c) != 0) {
     client_close(c);
   }
+
+  xSemaphoreGive(quic_mutex);
+  quic_pipeline_busy_add(QUIC_STAGE_IO, (uint32_t)(esp_timer_get_time() - start));
 }
 
 static ngtcp2_conn *get_conn(ngtcp2_crypto_conn_ref *conn_ref) {
@@ -642,74 +1880,162 @@ static ngtcp2_conn *get_conn(ngtcp2_crypto_conn_ref *conn_ref) {
   return c->conn;
 }
 
-static int client_init(struct client *c) {
-  struct sockaddr_storage remote_addr, local_addr;
-  socklen_t remote_addrlen, local_addrlen = sizeof(local_addr);
+// Resolve a broker, accounting the time in stats
+static int client_resolve(const char *hostname, const char *port,
+                          quic_dns_result_t *dns, quic_client_stats_t *stats) {
+  uint64_t dns_start = timestamp();
 
-  memset(c, 0, sizeof(*c));
+  if (quic_dns_resolve(hostname, port, dns) != 0) {
+    return -1;
+  }
+  stats->dns_us = (uint32_t)((timestamp() - dns_start) / 1000);
+  stats->dns_source = (uint8_t)dns->source;
+  return 0;
+}
+
+/*
+ * Set up a connection in a slot the caller cleared and filled in with
+ * hostname, stats, started and standby. On failure the slot holds
+ * whatever was set up so far, for client_stop.
+ */
+static int client_init(struct client *c, const quic_dns_result_t *dns) {
+  size_t i;
+
+  c->fd = -1;
+  c->race.fd = -1;
 
   ngtcp2_ccerr_default(&c->last_error);
 
-  c->fd = create_sock((struct sockaddr *)&remote_addr, &remote_addrlen,
-                      g_config.hostname, g_config.port);
+  // The connection starts on the first address that takes a socket...
+  for (i = 0; i < dns->count && c->fd == -1; i++) {
+    c->fd = create_sock(&dns->addrs[i], &c->local_addr, &c->local_addrlen);
+    if (c->fd != -1) {
+      memcpy(&c->remote_addr, &dns->addrs[i].addr, dns->addrs[i].addrlen);
+      c->remote_addrlen = dns->addrs[i].addrlen;
+    }
+  }
   if (c->fd == -1) {
+    ESP_LOGE(TAG, "No usable address for %s", c->hostname);
     return -1;
   }
 
-  if (connect_sock((struct sockaddr *)&local_addr, &local_addrlen, c->fd,
-                   (struct sockaddr *)&remote_addr, remote_addrlen) != 0) {
-    return -1;
+  // ...and races the first one of the other family
+  for (; i < dns->count; i++) {
+    if (dns->addrs[i].addr.ss_family != c->remote_addr.ss_family) {
+      client_race_init(c, &dns->addrs[i]);
+      break;
+    }
   }
 
-  memcpy(&c->local_addr, &local_addr, sizeof(c->local_addr));
-  c->local_addrlen = local_addrlen;
-
   if (client_ssl_init(c) != 0) {
     return -1;
   }
 
-  if (client_quic_init(c, (struct sockaddr *)&remote_addr, remote_addrlen,
-                       (struct sockaddr *)&local_addr, local_addrlen) != 0) {
+  if (client_quic_init(c, (struct sockaddr *)&c->remote_addr,
+                       c->remote_addrlen, (struct sockaddr *)&c->local_addr,
+                       c->local_addrlen) != 0) {
     return -1;
   }
 
   c->stream.stream_id = -1;
+  c->stream.hold_expiry = UINT64_MAX;
 
   c->conn_ref.get_conn = get_conn;
   c->conn_ref.user_data = c;
 
+  ev_timer_init(&c->timer, timer_cb, 0., 0.);
+  c->timer.data = c;
+
   ev_io_init(&c->rev, read_cb, c->fd, EV_READ);
   c->rev.data = c;
   ev_io_start(EV_DEFAULT, &c->rev);
 
-  ev_timer_init(&c->timer, timer_cb, 0., 0.);
-  c->timer.data = c;
-
   return 0;
 }
 
 static void client_free(struct client *c) {
+  if (c->race.fd != -1) {
+    client_race_end(c, false);
+  }
   ngtcp2_conn_del(c->conn);
   SSL_free(c->ssl);
-  SSL_CTX_free(c->ssl_ctx);
+  // c->ssl_ctx is shared across connections and kept
 }
 
-static ssize_t client_write_application_data(struct client *c, const uint8_t *data, size_t datalen) {
-    if (!c || !c->conn || !data || datalen == 0) {
-        ESP_LOGE(TAG, "Invalid parameters for client_write_application_data");
+// Keep what the connection learned about its path for the next one. A
+// peer that went silent leaves nothing worth keeping
+static void client_save_path(struct client *c) {
+  ngtcp2_conn_info info;
+  quic_path_state_t state;
+
+  if (!c->conn || !c->handshake_done || c->idle_closed) {
+    return;
+  }
+
+  ngtcp2_conn_get_conn_info(c->conn, &info);
+  state.smoothed_rtt_us = (uint32_t)(info.smoothed_rtt / NGTCP2_MICROSECONDS);
+  state.rttvar_us = (uint32_t)(info.rttvar / NGTCP2_MICROSECONDS);
+  state.min_rtt_us = info.min_rtt == UINT64_MAX ? 0 : (uint32_t)(info.min_rtt / NGTCP2_MICROSECONDS);
+  state.cwnd = (uint32_t)info.cwnd;
+  quic_path_save((struct sockaddr *)&c->remote_addr, &state);
+}
+
+// Tear down a slot completely, whether or not client_init finished
+static void client_stop(struct client *c) {
+  client_save_path(c);
+  ev_io_stop(EV_DEFAULT, &c->rev);
+  ev_timer_destroy(EV_DEFAULT, &c->timer);
+  client_free(c);
+  if (c->fd != -1) {
+    close(c->fd);
+  }
+  memset(c, 0, sizeof(*c));
+  c->fd = -1;
+  c->race.fd = -1;
+}
+
+static quic_standby_state_t client_standby_state(void) {
+  if (!g_standby) {
+    return QUIC_STANDBY_NONE;
+  }
+  if (g_standby->closed) {
+    return QUIC_STANDBY_FAILED;
+  }
+  return g_standby->handshake_done ? QUIC_STANDBY_READY : QUIC_STANDBY_CONNECTING;
+}
+
+/**
+ * @brief Append application data to the MQTT stream and flush it.
+ *
+ * The vectors are copied into app_send_buffer as one unit so that an
+ * MQTT packet is never split by a full buffer. Data larger than the
+ * whole buffer is queued in pieces as space frees up. With
+ * QUIC_WRITE_FLAG_COALESCE the data may be held back, see
+ * client_release_held_data. The unit is placed by its send class, see
+ * client_sched_insert.
+ *
+ * While a packet is open only the task writing it may append, anything
+ * else would land in the middle of it; other tasks get 0 and retry.
+ *
+ * @return Number of bytes queued, 0 if the buffer is full or another
+ * task has a packet open, -1 on error
+ */
+static ssize_t client_writev_application_data(struct client *c,
+                                              const ngtcp2_vec *datav,
+                                              size_t datavcnt,
+                                              uint32_t flags) {
+    size_t total = 0, avail, remaining, i;
+    uint32_t cls = (flags >> 4) & 0x0f;
+    uint64_t off;
+
+    if (!c || !c->conn || !datav || datavcnt == 0) {
+        ESP_LOGE(TAG, "Invalid parameters for client_writev_application_data");
         return -1;
     }
 
-    // This function should write application data to a QUIC stream
-    ngtcp2_vec vec = {
-        .base = (uint8_t *)data,
-        .len = datalen
-    };
-    
-    int64_t stream_id = -1;  // Use the appropriate stream ID or create a new one
-    
     // Check if we have an existing stream or need to create one
     if (c->stream.stream_id < 0) {
+        int64_t stream_id;
         int rv = ngtcp2_conn_open_bidi_stream(c->conn, &stream_id, NULL);
         if (rv != 0) {
             ESP_LOGE(TAG, "ngtcp2_conn_open_bidi_stream: %s", ngtcp2_strerror(rv));
@@ -717,52 +2043,224 @@ static ssize_t client_write_application_data(struct client *c, const uint8_t *da
         }
         c->stream.stream_id = stream_id;
         ESP_LOGI(TAG, "Opened new QUIC stream with ID: %lld", (long long)stream_id);
-    } else {
-        stream_id = c->stream.stream_id;
     }
-    
-    // Use the higher-level write function that handles buffering
-    uint32_t flags = NGTCP2_WRITE_STREAM_FLAG_NONE;
-    ngtcp2_ssize wdatalen = 0;
-    
-    uint8_t buf[1452];  // MTU-sized buffer
-    ngtcp2_path_storage ps;
-    ngtcp2_pkt_info pi;
-    
-    ngtcp2_path_storage_zero(&ps);
-
-    bool retry = false;
-    do {
-      ngtcp2_ssize nwrite = ngtcp2_conn_writev_stream(c->conn, &ps.path, &pi, buf, sizeof(buf),
-                                                      &wdatalen, flags, stream_id, &vec, 1, timestamp());
-      if (nwrite < 0) {
-        if (nwrite == NGTCP2_ERR_WRITE_MORE) {
-          // Partial write, this is normal
-          ESP_LOGI(TAG, "Partial write: %zu bytes queued", (size_t)wdatalen);
-        } else {
-          ESP_LOGE(TAG, "ngtcp2_conn_writev_stream: %s", ngtcp2_strerror((int)nwrite));
-          return -1;
+
+    if (c->sched.open && c->sched.owner != xTaskGetCurrentTaskHandle()) {
+        return 0;
+    }
+
+    for (i = 0; i < datavcnt; i++) {
+        total += datav[i].len;
+    }
+
+    avail = APP_SEND_BUFFER_SIZE - (size_t)(c->stream.queued - c->stream.acked);
+    if (total > avail) {
+        if (total <= APP_SEND_BUFFER_SIZE || avail == 0) {
+            // Wait until the peer acknowledges enough data, meanwhile push
+            // out what is already queued, held data included
+            c->stream.flushed = c->stream.queued;
+            c->stream.hold_expiry = UINT64_MAX;
+            send_credit.armed = true;
+            return client_write(c) != 0 ? -1 : 0;
         }
-      }
+        total = avail;
+        // The caller comes back with the rest
+        flags |= QUIC_WRITE_FLAG_MORE;
+    }
 
-      // Send the packet if we have data to send
-      if (nwrite > 0) {
-        if (client_send_packet(c, buf, (size_t)nwrite) != 0) {
-          ESP_LOGE(TAG, "client_send_packet failed");
-          return -1;
+    cls = cls == 0 || cls > QUIC_SEND_CLASS_COUNT ? QUIC_SEND_INTERACTIVE : cls - 1;
+    off = client_sched_insert(c, total, (quic_send_class_t)cls, (uint16_t)(flags >> 16),
+                              (flags & QUIC_WRITE_FLAG_MORE) != 0);
+    c->sched.owner = xTaskGetCurrentTaskHandle();
+
+    remaining = total;
+    for (i = 0; i < datavcnt && remaining > 0; i++) {
+        const uint8_t *src = datav[i].base;
+        size_t len = datav[i].len < remaining ? datav[i].len : remaining;
+
+        remaining -= len;
+        while (len > 0) {
+            size_t pos = (size_t)(off % APP_SEND_BUFFER_SIZE);
+            size_t n = APP_SEND_BUFFER_SIZE - pos;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(app_send_buffer + pos, src, n);
+            off += n;
+            src += n;
+            len -= n;
         }
-        ESP_LOGI(TAG, "Sent QUIC packet with %zu bytes, stream data: %d bytes", (size_t)nwrite, wdatalen);
-      }
+    }
+    c->stream.queued += total;
+    if (APP_SEND_BUFFER_SIZE - (size_t)(c->stream.queued - c->stream.acked) < send_credit.min_free) {
+        send_credit.armed = true;
+    }
+
+    c->stats->app_writes++;
+
+    if (!(flags & QUIC_WRITE_FLAG_COALESCE)) {
+        c->stream.flushed = c->stream.queued;
+        c->stream.hold_expiry = UINT64_MAX;
+    } else if (c->stream.hold_expiry == UINT64_MAX) {
+        // On a TX window in low-power mode
+        c->stream.hold_expiry = client_lp_align(timestamp() +
+            (ngtcp2_tstamp)g_config.coalesce_delay_ms * NGTCP2_MILLISECONDS);
+    }
+
+    if (client_write(c) != 0) {
+        return -1;
+    }
+
+    return (ssize_t)total;
+}
+
+#if QUIC_PIPELINE_ENABLE
+/**
+ * @brief Return the flow control credit of what the MQTT task consumed
+ * from the ring. Runs in the I/O task, under quic_mutex.
+ * @return 0 on success, -1 on failure
+ */
+static int client_return_credit(struct client *c) {
+    size_t consumed = atomic_load(&app_recv_ring.tail);
+    size_t n = consumed - atomic_load(&app_recv_credited);
+    int rv;
+
+    if (n == 0 || !c->conn || c->stream.stream_id < 0) {
+        return 0;
+    }
+
+    rv = ngtcp2_conn_extend_max_stream_offset(c->conn, c->stream.stream_id, n);
+    if (rv != 0) {
+        ESP_LOGE(TAG, "ngtcp2_conn_extend_max_stream_offset: %s", ngtcp2_strerror(rv));
+        return -1;
+    }
+    ngtcp2_conn_extend_max_offset(c->conn, n);
+    atomic_store(&app_recv_credited, consumed);
+    c->ack.credit += n;
+
+    return 0;
+}
+
+static void credit_cb(struct ev_loop *loop, ev_async *w, int revents) {
+    struct client *c = g_client;  // Whichever connection MQTT is on now
+    int64_t start = esp_timer_get_time();
+    (void)loop;
+    (void)w;
+    (void)revents;
+
+    if (quic_mutex == NULL || xSemaphoreTake(quic_mutex, portMAX_DELAY) != pdTRUE) {
+        return;
+    }
+    if (c->closed || !c->conn) {
+        xSemaphoreGive(quic_mutex);
+        return;
+    }
+
+    if (client_return_credit(c) != 0 || client_write(c) != 0) {
+        client_close(c);
+    }
+
+    xSemaphoreGive(quic_mutex);
+    quic_pipeline_busy_add(QUIC_STAGE_IO, (uint32_t)(esp_timer_get_time() - start));
+}
+
+/**
+ * @brief Release consumed bytes of the ring. Runs in the MQTT task without
+ * quic_mutex; the credit is returned by the I/O task, woken once half the
+ * window is waiting for it.
+ * @return 0
+ */
+static int client_consume_application_data(struct client *c, size_t n) {
+    (void)c;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    quic_spsc_consume(&app_recv_ring, n);
+    if (atomic_load(&app_recv_ring.tail) - atomic_load(&app_recv_credited) >=
+        APP_RECV_WINDOW / 2) {
+        ev_async_send(EV_DEFAULT, &app_recv_credit_async);
+    }
+
+    return 0;
+}
+
+int client_read_application_data(struct client *c, uint8_t *buffer, size_t buffer_size, size_t *bytes_read) {
+    const uint8_t *data;
+    size_t contig;
+    size_t available = quic_spsc_peek(&app_recv_ring, &data, &contig);
+    size_t to_copy = available < buffer_size ? available : buffer_size;
+
+    *bytes_read = 0;
+    if (to_copy == 0) {
+        return -2;  // Special code for no data
+    }
+
+    quic_spsc_copy(&app_recv_ring, buffer, to_copy);
+    *bytes_read = to_copy;
+
+    return client_consume_application_data(c, to_copy);
+}
+
+int recv_stream_data(ngtcp2_conn *conn, uint32_t flags,
+                    int64_t stream_id, uint64_t offset,
+                    const uint8_t *data, size_t datalen,
+                    void *user_data, void *stream_user_data) {
+    (void)conn;
+    (void)flags;
+    (void)offset;
+    (void)stream_user_data;
+
+    // MQTT has not moved to a standby yet, nothing it sends is wanted
+    if (((struct client *)user_data)->standby) {
+        return 0;
+    }
+
+    // Flow control bounds unread data to APP_RECV_WINDOW, the ring size
+    if (quic_spsc_push(&app_recv_ring, data, datalen) != 0) {
+        ESP_LOGE(TAG, "Receive ring overflow on stream %lld: %zu bytes",
+                 (long long)stream_id, datalen);
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+
+    return 0;
+}
+#else
+/**
+ * @brief Release consumed bytes of the receive buffer and return the
+ * matching flow control credit to the peer.
+ * @return 0 on success, -1 on failure
+ */
+static int client_consume_application_data(struct client *c, size_t n) {
+    int rv;
+
+    if (n == 0) {
+        return 0;
+    }
 
-      if (nwrite == 0)
-      {
-        ESP_LOGI(TAG, "Cannot send QUIC packet with %zu bytes, stream data: %zu bytes", (size_t)nwrite, (size_t)wdatalen);
-      }
+    app_recv_buffer_read_pos += n;
+    if (app_recv_buffer_read_pos >= app_recv_buffer_len) {
+        app_recv_buffer_len = 0;
+        app_recv_buffer_read_pos = 0;
+    } else if (app_recv_buffer_read_pos >= APP_RECV_WINDOW) {
+        size_t unread = app_recv_buffer_len - app_recv_buffer_read_pos;
+        memmove(app_recv_buffer, app_recv_buffer + app_recv_buffer_read_pos, unread);
+        app_recv_buffer_len = unread;
+        app_recv_buffer_read_pos = 0;
+    }
+
+    if (!c->conn || c->stream.stream_id < 0) {
+        return 0;
+    }
 
-      // retry when NO STREAM Frame is sent
-      // it happens when ngtcp2 cannot fit a STREAM frame in the buf that we sent
-      retry = wdatalen == -1;
-    } while(retry);
+    rv = ngtcp2_conn_extend_max_stream_offset(c->conn, c->stream.stream_id, n);
+    if (rv != 0) {
+        ESP_LOGE(TAG, "ngtcp2_conn_extend_max_stream_offset: %s", ngtcp2_strerror(rv));
+        return -1;
+    }
+    ngtcp2_conn_extend_max_offset(c->conn, n);
+    c->ack.credit += n;
 
     return 0;
 }
@@ -777,33 +2275,11 @@ int client_read_application_data(struct client *c, uint8_t *buffer, size_t buffe
         size_t to_copy = (available < buffer_size) ? available : buffer_size;
         
         memcpy(buffer, app_recv_buffer + app_recv_buffer_read_pos, to_copy);
-        app_recv_buffer_read_pos += to_copy;
-        
-        // Reset buffer if all data has been read
-        if (app_recv_buffer_read_pos >= app_recv_buffer_len) {
-            app_recv_buffer_len = 0;
-            app_recv_buffer_read_pos = 0;
-        }
-        
         *bytes_read = to_copy;
-        return 0;
-    }
-    
-    // We DONT need to read from the network
-    // We have another async reader,
-    // For demo, this is good for now.
-    /*
-    if (client_read(c) != 0) {
-        ESP_LOGE(TAG, "client_read failed");
-        return -1;
+
+        return client_consume_application_data(c, to_copy);
     }
     
-    // Check if we received any application data during client_read
-    if (app_recv_buffer_len > 0) {
-        // We have data in the buffer now, call ourselves recursively
-        return client_read_application_data(c, buffer, buffer_size, bytes_read);
-    }
-    */
     // No data available at this time
     return -2;  // Special code for no data
 }
@@ -812,26 +2288,46 @@ int recv_stream_data(ngtcp2_conn *conn, uint32_t flags,
                     int64_t stream_id, uint64_t offset,
                     const uint8_t *data, size_t datalen,
                     void *user_data, void *stream_user_data) {
-    (void)user_data;
-    
-    // Store the received data in our buffer
-    if (datalen > 0 && app_recv_buffer_len + datalen <= APP_BUFFER_SIZE) {
-        memcpy(app_recv_buffer + app_recv_buffer_len, data, datalen);
-        app_recv_buffer_len += datalen;
+    (void)conn;
+    (void)flags;
+    (void)offset;
+    (void)stream_user_data;
+
+    // MQTT has not moved to a standby yet, nothing it sends is wanted
+    if (((struct client *)user_data)->standby) {
+        return 0;
     }
-    
-    // Acknowledge the data was received by using ngtcp2_conn_extend_max_stream_offset
-    int rv = ngtcp2_conn_extend_max_stream_offset(conn, stream_id, datalen);
-    if (rv != 0) {
-        ESP_LOGE(TAG, "ngtcp2_conn_extend_max_stream_offset: %s", ngtcp2_strerror(rv));
+
+    // Flow control bounds unread data to APP_RECV_WINDOW, see APP_BUFFER_SIZE
+    if (app_recv_buffer_len + datalen > APP_BUFFER_SIZE) {
+        ESP_LOGE(TAG, "Receive buffer overflow on stream %lld: %zu + %zu bytes",
+                 (long long)stream_id, app_recv_buffer_len, datalen);
         return NGTCP2_ERR_CALLBACK_FAILURE;
     }
+
+    // Store the received data in our buffer
+    memcpy(app_recv_buffer + app_recv_buffer_len, data, datalen);
+    app_recv_buffer_len += datalen;
     
     return 0;
 }
+#endif /* QUIC_PIPELINE_ENABLE */
+
+// Drop received data not read yet, with the connection it came from
+static void client_reset_recv_buffer(void) {
+#if QUIC_PIPELINE_ENABLE
+    quic_spsc_init(&app_recv_ring, app_recv_buffer, sizeof(app_recv_buffer));
+    atomic_store(&app_recv_credited, 0);
+#else
+    app_recv_buffer_len = 0;
+    app_recv_buffer_read_pos = 0;
+#endif
+}
 
 // Non-blocking QUIC client functions
 int quic_client_init_with_config(const quic_client_config_t *config) {
+    quic_dns_result_t dns;
+
     // Initialize mutex for thread safety
     if (quic_mutex == NULL) {
         quic_mutex = xSemaphoreCreateMutex();
@@ -843,15 +2339,49 @@ int quic_client_init_with_config(const quic_client_config_t *config) {
     }
     
     // Clear the global client structure first
-    memset(&g_client, 0, sizeof(g_client));
+    g_client = &g_conns[0];
+    g_standby = NULL;
+    memset(g_conns, 0, sizeof(g_conns));
     quic_processing = false;
+    client_reset_recv_buffer();
+#if QUIC_PIPELINE_ENABLE
+    ev_async_init(&app_recv_credit_async, credit_cb);
+    ev_async_start(EV_DEFAULT, &app_recv_credit_async);
+#endif
+    memset(&g_stats, 0, sizeof(g_stats));
+    memset(&g_standby_stats, 0, sizeof(g_standby_stats));
     
     if (config) {
         g_config.hostname = config->hostname;
         g_config.port = config->port;
         g_config.alpn = config->alpn;
+        g_config.coalesce_bytes = config->coalesce_bytes;
+        g_config.coalesce_delay_ms = config->coalesce_delay_ms;
+        g_config.verify = config->verify;
+        g_config.ca_pem = config->ca_pem;
+        g_config.ca_store = config->ca_store;
+        g_config.server_key_sha256 = config->server_key_sha256;
+        g_config.keep_alive_ms = config->keep_alive_ms;
+        g_config.idle_timeout_ms = config->idle_timeout_ms;
+        g_config.tx_slack_ms = config->tx_slack_ms;
+        g_stats.tx_slack_ms = config->tx_slack_ms;
+        g_config.ack_tolerance = config->ack_tolerance;
+        g_config.max_ack_delay_ms = config->max_ack_delay_ms;
+        g_stats.ack_tolerance = config->ack_tolerance;
+        g_config.failover_timeout_ms = config->failover_timeout_ms;
+        g_config.standby_keep_alive_ms = config->standby_keep_alive_ms;
+        g_config.send_fifo = config->send_fifo;
+        g_stats.send_fifo = config->send_fifo;
         ESP_LOGI(TAG, "QUIC client config: %s:%s with ALPN %s", 
                g_config.hostname, g_config.port, g_config.alpn);
+        if (g_config.coalesce_bytes > 0) {
+            ESP_LOGI(TAG, "Publish coalescing: %zu bytes or %lu ms",
+                     g_config.coalesce_bytes, (unsigned long)g_config.coalesce_delay_ms);
+        }
+        if (g_config.tx_slack_ms > 0) {
+            ESP_LOGI(TAG, "Low-power TX windows every %lu ms",
+                     (unsigned long)g_config.tx_slack_ms);
+        }
     }
 
     ESP_LOGI(TAG, "init random number generator");
@@ -862,7 +2392,11 @@ int quic_client_init_with_config(const quic_client_config_t *config) {
     
     ESP_LOGI(TAG, "init client ...");
 
-    if (client_init(&g_client) != 0) {
+    g_client->hostname = g_config.hostname;
+    g_client->stats = &g_stats;
+    g_client->started = timestamp();
+    if (client_resolve(g_config.hostname, g_config.port, &dns, &g_stats) != 0 ||
+        client_init(g_client, &dns) != 0) {
         ESP_LOGE(TAG, "client_init failed");
         return -1;
     }
@@ -875,6 +2409,10 @@ int quic_client_init_with_config(const quic_client_config_t *config) {
 }
 
 int quic_client_process(void) {
+    quic_send_credit_cb credit_cb = NULL;
+    quic_send_credit_t credit;
+    void *credit_user_data = NULL;
+
     // Use delay to prevent watchdog trigger
     vTaskDelay(pdMS_TO_TICKS(5));
     
@@ -903,14 +2441,14 @@ int quic_client_process(void) {
     quic_processing = true;
     
     // Check if we have a valid connection
-    if (!g_client.conn) {
+    if (!g_client->conn || g_client->closed) {
         result = -1;
         goto cleanup;
     }
     
     // Check connection state before processing
-    if (ngtcp2_conn_in_closing_period(g_client.conn) || 
-        ngtcp2_conn_in_draining_period(g_client.conn)) {
+    if (ngtcp2_conn_in_closing_period(g_client->conn) || 
+        ngtcp2_conn_in_draining_period(g_client->conn)) {
         ESP_LOGI(TAG, "Connection is closing/draining, skipping processing");
         result = -1;
         goto cleanup;
@@ -918,7 +2456,7 @@ int quic_client_process(void) {
 
 
     // Read from the socket and handle packets
-    result = client_read(&g_client);
+    result = client_read(g_client);
     if (result != 0) {
         ESP_LOGE(TAG, "client_read failed: %d", result);
         goto cleanup;
@@ -928,33 +2466,315 @@ int quic_client_process(void) {
     vTaskDelay(pdMS_TO_TICKS(1));
     
     // Write any pending data
-    result = client_write(&g_client);
+    result = client_write(g_client);
     if (result != 0) {
         ESP_LOGE(TAG, "client_write failed: %d", result);
         goto cleanup;
     }
 
     // Update connection state
-    if (g_client.conn && !g_quic_handshake_completed) {
+    if (g_client->conn && !g_quic_handshake_completed) {
         g_quic_handshake_completed = true;
         g_quic_connected = true;
         ESP_LOGI(TAG, "QUIC connection established!");
     }
+    credit_cb = client_send_credit_due(g_client, &credit, &credit_user_data);
 
 cleanup:
     quic_processing = false;
     xSemaphoreGive(quic_mutex);
+    if (credit_cb) {
+        credit_cb(&credit, credit_user_data);
+    }
     return result;
 }
 
 bool quic_client_is_connected(void) {
-    return g_quic_connected && g_quic_handshake_completed && g_client.conn != NULL;
+    return g_quic_connected && g_quic_handshake_completed && g_client->conn != NULL;
 }
 
 int quic_client_local_stream_avail(void) {
     return g_quic_n_local_streams > 0;
 }
 
+size_t quic_client_unacked_bytes(void) {
+    return (size_t)(g_client->stream.queued - g_client->stream.acked);
+}
+
+int quic_client_get_send_credit(quic_send_credit_t *credit) {
+    int rv = -1;
+
+    memset(credit, 0, sizeof(*credit));
+    if (quic_mutex == NULL) {
+        return -1;
+    }
+    xSemaphoreTake(quic_mutex, portMAX_DELAY);
+
+    if (g_client->conn && !g_client->closed && g_quic_connected) {
+        client_send_credit(g_client, credit);
+        rv = 0;
+    }
+
+    xSemaphoreGive(quic_mutex);
+    return rv;
+}
+
+void quic_client_set_send_credit_cb(quic_send_credit_cb cb, void *user_data, size_t min_free) {
+    if (quic_mutex != NULL) {
+        xSemaphoreTake(quic_mutex, portMAX_DELAY);
+    }
+
+    send_credit.cb = cb;
+    send_credit.user_data = user_data;
+    send_credit.min_free = min_free > APP_SEND_BUFFER_SIZE ? APP_SEND_BUFFER_SIZE : min_free;
+    send_credit.armed = false;
+
+    if (quic_mutex != NULL) {
+        xSemaphoreGive(quic_mutex);
+    }
+}
+
+void quic_client_get_stats(quic_client_stats_t *stats) {
+    *stats = g_stats;
+    stats->standby_state = (uint8_t)client_standby_state();
+    stats->standby_handshake_us = g_standby_stats.handshake_us;
+    stats->standby_retries = g_standby_stats.retries;
+    stats->standby_token_used = g_standby_stats.token_used;
+    stats->standby_keep_alive_ms = g_standby_stats.keep_alive_ms;
+    stats->standby_tx_datagrams = g_standby_stats.tx_datagrams;
+    stats->standby_tx_bytes = g_standby_stats.tx_bytes;
+    stats->standby_rx_bytes = g_standby_stats.rx_bytes;
+    stats->radio_on_us = (uint64_t)g_stats.tx_bursts * QUIC_RADIO_BURST_US +
+                         (uint64_t)g_stats.tx_datagrams * QUIC_RADIO_DATAGRAM_US +
+                         g_stats.tx_bytes * 8 * 1000 / QUIC_RADIO_PHY_KBPS;
+}
+
+uint32_t quic_client_smoothed_rtt_ms(void) {
+    ngtcp2_conn_info info;
+
+    if (!g_client->conn) {
+        return 0;
+    }
+
+    ngtcp2_conn_get_conn_info(g_client->conn, &info);
+    return (uint32_t)(info.smoothed_rtt / NGTCP2_MILLISECONDS);
+}
+
+void quic_client_set_coalescing(size_t coalesce_bytes, uint32_t coalesce_delay_ms) {
+    if (quic_mutex != NULL) {
+        xSemaphoreTake(quic_mutex, portMAX_DELAY);
+    }
+
+    g_config.coalesce_bytes = coalesce_bytes;
+    g_config.coalesce_delay_ms = coalesce_delay_ms;
+
+    if (quic_mutex != NULL) {
+        xSemaphoreGive(quic_mutex);
+    }
+}
+
+void quic_client_set_keep_alive(uint32_t keep_alive_ms) {
+    if (quic_mutex != NULL) {
+        xSemaphoreTake(quic_mutex, portMAX_DELAY);
+    }
+
+    g_config.keep_alive_ms = keep_alive_ms;
+    if (g_client->conn && !g_client->closed) {
+        client_set_keep_alive(g_client);
+        // Re-arm the timer for the new keep-alive expiry
+        if (client_write(g_client) != 0) {
+            client_close(g_client);
+        }
+    }
+
+    if (quic_mutex != NULL) {
+        xSemaphoreGive(quic_mutex);
+    }
+}
+
+void quic_client_set_tx_slack(uint32_t tx_slack_ms) {
+    if (quic_mutex != NULL) {
+        xSemaphoreTake(quic_mutex, portMAX_DELAY);
+    }
+
+    g_config.tx_slack_ms = tx_slack_ms;
+    g_stats.tx_slack_ms = tx_slack_ms;
+    if (g_client->conn && !g_client->closed) {
+        // Re-arm the timer on the new grid
+        if (client_write(g_client) != 0) {
+            client_close(g_client);
+        }
+    }
+
+    if (quic_mutex != NULL) {
+        xSemaphoreGive(quic_mutex);
+    }
+}
+
+void quic_client_set_send_fifo(bool send_fifo) {
+    if (quic_mutex != NULL) {
+        xSemaphoreTake(quic_mutex, portMAX_DELAY);
+    }
+
+    // Packets already queued keep their place
+    g_config.send_fifo = send_fifo;
+    g_stats.send_fifo = send_fifo;
+
+    if (quic_mutex != NULL) {
+        xSemaphoreGive(quic_mutex);
+    }
+}
+
+void quic_client_set_ack_frequency(uint32_t ack_tolerance, uint32_t max_ack_delay_ms) {
+    if (quic_mutex != NULL) {
+        xSemaphoreTake(quic_mutex, portMAX_DELAY);
+    }
+
+    g_config.ack_tolerance = ack_tolerance;
+    g_config.max_ack_delay_ms = max_ack_delay_ms;
+    g_stats.ack_tolerance = ack_tolerance;
+    if (g_client->conn && !g_client->closed) {
+        g_stats.max_ack_delay_ms = (uint32_t)(client_ack_delay(g_client) / NGTCP2_MILLISECONDS);
+        // Send what a lower tolerance makes due, re-arm for the new delay
+        if (client_write(g_client) != 0) {
+            client_close(g_client);
+        }
+    }
+
+    if (quic_mutex != NULL) {
+        xSemaphoreGive(quic_mutex);
+    }
+}
+
+int quic_client_standby_start(const char *hostname, const char *port) {
+    quic_client_stats_t stats = {0};
+    quic_dns_result_t dns;
+    struct client *c;
+    int rv = -1;
+
+    if (!hostname || !port || quic_mutex == NULL) {
+        return -1;
+    }
+
+    // The slow parts stay outside the lock the I/O task needs
+    if (client_resolve(hostname, port, &dns, &stats) != 0) {
+        return -1;
+    }
+    quic_client_prepare_handshake();
+
+    xSemaphoreTake(quic_mutex, portMAX_DELAY);
+
+    if (!g_client->conn || g_client->closed) {
+        goto out;
+    }
+    if (g_standby) {
+        client_stop(g_standby);
+        g_standby = NULL;
+    }
+
+    c = g_client == &g_conns[0] ? &g_conns[1] : &g_conns[0];
+    g_standby_stats = stats;
+    c->hostname = hostname;
+    c->stats = &g_standby_stats;
+    c->started = timestamp();
+    c->standby = true;
+    if (client_init(c, &dns) != 0 || client_write(c) != 0) {
+        ESP_LOGE(TAG, "Cannot open a standby to %s:%s", hostname, port);
+        client_stop(c);
+        goto out;
+    }
+    g_standby = c;
+    ESP_LOGI(TAG, "Standby connecting to %s:%s", hostname, port);
+    rv = 0;
+
+out:
+    xSemaphoreGive(quic_mutex);
+    return rv;
+}
+
+quic_standby_state_t quic_client_standby_state(void) {
+    quic_standby_state_t state;
+
+    if (quic_mutex == NULL) {
+        return QUIC_STANDBY_NONE;
+    }
+    xSemaphoreTake(quic_mutex, portMAX_DELAY);
+    state = client_standby_state();
+    xSemaphoreGive(quic_mutex);
+    return state;
+}
+
+void quic_client_standby_stop(void) {
+    if (quic_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(quic_mutex, portMAX_DELAY);
+    if (g_standby) {
+        if (!g_standby->closed) {
+            client_close(g_standby);
+        }
+        client_stop(g_standby);
+        g_standby = NULL;
+    }
+    xSemaphoreGive(quic_mutex);
+}
+
+int quic_client_failover(void) {
+    struct client *old;
+    int rv = -1;
+
+    if (quic_mutex == NULL) {
+        return -1;
+    }
+    xSemaphoreTake(quic_mutex, portMAX_DELAY);
+
+    if (client_standby_state() != QUIC_STANDBY_READY) {
+        goto out;
+    }
+
+    // Whatever the old broker did not acknowledge is lost with it; MQTT
+    // redelivers what it has to after its new CONNECT
+    old = g_client;
+    if (old->conn && !old->closed) {
+        client_close(old);
+    }
+    client_stop(old);
+
+    g_client = g_standby;
+    g_standby = NULL;
+    g_client->standby = false;
+    g_client->stats = &g_stats;
+    g_stats.ip_version = g_standby_stats.ip_version;
+    g_stats.verify = g_standby_stats.verify;
+    g_stats.server_rpk = g_standby_stats.server_rpk;
+    g_stats.dns_source = g_standby_stats.dns_source;
+    g_stats.path_seeded = g_standby_stats.path_seeded;
+    g_stats.initial_rtt_ms = g_standby_stats.initial_rtt_ms;
+    g_stats.path_cwnd_hint = g_standby_stats.path_cwnd_hint;
+    g_stats.token_used = g_standby_stats.token_used;
+    g_stats.retries = g_standby_stats.retries;
+    g_stats.new_tokens = g_standby_stats.new_tokens;
+    g_stats.failovers++;
+    memset(&g_standby_stats, 0, sizeof(g_standby_stats));
+
+    client_set_keep_alive(g_client);
+    client_reset_recv_buffer();
+    g_quic_n_local_streams = g_client->max_local_streams;
+    g_quic_connected = g_client->max_local_streams > 0;
+    g_quic_handshake_completed = true;
+    ESP_LOGW(TAG, "Failed over to %s", g_client->hostname);
+
+    if (client_write(g_client) != 0) {
+        client_close(g_client);
+        goto out;
+    }
+    rv = 0;
+
+out:
+    xSemaphoreGive(quic_mutex);
+    return rv;
+}
+
 void quic_client_cleanup(void) {
     ESP_LOGI(TAG, "Cleaning up QUIC client...");
     
@@ -963,10 +2783,13 @@ void quic_client_cleanup(void) {
         xSemaphoreTake(quic_mutex, portMAX_DELAY);
     }
     
-    if (g_client.conn) {
+    if (g_standby) {
+        client_stop(g_standby);
+        g_standby = NULL;
+    }
+    if (g_client->conn) {
         ESP_LOGI(TAG, "Freeing QUIC connection...");
-        client_free(&g_client);
-        memset(&g_client, 0, sizeof(g_client));  // Clear the structure
+        client_stop(g_client);
     }
     
     g_quic_connected = false;
@@ -986,12 +2809,23 @@ void quic_client_cleanup(void) {
 
 // Thread-safe wrapper for QUIC write operations
 int quic_client_write_safe(const uint8_t *data, size_t datalen) {
+    ngtcp2_vec vec = {
+        .base = (uint8_t *)data,
+        .len = datalen
+    };
+
+    return quic_client_writev_safe(&vec, 1, QUIC_WRITE_FLAG_NONE) == (int)datalen ? 0 : -1;
+}
+
+// Thread-safe wrapper for vectored QUIC write operations
+int quic_client_writev_safe(const ngtcp2_vec *datav, size_t datavcnt,
+                            uint32_t flags) {
     if (quic_mutex == NULL) {
         ESP_LOGE(TAG, "QUIC mutex not initialized");
         return -1;
     }
     
-    if (data == NULL || datalen == 0) {
+    if (datav == NULL || datavcnt == 0) {
         ESP_LOGE(TAG, "Invalid write parameters");
         return -1;
     }
@@ -1005,7 +2839,7 @@ int quic_client_write_safe(const uint8_t *data, size_t datalen) {
     int result = -1;
     
     // Check if connection is valid
-    if (!g_client.conn || !g_quic_connected) {
+    if (!g_client->conn || !g_quic_connected) {
         ESP_LOGE(TAG, "QUIC connection not ready for write");
         goto cleanup;
     }
@@ -1017,9 +2851,11 @@ int quic_client_write_safe(const uint8_t *data, size_t datalen) {
     }
     
     // Perform the write operation
-    result = client_write_application_data(&g_client, data, datalen);
-    if (result == 0) {
-        ESP_LOGI(TAG, "Successfully wrote %zu bytes to QUIC stream", datalen);
+    result = (int)client_writev_application_data(g_client, datav, datavcnt, flags);
+    if (result > 0) {
+        ESP_LOGI(TAG, "Queued %d bytes on QUIC stream", result);
+    } else if (result == 0) {
+        ESP_LOGD(TAG, "QUIC stream send buffer full");
     } else {
         ESP_LOGE(TAG, "Failed to write data to QUIC stream: %d", result);
     }
@@ -1029,6 +2865,65 @@ cleanup:
     return result;
 }
 
+// Send stream data held for coalescing without waiting for the deadline
+int quic_client_flush_safe(void) {
+    if (quic_mutex == NULL) {
+        ESP_LOGE(TAG, "QUIC mutex not initialized");
+        return -1;
+    }
+
+    if (xSemaphoreTake(quic_mutex, pdMS_TO_TICKS(1000)) != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to acquire QUIC mutex for flush");
+        return -1;
+    }
+
+    int result = -1;
+
+    if (!g_client->conn || !g_quic_connected) {
+        ESP_LOGE(TAG, "QUIC connection not ready for flush");
+        goto cleanup;
+    }
+
+    result = 0;
+    if (g_client->stream.flushed != g_client->stream.queued) {
+        g_client->stream.flushed = g_client->stream.queued;
+        g_client->stream.hold_expiry = UINT64_MAX;
+        result = client_write(g_client);
+    }
+
+cleanup:
+    xSemaphoreGive(quic_mutex);
+    return result;
+}
+
+// Give up on a packet left open with QUIC_WRITE_FLAG_MORE
+int quic_client_abort_write(void) {
+    if (quic_mutex == NULL) {
+        ESP_LOGE(TAG, "QUIC mutex not initialized");
+        return -1;
+    }
+
+    if (xSemaphoreTake(quic_mutex, portMAX_DELAY) != pdTRUE) {
+        return -1;
+    }
+
+    int result = 0;
+
+    if (g_client->conn && !g_client->closed && g_client->sched.open &&
+        g_client->sched.owner == xTaskGetCurrentTaskHandle() &&
+        client_sched_drop_open(g_client) != 0) {
+        // The peer would read whatever follows as the rest of the packet
+        ESP_LOGE(TAG, "Closing the connection, a packet was cut short on the stream");
+        ngtcp2_ccerr_set_application_error(&g_client->last_error,
+                                           QUIC_APP_ERROR_PACKET_ABORTED, NULL, 0);
+        client_close(g_client);
+        result = -1;
+    }
+
+    xSemaphoreGive(quic_mutex);
+    return result;
+}
+
 // Thread-safe wrapper for QUIC read operations
 int quic_client_read_safe(uint8_t *buffer, size_t buffer_size, size_t *bytes_read) {
     if (quic_mutex == NULL) {
@@ -1042,17 +2937,121 @@ int quic_client_read_safe(uint8_t *buffer, size_t buffer_size, size_t *bytes_rea
     }
     
     *bytes_read = 0;
-    
+
+#if QUIC_PIPELINE_ENABLE
+    // The ring needs no lock, see app_recv_ring
+    return client_read_application_data(g_client, buffer, buffer_size, bytes_read);
+#else
     // Acquire mutex with timeout
     if (xSemaphoreTake(quic_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
         ESP_LOGE(TAG, "Failed to acquire QUIC mutex for read");
         return -1;
     }
     
-    int result = client_read_application_data(&g_client, buffer, buffer_size, bytes_read);
+    int result = client_read_application_data(g_client, buffer, buffer_size, bytes_read);
     
     // Release mutex
     xSemaphoreGive(quic_mutex);
     
     return result;
+#endif
+}
+
+// Thread-safe framed read: releases the previous frame and returns the next
+// complete one as a view into the receive buffer, under a single lock
+/*
+ * Nothing after a malformed or oversized frame on the MQTT stream can be
+ * told apart, and `consumed` is already released; close the connection.
+ * Called under quic_mutex.
+ */
+static void client_close_unframed(struct client *c) {
+    if (!c->conn || c->closed) {
+        return;
+    }
+    ngtcp2_ccerr_set_application_error(&c->last_error, QUIC_APP_ERROR_MALFORMED_FRAME,
+                                       NULL, 0);
+    client_close(c);
+}
+
+int quic_client_recv_frame_safe(size_t consumed, quic_frame_len_cb frame_len,
+                                const uint8_t **frame, size_t *framelen) {
+    if (quic_mutex == NULL) {
+        ESP_LOGE(TAG, "QUIC mutex not initialized");
+        return -1;
+    }
+
+    if (frame_len == NULL || frame == NULL || framelen == NULL) {
+        ESP_LOGE(TAG, "Invalid frame read parameters");
+        return -1;
+    }
+
+    *frame = NULL;
+    *framelen = 0;
+
+#if QUIC_PIPELINE_ENABLE
+    // The ring needs no lock, see app_recv_ring
+    const uint8_t *data;
+    size_t contig;
+    size_t unread;
+    ssize_t n;
+
+    client_consume_application_data(g_client, consumed);
+    unread = quic_spsc_peek(&app_recv_ring, &data, &contig);
+    n = contig > 0 ? frame_len(data, contig) : 0;
+    if (n == 0 && contig < unread) {
+        // The frame header crosses the end of the ring
+        quic_spsc_copy(&app_recv_ring, app_recv_frame, unread);
+        data = app_recv_frame;
+        n = frame_len(data, unread);
+    }
+
+    if (n < 0 || n > APP_RECV_WINDOW) {
+        ESP_LOGE(TAG, "Malformed or oversized frame (%ld bytes)", (long)n);
+        xSemaphoreTake(quic_mutex, portMAX_DELAY);
+        client_close_unframed(g_client);
+        xSemaphoreGive(quic_mutex);
+        return -1;
+    }
+    if (n == 0 || (size_t)n > unread) {
+        return -2;  // Special code for no complete frame
+    }
+    if (data != app_recv_frame && (size_t)n > contig) {
+        // The frame crosses the end of the ring
+        quic_spsc_copy(&app_recv_ring, app_recv_frame, (size_t)n);
+        data = app_recv_frame;
+    }
+    *frame = data;
+    *framelen = (size_t)n;
+    return 0;
+#else
+    // Acquire mutex with timeout
+    if (xSemaphoreTake(quic_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to acquire QUIC mutex for framed read");
+        return -1;
+    }
+
+    int result = client_consume_application_data(g_client, consumed);
+    if (result == 0) {
+        size_t unread = app_recv_buffer_len - app_recv_buffer_read_pos;
+        ssize_t n = unread > 0 ? frame_len(app_recv_buffer + app_recv_buffer_read_pos, unread) : 0;
+
+        if (n < 0 || n > APP_RECV_WINDOW) {
+            // A frame larger than the window can never complete
+            ESP_LOGE(TAG, "Malformed or oversized frame (%ld bytes)", (long)n);
+            result = -1;
+        } else if (n == 0 || (size_t)n > unread) {
+            result = -2;  // Special code for no complete frame
+        } else {
+            *frame = app_recv_buffer + app_recv_buffer_read_pos;
+            *framelen = (size_t)n;
+        }
+    }
+    if (result == -1) {
+        client_close_unframed(g_client);
+    }
+
+    xSemaphoreGive(quic_mutex);
+
+    return result;
+#endif /* QUIC_PIPELINE_ENABLE */
 }
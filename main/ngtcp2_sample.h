@@ -2,28 +2,313 @@
 #define NGTCP2_SAMPLE_H
 
 #include <stdbool.h>
+#include <sys/types.h>
+#include <ngtcp2/ngtcp2.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 
+// How the client authenticates the server
+typedef enum {
+    // Accept any server. For testing only
+    QUIC_TLS_VERIFY_NONE = 0,
+    // X.509 chain up to a CA in ca_pem, checked against the host name,
+    // dates as QUIC_TRUST_REQUIRE_CLOCK says; with server_key_sha256 set
+    // the server's key must match it as well
+    QUIC_TLS_VERIFY_CHAIN,
+    // Only the server's public key counts: it must hash to
+    // server_key_sha256. A raw public key (RFC 7250) is asked for, which
+    // keeps the server's handshake flight small; a server that does not
+    // support it sends its certificate and the key in there is checked
+    QUIC_TLS_VERIFY_PINNED_KEY,
+} quic_tls_verify_t;
+
+// Length of server_key_sha256
+#define QUIC_TLS_KEY_PIN_LEN 32
+
 // Configuration structure for QUIC client
 typedef struct {
     const char *hostname;
     const char *port;
     const char *alpn;
+    // Publish coalescing: stream data written with QUIC_WRITE_FLAG_COALESCE
+    // is held back until coalesce_bytes are pending or the oldest held write
+    // is coalesce_delay_ms old, so several small MQTT packets share one QUIC
+    // packet. 0 bytes disables coalescing.
+    size_t coalesce_bytes;
+    uint32_t coalesce_delay_ms;
+    quic_tls_verify_t verify;
+    // CA certificates (PEM) for QUIC_TLS_VERIFY_CHAIN, loaded into the
+    // shared TLS context on first use and kept
+    const char *ca_pem;
+    // Name of a data partition (a file in host builds) holding a CA image
+    // from tools/mk_trust_store.py, for QUIC_TLS_VERIFY_CHAIN besides or
+    // instead of ca_pem. The image stays in flash: issuers are looked up
+    // by subject and only those a server's chain needs are parsed
+    const char *ca_store;
+    // SHA-256 of the server's DER SubjectPublicKeyInfo, as printed by
+    // tools/mqtt_quic_server.py (openssl x509 -pubkey | openssl pkey
+    // -pubin -outform der | sha256sum for other brokers)
+    const uint8_t *server_key_sha256;
+    // Unified keepalive: ngtcp2 sends a PING once nothing was sent or
+    // received for keep_alive_ms, and closes the connection after
+    // idle_timeout_ms of silence (max_idle_timeout, the smaller of both
+    // sides' values applies). Liveness then needs no MQTT PINGREQ, so
+    // connect with keepAliveIntervalSec 0. keep_alive_ms is capped at half
+    // the idle timeout in effect. 0 leaves either off.
+    uint32_t keep_alive_ms;
+    uint32_t idle_timeout_ms;
+    // Low-power scheduling: while only deferrable sends are pending
+    // (delayed ACKs, keep-alive PINGs, data written with
+    // QUIC_WRITE_FLAG_COALESCE) they wait for the next multiple of
+    // tx_slack_ms on the monotonic clock, a grid all of them share, so
+    // they go out in one burst. Nothing waits longer than tx_slack_ms past
+    // its own deadline. Loss recovery and other data are never put off.
+    // ACKs can reach the peer up to tx_slack_ms later than max_ack_delay,
+    // so keep it well below the RTT. 0 disables it.
+    uint32_t tx_slack_ms;
+    // ACK frequency for downstream-heavy connections: an ACK goes out once
+    // ack_tolerance datagrams came in or the first of them waited
+    // max_ack_delay_ms, unless something else is sent first. ngtcp2 has
+    // no ACK_FREQUENCY frame, so the receiver side decides alone. The
+    // max_ack_delay_ms given at init is advertised to the peer and bounds
+    // later values. 0 keeps ngtcp2's ACK of every second packet and its
+    // 25 ms delay.
+    uint32_t ack_tolerance;
+    uint32_t max_ack_delay_ms;
+    // Failover: with a warm standby ready (quic_client_standby_start), a
+    // broker that leaves data in flight unanswered for failover_timeout_ms
+    // counts as gone, instead of only after idle_timeout_ms. The standby
+    // is dropped the same way. 0 leaves it to the idle timeout.
+    uint32_t failover_timeout_ms;
+    // PING interval of the standby; 0 sends them at half the idle timeout
+    // in effect, the fewest that keep it open
+    uint32_t standby_keep_alive_ms;
+    // Send stream data in arrival order instead of by quic_send_class_t
+    bool send_fifo;
 } quic_client_config_t;
 
+// Flags for quic_client_writev_safe
+#define QUIC_WRITE_FLAG_NONE 0x00
+// The data may wait for coalescing; writes without it are sent right away
+// and take any held data with them
+#define QUIC_WRITE_FLAG_COALESCE 0x01
+// More of the same packet follows in the next write; nothing is queued in
+// between. A write the send buffer could only take part of stays open too.
+#define QUIC_WRITE_FLAG_MORE 0x02
+// Send class of the packet, QUIC_SEND_INTERACTIVE if not given
+#define QUIC_WRITE_FLAG_CLASS(cls) ((uint32_t)((cls) + 1) << 4)
+// Ordering key of the packet, such as a hash of its PUBLISH topic: it is
+// never queued ahead of an earlier packet with the same key. 0 for none.
+#define QUIC_WRITE_FLAG_ORDER(key) ((uint32_t)(uint16_t)(key) << 16)
+
+/*
+ * Send classes. Queued packets not yet handed to ngtcp2 go out by class,
+ * in arrival order within a class, so a PUBACK or PINGREQ does not wait
+ * behind kilobytes of publishes. A packet is never split: once its first
+ * byte went out, the rest follows before anything else. Packets with the
+ * same QUIC_WRITE_FLAG_ORDER key keep their order whatever their class.
+ */
+typedef enum {
+    QUIC_SEND_CONTROL = 0,  // Acknowledgements, PINGREQ, SUBSCRIBE
+    QUIC_SEND_INTERACTIVE,  // Small publishes
+    QUIC_SEND_BULK,         // Large publishes, DISCONNECT after everything
+    QUIC_SEND_CLASS_COUNT
+} quic_send_class_t;
+
+// Packets tracked for scheduling; further ones join the last queued packet
+#define QUIC_SEND_MAX_PENDING 32
+
+// Application error codes of the CONNECTION_CLOSE sent when the MQTT
+// stream breaks: quic_client_abort_write, quic_client_recv_frame_safe
+#define QUIC_APP_ERROR_PACKET_ABORTED 0x1
+#define QUIC_APP_ERROR_MALFORMED_FRAME 0x2
+
+// Radio-on time model for quic_client_stats_t: a fixed wake-up and tail
+// cost per transmit burst, per-datagram overhead and airtime at the PHY rate
+#define QUIC_RADIO_BURST_US 2000
+#define QUIC_RADIO_DATAGRAM_US 100
+#define QUIC_RADIO_PHY_KBPS 11000
+
+// Transmit statistics, cumulative since quic_client_init_with_config
+typedef struct {
+    uint32_t app_writes;    // Writes queued on the stream, one per MQTT packet
+    uint32_t tx_datagrams;  // UDP datagrams sent, including ACK-only ones
+    uint32_t tx_bursts;     // Write passes that sent at least one datagram
+    uint64_t tx_bytes;      // UDP payload bytes sent
+    uint64_t radio_on_us;   // Estimated radio-on time, see QUIC_RADIO_*
+    // Connection setup phases. dns_us and keygen_us are durations (keygen_us
+    // is 0 with a key share from quic_client_prepare_handshake), the others
+    // are measured from the start of quic_client_init_with_config.
+    uint32_t dns_us;
+    uint32_t keygen_us;
+    uint32_t first_flight_us;  // First Initial handed to the socket
+    uint32_t handshake_us;     // Handshake completion, 0 until done
+    uint8_t dns_source;        // quic_dns_source_t of the broker address
+    bool raced;                // A second address family was tried too
+    uint8_t ip_version;        // 4 or 6 once the handshake completed
+    uint8_t verify;            // quic_tls_verify_t the server passed
+    bool server_rpk;           // The server sent a raw public key
+    // Path state saved by an earlier connection to the same address, see
+    // quic_path.h. ngtcp2 starts every connection with its own initial
+    // window, so the saved one is only reported
+    bool path_seeded;          // The initial RTT came from saved path state
+    uint32_t initial_rtt_ms;   // Initial RTT estimate the connection started with
+    uint32_t path_cwnd_hint;   // Window the previous connection closed with
+    // Address validation, see quic_token.h
+    bool token_used;           // The Initial carried a token from NEW_TOKEN
+    uint32_t retries;          // Retry packets received
+    uint32_t new_tokens;       // NEW_TOKEN frames received
+    uint32_t rx_datagrams;     // UDP datagrams received
+    uint64_t rx_bytes;
+    uint32_t rx_dropped;       // Discarded while the packet pool was empty
+    // Bytes each way up to handshake completion. The server's flight is
+    // bound by the anti-amplification limit, three times what we sent
+    uint32_t handshake_tx_bytes;
+    uint32_t handshake_rx_bytes;
+    // Keepalive in effect once the peer's transport parameters are known
+    uint32_t keep_alive_ms;
+    uint32_t idle_timeout_ms;
+    uint32_t tx_slack_ms;      // Low-power TX window in effect
+    uint32_t ack_tolerance;    // ACK frequency in effect
+    uint32_t max_ack_delay_ms;
+    // Datagrams sent while received ones awaited acknowledgement, each
+    // carrying an ACK
+    uint32_t ack_datagrams;
+    uint32_t timer_wakeups;    // QUIC timer expiries handled
+    // Warm standby. Its traffic is not part of the counters above; the
+    // standby_* values are those of the current standby since it started
+    uint32_t failovers;        // Standbys made the active connection
+    uint8_t standby_state;     // quic_standby_state_t
+    uint32_t standby_handshake_us;
+    uint32_t standby_retries;
+    bool standby_token_used;
+    uint32_t standby_keep_alive_ms;
+    uint32_t standby_tx_datagrams;
+    uint64_t standby_tx_bytes;
+    uint64_t standby_rx_bytes;
+    // Send scheduling per quic_send_class_t: packets, and the time from
+    // queueing a packet until its first byte was handed to ngtcp2
+    uint32_t class_packets[QUIC_SEND_CLASS_COUNT];
+    uint64_t class_delay_us[QUIC_SEND_CLASS_COUNT];  // Sum over the packets
+    uint32_t class_delay_max_us[QUIC_SEND_CLASS_COUNT];
+    uint32_t reordered;        // Packets queued ahead of earlier ones
+    bool send_fifo;            // Arrival order in effect
+} quic_client_stats_t;
+
+typedef enum {
+    QUIC_STANDBY_NONE = 0,
+    QUIC_STANDBY_CONNECTING,
+    QUIC_STANDBY_READY,   // Handshake completed, kept alive
+    QUIC_STANDBY_FAILED,  // Closed before it was needed; stop or restart it
+} quic_standby_state_t;
+
+// Size of the ring holding outgoing stream data until it is acknowledged
+#define APP_SEND_BUFFER_SIZE 8192
+
+// Stream flow control window for incoming data
+#define APP_RECV_WINDOW (16 * 1024)
+
+// How much the connection can take from the application now, see
+// quic_client_get_send_credit. The windows are what the peer and the
+// congestion controller allow beyond what is already in flight.
+typedef struct {
+    size_t buffer_free;      // Largest write quic_client_writev_safe takes
+    size_t queued;           // Queued bytes not sent yet
+    size_t unacked;          // Queued bytes the peer has not acknowledged
+    uint64_t stream_window;  // Stream flow control credit left
+    uint64_t conn_window;    // Connection flow control credit left
+    uint64_t cwnd_left;      // Congestion window headroom
+    // Bytes a write could add that go out at once: the smallest of the
+    // windows less what is queued, at most buffer_free
+    uint64_t send_now;
+} quic_send_credit_t;
+
+// Called from the QUIC I/O task, outside quic_mutex, when send buffer
+// space came back; see quic_client_set_send_credit_cb
+typedef void (*quic_send_credit_cb)(const quic_send_credit_t *credit, void *user_data);
+
+// Frame length callback for quic_client_recv_frame_safe: returns the total
+// length of the frame starting at data, 0 if more bytes are needed to tell,
+// or -1 if the data is malformed
+typedef ssize_t (*quic_frame_len_cb)(const uint8_t *data, size_t datalen);
+
 // Mutex for QUIC connection protection
 extern SemaphoreHandle_t quic_mutex;
 
-// Non-blocking QUIC client functions
+// Non-blocking QUIC client functions, apart from the name resolution in
+// quic_client_init_with_config and quic_client_standby_start, see
+// quic_dns_resolve
 int quic_client_init_with_config(const quic_client_config_t *config);
+// Create the shared TLS context and generate the key share for the next
+// connection now, so quic_client_init_with_config does not spend that time.
+// Call from idle time, e.g. while WiFi associates. Returns 0 on success.
+int quic_client_prepare_handshake(void);
 int quic_client_process(void);  // Non-blocking process function
 bool quic_client_is_connected(void);
 int quic_client_local_stream_avail(void);
+size_t quic_client_unacked_bytes(void);  // Stream bytes not yet acknowledged
+// Fill in the current send credit. Returns 0, or -1 without a connection
+// that takes writes (credit is zeroed then).
+int quic_client_get_send_credit(quic_send_credit_t *credit);
+// Call cb once buffer_free is back at min_free bytes or more after a write
+// was refused or left less than that. It runs in the QUIC I/O task and
+// must only signal the publisher, e.g. with a task notification; the
+// publisher writes from its own task. A write from the callback gets 0
+// while the MQTT task has a packet half queued. NULL removes it.
+void quic_client_set_send_credit_cb(quic_send_credit_cb cb, void *user_data, size_t min_free);
+void quic_client_get_stats(quic_client_stats_t *stats);
+uint32_t quic_client_smoothed_rtt_ms(void);  // ngtcp2 smoothed RTT estimate
 void quic_client_cleanup(void);
 
 // Thread-safe QUIC operations
 int quic_client_write_safe(const uint8_t *data, size_t datalen);
+// Queue the vectors on the stream; returns bytes queued, 0 when the send
+// buffer is full or another task has a packet open (retry later), or -1 on
+// error. flags is QUIC_WRITE_FLAG_*.
+int quic_client_writev_safe(const ngtcp2_vec *datav, size_t datavcnt,
+                            uint32_t flags);
+// Send any stream data held for coalescing now
+int quic_client_flush_safe(void);
+// Give up on the packet the calling task left open with
+// QUIC_WRITE_FLAG_MORE. It is dropped if none of it was handed to ngtcp2
+// yet; otherwise the peer would take what follows for the rest of it, so
+// the connection is closed with QUIC_APP_ERROR_PACKET_ABORTED. Returns 0
+// if the connection is still usable, -1 if it was closed.
+int quic_client_abort_write(void);
+// Change the coalescing threshold and delay of the running client
+void quic_client_set_coalescing(size_t coalesce_bytes, uint32_t coalesce_delay_ms);
+// Change the keep-alive interval of the running client, 0 to stop PINGs
+void quic_client_set_keep_alive(uint32_t keep_alive_ms);
+// Change the low-power TX slack of the running client, 0 to turn it off
+void quic_client_set_tx_slack(uint32_t tx_slack_ms);
+// max_ack_delay_ms is capped at the value advertised to the peer
+void quic_client_set_ack_frequency(uint32_t ack_tolerance, uint32_t max_ack_delay_ms);
+// Switch between class priority and arrival order for packets queued from now on
+void quic_client_set_send_fifo(bool send_fifo);
+// Open a warm standby: a second connection, to another broker, with the
+// TLS settings of the running client. It completes its handshake and then
+// only answers keep-alives until quic_client_failover. Replaces any
+// previous standby. hostname must stay valid while it is in use. Resolves
+// hostname in the calling task, outside quic_mutex; without a fresh cached
+// answer that blocks for up to QUIC_DNS_TIMEOUT_MS. Returns 0 once the
+// first flight is out, -1 on error.
+int quic_client_standby_start(const char *hostname, const char *port);
+quic_standby_state_t quic_client_standby_state(void);
+void quic_client_standby_stop(void);
+// Make the ready standby the connection MQTT runs on and close the current
+// one; its stream, unacknowledged data included, is dropped. Send CONNECT
+// next. Call from the task reading MQTT data. Returns 0, or -1 without a
+// ready standby.
+int quic_client_failover(void);
 int quic_client_read_safe(uint8_t *buffer, size_t buffer_size, size_t *bytes_read);
+// Release `consumed` bytes of the previous frame and return the next complete
+// frame as a view valid until the next call; returns 0, -2 if no complete
+// frame is buffered yet, or -1 on error. A frame can be at most
+// APP_RECV_WINDOW bytes, the most the peer may send unread. A malformed or
+// larger one leaves the stream unframeable, so the connection is closed
+// with QUIC_APP_ERROR_MALFORMED_FRAME. -1 while still connected means the
+// lock could not be taken and nothing was released.
+int quic_client_recv_frame_safe(size_t consumed, quic_frame_len_cb frame_len,
+                                const uint8_t **frame, size_t *framelen);
 
 #endif
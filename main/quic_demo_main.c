@@ -51,13 +51,168 @@
 #include "core_mqtt.h"
 #include "core_mqtt_state.h"
 #include "mqtt_quic_transport.h"
-
-extern struct client g_client;
+#include "quic_mem.h"
+#include "quic_netem.h"
+#include "quic_trust.h"
+#include "quic_pipeline.h"
+#include "mqtt_quic_bench.h"
+#include "mqtt_quic_offline.h"
+#include "mqtt_quic_router.h"
+#include "mqtt_quic_codec.h"
+#include "mqtt_quic_failover.h"
+#include "mqtt_quic_outbound.h"
 
 static const char *TAG = "quic_demo_main";
 
 static uint8_t gbuffer[2048];  // Buffer for MQTT messages
 
+// QUIC I/O runs on pooled packet buffers (quic_mem.h), so the task only
+// needs room for ngtcp2/wolfSSL call depth, DNS queries and coreMQTT.
+// The stacks bench result reports what each task left unused.
+#ifndef QUIC_MQTT_TASK_STACK_SIZE
+#define QUIC_MQTT_TASK_STACK_SIZE (16 * 1024)
+#endif
+// One-shot task creating the TLS context and key share during boot
+#ifndef QUIC_PREPARE_TASK_STACK_SIZE
+#define QUIC_PREPARE_TASK_STACK_SIZE (6 * 1024)
+#endif
+
+// Publish coalescing: small PUBLISH/PUBACK packets wait up to
+// QUIC_DEMO_COALESCE_DELAY_MS for company, or until about one QUIC
+// packet's worth is queued. Set the byte threshold to 0 to disable.
+#define QUIC_DEMO_COALESCE_BYTES 1200
+#define QUIC_DEMO_COALESCE_DELAY_MS 20
+
+// Telemetry is published every QUIC_DEMO_TELEMETRY_PERIOD_MS and goes to
+// the offline queue while the broker is unreachable. After losing the
+// connection the task keeps queueing for QUIC_DEMO_OFFLINE_RESTART_MS and
+// then restarts the device to reconnect; the queue is replayed once MQTT
+// is up again.
+#define QUIC_DEMO_TELEMETRY_TOPIC "esp32/quic/telemetry"
+#define QUIC_DEMO_TELEMETRY_PERIOD_MS 10000
+#define QUIC_DEMO_OFFLINE_RESTART_MS 60000
+// On a slow link only the newest sample waits to be sent, and one the
+// next has not replaced within QUIC_DEMO_TELEMETRY_TTL_MS is dropped
+#define QUIC_DEMO_TELEMETRY_TTL_MS QUIC_DEMO_TELEMETRY_PERIOD_MS
+
+// Unified keepalive: ngtcp2 PINGs the broker after QUIC_DEMO_KEEP_ALIVE_MS
+// without traffic, and a broker silent for QUIC_DEMO_IDLE_TIMEOUT_MS counts
+// as gone. MQTT keepalive is off, so idle periods cost one PING and its ACK
+// per interval instead of a PINGREQ, a PINGRESP and the ACKs of both.
+#define QUIC_DEMO_KEEP_ALIVE_MS 30000
+#define QUIC_DEMO_IDLE_TIMEOUT_MS 90000
+
+// Battery builds gather delayed ACKs, keep-alive PINGs and QoS0 publishes
+// into shared TX windows, see tx_slack_ms in ngtcp2_sample.h
+#ifndef QUIC_DEMO_TX_SLACK_MS
+#define QUIC_DEMO_TX_SLACK_MS 0
+#endif
+
+// ACK frequency, see ack_tolerance in ngtcp2_sample.h. 0 keeps ngtcp2's
+// defaults; the benchmarks raise the tolerance for bulk downloads only
+#define QUIC_DEMO_ACK_TOLERANCE 0
+#define QUIC_DEMO_MAX_ACK_DELAY_MS 0
+
+// Broker to connect to. Benchmark builds point these at the host running
+// tools/mqtt_quic_server.py, see main/CMakeLists.txt.
+#ifndef QUIC_DEMO_BROKER_HOST
+#define QUIC_DEMO_BROKER_HOST "broker.emqx.io"
+#endif
+#ifndef QUIC_DEMO_BROKER_PORT
+#define QUIC_DEMO_BROKER_PORT 14567
+#endif
+
+// Optional second broker, kept as a warm standby: its QUIC handshake is
+// done ahead of time, so losing the first broker costs the detection time
+// and one CONNECT round trip. A broker leaving data unanswered for
+// QUIC_DEMO_FAILOVER_TIMEOUT_MS counts as gone while a standby is ready.
+// The standby pings at half the idle timeout.
+#define QUIC_DEMO_FAILOVER_TIMEOUT_MS 3000
+#define QUIC_DEMO_STANDBY_KEEP_ALIVE_MS 0
+#ifndef QUIC_DEMO_STANDBY_PORT
+#define QUIC_DEMO_STANDBY_PORT QUIC_DEMO_BROKER_PORT
+#endif
+
+static const ServerInfo_t demo_brokers[] = {
+    { .pHostName = QUIC_DEMO_BROKER_HOST, .port = QUIC_DEMO_BROKER_PORT, .pAlpn = "mqtt" },
+#ifdef QUIC_DEMO_STANDBY_HOST
+    { .pHostName = QUIC_DEMO_STANDBY_HOST, .port = QUIC_DEMO_STANDBY_PORT, .pAlpn = "mqtt" },
+#endif
+};
+
+#ifdef QUIC_DEMO_RETRY_PORT
+// Port of the benchmark server that sends Retry, see mqtt_quic_bench_token
+static const ServerInfo_t demo_retry_broker = {
+    .pHostName = QUIC_DEMO_BROKER_HOST, .port = QUIC_DEMO_RETRY_PORT, .pAlpn = "mqtt"
+};
+#endif
+
+// SHA-256 of the broker's SubjectPublicKeyInfo, 64 hex digits. When set
+// (-DQUIC_BROKER_KEY=<hex>, see main/CMakeLists.txt) the broker must
+// present that key, as a raw public key or in its certificate.
+#ifndef QUIC_DEMO_BROKER_KEY_SHA256
+#define QUIC_DEMO_BROKER_KEY_SHA256 ""
+#endif
+
+// Verify the broker's certificate chain against the CA image in the
+// QUIC_TRUST_PARTITION partition (-DQUIC_TRUST_STORE=1, see README.md)
+#ifndef QUIC_DEMO_TRUST_STORE
+#define QUIC_DEMO_TRUST_STORE 0
+#endif
+
+static uint8_t broker_key_pin[QUIC_TLS_KEY_PIN_LEN];
+
+// Parse QUIC_DEMO_BROKER_KEY_SHA256, NULL if unset or malformed
+static const uint8_t *demo_broker_key_pin(void)
+{
+    const char *hex = QUIC_DEMO_BROKER_KEY_SHA256;
+
+    if (strlen(hex) != 2 * QUIC_TLS_KEY_PIN_LEN) {
+        if (hex[0] != '\0') {
+            ESP_LOGE(TAG, "QUIC_DEMO_BROKER_KEY_SHA256 must be %d hex digits", 2 * QUIC_TLS_KEY_PIN_LEN);
+        }
+        return NULL;
+    }
+    for (int i = 0; i < QUIC_TLS_KEY_PIN_LEN; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            ESP_LOGE(TAG, "QUIC_DEMO_BROKER_KEY_SHA256 is not hex");
+            return NULL;
+        }
+        broker_key_pin[i] = (uint8_t)byte;
+    }
+    return broker_key_pin;
+}
+
+#if QUIC_NETEM_ENABLE
+// Impairment applied when built with -DQUIC_NETEM=1: a congested WiFi
+// link. Change the seed to get a different but equally repeatable run.
+static const quic_netem_config_t demo_netem = {
+    .seed = 1,
+    .log_events = false,
+    .tx = { .loss_permille = 20, .dup_permille = 5, .reorder_permille = 10, .reorder_ms = 30,
+            .delay_ms = 40, .jitter_ms = 10, .rate_kbps = 2000 },
+    .rx = { .loss_permille = 20, .dup_permille = 5, .reorder_permille = 10, .reorder_ms = 30,
+            .delay_ms = 40, .jitter_ms = 10, .rate_kbps = 4000 },
+};
+#endif
+
+// Longest the QUIC task waits for quic_client_prepare_handshake to finish
+#define QUIC_DEMO_PREPARE_WAIT_MS 2000
+
+static SemaphoreHandle_t handshake_prepared;
+
+// Generate the TLS key share while the WiFi connection is coming up
+static void handshake_prepare_task(void *pvParameters)
+{
+    if (quic_client_prepare_handshake() != 0) {
+        ESP_LOGW(TAG, "Handshake preparation failed");
+    }
+    quic_mem_log_stack_watermark("quic_prep");
+    xSemaphoreGive(handshake_prepared);
+    vTaskDelete(NULL);
+}
+
 // MQTT application callback
 static void eventCallback(MQTTContext_t *pContext,
                          MQTTPacketInfo_t *pPacketInfo,
@@ -88,15 +243,16 @@ static void eventCallback(MQTTContext_t *pContext,
             break;
             
         case MQTT_PACKET_TYPE_PUBLISH:
-            ESP_LOGI(TAG, "=== MQTT PUBLISH RECEIVED ===");
             if (pDeserializedInfo && pDeserializedInfo->pPublishInfo) {
-                ESP_LOGI(TAG, "Topic: %.*s", 
-                         pDeserializedInfo->pPublishInfo->topicNameLength,
-                         pDeserializedInfo->pPublishInfo->pTopicName);
-                ESP_LOGI(TAG, "Payload: %.*s", 
-                         pDeserializedInfo->pPublishInfo->payloadLength,
-                         (char *)pDeserializedInfo->pPublishInfo->pPayload);
-                ESP_LOGI(TAG, "QoS: %d", pDeserializedInfo->pPublishInfo->qos);
+                // Undo compression on codec topics before the handlers see it
+                MQTTPublishInfo_t publishInfo = *pDeserializedInfo->pPublishInfo;
+                if (mqtt_quic_codec_receive(&publishInfo) != 0) {
+                    break;
+                }
+                if (mqtt_quic_router_dispatch(&publishInfo) == 0) {
+                    ESP_LOGW(TAG, "No route for PUBLISH on %.*s",
+                             publishInfo.topicNameLength, publishInfo.pTopicName);
+                }
             }
             break;
             
@@ -139,10 +295,81 @@ static void eventCallback(MQTTContext_t *pContext,
              pPacketInfo->remainingLength, pPacketInfo->type);
 }
 
+// Route handler for the demo topic
+static void demo_on_test_message(const MQTTPublishInfo_t *pPublishInfo, void *pUserCtx)
+{
+    (void)pUserCtx;
+
+    ESP_LOGI(TAG, "=== MQTT PUBLISH RECEIVED ===");
+    ESP_LOGI(TAG, "Topic: %.*s", pPublishInfo->topicNameLength, pPublishInfo->pTopicName);
+    ESP_LOGI(TAG, "Payload: %.*s", (int)pPublishInfo->payloadLength, (const char *)pPublishInfo->pPayload);
+    ESP_LOGI(TAG, "QoS: %d", pPublishInfo->qos);
+}
+
+// Publish a telemetry sample, or queue it if MQTT is not available
+static void demo_publish_telemetry(MQTTContext_t *pContext)
+{
+    static char payload[64];
+    MQTTPublishInfo_t publishInfo;
+
+    snprintf(payload, sizeof(payload), "{\"uptime_ms\":%lld,\"heap\":%lu}",
+             (long long)(esp_timer_get_time() / 1000), esp_get_free_heap_size());
+
+    memset(&publishInfo, 0, sizeof(publishInfo));
+    publishInfo.qos = MQTTQoS1;
+    publishInfo.pTopicName = QUIC_DEMO_TELEMETRY_TOPIC;
+    publishInfo.topicNameLength = strlen(QUIC_DEMO_TELEMETRY_TOPIC);
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = strlen(payload);
+
+    // Held by the outbound policy while the connection cannot take it
+    if (pContext != NULL && quic_client_is_connected() &&
+        mqtt_quic_outbound_publish(pContext, &publishInfo) == MQTTSuccess) {
+        return;
+    }
+
+    if (mqtt_quic_offline_enqueue(&publishInfo) != 0) {
+        ESP_LOGW(TAG, "Failed to queue telemetry sample");
+    }
+}
+
+static void demo_subscribe(MQTTContext_t *pContext)
+{
+    MQTTSubscribeInfo_t subscribeInfo;
+    MQTTStatus_t mqttStatus;
+
+    subscribeInfo.qos = MQTTQoS0;
+    subscribeInfo.pTopicFilter = "esp32/quic/test";
+    subscribeInfo.topicFilterLength = strlen("esp32/quic/test");
+
+    mqttStatus = MQTT_Subscribe(pContext, &subscribeInfo, 1, MQTT_GetPacketId(pContext));
+    if (mqttStatus != MQTTSuccess) {
+        ESP_LOGE(TAG, "Failed to subscribe to topic, error %d", mqttStatus);
+    } else {
+        ESP_LOGI(TAG, "Subscribed to topic esp32/quic/test");
+    }
+}
+
+// Keep queueing telemetry while offline, then restart to reconnect
+static void demo_offline_then_restart(void)
+{
+    ESP_LOGW(TAG, "Offline, queueing telemetry for %d s before restarting",
+             QUIC_DEMO_OFFLINE_RESTART_MS / 1000);
+
+    for (int elapsed = 0; elapsed < QUIC_DEMO_OFFLINE_RESTART_MS;
+         elapsed += QUIC_DEMO_TELEMETRY_PERIOD_MS) {
+        demo_publish_telemetry(NULL);
+        vTaskDelay(pdMS_TO_TICKS(QUIC_DEMO_TELEMETRY_PERIOD_MS));
+    }
+
+    mqtt_quic_offline_sync();
+    esp_restart();
+}
+
 // Combined task that handles both QUIC and MQTT
 void combined_quic_mqtt_task(void *pvParameters)
 {
-    ServerInfo_t *serverInfo = (ServerInfo_t *)pvParameters;
+    const ServerInfo_t *serverInfo = (const ServerInfo_t *)pvParameters;
     if (!serverInfo) {
         ESP_LOGE(TAG, "No server info provided");
         vTaskDelete(NULL);
@@ -157,20 +384,45 @@ void combined_quic_mqtt_task(void *pvParameters)
     snprintf(port_str, sizeof(port_str), "%d", serverInfo->port);
     
     // Prepare QUIC client configuration
+    const uint8_t *keyPin = demo_broker_key_pin();
     quic_client_config_t quic_config = {
         .hostname = serverInfo->pHostName,
         .port = port_str,
-        .alpn = serverInfo->pAlpn
+        .alpn = serverInfo->pAlpn,
+        .coalesce_bytes = QUIC_DEMO_COALESCE_BYTES,
+        .coalesce_delay_ms = QUIC_DEMO_COALESCE_DELAY_MS,
+#if QUIC_DEMO_TRUST_STORE
+        .verify = QUIC_TLS_VERIFY_CHAIN,
+        .ca_store = QUIC_TRUST_PARTITION,
+#else
+        .verify = keyPin ? QUIC_TLS_VERIFY_PINNED_KEY : QUIC_TLS_VERIFY_NONE,
+#endif
+        .server_key_sha256 = keyPin,
+        .keep_alive_ms = QUIC_DEMO_KEEP_ALIVE_MS,
+        .idle_timeout_ms = QUIC_DEMO_IDLE_TIMEOUT_MS,
+        .tx_slack_ms = QUIC_DEMO_TX_SLACK_MS,
+        .ack_tolerance = QUIC_DEMO_ACK_TOLERANCE,
+        .max_ack_delay_ms = QUIC_DEMO_MAX_ACK_DELAY_MS,
+        .failover_timeout_ms = QUIC_DEMO_FAILOVER_TIMEOUT_MS,
+        .standby_keep_alive_ms = QUIC_DEMO_STANDBY_KEEP_ALIVE_MS
     };
 
     ESP_LOGI(TAG, "Initializing QUIC client with %s:%s", quic_config.hostname, quic_config.port);
     ESP_LOGI(TAG, "Free heap before QUIC init: %lu bytes", esp_get_free_heap_size());
     
+#if QUIC_NETEM_ENABLE
+    quic_netem_configure(&demo_netem);
+#endif
+
+    // Normally done long ago, while WiFi was associating
+    if (xSemaphoreTake(handshake_prepared, pdMS_TO_TICKS(QUIC_DEMO_PREPARE_WAIT_MS)) != pdTRUE) {
+        ESP_LOGW(TAG, "Key share not ready, generating it during connect");
+    }
+
     // Initialize QUIC client (non-blocking)
     if (quic_client_init_with_config(&quic_config) != 0) {
         ESP_LOGE(TAG, "Failed to initialize QUIC client");
-        vTaskDelete(NULL);
-        return;
+        demo_offline_then_restart();
     }
 
     ESP_LOGI(TAG, "QUIC client initialized, waiting for connection...");
@@ -203,8 +455,7 @@ void combined_quic_mqtt_task(void *pvParameters)
     if (!quic_client_is_connected()) {
         ESP_LOGE(TAG, "Failed to establish QUIC connection after %d attempts", max_attempts);
         quic_client_cleanup();
-        vTaskDelete(NULL);
-        return;
+        demo_offline_then_restart();
     }
 
     ESP_LOGI(TAG, "QUIC connection established! Waiting a bit more for stability...");
@@ -242,6 +493,7 @@ void combined_quic_mqtt_task(void *pvParameters)
     xTransportInterface.pNetworkContext = &networkContext;
     xTransportInterface.recv = mqtt_quic_transport_recv;
     xTransportInterface.send = mqtt_quic_transport_send;
+    xTransportInterface.writev = mqtt_quic_transport_writev;
     
     // Initialize MQTT library
     // @FIXME: this buffer isn't thread safe.
@@ -265,6 +517,14 @@ void combined_quic_mqtt_task(void *pvParameters)
         return;
     }
     
+    // Inbound PUBLISH packets are dispatched by topic from eventCallback
+    mqtt_quic_router_add("esp32/quic/test", strlen("esp32/quic/test"), demo_on_test_message, NULL);
+#if QUIC_DEMO_RUN_BENCH
+    mqtt_quic_router_add("esp32/quic/bench/#", strlen("esp32/quic/bench/#"),
+                         mqtt_quic_bench_on_publish, NULL);
+#endif
+    mqtt_quic_outbound_set_policy(QUIC_DEMO_TELEMETRY_TOPIC, true, QUIC_DEMO_TELEMETRY_TTL_MS);
+
     ESP_LOGI(TAG, "MQTT initialized, connecting to broker...");
 
     // Connect to the MQTT broker
@@ -273,6 +533,8 @@ void combined_quic_mqtt_task(void *pvParameters)
     connectInfo.cleanSession = true;
     connectInfo.pClientIdentifier = "esp32_quic_client";
     connectInfo.clientIdentifierLength = strlen("esp32_quic_client");
+    // Liveness comes from QUIC keep-alive and the idle timeout
+    connectInfo.keepAliveIntervalSec = 0;
     
     // Add more debugging before MQTT connect
     ESP_LOGI(TAG, "About to call MQTT_Connect with:");
@@ -285,34 +547,37 @@ void combined_quic_mqtt_task(void *pvParameters)
     bool sessionPresent = false;
     
     // Use a shorter timeout for MQTT connect to prevent watchdog
+    int64_t mqttConnectStart = esp_timer_get_time();
     mqttStatus = MQTT_Connect(&mqttContext, &connectInfo, NULL, 5000, &sessionPresent);
+    uint32_t mqttConnectUs = (uint32_t)(esp_timer_get_time() - mqttConnectStart);
     
     ESP_LOGI(TAG, "MQTT_Connect returned: %d, sessionPresent: %s", mqttStatus, sessionPresent ? "true" : "false");
     if (mqttStatus != MQTTSuccess) {
         ESP_LOGE(TAG, "Failed to connect to MQTT broker, error %d", mqttStatus);
         quic_client_cleanup();
-        vTaskDelete(NULL);
-        return;
+        demo_offline_then_restart();
     }
     
     ESP_LOGI(TAG, "Connected to MQTT broker over QUIC!");
+
+    // Warm up the other broker while this one serves
+    mqtt_quic_failover_init(demo_brokers, sizeof(demo_brokers) / sizeof(demo_brokers[0]));
+    mqtt_quic_failover_standby();
+#if QUIC_DEMO_RUN_BENCH
+    mqtt_quic_bench_handshake(mqttConnectUs);
+#if QUIC_DEMO_TRUST_STORE
+    mqtt_quic_bench_trust_store();
+#endif
+#else
+    (void)mqttConnectUs;
+#endif
     
     // Give some time for CONNACK to be processed
     ESP_LOGI(TAG, "Waiting for CONNACK processing...");
     vTaskDelay(pdMS_TO_TICKS(1000));
     
     // Subscribe to a topic
-    MQTTSubscribeInfo_t subscribeInfo;
-    subscribeInfo.qos = MQTTQoS0;
-    subscribeInfo.pTopicFilter = "esp32/quic/test";
-    subscribeInfo.topicFilterLength = strlen("esp32/quic/test");
-    
-    mqttStatus = MQTT_Subscribe(&mqttContext, &subscribeInfo, 1, 2);
-    if (mqttStatus != MQTTSuccess) {
-        ESP_LOGE(TAG, "Failed to subscribe to topic, error %d", mqttStatus);
-    } else {
-        ESP_LOGI(TAG, "Subscribed to topic esp32/quic/test");
-    }
+    demo_subscribe(&mqttContext);
     
     // Publish a message
     MQTTPublishInfo_t publishInfo;
@@ -329,6 +594,38 @@ void combined_quic_mqtt_task(void *pvParameters)
     } else {
         ESP_LOGI(TAG, "Published message to esp32/quic/test");
     }
+
+    // Deliver telemetry queued while offline
+    if (mqtt_quic_offline_replay(&mqttContext, UINT32_MAX, 30000) < 0) {
+        ESP_LOGW(TAG, "Offline queue replay failed");
+    }
+
+#if QUIC_DEMO_RUN_BENCH
+    mqtt_quic_bench_router(100, 2000);
+    mqtt_quic_bench_codec(200);
+    mqtt_quic_bench_stream_publish(&mqttContext, "esp32/quic/bench/stream");
+    mqtt_quic_bench_inbound_qos0(&mqttContext, &networkContext, "esp32/quic/bench/inbound", 1000);
+    mqtt_quic_bench_fanout(&mqttContext, &networkContext, 1000);
+    mqtt_quic_bench_ack_frequency(&mqttContext, 10, 512, 1024);
+    mqtt_quic_bench_pipeline(&mqttContext, 1024, 1024);
+    mqtt_quic_bench_publish_latency(&mqttContext, &networkContext, "esp32/quic/bench/latency", 200);
+    mqtt_quic_bench_qos1_pipeline(&mqttContext, &networkContext, "esp32/quic/bench/qos1", 2000);
+    mqtt_quic_bench_priority(&mqttContext, 2048, 10000);
+    mqtt_quic_bench_outbound(&mqttContext, 200, 10000);
+    mqtt_quic_bench_coalescing(&mqttContext, "esp32/quic/bench/sensor",
+                               QUIC_DEMO_COALESCE_BYTES, QUIC_DEMO_COALESCE_DELAY_MS);
+    mqtt_quic_bench_netem();
+    mqtt_quic_bench_keepalive(&mqttContext, 10000, 60000);
+    mqtt_quic_bench_lowpower(&mqttContext, "esp32/quic/bench/inbound", 1000, 60000);
+    mqtt_quic_bench_path_cache(&mqttContext, &networkContext, &connectInfo, demo_brokers,
+                               sizeof(demo_brokers) / sizeof(demo_brokers[0]), 64);
+#ifdef QUIC_DEMO_RETRY_PORT
+    mqtt_quic_bench_token(&mqttContext, &demo_retry_broker);
+#endif
+    mqtt_quic_bench_failover(&mqttContext, &networkContext, &connectInfo, 200, 50);
+    mqtt_quic_bench_stacks();
+    mqtt_quic_bench_report("done", "\"heap_min\":%lu", esp_get_minimum_free_heap_size());
+#endif
     
     // Main loop - process both QUIC and MQTT
     ESP_LOGI(TAG, "Entering main processing loop...");
@@ -349,27 +646,50 @@ void combined_quic_mqtt_task(void *pvParameters)
         
         // Process MQTT events more frequently to catch all incoming messages
         if (loop_count % 5 == 0) {  // Process MQTT every 5 iterations (every 100ms)
+            int64_t start = esp_timer_get_time();
             mqttStatus = MQTT_ProcessLoop(&mqttContext);
+            quic_pipeline_busy_add(QUIC_STAGE_APP, (uint32_t)(esp_timer_get_time() - start));
             if (mqttStatus != MQTTSuccess) {
                 ESP_LOGW(TAG, "MQTT process loop failed, error %d", mqttStatus);
             }
+            mqtt_quic_outbound_flush(&mqttContext);
         }
         
+        if (loop_count % (QUIC_DEMO_TELEMETRY_PERIOD_MS / 20) == 0) {
+            MQTTQUICOfflineStats_t offlineStats;
+
+            demo_publish_telemetry(&mqttContext);
+
+            // Samples queued during a brief hiccup
+            mqtt_quic_offline_get_stats(&offlineStats);
+            if (offlineStats.pending > 0) {
+                mqtt_quic_offline_replay(&mqttContext, 256, 5000);
+            }
+
+            // Replace a standby that failed
+            mqtt_quic_failover_standby();
+        }
+
         // Check if QUIC connection is still alive
         if (!quic_client_is_connected()) {
             ESP_LOGW(TAG, "QUIC connection lost");
-            break;
+            if (mqtt_quic_failover_switch(&mqttContext, &networkContext, &connectInfo,
+                                          5000, NULL) != MQTTSuccess) {
+                break;
+            }
+            demo_subscribe(&mqttContext);
         }
         
         // Check free heap every 50 iterations
         if (loop_count % 50 == 0) {
             ESP_LOGD(TAG, "Free heap: %lu bytes (loop %d)", esp_get_free_heap_size(), loop_count);
+            quic_mem_log_stack_watermark("quic_mqtt_task");
         }
     }
     
-    ESP_LOGI(TAG, "Cleaning up and exiting...");
+    ESP_LOGI(TAG, "Cleaning up...");
     quic_client_cleanup();
-    vTaskDelete(NULL);
+    demo_offline_then_restart();
 }
 
 void wifi_init(void)
@@ -403,7 +723,16 @@ void app_main(void)
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+
+    // Telemetry published while offline survives reboots here
+    if (mqtt_quic_offline_init() != 0) {
+        ESP_LOGW(TAG, "Offline queue unavailable, telemetry is lost while offline");
+    }
     
+    handshake_prepared = xSemaphoreCreateBinary();
+    xTaskCreate(handshake_prepare_task, "quic_prep", QUIC_PREPARE_TASK_STACK_SIZE, NULL,
+                tskIDLE_PRIORITY + 1, NULL);
+
     // Connect to WiFi
     ESP_LOGI(TAG, "Connecting to WiFi...");
     ESP_ERROR_CHECK(esp_netif_init());
@@ -415,15 +744,10 @@ void app_main(void)
     // Log memory status before starting
     ESP_LOGI(TAG, "Free heap before task creation: %lu bytes", esp_get_free_heap_size());
     
-    // Create server info for QUIC client
-    static ServerInfo_t serverInfo = {
-        .pHostName = "broker.emqx.io",
-        .port = 14567,
-        .pAlpn = "mqtt"  // Use plain string instead of binary format
-    };
-    
-    // Run the combined QUIC+MQTT task with smaller stack
-    xTaskCreate(combined_quic_mqtt_task, "quic_mqtt_task", 28*1024, &serverInfo, 5, NULL);
+    // Run the combined QUIC+MQTT task with smaller stack, on the
+    // application core when pipelined. It connects to the first broker
+    quic_task_create(combined_quic_mqtt_task, "quic_mqtt_task", QUIC_MQTT_TASK_STACK_SIZE,
+                     (void *)&demo_brokers[0], QUIC_APP_TASK_PRIORITY, QUIC_APP_TASK_CORE, NULL);
 
     while (1) {
          vTaskDelay(10000 / portTICK_PERIOD_MS); // Yield to other tasks
@@ -0,0 +1,591 @@
+#include "quic_dns.h"
+#include "quic_persist.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/select.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_random.h"
+#include "lwip/dns.h"
+#else
+#include <stdio.h>
+#endif
+
+static const char *TAG = "QUIC_DNS";
+
+#define DNS_PORT 53
+#define DNS_HEADER_SIZE 12
+#define DNS_MSG_MAX 512
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE_MASK 0x000F
+
+// Bump when dns_cache changes layout; older blobs are then ignored
+#define DNS_CACHE_VERSION 2
+
+typedef struct {
+    uint8_t family;  // 4 or 6
+    uint8_t addr[16];
+} dns_addr_t;
+
+typedef struct {
+    quic_persist_time_t resolved;  // Of the answer, epoch 0 for an unused entry
+    char host[QUIC_DNS_HOST_MAX];
+    uint32_t ttl;                  // Seconds, smallest over the records used
+    uint8_t count;
+    dns_addr_t addrs[QUIC_DNS_MAX_ADDRS];
+} dns_entry_t;
+
+// Persisted as one blob
+static struct {
+    uint32_t version;
+    dns_entry_t entries[QUIC_DNS_CACHE_ENTRIES];
+} dns_blob;
+static quic_persist_cache_t dns_cache =
+    QUIC_PERSIST_CACHE_INIT(QUIC_DNS_PERSIST_KEY, DNS_CACHE_VERSION, dns_blob);
+
+typedef struct {
+    uint16_t qtype;
+    uint16_t id;
+    bool answered;
+} dns_question_t;
+
+static const char *const source_names[] = { "numeric", "cache", "query", "stale" };
+
+const char *quic_dns_source_name(quic_dns_source_t source) {
+    return source <= QUIC_DNS_STALE ? source_names[source] : "?";
+}
+
+static uint16_t dns_random16(void) {
+#ifdef ESP_PLATFORM
+    return (uint16_t)esp_random();
+#else
+    return (uint16_t)random();
+#endif
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static bool dns_match(const void *entry, const void *key) {
+    return strcasecmp(((const dns_entry_t *)entry)->host, key) == 0;
+}
+
+static dns_entry_t *dns_cache_find(const char *host) {
+    int i = quic_persist_cache_find(&dns_cache, dns_match, host);
+
+    return i < 0 ? NULL : &dns_blob.entries[i];
+}
+
+static bool dns_entry_fresh(const dns_entry_t *e) {
+    return quic_persist_age(&e->resolved) < e->ttl;
+}
+
+static bool dns_addr_from_sockaddr(const struct sockaddr *sa, dns_addr_t *a) {
+    memset(a, 0, sizeof(*a));
+    if (sa->sa_family == AF_INET) {
+        a->family = 4;
+        memcpy(a->addr, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+        return true;
+    }
+    if (sa->sa_family == AF_INET6) {
+        a->family = 6;
+        memcpy(a->addr, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+        return true;
+    }
+    return false;
+}
+
+static void dns_addr_to_result(const dns_addr_t *a, uint16_t port, quic_dns_addr_t *out) {
+    memset(out, 0, sizeof(*out));
+    if (a->family == 4) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&out->addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        memcpy(&sin->sin_addr, a->addr, 4);
+        out->addrlen = sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&out->addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        memcpy(&sin6->sin6_addr, a->addr, 16);
+        out->addrlen = sizeof(*sin6);
+    }
+}
+
+static bool dns_addr_equal(const dns_addr_t *a, const dns_addr_t *b) {
+    return a->family == b->family && memcmp(a->addr, b->addr, a->family == 4 ? 4 : 16) == 0;
+}
+
+/*
+ * Sort addresses for connecting: preferred first if present, then the
+ * families alternating starting with IPv6 (RFC 8305 section 4), each in
+ * answer order.
+ */
+static void dns_order(dns_entry_t *e, const dns_addr_t *preferred) {
+    dns_addr_t v6[QUIC_DNS_MAX_ADDRS], v4[QUIC_DNS_MAX_ADDRS];
+    size_t n6 = 0, n4 = 0, i6 = 0, i4 = 0, n = 0;
+    dns_addr_t first = { 0 };
+    bool have_first = false;
+
+    for (size_t i = 0; i < e->count; i++) {
+        if (preferred != NULL && !have_first && dns_addr_equal(&e->addrs[i], preferred)) {
+            first = e->addrs[i];
+            have_first = true;
+        } else if (e->addrs[i].family == 6) {
+            v6[n6++] = e->addrs[i];
+        } else {
+            v4[n4++] = e->addrs[i];
+        }
+    }
+
+    if (have_first) {
+        e->addrs[n++] = first;
+    }
+    while (i6 < n6 || i4 < n4) {
+        if (i6 < n6) {
+            e->addrs[n++] = v6[i6++];
+        }
+        if (i4 < n4) {
+            e->addrs[n++] = v4[i4++];
+        }
+    }
+}
+
+static void dns_fill_result(const dns_entry_t *e, uint16_t port, quic_dns_result_t *result) {
+    for (size_t i = 0; i < e->count; i++) {
+        dns_addr_to_result(&e->addrs[i], port, &result->addrs[i]);
+    }
+    result->count = e->count;
+}
+
+static bool dns_numeric(const char *host, uint16_t port, quic_dns_result_t *result) {
+    dns_addr_t a = { 0 };
+
+    if (inet_pton(AF_INET, host, a.addr) == 1) {
+        a.family = 4;
+    } else if (inet_pton(AF_INET6, host, a.addr) == 1) {
+        a.family = 6;
+    } else {
+        return false;
+    }
+
+    dns_addr_to_result(&a, port, &result->addrs[0]);
+    result->count = 1;
+    return true;
+}
+
+static int dns_nameserver(struct sockaddr_storage *server, socklen_t *serverlen) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)server;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)server;
+
+    memset(server, 0, sizeof(*server));
+
+#ifdef ESP_PLATFORM
+    for (uint8_t i = 0; i < DNS_MAX_SERVERS; i++) {
+        const ip_addr_t *ns = dns_getserver(i);
+        if (ns == NULL || ip_addr_isany(ns)) {
+            continue;
+        }
+#if LWIP_IPV6
+        if (IP_IS_V6(ns)) {
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(DNS_PORT);
+            memcpy(&sin6->sin6_addr, ip_2_ip6(ns)->addr, 16);
+            *serverlen = sizeof(*sin6);
+            return 0;
+        }
+#endif
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(DNS_PORT);
+        sin->sin_addr.s_addr = ip_2_ip4(ns)->addr;
+        *serverlen = sizeof(*sin);
+        return 0;
+    }
+#else
+    char line[128], addr[64];
+    FILE *f = fopen(QUIC_DNS_HOST_RESOLV_CONF, "r");
+
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, " nameserver %63s", addr) != 1) {
+            continue;
+        }
+        if (inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(DNS_PORT);
+            *serverlen = sizeof(*sin);
+            fclose(f);
+            return 0;
+        }
+        if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1) {
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(DNS_PORT);
+            *serverlen = sizeof(*sin6);
+            fclose(f);
+            return 0;
+        }
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+#endif
+
+    return -1;
+}
+
+// Question section for host: the name as labels, type and class
+static int dns_encode_question(uint8_t *buf, size_t size, const char *host, uint16_t qtype) {
+    size_t pos = 0;
+    const char *label = host;
+
+    while (*label != '\0') {
+        const char *dot = strchr(label, '.');
+        size_t len = dot != NULL ? (size_t)(dot - label) : strlen(label);
+
+        if (len == 0 || len > 63 || pos + 1 + len + 5 > size) {
+            return -1;
+        }
+        buf[pos++] = (uint8_t)len;
+        memcpy(&buf[pos], label, len);
+        pos += len;
+        label += len;
+        if (*label == '.') {
+            label++;
+        }
+    }
+    buf[pos++] = 0;
+    put16(&buf[pos], qtype);
+    put16(&buf[pos + 2], DNS_CLASS_IN);
+    return (int)(pos + 4);
+}
+
+static int dns_skip_name(const uint8_t *msg, size_t len, size_t *pos) {
+    while (*pos < len) {
+        uint8_t l = msg[*pos];
+
+        if ((l & 0xC0) == 0xC0) {
+            // A compression pointer ends the name
+            *pos += 2;
+            return *pos <= len ? 0 : -1;
+        }
+        if (l & 0xC0) {
+            return -1;
+        }
+        *pos += 1 + (size_t)l;
+        if (l == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Add the addresses of a response to e, at most half of e per family so
+ * that both have a candidate for racing.
+ *
+ * @return Number of addresses added, or -1 if msg is not an answer to
+ *         the question
+ */
+static int dns_parse_response(const uint8_t *msg, size_t len, const uint8_t *question,
+                              size_t qlen, uint16_t qtype, dns_entry_t *e, uint32_t *ttl) {
+    uint8_t family = qtype == DNS_TYPE_A ? 4 : 6;
+    size_t rdlen_expected = qtype == DNS_TYPE_A ? 4 : 16;
+    size_t have = 0, pos, ancount;
+    uint16_t flags;
+    int added = 0;
+
+    if (len < DNS_HEADER_SIZE + qlen) {
+        return -1;
+    }
+    flags = get16(&msg[2]);
+    if (!(flags & DNS_FLAG_QR) || get16(&msg[4]) != 1) {
+        return -1;
+    }
+    // The question must be echoed; names compare case-insensitively
+    for (size_t i = 0; i < qlen; i++) {
+        if (tolower(msg[DNS_HEADER_SIZE + i]) != tolower(question[i])) {
+            return -1;
+        }
+    }
+    if ((flags & DNS_RCODE_MASK) != 0) {
+        // NXDOMAIN and friends answer the question too, with no address
+        return 0;
+    }
+
+    for (size_t i = 0; i < e->count; i++) {
+        if (e->addrs[i].family == family) {
+            have++;
+        }
+    }
+
+    ancount = get16(&msg[6]);
+    pos = DNS_HEADER_SIZE + qlen;
+    for (size_t i = 0; i < ancount; i++) {
+        uint16_t type, cls, rdlen;
+        uint32_t rttl;
+
+        if (dns_skip_name(msg, len, &pos) != 0 || pos + 10 > len) {
+            break;
+        }
+        type = get16(&msg[pos]);
+        cls = get16(&msg[pos + 2]);
+        rttl = get32(&msg[pos + 4]);
+        rdlen = get16(&msg[pos + 8]);
+        pos += 10;
+        if (pos + rdlen > len) {
+            break;
+        }
+
+        // CNAME records come first and are skipped, the addresses follow
+        if (type == qtype && cls == DNS_CLASS_IN && rdlen == rdlen_expected &&
+            have < QUIC_DNS_MAX_ADDRS / 2 && e->count < QUIC_DNS_MAX_ADDRS) {
+            dns_addr_t *a = &e->addrs[e->count++];
+            memset(a, 0, sizeof(*a));
+            a->family = family;
+            memcpy(a->addr, &msg[pos], rdlen);
+            if (rttl < *ttl) {
+                *ttl = rttl;
+            }
+            have++;
+            added++;
+        }
+        pos += rdlen;
+    }
+
+    return added;
+}
+
+/*
+ * Ask the nameserver for A and AAAA records at the same time. Returns as
+ * soon as both are answered, QUIC_DNS_RESOLUTION_DELAY_MS after the first
+ * addresses arrived, or at QUIC_DNS_TIMEOUT_MS.
+ */
+static int dns_query(const char *host, dns_entry_t *e) {
+    dns_question_t questions[] = {
+        // AAAA first, as in RFC 8305 section 3
+#if QUIC_DNS_IPV6
+        { .qtype = DNS_TYPE_AAAA },
+#endif
+        { .qtype = DNS_TYPE_A },
+    };
+    const size_t nq = sizeof(questions) / sizeof(questions[0]);
+    struct sockaddr_storage server;
+    socklen_t serverlen;
+    uint8_t msg[DNS_MSG_MAX];
+    uint8_t question[QUIC_DNS_HOST_MAX + 6];
+    int64_t start, now, deadline, next_tx, addrs_at = 0;
+    uint32_t ttl = QUIC_DNS_MAX_TTL_S;
+    size_t answered = 0;
+    int qlen, fd;
+
+    if (dns_nameserver(&server, &serverlen) != 0) {
+        ESP_LOGE(TAG, "No nameserver configured");
+        return -1;
+    }
+
+    fd = socket(server.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "socket: %d", errno);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&server, serverlen) != 0) {
+        ESP_LOGE(TAG, "connect to nameserver: %d", errno);
+        close(fd);
+        return -1;
+    }
+
+    for (size_t i = 0; i < nq; i++) {
+        questions[i].id = dns_random16();
+    }
+
+    start = esp_timer_get_time();
+    deadline = start + QUIC_DNS_TIMEOUT_MS * 1000LL;
+    next_tx = start;
+
+    for (;;) {
+        int64_t wake;
+        struct timeval tv;
+        fd_set rfds;
+
+        now = esp_timer_get_time();
+        if (answered == nq || now >= deadline ||
+            (addrs_at != 0 && now >= addrs_at + QUIC_DNS_RESOLUTION_DELAY_MS * 1000LL)) {
+            break;
+        }
+
+        if (now >= next_tx) {
+            for (size_t i = 0; i < nq; i++) {
+                if (questions[i].answered) {
+                    continue;
+                }
+                memset(msg, 0, DNS_HEADER_SIZE);
+                put16(&msg[0], questions[i].id);
+                put16(&msg[2], DNS_FLAG_RD);
+                put16(&msg[4], 1);
+                qlen = dns_encode_question(&msg[DNS_HEADER_SIZE], sizeof(msg) - DNS_HEADER_SIZE,
+                                           host, questions[i].qtype);
+                if (qlen < 0) {
+                    ESP_LOGE(TAG, "Invalid host name %s", host);
+                    close(fd);
+                    return -1;
+                }
+                // A lost query is retried at the next round
+                send(fd, msg, DNS_HEADER_SIZE + (size_t)qlen, 0);
+            }
+            next_tx = now + QUIC_DNS_RETRANSMIT_MS * 1000LL;
+        }
+
+        wake = next_tx < deadline ? next_tx : deadline;
+        if (addrs_at != 0 && addrs_at + QUIC_DNS_RESOLUTION_DELAY_MS * 1000LL < wake) {
+            wake = addrs_at + QUIC_DNS_RESOLUTION_DELAY_MS * 1000LL;
+        }
+        tv.tv_sec = (long)((wake - now) / 1000000);
+        tv.tv_usec = (long)((wake - now) % 1000000);
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        if (select(fd + 1, &rfds, NULL, NULL, &tv) <= 0) {
+            continue;
+        }
+
+        ssize_t n = recv(fd, msg, sizeof(msg), 0);
+        if (n < DNS_HEADER_SIZE) {
+            continue;
+        }
+        for (size_t i = 0; i < nq; i++) {
+            dns_question_t *q = &questions[i];
+            int added;
+
+            if (q->answered || get16(msg) != q->id) {
+                continue;
+            }
+            qlen = dns_encode_question(question, sizeof(question), host, q->qtype);
+            added = dns_parse_response(msg, (size_t)n, question, (size_t)qlen, q->qtype, e, &ttl);
+            if (added < 0) {
+                break;
+            }
+            q->answered = true;
+            answered++;
+            if (added > 0 && addrs_at == 0) {
+                addrs_at = esp_timer_get_time();
+            }
+            break;
+        }
+    }
+
+    close(fd);
+
+    if (e->count == 0) {
+        ESP_LOGW(TAG, "No address for %s after %lu ms", host,
+                 (unsigned long)((esp_timer_get_time() - start) / 1000));
+        return -1;
+    }
+
+    if (ttl < QUIC_DNS_MIN_TTL_S) {
+        ttl = QUIC_DNS_MIN_TTL_S;
+    }
+    e->ttl = ttl;
+    ESP_LOGI(TAG, "%s: %u addresses, ttl %lus, %u/%u answers in %lu ms", host, e->count,
+             (unsigned long)ttl, (unsigned)answered, (unsigned)nq,
+             (unsigned long)((esp_timer_get_time() - start) / 1000));
+    return 0;
+}
+
+int quic_dns_resolve(const char *host, const char *port, quic_dns_result_t *result) {
+    uint16_t portnum = (uint16_t)strtoul(port, NULL, 10);
+    dns_entry_t answer;
+    dns_entry_t *e;
+
+    memset(result, 0, sizeof(*result));
+
+    if (dns_numeric(host, portnum, result)) {
+        result->source = QUIC_DNS_NUMERIC;
+        return 0;
+    }
+    if (strlen(host) >= QUIC_DNS_HOST_MAX) {
+        ESP_LOGE(TAG, "Host name too long: %s", host);
+        return -1;
+    }
+
+    quic_persist_cache_load(&dns_cache);
+    e = dns_cache_find(host);
+    if (e != NULL && dns_entry_fresh(e)) {
+        dns_fill_result(e, portnum, result);
+        result->source = QUIC_DNS_CACHE;
+        return 0;
+    }
+
+    memset(&answer, 0, sizeof(answer));
+    strcpy(answer.host, host);
+    if (dns_query(host, &answer) == 0) {
+        answer.resolved = quic_persist_now();
+        // Keep the address that worked last time in front
+        dns_order(&answer, e != NULL && e->count > 0 ? &e->addrs[0] : NULL);
+        if (e == NULL) {
+            e = &dns_blob.entries[quic_persist_cache_victim(&dns_cache)];
+        }
+        *e = answer;
+        quic_persist_cache_store(&dns_cache);
+        dns_fill_result(e, portnum, result);
+        result->source = QUIC_DNS_QUERY;
+        return 0;
+    }
+
+    if (e != NULL && e->count > 0) {
+        ESP_LOGW(TAG, "Using expired addresses for %s", host);
+        dns_fill_result(e, portnum, result);
+        result->source = QUIC_DNS_STALE;
+        return 0;
+    }
+
+    ESP_LOGE(TAG, "Cannot resolve %s", host);
+    return -1;
+}
+
+void quic_dns_connected(const char *host, const struct sockaddr *addr) {
+    dns_addr_t a;
+    dns_entry_t *e;
+
+    if (!dns_addr_from_sockaddr(addr, &a)) {
+        return;
+    }
+    quic_persist_cache_load(&dns_cache);
+    e = dns_cache_find(host);
+    if (e == NULL) {
+        return;
+    }
+
+    for (size_t i = 1; i < e->count; i++) {
+        if (dns_addr_equal(&e->addrs[i], &a)) {
+            memmove(&e->addrs[1], &e->addrs[0], i * sizeof(e->addrs[0]));
+            e->addrs[0] = a;
+            quic_persist_cache_store(&dns_cache);
+            ESP_LOGI(TAG, "%s: preferring IPv%u address from now on", host, a.family);
+            return;
+        }
+    }
+}
+
+void quic_dns_flush(void) {
+    quic_persist_cache_flush(&dns_cache);
+}
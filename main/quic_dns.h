@@ -0,0 +1,126 @@
+#ifndef QUIC_DNS_H
+#define QUIC_DNS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+/**
+ * @brief Query AAAA records besides A. Follows lwIP's IPv6 support on the
+ * device, always on in host builds.
+ */
+#if defined(ESP_PLATFORM) && !CONFIG_LWIP_IPV6
+#define QUIC_DNS_IPV6 0
+#else
+#define QUIC_DNS_IPV6 1
+#endif
+
+/**
+ * @brief Addresses kept per host name, over both families.
+ */
+#define QUIC_DNS_MAX_ADDRS 4
+
+/**
+ * @brief Host names in the cache. The least recently resolved one is
+ * replaced when it is full.
+ */
+#define QUIC_DNS_CACHE_ENTRIES 4
+#define QUIC_DNS_HOST_MAX 64
+
+/**
+ * @brief quic_persist key of the cache.
+ */
+#define QUIC_DNS_PERSIST_KEY "dns_cache"
+
+/**
+ * @brief Query timing. Unanswered queries are sent again every
+ * QUIC_DNS_RETRANSMIT_MS until QUIC_DNS_TIMEOUT_MS. Once one family has
+ * answered with addresses, the other gets QUIC_DNS_RESOLUTION_DELAY_MS
+ * more (RFC 8305 section 3), so a slow or dead AAAA lookup never holds
+ * up the connect.
+ */
+#define QUIC_DNS_TIMEOUT_MS 3000
+#define QUIC_DNS_RETRANSMIT_MS 1000
+#define QUIC_DNS_RESOLUTION_DELAY_MS 50
+
+/**
+ * @brief Bounds applied to the TTL of answers.
+ */
+#define QUIC_DNS_MIN_TTL_S 30
+#define QUIC_DNS_MAX_TTL_S (24 * 3600)
+
+/**
+ * @brief Nameserver list read when built without ESP_PLATFORM.
+ */
+#define QUIC_DNS_HOST_RESOLV_CONF "/etc/resolv.conf"
+
+/**
+ * @brief Connection racing in ngtcp2_sample.c. When the broker has
+ * addresses in both families, the first flight also goes to the first
+ * address of the other family if no answer came within
+ * QUIC_RACE_DELAY_MS (RFC 8305 section 5), or at once if sending to the
+ * first address fails. Up to QUIC_RACE_FLIGHT_MAX datagrams are kept
+ * for that per connection, in packet buffers (see quic_mem.h); the
+ * active connection and a standby can race at the same time.
+ */
+#define QUIC_RACE_DELAY_MS 250
+#define QUIC_RACE_FLIGHT_MAX 2
+
+typedef enum {
+    QUIC_DNS_NUMERIC = 0,  // The host was an address literal
+    QUIC_DNS_CACHE,        // Cached answer within its TTL
+    QUIC_DNS_QUERY,        // Fresh answer from the nameserver
+    QUIC_DNS_STALE,        // Expired cached answer, the query failed
+} quic_dns_source_t;
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+} quic_dns_addr_t;
+
+typedef struct {
+    // Preference order: the address that last completed a handshake,
+    // then the families alternating, IPv6 first
+    quic_dns_addr_t addrs[QUIC_DNS_MAX_ADDRS];
+    size_t count;
+    quic_dns_source_t source;
+} quic_dns_result_t;
+
+/**
+ * @brief Resolve host to UDP addresses with the given port.
+ *
+ * Answers are cached for their TTL, and the cache is persisted with
+ * quic_persist, so it survives restarts. Entries are dated with
+ * quic_persist_age: without SNTP they stay usable across esp_restart(),
+ * but count as expired after a power loss. A and AAAA queries
+ * go out together to the first nameserver, without going through lwIP's
+ * resolver. If they fail, an expired entry is used rather than none.
+ *
+ * Synchronous: a query blocks the calling task until both families have
+ * answered, or for up to QUIC_DNS_TIMEOUT_MS. It takes no locks, so the
+ * QUIC I/O task keeps running meanwhile; callers resolve before taking
+ * quic_mutex. Answers from the cache and address literals return at once.
+ *
+ * @return 0 with at least one address, -1 on failure
+ */
+int quic_dns_resolve(const char *host, const char *port, quic_dns_result_t *result);
+
+/**
+ * @brief Record the address a connection to host was established over,
+ * so later lookups list it first.
+ */
+void quic_dns_connected(const char *host, const struct sockaddr *addr);
+
+/**
+ * @brief Drop all cached answers, in RAM and persisted.
+ */
+void quic_dns_flush(void);
+
+const char *quic_dns_source_name(quic_dns_source_t source);
+
+#endif /* QUIC_DNS_H */
@@ -0,0 +1,127 @@
+#include "quic_mem.h"
+#include "quic_netem.h"
+#include "quic_dns.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "QUIC_MEM";
+
+/*
+ * Number of packet buffers in the shared pool.
+ *
+ * At most the ev_esp_loop task and the quic_mqtt_task hold a buffer at
+ * the same time (one for RX, one for TX), plus the header of a pipelined
+ * PUBLISH that the quic_mqtt_task keeps while its datagram goes out; the
+ * rest is headroom. The streaming publisher has a buffer of its own. Racing
+ * a second address keeps up to QUIC_RACE_FLIGHT_MAX datagrams for the
+ * active connection and as many for a standby, and the impairment layer
+ * holds up to QUIC_NETEM_QUEUE_LEN per direction.
+ */
+#if QUIC_NETEM_ENABLE
+#define QUIC_PKT_POOL_COUNT (5 + 2 * QUIC_RACE_FLIGHT_MAX + 2 * QUIC_NETEM_QUEUE_LEN)
+#else
+#define QUIC_PKT_POOL_COUNT (5 + 2 * QUIC_RACE_FLIGHT_MAX)
+#endif
+
+static quic_pkt_buf_t pkt_pool[QUIC_PKT_POOL_COUNT];
+static portMUX_TYPE pkt_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+quic_pkt_buf_t *quic_pkt_buf_alloc(void) {
+    quic_pkt_buf_t *buf = NULL;
+
+    taskENTER_CRITICAL(&pkt_pool_lock);
+    for (int i = 0; i < QUIC_PKT_POOL_COUNT; i++) {
+        if (pkt_pool[i].refcnt == 0) {
+            buf = &pkt_pool[i];
+            buf->refcnt = 1;
+            buf->len = 0;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&pkt_pool_lock);
+
+    if (buf == NULL) {
+        ESP_LOGW(TAG, "Packet buffer pool exhausted");
+    }
+
+    return buf;
+}
+
+quic_pkt_buf_t *quic_pkt_buf_ref(quic_pkt_buf_t *buf) {
+    taskENTER_CRITICAL(&pkt_pool_lock);
+    buf->refcnt++;
+    taskEXIT_CRITICAL(&pkt_pool_lock);
+
+    return buf;
+}
+
+void quic_pkt_buf_unref(quic_pkt_buf_t *buf) {
+    if (buf == NULL) {
+        return;
+    }
+
+    taskENTER_CRITICAL(&pkt_pool_lock);
+    if (buf->refcnt > 0) {
+        buf->refcnt--;
+    }
+    taskEXIT_CRITICAL(&pkt_pool_lock);
+}
+
+size_t quic_pkt_pool_available(void) {
+    size_t n = 0;
+
+    taskENTER_CRITICAL(&pkt_pool_lock);
+    for (int i = 0; i < QUIC_PKT_POOL_COUNT; i++) {
+        if (pkt_pool[i].refcnt == 0) {
+            n++;
+        }
+    }
+    taskEXIT_CRITICAL(&pkt_pool_lock);
+
+    return n;
+}
+
+static quic_mem_stack_mark_t stack_marks[QUIC_MEM_STACK_TASKS];
+
+void quic_mem_log_stack_watermark(const char *task_name) {
+    // On ESP-IDF the high-water mark is reported in bytes
+    uint32_t mark = (uint32_t)uxTaskGetStackHighWaterMark(NULL);
+    quic_mem_stack_mark_t *entry = NULL;
+    bool lower = false;
+
+    taskENTER_CRITICAL(&pkt_pool_lock);
+    for (int i = 0; i < QUIC_MEM_STACK_TASKS && entry == NULL; i++) {
+        if (stack_marks[i].task_name == NULL) {
+            stack_marks[i].task_name = task_name;
+            stack_marks[i].free_bytes = UINT32_MAX;
+        }
+        if (strcmp(stack_marks[i].task_name, task_name) == 0) {
+            entry = &stack_marks[i];
+        }
+    }
+    if (entry != NULL && mark < entry->free_bytes) {
+        entry->free_bytes = mark;
+        lower = true;
+    }
+    taskEXIT_CRITICAL(&pkt_pool_lock);
+
+    if (lower) {
+        ESP_LOGI(TAG, "Stack high-water mark for %s: %u bytes free",
+                 task_name, (unsigned)mark);
+    }
+}
+
+size_t quic_mem_stack_marks(quic_mem_stack_mark_t *marks, size_t max) {
+    size_t n = 0;
+
+    taskENTER_CRITICAL(&pkt_pool_lock);
+    for (int i = 0; i < QUIC_MEM_STACK_TASKS && n < max; i++) {
+        if (stack_marks[i].task_name != NULL) {
+            marks[n++] = stack_marks[i];
+        }
+    }
+    taskEXIT_CRITICAL(&pkt_pool_lock);
+
+    return n;
+}
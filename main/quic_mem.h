@@ -0,0 +1,73 @@
+#ifndef QUIC_MEM_H
+#define QUIC_MEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+
+/**
+ * @brief Size of one packet buffer. Matches ngtcp2's default maximum
+ * transmit UDP payload and is advertised as our max_udp_payload_size,
+ * so a single buffer always holds a whole datagram in either direction.
+ */
+#define QUIC_PKT_BUF_SIZE 1452
+
+/**
+ * @brief Refcounted packet buffer drawn from the shared pool.
+ */
+typedef struct quic_pkt_buf {
+    uint8_t data[QUIC_PKT_BUF_SIZE];
+    size_t len;
+    uint8_t refcnt;
+} quic_pkt_buf_t;
+
+/**
+ * @brief Take a buffer from the pool with a reference count of 1.
+ * @return The buffer, or NULL if the pool is exhausted
+ */
+quic_pkt_buf_t *quic_pkt_buf_alloc(void);
+
+/**
+ * @brief Take an additional reference on a buffer.
+ * @return The same buffer, for convenience
+ */
+quic_pkt_buf_t *quic_pkt_buf_ref(quic_pkt_buf_t *buf);
+
+/**
+ * @brief Drop a reference; the buffer returns to the pool at zero.
+ */
+void quic_pkt_buf_unref(quic_pkt_buf_t *buf);
+
+/**
+ * @brief Number of buffers currently free in the pool.
+ */
+size_t quic_pkt_pool_available(void);
+
+/**
+ * @brief Tasks whose stack high-water mark is tracked.
+ */
+#define QUIC_MEM_STACK_TASKS 4
+
+/**
+ * @brief Lowest stack high-water mark seen for a task.
+ */
+typedef struct {
+    const char *task_name;
+    uint32_t free_bytes;
+} quic_mem_stack_mark_t;
+
+/**
+ * @brief Record the calling task's stack high-water mark, and log it when
+ * it reaches a new low.
+ * @param task_name Name used in the log line and quic_mem_stack_marks;
+ *                  must stay valid, a string literal
+ */
+void quic_mem_log_stack_watermark(const char *task_name);
+
+/**
+ * @brief Lowest marks recorded so far, one per task name.
+ * @return Number of entries written, at most max
+ */
+size_t quic_mem_stack_marks(quic_mem_stack_mark_t *marks, size_t max);
+
+#endif /* QUIC_MEM_H */
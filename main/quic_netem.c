@@ -0,0 +1,213 @@
+#include "quic_netem.h"
+#include "quic_mem.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "QUIC_NETEM";
+
+static const char *const dir_names[] = { "tx", "rx" };
+
+typedef struct {
+    quic_pkt_buf_t *pb;
+    uint64_t release_us;
+} netem_entry_t;
+
+typedef struct {
+    const quic_netem_dir_config_t *config;
+    uint32_t rng;              // xorshift32 state, never 0
+    uint32_t seq;              // Datagrams submitted, numbers the log lines
+    uint64_t link_free_us;     // When the rate-limited link finishes the last datagram
+    netem_entry_t queue[QUIC_NETEM_QUEUE_LEN];  // Sorted by release time
+    size_t count;
+    quic_netem_stats_t stats;
+} netem_dir_t;
+
+static quic_netem_config_t netem_config;
+static bool netem_active = false;
+static netem_dir_t netem_dirs[2];
+
+static uint32_t netem_random(netem_dir_t *d) {
+    uint32_t x = d->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    d->rng = x;
+    return x;
+}
+
+static bool netem_chance(netem_dir_t *d, uint16_t permille) {
+    // Always draw, so one setting does not shift the sequence of another
+    uint32_t r = netem_random(d) % 1000;
+    return r < permille;
+}
+
+static void netem_flush(netem_dir_t *d) {
+    for (size_t i = 0; i < d->count; i++) {
+        quic_pkt_buf_unref(d->queue[i].pb);
+    }
+    d->count = 0;
+}
+
+void quic_netem_configure(const quic_netem_config_t *config) {
+    for (int i = 0; i < 2; i++) {
+        netem_flush(&netem_dirs[i]);
+        memset(&netem_dirs[i], 0, sizeof(netem_dirs[i]));
+    }
+
+    netem_active = config != NULL;
+    if (!netem_active) {
+        ESP_LOGI(TAG, "Network impairment off");
+        return;
+    }
+
+    netem_config = *config;
+    netem_dirs[QUIC_NETEM_TX].config = &netem_config.tx;
+    netem_dirs[QUIC_NETEM_RX].config = &netem_config.rx;
+    // Independent streams per direction, so traffic in one does not
+    // change the decisions in the other
+    netem_dirs[QUIC_NETEM_TX].rng = (config->seed * 2654435761U) ^ 0x7478U;
+    netem_dirs[QUIC_NETEM_RX].rng = (config->seed * 2654435761U) ^ 0x7278U;
+
+    for (int i = 0; i < 2; i++) {
+        const quic_netem_dir_config_t *c = netem_dirs[i].config;
+        if (netem_dirs[i].rng == 0) {
+            netem_dirs[i].rng = 1;
+        }
+        ESP_LOGI(TAG, "%s: seed=%lu loss=%u/1000 dup=%u/1000 reorder=%u/1000+%lums "
+                 "delay=%lu+-%lums rate=%lukbps",
+                 dir_names[i], (unsigned long)config->seed,
+                 c->loss_permille, c->dup_permille, c->reorder_permille,
+                 (unsigned long)c->reorder_ms, (unsigned long)c->delay_ms,
+                 (unsigned long)c->jitter_ms, (unsigned long)c->rate_kbps);
+    }
+}
+
+bool quic_netem_active(void) {
+    return netem_active;
+}
+
+static bool netem_enqueue(netem_dir_t *d, quic_pkt_buf_t *pb, uint64_t release_us) {
+    size_t i;
+
+    if (d->count == QUIC_NETEM_QUEUE_LEN) {
+        d->stats.overflow++;
+        return false;
+    }
+
+    // After entries with the same release time, to keep their order
+    for (i = d->count; i > 0 && d->queue[i - 1].release_us > release_us; i--) {
+        d->queue[i] = d->queue[i - 1];
+    }
+    d->queue[i].pb = pb;
+    d->queue[i].release_us = release_us;
+    d->count++;
+    return true;
+}
+
+int quic_netem_submit(quic_netem_dir_t dir, const uint8_t *data, size_t len, uint64_t now_us) {
+    netem_dir_t *d = &netem_dirs[dir];
+    const quic_netem_dir_config_t *c = d->config;
+    uint64_t departure_us, release_us;
+    int64_t jitter_us = 0;
+    int copies = 0;
+
+    d->seq++;
+    d->stats.datagrams++;
+
+    bool lost = netem_chance(d, c->loss_permille);
+    bool dup = netem_chance(d, c->dup_permille);
+    bool reorder = netem_chance(d, c->reorder_permille);
+    if (c->jitter_ms > 0) {
+        jitter_us = (int64_t)(netem_random(d) % (2 * c->jitter_ms * 1000 + 1)) -
+                    (int64_t)c->jitter_ms * 1000;
+    }
+
+    if (lost) {
+        d->stats.dropped++;
+        if (netem_config.log_events) {
+            ESP_LOGI(TAG, "%s #%lu len=%zu drop", dir_names[dir], (unsigned long)d->seq, len);
+        }
+        return 0;
+    }
+
+    // A capped link sends one datagram after the other
+    departure_us = now_us > d->link_free_us ? now_us : d->link_free_us;
+    if (c->rate_kbps > 0) {
+        departure_us += (uint64_t)len * 8000 / c->rate_kbps;
+        d->link_free_us = departure_us;
+    }
+
+    int64_t delay_us = (int64_t)c->delay_ms * 1000 + jitter_us;
+    if (reorder) {
+        delay_us += (int64_t)c->reorder_ms * 1000;
+        d->stats.reordered++;
+    }
+    if (delay_us < 0) {
+        delay_us = 0;
+    }
+    release_us = departure_us + (uint64_t)delay_us;
+
+    quic_pkt_buf_t *pb = quic_pkt_buf_alloc();
+    if (pb == NULL || len > sizeof(pb->data)) {
+        quic_pkt_buf_unref(pb);
+        d->stats.overflow++;
+        return 0;
+    }
+    memcpy(pb->data, data, len);
+    pb->len = len;
+
+    if (netem_enqueue(d, pb, release_us)) {
+        copies++;
+        d->stats.delay_us += release_us - now_us;
+        // The copy shares the buffer and follows right behind the original
+        if (dup) {
+            if (netem_enqueue(d, quic_pkt_buf_ref(pb), release_us)) {
+                d->stats.duplicated++;
+                copies++;
+            } else {
+                quic_pkt_buf_unref(pb);
+            }
+        }
+    } else {
+        quic_pkt_buf_unref(pb);
+    }
+
+    if (netem_config.log_events) {
+        ESP_LOGI(TAG, "%s #%lu len=%zu delay_us=%llu%s%s%s", dir_names[dir],
+                 (unsigned long)d->seq, len, (unsigned long long)(release_us - now_us),
+                 reorder ? " reorder" : "", copies == 2 ? " dup" : "",
+                 copies == 0 ? " overflow" : "");
+    }
+
+    return copies;
+}
+
+quic_pkt_buf_t *quic_netem_poll(quic_netem_dir_t dir, uint64_t now_us) {
+    netem_dir_t *d = &netem_dirs[dir];
+    quic_pkt_buf_t *pb;
+
+    if (d->count == 0 || d->queue[0].release_us > now_us) {
+        return NULL;
+    }
+
+    pb = d->queue[0].pb;
+    d->count--;
+    memmove(&d->queue[0], &d->queue[1], d->count * sizeof(d->queue[0]));
+    return pb;
+}
+
+uint64_t quic_netem_next_release_us(void) {
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < 2; i++) {
+        if (netem_dirs[i].count > 0 && netem_dirs[i].queue[0].release_us < next) {
+            next = netem_dirs[i].queue[0].release_us;
+        }
+    }
+    return next;
+}
+
+void quic_netem_get_stats(quic_netem_dir_t dir, quic_netem_stats_t *stats) {
+    *stats = netem_dirs[dir].stats;
+}
@@ -0,0 +1,98 @@
+#ifndef QUIC_NETEM_H
+#define QUIC_NETEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief Build the datagram impairment layer into the QUIC client.
+ *
+ * Off by default; enable with idf.py -DQUIC_NETEM=1, see main/CMakeLists.txt.
+ * The layer sits between ngtcp2 and the UDP socket in both directions and
+ * does nothing until quic_netem_configure() is called.
+ */
+#ifndef QUIC_NETEM_ENABLE
+#define QUIC_NETEM_ENABLE 0
+#endif
+
+/**
+ * @brief Datagrams held per direction. Each one occupies a packet buffer,
+ * so quic_mem.h enlarges the pool when the layer is built in. A datagram
+ * arriving at a full queue is dropped and counted as an overflow.
+ */
+#define QUIC_NETEM_QUEUE_LEN 16
+
+typedef enum {
+    QUIC_NETEM_TX = 0,  // Client to server, applied in client_send_packet
+    QUIC_NETEM_RX = 1,  // Server to client, applied in client_read
+} quic_netem_dir_t;
+
+// Impairments of one direction; all zero passes datagrams through unchanged
+typedef struct {
+    uint16_t loss_permille;     // Drop probability
+    uint16_t dup_permille;      // Probability of delivering a second copy
+    uint16_t reorder_permille;  // Probability of holding a datagram back by reorder_ms
+    uint32_t reorder_ms;        // so that later datagrams overtake it
+    uint32_t delay_ms;          // Fixed one-way delay
+    uint32_t jitter_ms;         // Uniform variation of the delay, +/-
+    uint32_t rate_kbps;         // Bandwidth cap, 0 for none
+} quic_netem_dir_config_t;
+
+typedef struct {
+    uint32_t seed;              // Same seed and traffic give the same decisions
+    bool log_events;            // Log the fate of every datagram
+    quic_netem_dir_config_t tx;
+    quic_netem_dir_config_t rx;
+} quic_netem_config_t;
+
+typedef struct {
+    uint32_t datagrams;   // Datagrams submitted
+    uint32_t dropped;     // Lost by loss_permille
+    uint32_t duplicated;
+    uint32_t reordered;
+    uint32_t overflow;    // Dropped at a full queue
+    uint64_t delay_us;    // Sum of delays applied, for the mean
+} quic_netem_stats_t;
+
+struct quic_pkt_buf;
+
+/**
+ * @brief Set impairments and reset the random state, queues and counters.
+ *
+ * Call before quic_client_init_with_config(). A NULL config disables the
+ * layer again.
+ */
+void quic_netem_configure(const quic_netem_config_t *config);
+
+/**
+ * @brief Whether datagrams currently go through the layer.
+ */
+bool quic_netem_active(void);
+
+/**
+ * @brief Pass a datagram into one direction.
+ *
+ * The datagram is copied into a pool buffer and queued until its release
+ * time; a duplicate shares the buffer by reference.
+ *
+ * @param now_us Current time from esp_timer_get_time()
+ * @return Number of copies queued, 0 if the datagram was dropped
+ */
+int quic_netem_submit(quic_netem_dir_t dir, const uint8_t *data, size_t len, uint64_t now_us);
+
+/**
+ * @brief Take the next datagram of a direction whose release time has come.
+ * @return Buffer holding the datagram (drop it with quic_pkt_buf_unref),
+ *         or NULL if none is due
+ */
+struct quic_pkt_buf *quic_netem_poll(quic_netem_dir_t dir, uint64_t now_us);
+
+/**
+ * @brief Earliest release time over both directions, UINT64_MAX if empty.
+ */
+uint64_t quic_netem_next_release_us(void);
+
+void quic_netem_get_stats(quic_netem_dir_t dir, quic_netem_stats_t *stats);
+
+#endif /* QUIC_NETEM_H */
@@ -0,0 +1,143 @@
+#include "quic_path.h"
+#include "quic_persist.h"
+#include "esp_log.h"
+#include <string.h>
+#include <netinet/in.h>
+
+static const char *TAG = "QUIC_PATH";
+
+// Bump when path_cache changes layout; older blobs are then ignored
+#define PATH_CACHE_VERSION 2
+
+typedef struct {
+    quic_persist_time_t saved;  // Epoch 0 for an unused entry
+    uint8_t family;             // 4 or 6
+    uint8_t addr[16];
+    uint16_t port;
+    quic_path_state_t state;
+} path_entry_t;
+
+// Persisted as one blob
+typedef struct {
+    uint32_t version;
+    path_entry_t entries[QUIC_PATH_CACHE_ENTRIES];
+} path_blob_t;
+static path_blob_t path_blob, path_stored;  // path_stored is what flash holds
+static quic_persist_cache_t path_cache =
+    QUIC_PERSIST_CACHE_INIT(QUIC_PATH_PERSIST_KEY, PATH_CACHE_VERSION, path_blob);
+
+static void path_cache_load(void) {
+    if (quic_persist_cache_load(&path_cache)) {
+        path_stored = path_blob;
+    }
+}
+
+static int path_key(const struct sockaddr *addr, path_entry_t *key) {
+    memset(key, 0, sizeof(*key));
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+        key->family = 4;
+        memcpy(key->addr, &sin->sin_addr, 4);
+        key->port = ntohs(sin->sin_port);
+        return 0;
+    }
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+        key->family = 6;
+        memcpy(key->addr, &sin6->sin6_addr, 16);
+        key->port = ntohs(sin6->sin6_port);
+        return 0;
+    }
+    return -1;
+}
+
+static bool path_match(const void *entry, const void *key) {
+    const path_entry_t *e = entry;
+    const path_entry_t *k = key;
+
+    return e->family == k->family && e->port == k->port &&
+           memcmp(e->addr, k->addr, sizeof(e->addr)) == 0;
+}
+
+int quic_path_lookup(const struct sockaddr *addr, quic_path_state_t *state) {
+    path_entry_t key;
+    uint32_t age;
+    int i;
+
+    path_cache_load();
+    if (path_key(addr, &key) != 0 ||
+        (i = quic_persist_cache_find(&path_cache, path_match, &key)) < 0) {
+        return -1;
+    }
+
+    age = quic_persist_age(&path_blob.entries[i].saved);
+    if (age >= QUIC_PATH_MAX_AGE_S) {
+        return -1;
+    }
+
+    *state = path_blob.entries[i].state;
+    ESP_LOGI(TAG, "Path state from %lu s ago: srtt %lu us, rttvar %lu us, cwnd %lu",
+             (unsigned long)age, (unsigned long)state->smoothed_rtt_us,
+             (unsigned long)state->rttvar_us, (unsigned long)state->cwnd);
+    return 0;
+}
+
+static bool path_moved(uint32_t stored, uint32_t now) {
+    uint32_t diff = stored > now ? stored - now : now - stored;
+    return diff > stored / QUIC_PATH_CHANGE_DIV;
+}
+
+void quic_path_save(const struct sockaddr *addr, const quic_path_state_t *state) {
+    path_entry_t key;
+    const path_entry_t *stored;
+    path_entry_t *e;
+    int i;
+
+    path_cache_load();
+    if (path_key(addr, &key) != 0 || state->smoothed_rtt_us == 0) {
+        return;
+    }
+
+    i = quic_persist_cache_find(&path_cache, path_match, &key);
+    if (i < 0) {
+        i = (int)quic_persist_cache_victim(&path_cache);
+    }
+    e = &path_blob.entries[i];
+    *e = key;
+    e->saved = quic_persist_now();
+    e->state = *state;
+
+    // Writes go to flash, most reconnects see the same path
+    stored = &path_stored.entries[i];
+    if (stored->saved.epoch != 0 && path_match(stored, &key) &&
+        !path_moved(stored->state.smoothed_rtt_us, state->smoothed_rtt_us) &&
+        !path_moved(stored->state.cwnd, state->cwnd) &&
+        quic_persist_age(&stored->saved) < QUIC_PATH_MAX_AGE_S / 2) {
+        return;
+    }
+
+    if (quic_persist_cache_store(&path_cache) == 0) {
+        path_stored = path_blob;
+    }
+}
+
+uint32_t quic_path_initial_rtt_ms(const quic_path_state_t *state) {
+    uint32_t rtt_ms = (state->smoothed_rtt_us + state->rttvar_us) / 1000;
+
+    if (rtt_ms < QUIC_PATH_MIN_INITIAL_RTT_MS) {
+        return QUIC_PATH_MIN_INITIAL_RTT_MS;
+    }
+    if (rtt_ms > QUIC_PATH_MAX_INITIAL_RTT_MS) {
+        return QUIC_PATH_MAX_INITIAL_RTT_MS;
+    }
+    return rtt_ms;
+}
+
+void quic_path_reload(void) {
+    quic_persist_cache_reload(&path_cache);
+}
+
+void quic_path_flush(void) {
+    quic_persist_cache_flush(&path_cache);
+    path_stored = path_blob;
+}
@@ -0,0 +1,83 @@
+#ifndef QUIC_PATH_H
+#define QUIC_PATH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/**
+ * @brief Broker addresses whose path state is kept. The one saved longest
+ * ago is replaced when it is full.
+ */
+#define QUIC_PATH_CACHE_ENTRIES 4
+
+/**
+ * @brief quic_persist key of the cache.
+ */
+#define QUIC_PATH_PERSIST_KEY "path_cache"
+
+/**
+ * @brief Path state older than this is not used. Without a set wall clock
+ * only state saved since power-up can be dated, see quic_persist_age.
+ */
+#ifndef QUIC_PATH_MAX_AGE_S
+#define QUIC_PATH_MAX_AGE_S (6 * 3600)
+#endif
+
+/**
+ * @brief Bounds of the initial RTT seeded from the cache. The lower one
+ * leaves room for the server's handshake processing, the upper one is
+ * ngtcp2's default, so a seeded connection never probes later than an
+ * unseeded one.
+ */
+#define QUIC_PATH_MIN_INITIAL_RTT_MS 20
+#define QUIC_PATH_MAX_INITIAL_RTT_MS 333
+
+/**
+ * @brief Rewrite a persisted entry only when its RTT or window moved by
+ * more than 1/QUIC_PATH_CHANGE_DIV, or it is half way to going stale.
+ */
+#define QUIC_PATH_CHANGE_DIV 4
+
+// What a connection learned about the path to its broker
+typedef struct {
+    uint32_t smoothed_rtt_us;
+    uint32_t rttvar_us;
+    uint32_t min_rtt_us;
+    uint32_t cwnd;  // Congestion window at close, bytes
+} quic_path_state_t;
+
+/**
+ * @brief Path state saved for a broker address and port.
+ *
+ * @return 0 with state filled in, -1 if there is none or it is stale
+ */
+int quic_path_lookup(const struct sockaddr *addr, quic_path_state_t *state);
+
+/**
+ * @brief Remember the path state of a connection that is closing.
+ *
+ * Kept in RAM and written to flash when it differs enough from what is
+ * stored, see QUIC_PATH_CHANGE_DIV.
+ */
+void quic_path_save(const struct sockaddr *addr, const quic_path_state_t *state);
+
+/**
+ * @brief Initial RTT for a new connection from saved path state,
+ * smoothed RTT plus its variation within the QUIC_PATH_*_INITIAL_RTT_MS
+ * bounds.
+ */
+uint32_t quic_path_initial_rtt_ms(const quic_path_state_t *state);
+
+/**
+ * @brief Read the path state from flash again on next use, as after a
+ * restart.
+ */
+void quic_path_reload(void);
+
+/**
+ * @brief Drop all saved path state, in RAM and persisted.
+ */
+void quic_path_flush(void);
+
+#endif /* QUIC_PATH_H */
@@ -0,0 +1,246 @@
+#include "quic_persist.h"
+#include "esp_log.h"
+#include <string.h>
+#include <time.h>
+
+#ifdef ESP_PLATFORM
+#include "nvs.h"
+#include "esp_attr.h"
+#include "esp_random.h"
+#include "esp_system.h"
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+
+static const char *TAG = "QUIC_PERSIST";
+
+// time() before 2020 means the wall clock was never set
+#define PERSIST_CLOCK_VALID 1577836800U
+// Marks boot_epoch as set in this power cycle
+#define PERSIST_EPOCH_MAGIC 0x51504543U
+
+// Kept in RTC memory, like the time() it dates, across all but power loss
+#ifdef ESP_PLATFORM
+static RTC_NOINIT_ATTR uint32_t boot_epoch;
+static RTC_NOINIT_ATTR uint32_t boot_epoch_magic;
+#else
+static uint32_t boot_epoch;
+static uint32_t boot_epoch_magic;
+#endif
+
+static uint32_t persist_boot_epoch(void) {
+#ifdef ESP_PLATFORM
+    esp_reset_reason_t reason = esp_reset_reason();
+
+    // RTC memory holds garbage after these, and time() starts over
+    if (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT) {
+        boot_epoch_magic = 0;
+    }
+#endif
+    while (boot_epoch_magic != PERSIST_EPOCH_MAGIC || boot_epoch <= QUIC_PERSIST_EPOCH_WALL) {
+#ifdef ESP_PLATFORM
+        boot_epoch = esp_random();
+#else
+        boot_epoch = (uint32_t)random();
+#endif
+        boot_epoch_magic = PERSIST_EPOCH_MAGIC;
+    }
+    return boot_epoch;
+}
+
+bool quic_persist_wall_clock(void) {
+    return (uint32_t)time(NULL) >= PERSIST_CLOCK_VALID;
+}
+
+quic_persist_time_t quic_persist_now(void) {
+    quic_persist_time_t now = { .secs = (uint32_t)time(NULL) };
+
+    now.epoch = now.secs >= PERSIST_CLOCK_VALID ? QUIC_PERSIST_EPOCH_WALL : persist_boot_epoch();
+    return now;
+}
+
+uint32_t quic_persist_age(const quic_persist_time_t *then) {
+    quic_persist_time_t now = quic_persist_now();
+
+    if (then->epoch == 0 || then->epoch != now.epoch || now.secs < then->secs) {
+        return UINT32_MAX;
+    }
+    return now.secs - then->secs;
+}
+
+bool quic_persist_cache_load(quic_persist_cache_t *cache) {
+    size_t len = cache->size;
+
+    if (cache->loaded) {
+        return false;
+    }
+    cache->loaded = true;
+
+    if (quic_persist_load(cache->key, cache->blob, &len) != 0 ||
+        len != cache->size || *(uint32_t *)cache->blob != cache->version) {
+        memset(cache->blob, 0, cache->size);
+        *(uint32_t *)cache->blob = cache->version;
+    }
+    return true;
+}
+
+int quic_persist_cache_store(quic_persist_cache_t *cache) {
+    return quic_persist_store(cache->key, cache->blob, cache->size);
+}
+
+void *quic_persist_cache_entry(quic_persist_cache_t *cache, size_t i) {
+    return i < cache->count ? (uint8_t *)cache->entries + i * cache->entry_size : NULL;
+}
+
+static const quic_persist_time_t *cache_saved(quic_persist_cache_t *cache, size_t i) {
+    return (const quic_persist_time_t *)quic_persist_cache_entry(cache, i);
+}
+
+int quic_persist_cache_find(quic_persist_cache_t *cache,
+                            bool (*match)(const void *entry, const void *key),
+                            const void *key) {
+    for (size_t i = 0; i < cache->count; i++) {
+        if (cache_saved(cache, i)->epoch != 0 && match(quic_persist_cache_entry(cache, i), key)) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+size_t quic_persist_cache_victim(quic_persist_cache_t *cache) {
+    size_t victim = 0;
+    uint32_t oldest = 0;
+
+    for (size_t i = 0; i < cache->count; i++) {
+        uint32_t age;
+
+        if (cache_saved(cache, i)->epoch == 0) {
+            return i;
+        }
+        age = quic_persist_age(cache_saved(cache, i));
+        if (i == 0 || age > oldest) {
+            victim = i;
+            oldest = age;
+        }
+    }
+    return victim;
+}
+
+void quic_persist_cache_reload(quic_persist_cache_t *cache) {
+    cache->loaded = false;
+}
+
+void quic_persist_cache_flush(quic_persist_cache_t *cache) {
+    memset(cache->blob, 0, cache->size);
+    *(uint32_t *)cache->blob = cache->version;
+    cache->loaded = true;
+    quic_persist_erase(cache->key);
+}
+
+#ifdef ESP_PLATFORM
+
+int quic_persist_load(const char *key, void *buf, size_t *len) {
+    nvs_handle_t handle;
+    esp_err_t err;
+
+    if (nvs_open(QUIC_PERSIST_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        // The namespace does not exist until the first store
+        return -1;
+    }
+    err = nvs_get_blob(handle, key, buf, len);
+    nvs_close(handle);
+
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(TAG, "Cannot read %s: %s", key, esp_err_to_name(err));
+    }
+    return err == ESP_OK ? 0 : -1;
+}
+
+int quic_persist_store(const char *key, const void *buf, size_t len) {
+    nvs_handle_t handle;
+    esp_err_t err;
+
+    err = nvs_open(QUIC_PERSIST_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, key, buf, len);
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot store %s: %s", key, esp_err_to_name(err));
+        return -1;
+    }
+    return 0;
+}
+
+void quic_persist_erase(const char *key) {
+    nvs_handle_t handle;
+
+    if (nvs_open(QUIC_PERSIST_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+        if (nvs_erase_key(handle, key) == ESP_OK) {
+            nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+}
+
+#else
+
+static void persist_path(const char *key, char *path, size_t size) {
+    snprintf(path, size, "%s/%s.bin", QUIC_PERSIST_HOST_DIR, key);
+}
+
+int quic_persist_load(const char *key, void *buf, size_t *len) {
+    char path[256];
+    FILE *f;
+    long size;
+    int rv = -1;
+
+    persist_path(key, path, sizeof(path));
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 &&
+        (size_t)size <= *len && fseek(f, 0, SEEK_SET) == 0 &&
+        fread(buf, 1, (size_t)size, f) == (size_t)size) {
+        *len = (size_t)size;
+        rv = 0;
+    }
+    fclose(f);
+    return rv;
+}
+
+int quic_persist_store(const char *key, const void *buf, size_t len) {
+    char path[256];
+    FILE *f;
+    int rv = 0;
+
+    persist_path(key, path, sizeof(path));
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        ESP_LOGW(TAG, "Cannot create %s", path);
+        return -1;
+    }
+    if (fwrite(buf, 1, len, f) != len) {
+        rv = -1;
+    }
+    if (fclose(f) != 0) {
+        rv = -1;
+    }
+    return rv;
+}
+
+void quic_persist_erase(const char *key) {
+    char path[256];
+
+    persist_path(key, path, sizeof(path));
+    remove(path);
+}
+
+#endif /* ESP_PLATFORM */
@@ -0,0 +1,153 @@
+#ifndef QUIC_PERSIST_H
+#define QUIC_PERSIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief NVS namespace holding the blobs (nvs_flash_init() must have run).
+ */
+#define QUIC_PERSIST_NAMESPACE "quic"
+
+/**
+ * @brief Directory for the blobs when built without ESP_PLATFORM, one
+ * file per key.
+ */
+#define QUIC_PERSIST_HOST_DIR "."
+
+/**
+ * @brief Longest key, the NVS limit.
+ */
+#define QUIC_PERSIST_KEY_MAX 15
+
+/**
+ * @brief Read a blob stored under key.
+ *
+ * @param key Name of at most QUIC_PERSIST_KEY_MAX characters
+ * @param buf Destination
+ * @param len In: size of buf. Out: size of the blob
+ * @return 0 on success, -1 if there is no such blob or it does not fit
+ */
+int quic_persist_load(const char *key, void *buf, size_t *len);
+
+/**
+ * @brief Store a blob under key, replacing any previous one.
+ *
+ * Writes go to flash; store only when the data changed.
+ *
+ * @return 0 on success, -1 on error
+ */
+int quic_persist_store(const char *key, const void *buf, size_t len);
+
+/**
+ * @brief Remove the blob stored under key, if any.
+ */
+void quic_persist_erase(const char *key);
+
+/**
+ * @brief Epoch of times taken from a set wall clock. Without one, times
+ * are counted from power-up in a random epoch of that power cycle: the
+ * RTC keeps time() running across esp_restart(), panics and deep sleep,
+ * but not across a power loss.
+ */
+#define QUIC_PERSIST_EPOCH_WALL 1
+
+/**
+ * @brief A time that can be persisted and dated later. Epoch 0 is none.
+ */
+typedef struct {
+    uint32_t epoch;  // QUIC_PERSIST_EPOCH_WALL or the power cycle's
+    uint32_t secs;   // time()
+} quic_persist_time_t;
+
+/**
+ * @brief Whether time() is a set wall clock, by SNTP for instance.
+ */
+bool quic_persist_wall_clock(void);
+
+/**
+ * @brief The current time, for an entry about to be persisted.
+ */
+quic_persist_time_t quic_persist_now(void);
+
+/**
+ * @brief Seconds since then, or UINT32_MAX if it cannot be told: it is
+ * none, from another power cycle without a wall clock, from before SNTP
+ * set the clock, or in the future.
+ */
+uint32_t quic_persist_age(const quic_persist_time_t *then);
+
+/**
+ * @brief A table of entries persisted as one blob under key.
+ *
+ * The blob is a struct whose first member is a uint32_t version followed
+ * by an entries array; each entry starts with the quic_persist_time_t it
+ * was saved at, epoch 0 for an unused one. Blobs of another size or
+ * version are ignored. Set up with QUIC_PERSIST_CACHE_INIT.
+ */
+typedef struct {
+    const char *key;
+    uint32_t version;  // Bump when the entry layout changes
+    void *blob;
+    size_t size;
+    void *entries;
+    size_t entry_size;
+    size_t count;
+    bool loaded;
+} quic_persist_cache_t;
+
+#define QUIC_PERSIST_CACHE_INIT(key_, version_, blob_) {                     \
+    .key = (key_),                                                           \
+    .version = (version_),                                                   \
+    .blob = &(blob_),                                                        \
+    .size = sizeof(blob_),                                                   \
+    .entries = (blob_).entries,                                              \
+    .entry_size = sizeof((blob_).entries[0]),                                \
+    .count = sizeof((blob_).entries) / sizeof((blob_).entries[0]),           \
+}
+
+/**
+ * @brief Read the blob from flash on first use, or start empty.
+ *
+ * @return true if it was read now
+ */
+bool quic_persist_cache_load(quic_persist_cache_t *cache);
+
+/**
+ * @brief Write the blob to flash.
+ *
+ * @return 0 on success, -1 on error
+ */
+int quic_persist_cache_store(quic_persist_cache_t *cache);
+
+/**
+ * @brief Entry i, or NULL past the end.
+ */
+void *quic_persist_cache_entry(quic_persist_cache_t *cache, size_t i);
+
+/**
+ * @brief Index of the used entry match() accepts, or -1.
+ */
+int quic_persist_cache_find(quic_persist_cache_t *cache,
+                            bool (*match)(const void *entry, const void *key),
+                            const void *key);
+
+/**
+ * @brief Index of an unused entry, or else of the oldest one; entries
+ * that cannot be dated go first.
+ */
+size_t quic_persist_cache_victim(quic_persist_cache_t *cache);
+
+/**
+ * @brief Forget the copy in RAM; the next load reads flash again, as
+ * after a restart.
+ */
+void quic_persist_cache_reload(quic_persist_cache_t *cache);
+
+/**
+ * @brief Drop all entries, in RAM and persisted.
+ */
+void quic_persist_cache_flush(quic_persist_cache_t *cache);
+
+#endif /* QUIC_PERSIST_H */
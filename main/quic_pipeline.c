@@ -0,0 +1,184 @@
+#ifndef ESP_PLATFORM
+#define _GNU_SOURCE  // CPU_SET and pthread_attr_setaffinity_np
+#endif
+
+#include "quic_pipeline.h"
+#include "esp_log.h"
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef ESP_PLATFORM
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+static const char *TAG = "QUIC_PIPELINE";
+
+static atomic_uint_fast64_t stage_busy_us[QUIC_STAGE_COUNT];
+
+#ifdef ESP_PLATFORM
+
+int quic_task_create(void (*fn)(void *arg), const char *name, uint32_t stack_size,
+                     void *arg, int priority, int core, quic_task_handle_t *handle) {
+    BaseType_t core_id = core >= 0 && core < portNUM_PROCESSORS ? core : tskNO_AFFINITY;
+
+    if (xTaskCreatePinnedToCore(fn, name, stack_size, arg, priority, handle,
+                                core_id) != pdPASS) {
+        ESP_LOGE(TAG, "Cannot create task %s", name);
+        return -1;
+    }
+    return 0;
+}
+
+int64_t quic_pipeline_idle_us(int core) {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    if (core < 0 || core >= portNUM_PROCESSORS) {
+        return -1;
+    }
+    // The default run-time clock is esp_timer, in microseconds
+    return (int64_t)ulTaskGetIdleRunTimeCounterForCore(core);
+#else
+    (void)core;
+    return -1;
+#endif
+}
+
+#else
+
+struct task_start {
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+static void *task_trampoline(void *p) {
+    struct task_start start = *(struct task_start *)p;
+
+    free(p);
+    start.fn(start.arg);
+    return NULL;
+}
+
+int quic_task_create(void (*fn)(void *arg), const char *name, uint32_t stack_size,
+                     void *arg, int priority, int core, quic_task_handle_t *handle) {
+    struct task_start *start;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int rv;
+
+    (void)priority;
+
+    start = malloc(sizeof(*start));
+    if (start == NULL) {
+        return -1;
+    }
+    start->fn = fn;
+    start->arg = arg;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : stack_size);
+#ifdef __linux__
+    // Like on the ESP32, a core the machine does not have means none
+    if (core >= 0 && core < sysconf(_SC_NPROCESSORS_ONLN)) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+#endif
+    rv = pthread_create(&thread, &attr, task_trampoline, start);
+    pthread_attr_destroy(&attr);
+    if (rv != 0) {
+        ESP_LOGE(TAG, "Cannot create thread %s", name);
+        free(start);
+        return -1;
+    }
+
+    if (handle) {
+        *handle = thread;
+    } else {
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+int64_t quic_pipeline_idle_us(int core) {
+    (void)core;
+    return -1;
+}
+
+#endif /* ESP_PLATFORM */
+
+void quic_spsc_init(quic_spsc_ring_t *ring, uint8_t *buf, size_t size) {
+    ring->buf = buf;
+    ring->size = size;
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+}
+
+int quic_spsc_push(quic_spsc_ring_t *ring, const uint8_t *data, size_t len) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t pos = head & (ring->size - 1);
+    size_t n = ring->size - pos;
+
+    if (len > ring->size - (head - tail)) {
+        return -1;
+    }
+
+    if (n > len) {
+        n = len;
+    }
+    memcpy(ring->buf + pos, data, n);
+    memcpy(ring->buf, data + n, len - n);
+
+    // Publish the bytes only once they are written
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+    return 0;
+}
+
+size_t quic_spsc_peek(quic_spsc_ring_t *ring, const uint8_t **data, size_t *contig) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t pos = tail & (ring->size - 1);
+    size_t avail = head - tail;
+
+    *data = ring->buf + pos;
+    *contig = avail < ring->size - pos ? avail : ring->size - pos;
+    return avail;
+}
+
+void quic_spsc_copy(quic_spsc_ring_t *ring, uint8_t *dst, size_t len) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed) & (ring->size - 1);
+    size_t n = ring->size - pos;
+
+    if (n > len) {
+        n = len;
+    }
+    memcpy(dst, ring->buf + pos, n);
+    memcpy(dst + n, ring->buf, len - n);
+}
+
+void quic_spsc_consume(quic_spsc_ring_t *ring, size_t n) {
+    // Hand the space back only after the bytes were read
+    atomic_fetch_add_explicit(&ring->tail, n, memory_order_release);
+}
+
+void quic_pipeline_busy_add(quic_stage_t stage, uint32_t us) {
+    atomic_fetch_add_explicit(&stage_busy_us[stage], us, memory_order_relaxed);
+}
+
+uint64_t quic_pipeline_busy_us(quic_stage_t stage) {
+    return atomic_load_explicit(&stage_busy_us[stage], memory_order_relaxed);
+}
+
+int quic_pipeline_stage_core(quic_stage_t stage) {
+    int core = stage == QUIC_STAGE_IO ? QUIC_IO_TASK_CORE : QUIC_APP_TASK_CORE;
+
+#ifdef ESP_PLATFORM
+    if (core >= portNUM_PROCESSORS) {
+        return QUIC_TASK_NO_AFFINITY;
+    }
+#endif
+    return core;
+}
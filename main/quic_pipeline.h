@@ -0,0 +1,132 @@
+#ifndef QUIC_PIPELINE_H
+#define QUIC_PIPELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <pthread.h>
+#endif
+
+/**
+ * @brief Pipelined mode for dual-core parts.
+ *
+ * Off by default; enable with idf.py -DQUIC_PIPELINE=1, see
+ * main/CMakeLists.txt. The I/O stage (io_monitor and ev_esp_loop: socket
+ * reads, ngtcp2 decryption, timers) and the application stage
+ * (quic_mqtt_task: MQTT parsing and handlers) are pinned to cores of their
+ * own, and received stream data goes from one to the other through a
+ * lock-free ring instead of under quic_mutex. On single-core parts the
+ * stages only get their priorities.
+ */
+#ifndef QUIC_PIPELINE_ENABLE
+#define QUIC_PIPELINE_ENABLE 0
+#endif
+
+#define QUIC_TASK_NO_AFFINITY -1
+
+/**
+ * @brief Core and priority of each stage. The I/O stage runs above the
+ * application so decryption and ACKs are not held up by handlers. Without
+ * pipelining every task floats at priority 5 as before.
+ */
+#if QUIC_PIPELINE_ENABLE
+#ifndef QUIC_IO_TASK_CORE
+#define QUIC_IO_TASK_CORE 0
+#endif
+#ifndef QUIC_APP_TASK_CORE
+#define QUIC_APP_TASK_CORE 1
+#endif
+#ifndef QUIC_IO_TASK_PRIORITY
+#define QUIC_IO_TASK_PRIORITY 6
+#endif
+#else
+#define QUIC_IO_TASK_CORE QUIC_TASK_NO_AFFINITY
+#define QUIC_APP_TASK_CORE QUIC_TASK_NO_AFFINITY
+#define QUIC_IO_TASK_PRIORITY 5
+#endif
+#ifndef QUIC_APP_TASK_PRIORITY
+#define QUIC_APP_TASK_PRIORITY 5
+#endif
+
+typedef enum {
+    QUIC_STAGE_IO = 0,
+    QUIC_STAGE_APP = 1,
+    QUIC_STAGE_COUNT
+} quic_stage_t;
+
+#ifdef ESP_PLATFORM
+typedef TaskHandle_t quic_task_handle_t;
+#else
+typedef pthread_t quic_task_handle_t;
+#endif
+
+/**
+ * @brief Start a task on a core, a thread pinned to that CPU on the host.
+ *
+ * @param core Core number, or QUIC_TASK_NO_AFFINITY. Cores the part does
+ * not have mean no affinity.
+ * @param priority FreeRTOS priority, ignored on the host
+ * @param handle Where to store the handle, may be NULL
+ * @return 0 on success, -1 on failure
+ */
+int quic_task_create(void (*fn)(void *arg), const char *name, uint32_t stack_size,
+                     void *arg, int priority, int core, quic_task_handle_t *handle);
+
+/**
+ * @brief Single-producer single-consumer byte ring.
+ *
+ * The producer only moves head and the consumer only moves tail, so the
+ * two sides need no lock. size must be a power of two.
+ */
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    atomic_size_t head;  // Bytes ever pushed
+    atomic_size_t tail;  // Bytes ever consumed
+} quic_spsc_ring_t;
+
+void quic_spsc_init(quic_spsc_ring_t *ring, uint8_t *buf, size_t size);
+
+/**
+ * @brief Producer: append len bytes, all or nothing.
+ * @return 0 on success, -1 if they do not fit
+ */
+int quic_spsc_push(quic_spsc_ring_t *ring, const uint8_t *data, size_t len);
+
+/**
+ * @brief Consumer: bytes available, and in *contig how many of them are
+ * contiguous at the returned pointer.
+ */
+size_t quic_spsc_peek(quic_spsc_ring_t *ring, const uint8_t **data, size_t *contig);
+
+// Consumer: copy len bytes starting at the tail, across the wrap
+void quic_spsc_copy(quic_spsc_ring_t *ring, uint8_t *dst, size_t len);
+
+// Consumer: release n bytes
+void quic_spsc_consume(quic_spsc_ring_t *ring, size_t n);
+
+/**
+ * @brief Time each stage spent working, for the utilisation of the cores
+ * they are pinned to. The I/O stage is accounted in ngtcp2_sample.c, the
+ * application stage by whoever runs MQTT_ProcessLoop.
+ */
+void quic_pipeline_busy_add(quic_stage_t stage, uint32_t us);
+uint64_t quic_pipeline_busy_us(quic_stage_t stage);
+
+// Core a stage is pinned to, QUIC_TASK_NO_AFFINITY if it floats
+int quic_pipeline_stage_core(quic_stage_t stage);
+
+/**
+ * @brief Idle time of a core in microseconds, from the FreeRTOS run-time
+ * counters. Needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS; returns -1
+ * without it and on the host.
+ */
+int64_t quic_pipeline_idle_us(int core);
+
+#endif /* QUIC_PIPELINE_H */
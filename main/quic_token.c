@@ -0,0 +1,97 @@
+#include "quic_token.h"
+#include "quic_persist.h"
+#include "esp_log.h"
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+
+static const char *TAG = "QUIC_TOKEN";
+
+// Bump when token_cache changes layout; older blobs are then ignored
+#define TOKEN_CACHE_VERSION 2
+
+typedef struct {
+    quic_persist_time_t received;    // Of the NEW_TOKEN, epoch 0 for an unused entry
+    char host[QUIC_TOKEN_HOST_MAX];
+    uint16_t port;
+    uint16_t len;                    // 0 once taken
+    uint8_t token[QUIC_TOKEN_MAX_LEN];
+} token_entry_t;
+
+typedef struct {
+    const char *host;
+    uint16_t port;
+} token_key_t;
+
+// Persisted as one blob
+static struct {
+    uint32_t version;
+    token_entry_t entries[QUIC_TOKEN_CACHE_ENTRIES];
+} token_blob;
+static quic_persist_cache_t token_cache =
+    QUIC_PERSIST_CACHE_INIT(QUIC_TOKEN_PERSIST_KEY, TOKEN_CACHE_VERSION, token_blob);
+
+static bool token_match(const void *entry, const void *key) {
+    const token_entry_t *e = entry;
+    const token_key_t *k = key;
+
+    return e->port == k->port && strcasecmp(e->host, k->host) == 0;
+}
+
+int quic_token_take(const char *host, uint16_t port, uint8_t *token, size_t *len) {
+    token_key_t key = { host, port };
+    token_entry_t *e;
+    int i;
+
+    quic_persist_cache_load(&token_cache);
+    if ((i = quic_persist_cache_find(&token_cache, token_match, &key)) < 0) {
+        return -1;
+    }
+
+    e = &token_blob.entries[i];
+    if (e->len == 0 || quic_persist_age(&e->received) >= QUIC_TOKEN_MAX_AGE_S) {
+        return -1;
+    }
+
+    memcpy(token, e->token, e->len);
+    *len = e->len;
+    // Flash keeps it until the next NEW_TOKEN replaces it
+    e->len = 0;
+    ESP_LOGI(TAG, "Using a %u byte token for %s:%u", (unsigned)*len, host, port);
+    return 0;
+}
+
+void quic_token_save(const char *host, uint16_t port, const uint8_t *token, size_t len) {
+    token_key_t key = { host, port };
+    token_entry_t *e;
+    int i;
+
+    if (len == 0 || len > QUIC_TOKEN_MAX_LEN || strlen(host) >= QUIC_TOKEN_HOST_MAX) {
+        ESP_LOGW(TAG, "Not keeping a %u byte token for %s", (unsigned)len, host);
+        return;
+    }
+
+    quic_persist_cache_load(&token_cache);
+    i = quic_persist_cache_find(&token_cache, token_match, &key);
+    if (i < 0) {
+        i = (int)quic_persist_cache_victim(&token_cache);
+    }
+
+    e = &token_blob.entries[i];
+    memset(e, 0, sizeof(*e));
+    e->received = quic_persist_now();
+    strcpy(e->host, host);
+    e->port = port;
+    e->len = (uint16_t)len;
+    memcpy(e->token, token, len);
+
+    quic_persist_cache_store(&token_cache);
+}
+
+void quic_token_reload(void) {
+    quic_persist_cache_reload(&token_cache);
+}
+
+void quic_token_flush(void) {
+    quic_persist_cache_flush(&token_cache);
+}
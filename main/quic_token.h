@@ -0,0 +1,66 @@
+#ifndef QUIC_TOKEN_H
+#define QUIC_TOKEN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Servers whose address validation token is kept. The one received
+ * longest ago is replaced when it is full.
+ */
+#define QUIC_TOKEN_CACHE_ENTRIES 4
+#define QUIC_TOKEN_HOST_MAX 64
+
+/**
+ * @brief Longest token kept; longer ones are not stored.
+ */
+#define QUIC_TOKEN_MAX_LEN 128
+
+/**
+ * @brief quic_persist key of the cache.
+ */
+#define QUIC_TOKEN_PERSIST_KEY "token_cache"
+
+/**
+ * @brief Tokens older than this are not used. Servers bound how long they
+ * accept them; an expired one only costs the Retry it was meant to save.
+ * Without a set wall clock only tokens received since power-up can be
+ * dated, see quic_persist_age.
+ */
+#ifndef QUIC_TOKEN_MAX_AGE_S
+#define QUIC_TOKEN_MAX_AGE_S (24 * 3600)
+#endif
+
+/**
+ * @brief Take the token a server gave in a NEW_TOKEN frame, for the
+ * Initial packets of a new connection to it.
+ *
+ * A token is handed out once (RFC 9000 section 8.1.3), the server sends
+ * a new one on each connection.
+ *
+ * @param host Server name the token came from
+ * @param port Its UDP port
+ * @param token Destination of QUIC_TOKEN_MAX_LEN bytes
+ * @param len Set to the token length
+ * @return 0 with a token, -1 if there is none or it is stale
+ */
+int quic_token_take(const char *host, uint16_t port, uint8_t *token, size_t *len);
+
+/**
+ * @brief Keep a token received in a NEW_TOKEN frame, replacing the one
+ * stored for the server.
+ */
+void quic_token_save(const char *host, uint16_t port, const uint8_t *token, size_t len);
+
+/**
+ * @brief Read the tokens from flash again on next use, as after a
+ * restart.
+ */
+void quic_token_reload(void);
+
+/**
+ * @brief Drop all tokens, in RAM and persisted.
+ */
+void quic_token_flush(void);
+
+#endif /* QUIC_TOKEN_H */
@@ -0,0 +1,331 @@
+#include "quic_trust.h"
+#include "quic_persist.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <string.h>
+#include <stdbool.h>
+
+#include <openssl/ssl.h>
+#include <wolfssl/wolfcrypt/sha256.h>
+#include <wolfssl/wolfcrypt/error-crypt.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char *TAG = "QUIC_TRUST";
+
+#define HEADER_LEN 12
+#define ENTRY_LEN (QUIC_TRUST_HASH_LEN + 8)
+
+// Used from the QUIC task only, like the TLS context it serves
+static struct {
+    char name[64];
+    const uint8_t *image;
+    size_t size;
+    size_t count;
+#ifdef ESP_PLATFORM
+    esp_partition_mmap_handle_t handle;
+#endif
+    quic_trust_stats_t stats;
+} store;
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#ifdef ESP_PLATFORM
+
+static int image_map(const char *name, size_t *size) {
+    const esp_partition_t *partition;
+    const void *ptr;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                         QUIC_TRUST_PARTITION_SUBTYPE, name);
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "Partition %s not found", name);
+        return -1;
+    }
+    if (esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA,
+                           &ptr, &store.handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot map partition %s", name);
+        return -1;
+    }
+
+    store.image = ptr;
+    *size = partition->size;
+    return 0;
+}
+
+static void image_unmap(void) {
+    esp_partition_munmap(store.handle);
+}
+
+#else
+
+static int image_map(const char *name, size_t *size) {
+    struct stat st;
+    void *ptr;
+    int fd;
+
+    fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        ESP_LOGE(TAG, "Cannot open %s", name);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < HEADER_LEN) {
+        close(fd);
+        return -1;
+    }
+    ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        ESP_LOGE(TAG, "Cannot map %s", name);
+        return -1;
+    }
+
+    store.image = ptr;
+    *size = (size_t)st.st_size;
+    return 0;
+}
+
+static void image_unmap(void) {
+    munmap((void *)store.image, store.size);
+}
+
+#endif /* ESP_PLATFORM */
+
+void quic_trust_close(void) {
+    if (store.image) {
+        image_unmap();
+    }
+    memset(&store, 0, sizeof(store));
+}
+
+int quic_trust_open(const char *name) {
+    int64_t start = esp_timer_get_time();
+    size_t mapped;
+    size_t size;
+    size_t count;
+
+    if (store.image && strcmp(store.name, name) == 0) {
+        return 0;
+    }
+    quic_trust_close();
+
+    if (strlen(name) >= sizeof(store.name) || image_map(name, &mapped) != 0) {
+        return -1;
+    }
+    // The mapped length, for unmapping; a partition is larger than its image
+    store.size = mapped;
+
+    count = mapped >= HEADER_LEN ? get_u32(store.image + 4) : 0;
+    size = mapped >= HEADER_LEN ? get_u32(store.image + 8) : 0;
+    if (size < HEADER_LEN || size > mapped || memcmp(store.image, QUIC_TRUST_MAGIC, 4) != 0 ||
+        count > (size - HEADER_LEN) / ENTRY_LEN) {
+        ESP_LOGE(TAG, "%s holds no CA image", name);
+        quic_trust_close();
+        return -1;
+    }
+
+    strcpy(store.name, name);
+    store.count = count;
+    store.stats.certs = count;
+    store.stats.image_bytes = size;
+    store.stats.open_us = (uint32_t)(esp_timer_get_time() - start);
+    ESP_LOGI(TAG, "%u CA certificates in %s (%u bytes)",
+             (unsigned)count, name, (unsigned)size);
+    return 0;
+}
+
+int quic_trust_get(size_t i, const uint8_t **der, size_t *len) {
+    const uint8_t *entry;
+    uint32_t offset;
+    uint32_t length;
+
+    if (!store.image || i >= store.count) {
+        return -1;
+    }
+
+    entry = store.image + HEADER_LEN + i * ENTRY_LEN;
+    offset = get_u32(entry + QUIC_TRUST_HASH_LEN);
+    length = get_u32(entry + QUIC_TRUST_HASH_LEN + 4);
+    if (offset > store.stats.image_bytes || length > store.stats.image_bytes - offset) {
+        return -1;
+    }
+
+    *der = store.image + offset;
+    *len = length;
+    return 0;
+}
+
+// Step over one DER element with the given tag. On success p and len
+// describe what follows it, and tlv and tlvLen the element itself.
+static int der_next(const uint8_t **p, size_t *len, uint8_t tag,
+                    const uint8_t **tlv, size_t *tlvLen) {
+    size_t hdr = 2;
+    size_t body;
+
+    if (*len < 2 || (*p)[0] != tag) {
+        return -1;
+    }
+
+    body = (*p)[1];
+    if (body & 0x80) {
+        size_t n = body & 0x7f;
+        if (n == 0 || n > 3 || *len < 2 + n) {
+            return -1;
+        }
+        body = 0;
+        for (size_t i = 0; i < n; i++) {
+            body = body << 8 | (*p)[2 + i];
+        }
+        hdr += n;
+    }
+    if (body > *len - hdr) {
+        return -1;
+    }
+
+    *tlv = *p;
+    *tlvLen = hdr + body;
+    *p += hdr + body;
+    *len -= hdr + body;
+    return 0;
+}
+
+// Enter the DER element with the given tag: p and len become its content
+static int der_enter(const uint8_t **p, size_t *len, uint8_t tag) {
+    const uint8_t *tlv;
+    size_t tlvLen;
+    size_t hdr;
+
+    if (der_next(p, len, tag, &tlv, &tlvLen) != 0) {
+        return -1;
+    }
+    hdr = (tlv[1] & 0x80) ? 2 + (tlv[1] & 0x7f) : 2;
+    *p = tlv + hdr;
+    *len = tlvLen - hdr;
+    return 0;
+}
+
+// Locate the issuer or the subject Name of a DER certificate
+static int cert_name(const uint8_t *der, size_t len, bool subject,
+                     const uint8_t **name, size_t *nameLen) {
+    const uint8_t *skip;
+    size_t skipLen;
+
+    if (der_enter(&der, &len, 0x30) != 0 ||  // Certificate
+        der_enter(&der, &len, 0x30) != 0) {  // TBSCertificate
+        return -1;
+    }
+    if (len > 0 && der[0] == 0xa0) {         // [0] version
+        if (der_next(&der, &len, 0xa0, &skip, &skipLen) != 0) {
+            return -1;
+        }
+    }
+    if (der_next(&der, &len, 0x02, &skip, &skipLen) != 0 ||  // serialNumber
+        der_next(&der, &len, 0x30, &skip, &skipLen) != 0 ||  // signature
+        der_next(&der, &len, 0x30, name, nameLen) != 0) {    // issuer
+        return -1;
+    }
+    if (subject &&
+        (der_next(&der, &len, 0x30, &skip, &skipLen) != 0 ||  // validity
+         der_next(&der, &len, 0x30, name, nameLen) != 0)) {   // subject
+        return -1;
+    }
+    return 0;
+}
+
+int quic_trust_verify_signed_by(const uint8_t *der, size_t len,
+                                const uint8_t *issuer, size_t issuerLen) {
+    int64_t start = esp_timer_get_time();
+    WOLFSSL_CERT_MANAGER *cm;
+    int rv = -1;
+
+    // A throwaway manager holding just this issuer, freed right after
+    cm = wolfSSL_CertManagerNew();
+    if (cm == NULL) {
+        return -1;
+    }
+    if (wolfSSL_CertManagerLoadCABuffer(cm, issuer, (long)issuerLen,
+                                        WOLFSSL_FILETYPE_ASN1) == WOLFSSL_SUCCESS) {
+        // wolfSSL reports a date error only once the signature verified
+        int err = wolfSSL_CertManagerVerifyBuffer(cm, der, (long)len, WOLFSSL_FILETYPE_ASN1);
+        if (err == WOLFSSL_SUCCESS || quic_trust_waive_date_error(err)) {
+            rv = 0;
+        }
+    }
+    wolfSSL_CertManagerFree(cm);
+
+    store.stats.verify_us += (uint32_t)(esp_timer_get_time() - start);
+    return rv;
+}
+
+int quic_trust_verify(const uint8_t *der, size_t len) {
+    const uint8_t *issuer;
+    size_t issuerLen;
+    uint8_t hash[WC_SHA256_DIGEST_SIZE];
+    size_t lo = 0;
+    size_t hi = store.count;
+
+    if (!store.image || cert_name(der, len, false, &issuer, &issuerLen) != 0 ||
+        wc_Sha256Hash(issuer, (word32)issuerLen, hash) != 0) {
+        return -1;
+    }
+    store.stats.lookups++;
+
+    // First index entry not below the hash
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (memcmp(store.image + HEADER_LEN + mid * ENTRY_LEN, hash, QUIC_TRUST_HASH_LEN) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Several CAs may share a subject, after a key rollover for instance
+    for (; lo < store.count; lo++) {
+        const uint8_t *ca;
+        size_t caLen;
+        const uint8_t *subject;
+        size_t subjectLen;
+
+        if (memcmp(store.image + HEADER_LEN + lo * ENTRY_LEN, hash, QUIC_TRUST_HASH_LEN) != 0) {
+            break;
+        }
+        if (quic_trust_get(lo, &ca, &caLen) != 0 ||
+            cert_name(ca, caLen, true, &subject, &subjectLen) != 0 ||
+            subjectLen != issuerLen || memcmp(subject, issuer, issuerLen) != 0) {
+            continue;
+        }
+
+        store.stats.parsed++;
+        if (quic_trust_verify_signed_by(der, len, ca, caLen) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+bool quic_trust_waive_date_error(int error) {
+    if (error != ASN_BEFORE_DATE_E && error != ASN_AFTER_DATE_E &&
+        error != X509_V_ERR_CERT_NOT_YET_VALID && error != X509_V_ERR_CERT_HAS_EXPIRED) {
+        return false;
+    }
+    if (QUIC_TRUST_REQUIRE_CLOCK || quic_persist_wall_clock()) {
+        return false;
+    }
+    store.stats.dates_waived++;
+    ESP_LOGW(TAG, "No wall clock, not checking certificate dates");
+    return true;
+}
+
+void quic_trust_get_stats(quic_trust_stats_t *stats) {
+    *stats = store.stats;
+}
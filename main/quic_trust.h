@@ -0,0 +1,103 @@
+#ifndef QUIC_TRUST_H
+#define QUIC_TRUST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief Data partition holding the CA image, and its subtype.
+ */
+#define QUIC_TRUST_PARTITION "castore"
+#define QUIC_TRUST_PARTITION_SUBTYPE 0x41
+
+/**
+ * @brief CA image built by tools/mk_trust_store.py from a PEM bundle,
+ * little-endian:
+ *
+ *   header   "QTS1", uint32 count, uint32 total image size
+ *   index    count entries sorted by subject hash: the first
+ *            QUIC_TRUST_HASH_LEN bytes of the SHA-256 of the DER subject
+ *            Name, then uint32 offset and uint32 length of the certificate
+ *   certs    DER certificates
+ *
+ * The image is used in place, mapped from flash, so neither the index nor
+ * the certificates take heap.
+ */
+#define QUIC_TRUST_MAGIC "QTS1"
+#define QUIC_TRUST_HASH_LEN 8
+
+/**
+ * @brief Certificate date policy. The device has no clock of its own:
+ * until SNTP sets one, time() counts from 1970 and every certificate
+ * looks not yet valid. Validity dates are therefore checked only once
+ * the wall clock is set (quic_persist_wall_clock). Before that, a
+ * certificate that fails on its dates alone, with its signature and host
+ * name verified, is accepted with a warning. Build with
+ * QUIC_TRUST_REQUIRE_CLOCK=1 to reject every chain until the clock is
+ * set instead. This applies to ca_pem and ca_store alike.
+ */
+#ifndef QUIC_TRUST_REQUIRE_CLOCK
+#define QUIC_TRUST_REQUIRE_CLOCK 0
+#endif
+
+typedef struct {
+    size_t certs;         // Certificates in the image
+    size_t image_bytes;
+    uint32_t open_us;     // Time quic_trust_open took to map and check the image
+    uint32_t lookups;     // Issuers looked up
+    uint32_t parsed;      // Issuer certificates parsed for that
+    uint32_t verify_us;   // Total time spent in the verify functions
+    uint32_t dates_waived;  // Date errors accepted without a wall clock
+} quic_trust_stats_t;
+
+/**
+ * @brief Map the CA image. Only the header and the index bounds are
+ * checked here; a certificate is parsed when it is needed as an issuer.
+ * The mapping stays until quic_trust_close, another name replaces it.
+ *
+ * @param name Partition name, a file path when built without ESP_PLATFORM
+ * @return 0 on success, -1 if the image is missing or malformed
+ */
+int quic_trust_open(const char *name);
+
+void quic_trust_close(void);
+
+/**
+ * @brief Verify that a DER certificate is signed by a CA of the image:
+ * the index is searched for its issuer Name and only the certificates
+ * found are parsed. Validity dates are checked as the date policy above
+ * says.
+ *
+ * @return 0 if verified, -1 otherwise
+ */
+int quic_trust_verify(const uint8_t *der, size_t len);
+
+/**
+ * @brief Verify that a DER certificate is signed by the given issuer,
+ * for instance an intermediate accepted with quic_trust_verify.
+ *
+ * @return 0 if verified, -1 otherwise
+ */
+int quic_trust_verify_signed_by(const uint8_t *der, size_t len,
+                                const uint8_t *issuer, size_t issuerLen);
+
+/**
+ * @brief Certificate i of the image, pointing into the mapping.
+ *
+ * @return 0 on success, -1 if i is out of range or no image is open
+ */
+int quic_trust_get(size_t i, const uint8_t **der, size_t *len);
+
+/**
+ * @brief Apply the date policy to a certificate that failed verification
+ * with error, a wolfSSL or X509_V_ERR code.
+ *
+ * @return true if error is a validity date error to let pass because the
+ *         wall clock is not set; counted and logged
+ */
+bool quic_trust_waive_date_error(int error);
+
+void quic_trust_get_stats(quic_trust_stats_t *stats);
+
+#endif /* QUIC_TRUST_H */
@@ -0,0 +1,88 @@
+# SPDX-FileCopyrightText: 2024 EMQX
+# SPDX-License-Identifier: MIT
+"""Benchmark run against the in-repo MQTT-over-QUIC server stand-in.
+
+Build the firmware pointing at this host, then run pytest with the same
+address so the stand-in is started next to the DUT:
+
+    idf.py -DQUIC_BENCH_BROKER=192.168.1.10 build
+    QUIC_BENCH_BROKER=192.168.1.10 pytest pytest_quic_bench.py --target esp32c3
+
+Every BENCH_RESULT line logged by main/mqtt_quic_bench.c is collected and
+written as JSON to $QUIC_BENCH_OUTPUT (default quic_bench_results.json).
+"""
+import json
+import logging
+import os
+import sys
+import time
+from typing import Any, Dict, List
+
+import pytest
+from pytest_embedded_idf.dut import IdfDut
+from pytest_embedded_idf.utils import idf_parametrize
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), 'tools'))
+
+BENCH_PORT = 14567
+# Warm standby broker for the failover scenario, see main/CMakeLists.txt
+BENCH_STANDBY_PORT = 14568
+# Broker that sends Retry, for the token scenario
+BENCH_RETRY_PORT = 14569
+BENCH_TIMEOUT_S = 600
+# Least stack each task must have left unused over a run
+BENCH_MIN_STACK_FREE = 1024
+
+# Scenarios a complete run must report
+EXPECTED_SCENARIOS = {
+    'handshake', 'stream_publish', 'inbound_qos0', 'fanout',
+    'publish_latency', 'qos1_pipeline', 'keepalive', 'lowpower', 'ack_frequency',
+    'pipeline', 'priority', 'outbound', 'path_cache', 'token', 'failover', 'stacks', 'done',
+}
+
+
+@pytest.fixture(scope='module')
+def quic_bench_server() -> None:
+    import mqtt_quic_server
+    mqtt_quic_server.start_in_thread('0.0.0.0', BENCH_PORT, BENCH_STANDBY_PORT, BENCH_RETRY_PORT)
+    time.sleep(1)
+
+
+@pytest.mark.quic_bench
+@pytest.mark.skipif(not os.environ.get('QUIC_BENCH_BROKER'),
+                    reason='set QUIC_BENCH_BROKER to the address the firmware was built with')
+@idf_parametrize('target', ['esp32c3'], indirect=['target'])
+def test_quic_bench(dut: IdfDut, quic_bench_server: None) -> None:
+    """Collect benchmark results from a firmware built with QUIC_BENCH_BROKER"""
+    results: List[Dict[str, Any]] = []
+    deadline = time.time() + BENCH_TIMEOUT_S
+
+    while time.time() < deadline:
+        line = dut.expect(r'BENCH_RESULT (\{.*\})', timeout=BENCH_TIMEOUT_S).group(1).decode('utf-8')
+        result = json.loads(line)
+        logging.info('bench: %s', result)
+        results.append(result)
+        if result['scenario'] == 'done':
+            break
+
+    output = os.environ.get('QUIC_BENCH_OUTPUT', 'quic_bench_results.json')
+    with open(output, 'w') as f:
+        json.dump({'target': dut.target, 'time': int(time.time()), 'results': results}, f, indent=2)
+    logging.info('Wrote %d results to %s', len(results), output)
+
+    missing = EXPECTED_SCENARIOS - {r['scenario'] for r in results}
+    assert not missing, f'Scenarios not reported: {sorted(missing)}'
+    assert all(r['received'] == r['msgs'] for r in results if r['scenario'] == 'fanout')
+    assert all(r['received'] == r['msgs'] for r in results if r['scenario'] == 'path_cache')
+    assert all(r['seeded'] == r['warm'] for r in results if r['scenario'] == 'path_cache')
+    assert any(r['reloaded'] for r in results if r['scenario'] == 'path_cache')
+    assert all(r['ready'] and r['token_used'] == r['warm'] and r['retries'] == 1 - r['warm']
+               for r in results if r['scenario'] == 'token')
+    assert any(r['reloaded'] for r in results if r['scenario'] == 'token')
+    assert all(r['failovers'] == 1 for r in results if r['scenario'] == 'failover')
+    for r in results:
+        if r['scenario'] == 'stacks':
+            low = {task: free for task, free in r['free'].items() if free < BENCH_MIN_STACK_FREE}
+            assert not low, f'Stacks nearly exhausted (bytes left): {low}'
+    assert all(r['sent'] + r['conflated'] + r['dropped'] + r['overflows'] + r['pending'] == r['samples']
+               for r in results if r['scenario'] == 'outbound')
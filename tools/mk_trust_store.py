@@ -0,0 +1,102 @@
+# SPDX-FileCopyrightText: 2024 EMQX
+# SPDX-License-Identifier: MIT
+"""Build the CA image read by main/quic_trust.c from PEM certificates.
+
+    python tools/mk_trust_store.py isrg-root-x1.pem digicert-global-root-g2.pem -o castore.bin
+    parttool.py write_partition --partition-name castore --input castore.bin
+
+Pass the CAs your brokers chain to, not a whole bundle: the Mozilla bundle
+builds to about 155KB (144 certificates), the 64KB castore partition holds
+roughly 55 typical roots, and a 2MB flash leaves no room for a larger one.
+
+The layout is described in main/quic_trust.h. Only the standard library is
+needed, so this also runs where the cryptography package is missing.
+"""
+import argparse
+import base64
+import hashlib
+import re
+import struct
+import sys
+from typing import List, Tuple
+
+MAGIC = b'QTS1'
+HASH_LEN = 8
+HEADER_LEN = 12
+ENTRY_LEN = HASH_LEN + 8
+PARTITION_SIZE = 64 * 1024
+
+PEM_RE = re.compile(rb'-----BEGIN CERTIFICATE-----(.+?)-----END CERTIFICATE-----', re.S)
+
+
+def der_next(data: bytes, pos: int, tag: int) -> Tuple[int, int, int]:
+    """Return (start, content start, end) of the element with the given tag at pos."""
+    if data[pos] != tag:
+        raise ValueError(f'expected tag 0x{tag:02x} at {pos}, got 0x{data[pos]:02x}')
+    length = data[pos + 1]
+    content = pos + 2
+    if length & 0x80:
+        n = length & 0x7f
+        length = int.from_bytes(data[content:content + n], 'big')
+        content += n
+    return pos, content, content + length
+
+
+def subject_name(der: bytes) -> bytes:
+    """DER subject Name of a certificate, as main/quic_trust.c locates it."""
+    _, pos, _ = der_next(der, 0, 0x30)   # Certificate
+    _, pos, _ = der_next(der, pos, 0x30)  # TBSCertificate
+    if der[pos] == 0xa0:                  # [0] version
+        pos = der_next(der, pos, 0xa0)[2]
+    for tag in (0x02, 0x30, 0x30, 0x30):  # serialNumber, signature, issuer, validity
+        pos = der_next(der, pos, tag)[2]
+    start, _, end = der_next(der, pos, 0x30)
+    return der[start:end]
+
+
+def read_certificates(paths: List[str]) -> List[bytes]:
+    certs = []
+    for path in paths:
+        with open(path, 'rb') as f:
+            data = f.read()
+        blocks = PEM_RE.findall(data)
+        if blocks:
+            certs.extend(base64.b64decode(b''.join(block.split())) for block in blocks)
+        else:
+            certs.append(data)  # A single DER certificate
+    return certs
+
+
+def build_image(certs: List[bytes]) -> bytes:
+    # Drop duplicates, keep the order stable for equal hashes
+    unique = list(dict.fromkeys(certs))
+    entries = sorted(((hashlib.sha256(subject_name(der)).digest()[:HASH_LEN], der) for der in unique),
+                     key=lambda e: e[0])
+    offset = HEADER_LEN + ENTRY_LEN * len(entries)
+    index = b''
+    body = b''
+    for digest, der in entries:
+        index += digest + struct.pack('<II', offset + len(body), len(der))
+        body += der
+    return MAGIC + struct.pack('<II', len(entries), offset + len(body)) + index + body
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('certificates', nargs='+', help='PEM bundles or DER certificates')
+    parser.add_argument('-o', '--output', default='castore.bin')
+    parser.add_argument('--size', type=int, default=PARTITION_SIZE,
+                        help='partition size the image must fit (default %(default)d)')
+    args = parser.parse_args()
+
+    image = build_image(read_certificates(args.certificates))
+    if len(image) > args.size:
+        sys.exit(f'image is {len(image)} bytes, the partition holds {args.size}; '
+                 'pass only the CAs your brokers chain to')
+    with open(args.output, 'wb') as f:
+        f.write(image)
+    print(f'{args.output}: {struct.unpack_from("<I", image, 4)[0]} certificates, {len(image)} bytes')
+
+
+if __name__ == '__main__':
+    main()
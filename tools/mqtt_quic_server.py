@@ -0,0 +1,446 @@
+# SPDX-FileCopyrightText: 2024 EMQX
+# SPDX-License-Identifier: MIT
+"""Minimal MQTT-over-QUIC broker for benchmarking the demo client.
+
+Speaks enough MQTT 3.1.1 on one bidirectional QUIC stream per connection
+(ALPN "mqtt") to run the benchmarks in main/mqtt_quic_bench.c:
+CONNECT, SUBSCRIBE/UNSUBSCRIBE, PUBLISH at QoS 0-2 with fan-out to
+matching subscriptions, PINGREQ and DISCONNECT. No retained messages,
+sessions or authentication.
+
+A publish of a decimal count to FANOUT_CONTROL makes the server send that
+many 16-byte QoS0 messages to FANOUT_TOPIC/<n> on the same connection;
+"<count> <size>" sets the payload size.
+
+A publish of a decimal count to FAILOVER_CONTROL makes the server crash,
+as far as clients can tell, after that many more publishes to
+FAILOVER_TOPIC: it drops every datagram from then on, in both directions.
+--standby-port serves a second, independent broker for the client's warm
+standby.
+
+--retry-port serves another broker that sends Retry to every new client
+without a valid token, and gives each client a token for its next
+connection in a NEW_TOKEN frame.
+
+Requires aioquic. Usage:
+    python tools/mqtt_quic_server.py [--host 0.0.0.0] [--port 14567] [--standby-port 14568]
+                                     [--retry-port 14569]
+"""
+import argparse
+import asyncio
+import datetime
+import functools
+import hashlib
+import hmac
+import logging
+import os
+import struct
+import tempfile
+import threading
+import time
+from typing import Dict, List, Optional, Sequence, Tuple
+
+from aioquic.asyncio import QuicConnectionProtocol, serve
+from aioquic.asyncio.server import QuicServer
+from aioquic.buffer import Buffer
+from aioquic.quic.configuration import QuicConfiguration
+from aioquic.quic.connection import QuicConnection
+from aioquic.quic.events import ConnectionTerminated, HandshakeCompleted, QuicEvent, StreamDataReceived
+from aioquic.quic.packet import QuicFrameType, pull_quic_header
+
+# Must match main/mqtt_quic_bench.h
+FANOUT_CONTROL = 'esp32/quic/bench/fanout/ctl'
+FANOUT_TOPIC = 'esp32/quic/bench/fanout/data'
+FANOUT_TOPICS = 8
+FAILOVER_CONTROL = 'esp32/quic/bench/failover/ctl'
+FAILOVER_TOPIC = 'esp32/quic/bench/failover/data'
+
+# How long a token sent in NEW_TOKEN is accepted
+NEW_TOKEN_LIFETIME_S = 3600
+
+CONNECT, CONNACK, PUBLISH, PUBACK, PUBREC, PUBREL, PUBCOMP = 1, 2, 3, 4, 5, 6, 7
+SUBSCRIBE, SUBACK, UNSUBSCRIBE, UNSUBACK, PINGREQ, PINGRESP, DISCONNECT = 8, 9, 10, 11, 12, 13, 14
+
+logger = logging.getLogger('mqtt_quic_server')
+
+
+def topic_matches(topic_filter: str, topic: str) -> bool:
+    """MQTT topic filter match, including the '$' topic rule."""
+    if topic.startswith('$') and topic_filter[:1] in ('+', '#'):
+        return False
+    f_levels = topic_filter.split('/')
+    t_levels = topic.split('/')
+    for i, level in enumerate(f_levels):
+        if level == '#':
+            return True
+        if i >= len(t_levels) or (level != '+' and level != t_levels[i]):
+            return False
+    return len(f_levels) == len(t_levels)
+
+
+def encode_remaining_length(length: int) -> bytes:
+    out = bytearray()
+    while True:
+        byte = length % 128
+        length //= 128
+        out.append(byte | 0x80 if length else byte)
+        if not length:
+            return bytes(out)
+
+
+def packet(first_byte: int, body: bytes) -> bytes:
+    return bytes([first_byte]) + encode_remaining_length(len(body)) + body
+
+
+def publish_packet(topic: str, payload: bytes, qos: int = 0, packet_id: int = 0) -> bytes:
+    t = topic.encode()
+    body = len(t).to_bytes(2, 'big') + t
+    if qos:
+        body += packet_id.to_bytes(2, 'big')
+    return packet((PUBLISH << 4) | (qos << 1), body + payload)
+
+
+class Session:
+    """MQTT session bound to one QUIC stream."""
+
+    def __init__(self, broker: 'Broker', protocol: 'MqttQuicProtocol', stream_id: int) -> None:
+        self.broker = broker
+        self.protocol = protocol
+        self.stream_id = stream_id
+        self.buffer = bytearray()
+        self.subscriptions: Dict[str, int] = {}
+        self.next_packet_id = 1
+        self.stats = {'rx_packets': 0, 'tx_packets': 0, 'rx_publish': 0, 'tx_publish': 0}
+
+    def send(self, data: bytes) -> None:
+        self.stats['tx_packets'] += 1
+        self.protocol.send_stream(self.stream_id, data)
+
+    def deliver(self, topic: str, payload: bytes, qos: int) -> None:
+        packet_id = 0
+        if qos:
+            packet_id = self.next_packet_id
+            self.next_packet_id = self.next_packet_id % 0xFFFF + 1
+        self.stats['tx_publish'] += 1
+        self.send(publish_packet(topic, payload, qos, packet_id))
+
+    def feed(self, data: bytes) -> None:
+        self.buffer += data
+        while True:
+            frame = self._next_frame()
+            if frame is None:
+                return
+            self.stats['rx_packets'] += 1
+            self._handle(*frame)
+
+    def _next_frame(self) -> Optional[Tuple[int, bytes]]:
+        length, multiplier, i = 0, 1, 1
+        while True:
+            if i >= len(self.buffer):
+                return None
+            byte = self.buffer[i]
+            length += (byte & 0x7F) * multiplier
+            multiplier *= 128
+            i += 1
+            if not byte & 0x80:
+                break
+            if i > 4:
+                raise ValueError('malformed remaining length')
+        if len(self.buffer) < i + length:
+            return None
+        first_byte = self.buffer[0]
+        body = bytes(self.buffer[i:i + length])
+        del self.buffer[:i + length]
+        return first_byte, body
+
+    def _handle(self, first_byte: int, body: bytes) -> None:
+        kind = first_byte >> 4
+        if kind == CONNECT:
+            self.send(packet(CONNACK << 4, b'\x00\x00'))
+        elif kind == PUBLISH:
+            self._handle_publish(first_byte, body)
+        elif kind == PUBREL:
+            self.send(packet(PUBCOMP << 4, body[:2]))
+        elif kind == SUBSCRIBE:
+            granted = bytearray()
+            pos = 2
+            while pos < len(body):
+                n = int.from_bytes(body[pos:pos + 2], 'big')
+                topic_filter = body[pos + 2:pos + 2 + n].decode()
+                qos = min(body[pos + 2 + n] & 0x03, 1)
+                self.subscriptions[topic_filter] = qos
+                granted.append(qos)
+                pos += 3 + n
+            self.send(packet(SUBACK << 4, body[:2] + bytes(granted)))
+        elif kind == UNSUBSCRIBE:
+            pos = 2
+            while pos < len(body):
+                n = int.from_bytes(body[pos:pos + 2], 'big')
+                self.subscriptions.pop(body[pos + 2:pos + 2 + n].decode(), None)
+                pos += 2 + n
+            self.send(packet(UNSUBACK << 4, body[:2]))
+        elif kind == PINGREQ:
+            self.send(packet(PINGRESP << 4, b''))
+        elif kind == DISCONNECT:
+            self.protocol.close()
+        # PUBACK, PUBREC and PUBCOMP for our own publishes need no answer
+
+    def _handle_publish(self, first_byte: int, body: bytes) -> None:
+        qos = (first_byte >> 1) & 0x03
+        n = int.from_bytes(body[:2], 'big')
+        topic = body[2:2 + n].decode()
+        pos = 2 + n
+        packet_id = body[pos:pos + 2]
+        if qos:
+            pos += 2
+        payload = body[pos:]
+        self.stats['rx_publish'] += 1
+
+        if qos == 1:
+            self.send(packet(PUBACK << 4, packet_id))
+        elif qos == 2:
+            self.send(packet(PUBREC << 4, packet_id))
+
+        if topic == FANOUT_CONTROL:
+            args = payload.split() or [b'0']
+            size = int(args[1]) if len(args) > 1 else 16
+            for i in range(int(args[0])):
+                self.deliver(f'{FANOUT_TOPIC}/{i % FANOUT_TOPICS}', (b'%016d' % i).ljust(size, b'.'), 0)
+            return
+        if topic == FAILOVER_CONTROL:
+            self.broker.kill_after = int(payload or b'0')
+            return
+        if topic == FAILOVER_TOPIC and self.broker.kill_after is not None:
+            self.broker.kill_after -= 1
+            if self.broker.kill_after <= 0:
+                logger.info('broker on port %d going silent', self.broker.port)
+                self.broker.dead = True
+            return
+        self.broker.route(topic, payload, qos)
+
+
+class Broker:
+    def __init__(self, port: int = 0) -> None:
+        self.port = port
+        self.sessions: List[Session] = []
+        # Publishes to FAILOVER_TOPIC left before the simulated crash
+        self.kill_after: Optional[int] = None
+        self.dead = False
+
+    def route(self, topic: str, payload: bytes, qos: int) -> None:
+        for session in self.sessions:
+            granted = [q for f, q in session.subscriptions.items() if topic_matches(f, topic)]
+            if granted:
+                session.deliver(topic, payload, min(qos, max(granted)))
+
+
+class MqttQuicProtocol(QuicConnectionProtocol):
+    def __init__(self, *args, broker: Broker, **kwargs) -> None:  # type: ignore
+        super().__init__(*args, **kwargs)
+        self.broker = broker
+        self.sessions: Dict[int, Session] = {}
+
+    def datagram_received(self, data, addr) -> None:  # type: ignore
+        if not self.broker.dead:
+            super().datagram_received(data, addr)
+
+    def transmit(self) -> None:
+        if self.broker.dead:
+            # Keep aioquic's state moving, just let nothing out
+            self._quic.datagrams_to_send(now=self._loop.time())
+            return
+        super().transmit()
+
+    def send_stream(self, stream_id: int, data: bytes) -> None:
+        self._quic.send_stream_data(stream_id, data)
+        self.transmit()
+
+    def quic_event_received(self, event: QuicEvent) -> None:
+        if isinstance(event, HandshakeCompleted):
+            logger.info('handshake completed, alpn=%s', event.alpn_protocol)
+        elif isinstance(event, StreamDataReceived):
+            session = self.sessions.get(event.stream_id)
+            if session is None:
+                session = Session(self.broker, self, event.stream_id)
+                self.sessions[event.stream_id] = session
+                self.broker.sessions.append(session)
+            try:
+                session.feed(event.data)
+            except (ValueError, UnicodeDecodeError) as e:
+                logger.warning('closing connection: %s', e)
+                self.close()
+        elif isinstance(event, ConnectionTerminated):
+            for session in self.sessions.values():
+                logger.info('session closed: %s', session.stats)
+                if session in self.broker.sessions:
+                    self.broker.sessions.remove(session)
+            self.sessions.clear()
+
+
+class NewTokenIssuer:
+    """Tokens for NEW_TOKEN frames, bound to the client's IP address and issue time."""
+
+    def __init__(self) -> None:
+        self._key = os.urandom(32)
+
+    def issue(self, addr: Tuple) -> bytes:
+        issued = struct.pack('!Q', int(time.time()))
+        return b'\x01' + issued + self._mac(addr, issued)
+
+    def validate(self, addr: Tuple, token: bytes) -> bool:
+        if len(token) != 25 or token[0] != 1:
+            return False
+        issued = token[1:9]
+        return (hmac.compare_digest(token[9:], self._mac(addr, issued)) and
+                time.time() - struct.unpack('!Q', issued)[0] < NEW_TOKEN_LIFETIME_S)
+
+    def _mac(self, addr: Tuple, issued: bytes) -> bytes:
+        return hmac.new(self._key, addr[0].encode() + issued, hashlib.sha256).digest()[:16]
+
+
+class NewTokenConnection(QuicConnection):
+    """Sends a NEW_TOKEN frame along with HANDSHAKE_DONE; aioquic itself only issues Retry tokens.
+
+    The frame is not retransmitted if lost, the client then just pays the Retry again.
+    """
+    new_token = b''
+
+    def _write_handshake_done_frame(self, builder) -> None:  # type: ignore
+        super()._write_handshake_done_frame(builder)
+        if self.new_token:
+            buf = builder.start_frame(QuicFrameType.NEW_TOKEN, capacity=2 + len(self.new_token))
+            buf.push_uint_var(len(self.new_token))
+            buf.push_bytes(self.new_token)
+            self.new_token = b''
+
+
+class RetryServer(QuicServer):
+    """Sends Retry to new clients unless they present a token from an earlier NEW_TOKEN."""
+
+    def __init__(self, **kwargs) -> None:  # type: ignore
+        super().__init__(retry=True, **kwargs)
+        self._new_tokens = NewTokenIssuer()
+        self.tokens_accepted = 0
+
+    def datagram_received(self, data, addr) -> None:  # type: ignore
+        try:
+            header = pull_quic_header(Buffer(data=data),
+                                      host_cid_length=self._configuration.connection_id_length)
+        except ValueError:
+            return
+        new = header.destination_cid not in self._protocols
+
+        if new and header.token and self._new_tokens.validate(addr, header.token):
+            # The address is validated already, accept it as a server without Retry would
+            self.tokens_accepted += 1
+            logger.info('token from %s accepted (%d so far)', addr[0], self.tokens_accepted)
+            retry, self._retry = self._retry, None
+            try:
+                super().datagram_received(data, addr)
+            finally:
+                self._retry = retry
+        else:
+            super().datagram_received(data, addr)
+
+        protocol = self._protocols.get(header.destination_cid)
+        if new and protocol is not None:
+            protocol._quic.__class__ = NewTokenConnection
+            protocol._quic.new_token = self._new_tokens.issue(addr)
+
+
+def self_signed_cert(directory: str) -> Tuple[str, str]:
+    """Write a throwaway certificate. A fresh key each run, so pinned builds need --certificate."""
+    from cryptography import x509
+    from cryptography.hazmat.primitives import hashes, serialization
+    from cryptography.hazmat.primitives.asymmetric import ec
+    from cryptography.x509.oid import NameOID
+
+    key = ec.generate_private_key(ec.SECP256R1())
+    name = x509.Name([x509.NameAttribute(NameOID.COMMON_NAME, 'mqtt-quic-bench')])
+    now = datetime.datetime.now(datetime.timezone.utc)
+    cert = (x509.CertificateBuilder().subject_name(name).issuer_name(name)
+            .public_key(key.public_key()).serial_number(x509.random_serial_number())
+            .not_valid_before(now - datetime.timedelta(days=1))
+            .not_valid_after(now + datetime.timedelta(days=30))
+            .sign(key, hashes.SHA256()))
+    certfile = os.path.join(directory, 'cert.pem')
+    keyfile = os.path.join(directory, 'key.pem')
+    with open(certfile, 'wb') as f:
+        f.write(cert.public_bytes(serialization.Encoding.PEM))
+    with open(keyfile, 'wb') as f:
+        f.write(key.private_bytes(serialization.Encoding.PEM, serialization.PrivateFormat.PKCS8,
+                                  serialization.NoEncryption()))
+    return certfile, keyfile
+
+
+def key_pin(certfile: str) -> str:
+    """SHA-256 of the certificate's SubjectPublicKeyInfo, for idf.py -DQUIC_BROKER_KEY=..."""
+    from cryptography import x509
+    from cryptography.hazmat.primitives import serialization
+
+    with open(certfile, 'rb') as f:
+        cert = x509.load_pem_x509_certificate(f.read())
+    spki = cert.public_key().public_bytes(serialization.Encoding.DER,
+                                          serialization.PublicFormat.SubjectPublicKeyInfo)
+    return hashlib.sha256(spki).hexdigest()
+
+
+def make_configuration(certfile: Optional[str] = None, keyfile: Optional[str] = None) -> QuicConfiguration:
+    configuration = QuicConfiguration(alpn_protocols=['mqtt'], is_client=False, idle_timeout=300.0)
+    if certfile is None:
+        certfile, keyfile = self_signed_cert(tempfile.mkdtemp(prefix='mqtt_quic_server_'))
+    configuration.load_cert_chain(certfile, keyfile)
+    logger.info('server key sha256: %s', key_pin(certfile))
+    return configuration
+
+
+async def run(host: str, ports: List[int], configuration: QuicConfiguration,
+              retry_ports: Sequence[int] = ()) -> None:
+    """Serve an independent broker on each port, sending Retry on retry_ports."""
+    loop = asyncio.get_running_loop()
+    for port in ports:
+        protocol = functools.partial(MqttQuicProtocol, broker=Broker(port))
+        await serve(host, port, configuration=configuration, create_protocol=protocol)
+        logger.info('listening on %s:%d (udp)', host, port)
+    for port in retry_ports:
+        protocol = functools.partial(MqttQuicProtocol, broker=Broker(port))
+        await loop.create_datagram_endpoint(
+            functools.partial(RetryServer, configuration=configuration, create_protocol=protocol),
+            local_addr=(host, port))
+        logger.info('listening on %s:%d (udp), sending Retry', host, port)
+    await asyncio.Event().wait()
+
+
+def start_in_thread(host: str = '0.0.0.0', port: int = 14567,
+                    standby_port: Optional[int] = None,
+                    retry_port: Optional[int] = None) -> threading.Thread:
+    """Run the server on a daemon thread, for use from pytest."""
+    configuration = make_configuration()
+    ports = [port] if standby_port is None else [port, standby_port]
+    retry_ports = [] if retry_port is None else [retry_port]
+    thread = threading.Thread(target=lambda: asyncio.run(run(host, ports, configuration, retry_ports)),
+                              name='mqtt_quic_server', daemon=True)
+    thread.start()
+    return thread
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--host', default='0.0.0.0')
+    parser.add_argument('--port', type=int, default=14567)
+    parser.add_argument('--standby-port', type=int, help='also serve a second broker on this port')
+    parser.add_argument('--retry-port', type=int, help='also serve a broker that sends Retry on this port')
+    parser.add_argument('--certificate', help='PEM certificate, self-signed if omitted')
+    parser.add_argument('--private-key', help='PEM private key')
+    parser.add_argument('-v', '--verbose', action='store_true')
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO,
+                        format='%(asctime)s %(name)s %(message)s')
+    ports = [args.port] if args.standby_port is None else [args.port, args.standby_port]
+    retry_ports = [] if args.retry_port is None else [args.retry_port]
+    asyncio.run(run(args.host, ports, make_configuration(args.certificate, args.private_key), retry_ports))
+
+
+if __name__ == '__main__':
+    main()